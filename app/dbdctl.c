@@ -11,24 +11,36 @@
 #include <errno.h>
 #include <limits.h>
 #include <ctype.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/time.h>
 
 #include "libdattobd.h"
 
 static void print_help(int status){
 	printf("Usage:\n");
-	printf("\tdbdctl setup-snapshot [-c <cache size>] [-f fallocate] <block device> <cow file> <minor>\n");
-	printf("\tdbdctl reload-snapshot [-c <cache size>] <block device> <cow file> <minor>\n");
-	printf("\tdbdctl reload-incremental [-c <cache size>] <block device> <cow file> <minor>\n");
+	printf("\tdbdctl setup-snapshot [-c <cache size>] [-f fallocate] [-i <cow io mode>] <block device> <cow file> <minor>\n");
+	printf("\tdbdctl reload-snapshot [-c <cache size>] [-i <cow io mode>] <block device> <cow file> <minor>\n");
+	printf("\tdbdctl reload-incremental [-c <cache size>] [-i <cow io mode>] <block device> <cow file> <minor>\n");
 	printf("\tdbdctl destroy <minor>\n");
 	printf("\tdbdctl transition-to-incremental <minor>\n");
 	printf("\tdbdctl transition-to-snapshot [-f fallocate] <cow file> <minor>\n");
 	printf("\tdbdctl reconfigure [-c <cache size>] <minor>\n");
 	printf("\tdbdctl expand-cow-file <size> <minor>\n");
 	printf("\tdbdctl reconfigure-auto-expand [-r <reserved space>] <step size> <minor>\n");
+	printf("\tdbdctl reconfigure-cow-io <cow io mode> <minor>\n");
+	printf("\tdbdctl info <minor>\n");
+	printf("\tdbdctl info --all\n");
+	printf("\tdbdctl events\n");
+	printf("\tdbdctl top [-i <interval>] [-n <count>] [-j] [<minor>...]\n");
+	printf("\tdbdctl export-changes [-j] [-s <device size>] <cow file>\n");
+	printf("\tdbdctl export-changes [-j] -m <minor>\n");
 	printf("\tdbdctl help\n\n");
 	printf("<cow file> should be specified as an absolute path.\n");
 	printf("cache size should be provided in bytes, and fallocate should be provided in megabytes.\n");
 	printf("in expand-cow-file and reconfigure-auto-expand size should be provided in megabytes.\n");
+	printf("the top interval should be provided in seconds, and device size in bytes.\n");
+	printf("cow io mode is one of buffered (the default), drop-cache or direct.\n");
 	printf("note: if the -c or -f options are not specified for any given call, module defaults are used.\n");
 	exit(status);
 }
@@ -116,14 +128,24 @@ error:
 	return -1;
 }
 
+static int parse_cow_io_mode(const char *str){
+	if(!strcmp(str, "buffered")) return COW_IO_BUFFERED;
+	if(!strcmp(str, "drop-cache")) return COW_IO_DROP_CACHE;
+	if(!strcmp(str, "direct")) return COW_IO_DIRECT;
+
+	errno = EINVAL;
+	return -1;
+}
+
 static int handle_setup_snap(int argc, char **argv){
 	int ret, c;
 	unsigned int minor;
 	unsigned long cache_size = 0, fallocated_space = 0;
+	int cow_io_mode = -1;
 	char *bdev, *cow;
 
 	//get cache size and fallocated space params, if given
-	while((c = getopt(argc, argv, "c:f:")) != -1){
+	while((c = getopt(argc, argv, "c:f:i:")) != -1){
 		switch(c){
 		case 'c':
 			ret = parse_ul(optarg, &cache_size);
@@ -133,6 +155,10 @@ static int handle_setup_snap(int argc, char **argv){
 			ret = parse_ul(optarg, &fallocated_space);
 			if(ret) goto error;
 			break;
+		case 'i':
+			cow_io_mode = parse_cow_io_mode(optarg);
+			if(cow_io_mode < 0) goto error;
+			break;
 		default:
 			errno = EINVAL;
 			goto error;
@@ -150,7 +176,10 @@ static int handle_setup_snap(int argc, char **argv){
 	ret = parse_ui(argv[optind + 2], &minor);
 	if(ret) goto error;
 
-	return dattobd_setup_snapshot(minor, bdev, cow, fallocated_space, cache_size);
+	ret = dattobd_setup_snapshot(minor, bdev, cow, fallocated_space, cache_size);
+	if(ret || cow_io_mode < 0) return ret;
+
+	return dattobd_reconfigure_cow_io(minor, cow_io_mode);
 
 error:
 	perror("error interpreting setup snapshot parameters");
@@ -162,15 +191,20 @@ static int handle_reload_snap(int argc, char **argv){
 	int ret, c;
 	unsigned int minor;
 	unsigned long cache_size = 0;
+	int cow_io_mode = -1;
 	char *bdev, *cow;
 
 	//get cache size and fallocated space params, if given
-	while((c = getopt(argc, argv, "c:")) != -1){
+	while((c = getopt(argc, argv, "c:i:")) != -1){
 		switch(c){
 		case 'c':
 			ret = parse_ul(optarg, &cache_size);
 			if(ret) goto error;
 			break;
+		case 'i':
+			cow_io_mode = parse_cow_io_mode(optarg);
+			if(cow_io_mode < 0) goto error;
+			break;
 		default:
 			errno = EINVAL;
 			goto error;
@@ -188,7 +222,10 @@ static int handle_reload_snap(int argc, char **argv){
 	ret = parse_ui(argv[optind + 2], &minor);
 	if(ret) goto error;
 
-	return dattobd_reload_snapshot(minor, bdev, cow, cache_size);
+	ret = dattobd_reload_snapshot(minor, bdev, cow, cache_size);
+	if(ret || cow_io_mode < 0) return ret;
+
+	return dattobd_reconfigure_cow_io(minor, cow_io_mode);
 
 error:
 	perror("error interpreting reload snapshot parameters");
@@ -200,15 +237,20 @@ static int handle_reload_inc(int argc, char **argv){
 	int ret, c;
 	unsigned int minor;
 	unsigned long cache_size = 0;
+	int cow_io_mode = -1;
 	char *bdev, *cow;
 
 	//get cache size and fallocated space params, if given
-	while((c = getopt(argc, argv, "c:")) != -1){
+	while((c = getopt(argc, argv, "c:i:")) != -1){
 		switch(c){
 		case 'c':
 			ret = parse_ul(optarg, &cache_size);
 			if(ret) goto error;
 			break;
+		case 'i':
+			cow_io_mode = parse_cow_io_mode(optarg);
+			if(cow_io_mode < 0) goto error;
+			break;
 		default:
 			errno = EINVAL;
 			goto error;
@@ -226,7 +268,10 @@ static int handle_reload_inc(int argc, char **argv){
 	ret = parse_ui(argv[optind + 2], &minor);
 	if(ret) goto error;
 
-	return dattobd_reload_incremental(minor, bdev, cow, cache_size);
+	ret = dattobd_reload_incremental(minor, bdev, cow, cache_size);
+	if(ret || cow_io_mode < 0) return ret;
+
+	return dattobd_reconfigure_cow_io(minor, cow_io_mode);
 
 error:
 	perror("error interpreting reload incremental parameters");
@@ -405,12 +450,609 @@ error:
 	return 0;
 }
 
+static int handle_reconfigure_cow_io(int argc, char **argv){
+	int ret, mode;
+	unsigned int minor;
+
+	if(argc != 3){
+		errno = EINVAL;
+		goto error;
+	}
+
+	mode = parse_cow_io_mode(argv[1]);
+	if(mode < 0) goto error;
+
+	ret = parse_ui(argv[2], &minor);
+	if(ret) goto error;
+
+	return dattobd_reconfigure_cow_io(minor, mode);
+
+error:
+	perror("error interpreting reconfigure cow io parameters");
+	print_help(-1);
+	return 0;
+}
+
+static void print_info(const struct dattobd_info_rec *rec, const char *cow, const char *bdev){
+	int i;
+
+	printf("minor: %u\n", rec->minor);
+	printf("state: %llu\n", (unsigned long long)rec->state);
+	printf("error: %d\n", rec->error);
+	printf("cache_size: %llu\n", (unsigned long long)rec->cache_size);
+	printf("falloc_size: %llu\n", (unsigned long long)rec->falloc_size);
+	printf("seqid: %llu\n", (unsigned long long)rec->seqid);
+	printf("version: %llu\n", (unsigned long long)rec->version);
+	printf("nr_changed_blocks: %llu\n", (unsigned long long)rec->nr_changed_blocks);
+	printf("uuid: ");
+	for(i = 0; i < COW_UUID_SIZE; i++) printf("%02x", rec->uuid[i]);
+	printf("\n");
+	printf("cow: %s\n", cow);
+	printf("bdev: %s\n", bdev);
+}
+
+static const char *info_path(const char *strings, uint32_t off){
+	return (off == DATTOBD_INFO_NO_PATH) ? "" : strings + off;
+}
+
+static int get_info_all(struct dattobd_info_rec **recs_out, char **strings_out, uint32_t *count_out){
+	int ret, err;
+	uint32_t count = 0, strings_size = 0;
+	struct dattobd_info_all_params params;
+	struct dattobd_info_rec *recs = NULL;
+	char *strings = NULL;
+
+	//grow the buffers to what the driver asks for until everything fits
+	while(1){
+		params.count = count;
+		params.strings_size = strings_size;
+		params.recs = recs;
+		params.strings = strings;
+
+		ret = dattobd_info_all(&params);
+		if(ret) goto error;
+
+		if(params.count <= count && params.strings_size <= strings_size) break;
+
+		count = params.count;
+		strings_size = params.strings_size;
+		free(recs);
+		free(strings);
+		recs = malloc(count * sizeof(struct dattobd_info_rec));
+		strings = malloc(strings_size);
+		if(!recs || !strings){
+			errno = ENOMEM;
+			ret = -1;
+			goto error;
+		}
+	}
+
+	*recs_out = recs;
+	*strings_out = strings;
+	*count_out = params.count;
+	return 0;
+
+error:
+	err = errno;
+	free(recs);
+	free(strings);
+	errno = err;
+	return ret;
+}
+
+static int print_info_all(void){
+	int ret;
+	uint32_t i, count;
+	struct dattobd_info_rec *recs;
+	char *strings;
+
+	ret = get_info_all(&recs, &strings, &count);
+	if(ret) return ret;
+
+	for(i = 0; i < count; i++){
+		if(i) printf("\n");
+		print_info(&recs[i], info_path(strings, recs[i].cow), info_path(strings, recs[i].bdev));
+	}
+
+	free(recs);
+	free(strings);
+	return 0;
+}
+
+static int handle_info(int argc, char **argv){
+	int ret;
+	unsigned int minor;
+	struct dattobd_info info;
+	struct dattobd_info_rec rec;
+
+	if(argc != 2){
+		errno = EINVAL;
+		goto error;
+	}
+
+	if(!strcmp(argv[1], "--all")) return print_info_all();
+
+	ret = parse_ui(argv[1], &minor);
+	if(ret) goto error;
+
+	ret = dattobd_info(minor, &info);
+	if(ret) return ret;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.minor = info.minor;
+	rec.state = info.state;
+	rec.error = info.error;
+	rec.cache_size = info.cache_size;
+	rec.falloc_size = info.falloc_size;
+	rec.seqid = info.seqid;
+	rec.version = info.version;
+	rec.nr_changed_blocks = info.nr_changed_blocks;
+	memcpy(rec.uuid, info.uuid, COW_UUID_SIZE);
+
+	print_info(&rec, info.cow, info.bdev);
+	return 0;
+
+error:
+	perror("error interpreting info parameters");
+	print_help(-1);
+	return 0;
+}
+
+static const char *event_type_name(uint32_t type){
+	switch(type){
+	case DATTOBD_EVENT_LOST: return "lost";
+	case DATTOBD_EVENT_FILL: return "fill";
+	case DATTOBD_EVENT_EXPAND: return "expand";
+	case DATTOBD_EVENT_FAIL: return "fail";
+	case DATTOBD_EVENT_STATE: return "state";
+	default: return "unknown";
+	}
+}
+
+static int handle_events(int argc){
+	int fd, ret, i;
+	struct dattobd_event events[16];
+
+	if(argc != 1){
+		errno = EINVAL;
+		perror("error interpreting events parameters");
+		print_help(-1);
+	}
+
+	fd = dattobd_events_open(0);
+	if(fd < 0) return -1;
+
+	//print events as they arrive until interrupted
+	while(1){
+		ret = dattobd_events_read(fd, events, sizeof(events) / sizeof(events[0]));
+		if(ret < 0){
+			if(errno == EINTR) continue;
+			break;
+		}
+
+		for(i = 0; i < ret; i++){
+			if(events[i].type == DATTOBD_EVENT_LOST) printf("%llu - %s %llu\n", (unsigned long long)events[i].time_ns, event_type_name(events[i].type), (unsigned long long)events[i].value);
+			else printf("%llu %u %s %llu %d\n", (unsigned long long)events[i].time_ns, events[i].minor, event_type_name(events[i].type), (unsigned long long)events[i].value, events[i].error);
+		}
+		fflush(stdout);
+	}
+
+	ret = errno;
+	close(fd);
+	errno = ret;
+	return -1;
+}
+
+//the last sample taken of a device by handle_top()
+struct top_prev {
+	int valid;
+	double time;
+	struct dattobd_stats stats;
+};
+
+static double top_now(void){
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+//counters only go backwards when the minor was destroyed and set up again
+static uint64_t top_delta(uint64_t cur, uint64_t prev){
+	return (cur >= prev) ? cur - prev : cur;
+}
+
+//returns the pct percentile of the samples added to a histogram since prev in
+//microseconds, interpolating within the log2 bucket, or -1 if there are none
+static double top_percentile(const struct dattobd_hist *cur, const struct dattobd_hist *prev, double pct){
+	int i, reset = cur->count < prev->count;
+	uint64_t delta[DATTOBD_HIST_BUCKETS], total = 0;
+	double target, seen = 0, lo, hi;
+
+	for(i = 0; i < DATTOBD_HIST_BUCKETS; i++){
+		delta[i] = (reset) ? cur->buckets[i] : top_delta(cur->buckets[i], prev->buckets[i]);
+		total += delta[i];
+	}
+	if(!total) return -1;
+
+	target = total * pct / 100;
+	for(i = 0; i < DATTOBD_HIST_BUCKETS - 1; i++){
+		if(delta[i] && seen + delta[i] >= target) break;
+		seen += delta[i];
+	}
+
+	lo = (i) ? (double)(1ULL << (i - 1)) : 0;
+	hi = (double)(1ULL << i);
+	if(delta[i]) lo += (hi - lo) * (target - seen) / delta[i];
+	return lo / 1000;
+}
+
+//everything handle_top() prints about a device for one interval
+struct top_row {
+	unsigned int minor;
+	double write_iops;
+	double cow_bytes_per_sec;
+	double skip_bytes_per_sec; //writes that needed no clone
+	double hit_ratio; //-1 without lookups
+	uint64_t cow_queue;
+	uint64_t orig_queue;
+	double p50_us, p99_us; //-1 without writes
+	double fill_bytes_per_sec;
+	uint64_t cow_file_used;
+	uint64_t cow_file_size; //0 if the driver does not report it
+	double time_to_full; //seconds, -1 if the cow file is not filling up
+};
+
+static void top_compute(struct top_row *row, unsigned int minor, const struct dattobd_stats *prev, const struct dattobd_stats *cur, double secs){
+	uint64_t hits, misses, used;
+
+	memset(row, 0, sizeof(*row));
+	row->minor = minor;
+	row->write_iops = top_delta(cur->writes_traced, prev->writes_traced) / secs;
+	row->cow_bytes_per_sec = top_delta(cur->cow_bytes_written, prev->cow_bytes_written) / secs;
+	row->skip_bytes_per_sec = top_delta(cur->write_bytes_passed, prev->write_bytes_passed) / secs;
+
+	hits = top_delta(cur->cache_hits, prev->cache_hits);
+	misses = top_delta(cur->cache_misses, prev->cache_misses);
+	row->hit_ratio = (hits + misses) ? (double)hits / (hits + misses) : -1;
+
+	row->cow_queue = cur->cow_bios_queued;
+	row->orig_queue = cur->orig_bios_queued;
+	row->p50_us = top_percentile(&cur->write_delay, &prev->write_delay, 50);
+	row->p99_us = top_percentile(&cur->write_delay, &prev->write_delay, 99);
+
+	row->time_to_full = -1;
+	if(cur->size < offsetof(struct dattobd_stats, cow_file_used) + sizeof(cur->cow_file_used)) return;
+
+	used = cur->cow_file_used;
+	row->cow_file_used = used;
+	row->cow_file_size = cur->cow_file_size;
+	row->fill_bytes_per_sec = (used >= prev->cow_file_used) ? (used - prev->cow_file_used) / secs : 0;
+	if(row->fill_bytes_per_sec > 0 && cur->cow_file_size > used) row->time_to_full = (cur->cow_file_size - used) / row->fill_bytes_per_sec;
+}
+
+static void top_print_header(void){
+	printf("%5s %9s %9s %9s %6s %6s %6s %9s %9s %9s %6s %9s\n", "minor", "writes/s", "cow MB/s", "skip MB/s", "hit%", "cowq", "origq", "p50 us", "p99 us", "fill MB/s", "used%", "full in");
+}
+
+static void top_print_row(const struct top_row *row){
+	char hit[16] = "-", p50[16] = "-", p99[16] = "-", used[16] = "-", full[32] = "-";
+	unsigned long long secs;
+
+	if(row->hit_ratio >= 0) snprintf(hit, sizeof(hit), "%.1f", row->hit_ratio * 100);
+	if(row->p50_us >= 0) snprintf(p50, sizeof(p50), "%.0f", row->p50_us);
+	if(row->p99_us >= 0) snprintf(p99, sizeof(p99), "%.0f", row->p99_us);
+	if(row->cow_file_size) snprintf(used, sizeof(used), "%.1f", row->cow_file_used * 100.0 / row->cow_file_size);
+	if(row->time_to_full >= 0){
+		secs = (unsigned long long)row->time_to_full;
+		if(secs >= 3600) snprintf(full, sizeof(full), "%lluh%02llum", secs / 3600, (secs % 3600) / 60);
+		else if(secs >= 60) snprintf(full, sizeof(full), "%llum%02llus", secs / 60, secs % 60);
+		else snprintf(full, sizeof(full), "%llus", secs);
+	}
+
+	printf("%5u %9.0f %9.2f %9.2f %6s %6llu %6llu %9s %9s %9.2f %6s %9s\n", row->minor, row->write_iops, row->cow_bytes_per_sec / 1000000, row->skip_bytes_per_sec / 1000000, hit, (unsigned long long)row->cow_queue, (unsigned long long)row->orig_queue, p50, p99, row->fill_bytes_per_sec / 1000000, used, full);
+}
+
+//prints a value of a json object, null if it is negative
+static void top_json_double(const char *name, double val){
+	if(val < 0) printf(", \"%s\": null", name);
+	else printf(", \"%s\": %.3f", name, val);
+}
+
+static void top_print_json(const struct top_row *row, double now, double secs){
+	printf("{\"time\": %.3f, \"interval\": %.3f, \"minor\": %u", now, secs, row->minor);
+	top_json_double("write_iops", row->write_iops);
+	top_json_double("cow_bytes_per_sec", row->cow_bytes_per_sec);
+	top_json_double("skip_bytes_per_sec", row->skip_bytes_per_sec);
+	top_json_double("cache_hit_ratio", row->hit_ratio);
+	printf(", \"cow_queue\": %llu, \"orig_queue\": %llu", (unsigned long long)row->cow_queue, (unsigned long long)row->orig_queue);
+	top_json_double("write_delay_p50_us", row->p50_us);
+	top_json_double("write_delay_p99_us", row->p99_us);
+	top_json_double("fill_bytes_per_sec", row->fill_bytes_per_sec);
+	printf(", \"cow_file_used\": %llu, \"cow_file_size\": %llu", (unsigned long long)row->cow_file_used, (unsigned long long)row->cow_file_size);
+	top_json_double("time_to_full_sec", row->time_to_full);
+	printf("}\n");
+}
+
+//fills in the minors to sample, the ones given or else every configured device
+static int top_minors(char **args, int nargs, unsigned int **minors, uint32_t *count){
+	int ret;
+	uint32_t i, n;
+	struct dattobd_info_rec *recs;
+	char *strings;
+
+	if(nargs){
+		*minors = malloc(nargs * sizeof(unsigned int));
+		if(!*minors){
+			errno = ENOMEM;
+			return -1;
+		}
+
+		for(i = 0; i < (uint32_t)nargs; i++){
+			ret = parse_ui(args[i], &(*minors)[i]);
+			if(ret){
+				free(*minors);
+				return ret;
+			}
+		}
+		*count = nargs;
+		return 0;
+	}
+
+	ret = get_info_all(&recs, &strings, &n);
+	if(ret) return ret;
+
+	*minors = malloc((n ? n : 1) * sizeof(unsigned int));
+	if(!*minors){
+		free(recs);
+		free(strings);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for(i = 0; i < n; i++) (*minors)[i] = recs[i].minor;
+	*count = n;
+
+	free(recs);
+	free(strings);
+	return 0;
+}
+
+static int handle_top(int argc, char **argv){
+	int ret, c, json = 0, tty = isatty(STDOUT_FILENO);
+	unsigned int interval = 1, samples = 0, iter, *minors = NULL, nr_prev = 0;
+	uint32_t i, count;
+	double now, secs;
+	struct dattobd_stats stats;
+	struct top_prev *prev = NULL, *tmp, *p;
+	struct top_row row;
+
+	while((c = getopt(argc, argv, "i:n:j")) != -1){
+		switch(c){
+		case 'i':
+			ret = parse_ui(optarg, &interval);
+			if(ret) goto error;
+			break;
+		case 'n':
+			ret = parse_ui(optarg, &samples);
+			if(ret) goto error;
+			break;
+		case 'j':
+			json = 1;
+			break;
+		default:
+			errno = EINVAL;
+			goto error;
+		}
+	}
+
+	if(!interval){
+		errno = EINVAL;
+		goto error;
+	}
+
+	//the first pass only takes the samples the first report is relative to
+	for(iter = 0; !samples || iter <= samples; iter++){
+		if(iter) sleep(interval);
+
+		ret = top_minors(argv + optind, argc - optind, &minors, &count);
+		if(ret) goto out;
+
+		now = top_now();
+		if(iter && !json){
+			if(tty) printf("\033[H\033[2J");
+			top_print_header();
+		}
+
+		for(i = 0; i < count; i++){
+			//a device may go away between listing and sampling it
+			if(dattobd_stats(minors[i], &stats)) continue;
+
+			if(minors[i] >= nr_prev){
+				tmp = realloc(prev, (minors[i] + 1) * sizeof(struct top_prev));
+				if(!tmp){
+					errno = ENOMEM;
+					ret = -1;
+					goto out;
+				}
+				prev = tmp;
+				memset(prev + nr_prev, 0, (minors[i] + 1 - nr_prev) * sizeof(struct top_prev));
+				nr_prev = minors[i] + 1;
+			}
+
+			p = &prev[minors[i]];
+			if(iter && p->valid){
+				secs = now - p->time;
+				top_compute(&row, minors[i], &p->stats, &stats, (secs > 0) ? secs : interval);
+				if(json) top_print_json(&row, now, secs);
+				else top_print_row(&row);
+			}
+
+			p->valid = 1;
+			p->time = now;
+			p->stats = stats;
+		}
+
+		fflush(stdout);
+		free(minors);
+		minors = NULL;
+	}
+
+	ret = 0;
+
+out:
+	free(minors);
+	free(prev);
+	return ret;
+
+error:
+	perror("error interpreting top parameters");
+	print_help(-1);
+	return 0;
+}
+
+//state of handle_export_changes() while extents are streamed out
+struct export_ctx {
+	int json;
+	int started;
+	uint64_t pos; //end of the last extent written
+	uint64_t nr_extents;
+	uint64_t changed;
+	const struct dattobd_changes_header *hdr;
+};
+
+static void export_begin(struct export_ctx *ctx){
+	int i;
+	uint8_t buf[DATTOBD_CHANGES_HEADER_SIZE];
+
+	ctx->started = 1;
+
+	if(!ctx->json){
+		dattobd_changes_put_header(buf, ctx->hdr);
+		fwrite(buf, 1, sizeof(buf), stdout);
+		return;
+	}
+
+	printf("{\"uuid\":\"");
+	for(i = 0; i < COW_UUID_SIZE; i++) printf("%02x", ctx->hdr->uuid[i]);
+	printf("\",\"seqid\":%llu,\"block_size\":%u,\"nr_blocks\":%llu,\"extents\":[", (unsigned long long)ctx->hdr->seqid, ctx->hdr->block_size, (unsigned long long)ctx->hdr->nr_blocks);
+}
+
+static int export_extent(const struct dattobd_extent *ext, void *arg){
+	struct export_ctx *ctx = arg;
+	uint8_t buf[DATTOBD_CHANGES_EXTENT_MAX];
+	size_t n;
+
+	if(!ctx->started) export_begin(ctx);
+
+	if(ctx->json){
+		printf("%s[%llu,%llu]", (ctx->nr_extents) ? "," : "", (unsigned long long)ext->start, (unsigned long long)ext->len);
+	}else{
+		n = dattobd_changes_put_extent(buf, &ctx->pos, ext);
+		fwrite(buf, 1, n, stdout);
+	}
+
+	ctx->nr_extents++;
+	ctx->changed += ext->len;
+
+	return (ferror(stdout)) ? -1 : 0;
+}
+
+static int export_end(struct export_ctx *ctx){
+	uint8_t buf[DATTOBD_CHANGES_EXTENT_MAX];
+	size_t n;
+
+	if(!ctx->started) export_begin(ctx);
+
+	if(ctx->json){
+		printf("],\"nr_extents\":%llu,\"changed_blocks\":%llu}\n", (unsigned long long)ctx->nr_extents, (unsigned long long)ctx->changed);
+	}else{
+		n = dattobd_changes_put_extent(buf, &ctx->pos, NULL);
+		fwrite(buf, 1, n, stdout);
+	}
+
+	return (fflush(stdout) || ferror(stdout)) ? -1 : 0;
+}
+
+static int handle_export_changes(int argc, char **argv){
+	int ret, c, fd, live = 0;
+	unsigned int minor = 0;
+	uint64_t size = 0;
+	struct dattobd_changes_header hdr;
+	struct export_ctx ctx;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.hdr = &hdr;
+
+	while((c = getopt(argc, argv, "jm:s:")) != -1){
+		switch(c){
+		case 'j':
+			ctx.json = 1;
+			break;
+		case 'm':
+			ret = parse_ui(optarg, &minor);
+			if(ret) goto error;
+			live = 1;
+			break;
+		case 's':
+			ret = parse_ui64(optarg, &size);
+			if(ret) goto error;
+			break;
+		default:
+			errno = EINVAL;
+			goto error;
+		}
+	}
+
+	//a live device knows its size and has no cow file argument
+	if((live && (size || argc != optind)) || (!live && argc - optind != 1)){
+		errno = EINVAL;
+		goto error;
+	}
+
+	//binary output is useless on a terminal
+	if(!ctx.json && isatty(STDOUT_FILENO)){
+		errno = EINVAL;
+		perror("refusing to write binary change list to a terminal, redirect it or use -j");
+		return -1;
+	}
+
+	if(live){
+		ret = dattobd_live_changes(minor, &hdr, export_extent, &ctx);
+		if(!ret) ret = export_end(&ctx);
+		return ret;
+	}
+
+	fd = open(argv[optind], O_RDONLY);
+	if(fd < 0) return -1;
+
+	ret = dattobd_cow_changes(fd, (size + COW_BLOCK_SIZE - 1) / COW_BLOCK_SIZE, &hdr, export_extent, &ctx);
+	if(!ret) ret = export_end(&ctx);
+
+	c = errno;
+	close(fd);
+	errno = c;
+	return ret;
+
+error:
+	perror("error interpreting export-changes parameters");
+	print_help(-1);
+	return 0;
+}
+
 int main(int argc, char **argv){
 	int ret = 0;
 
 	//check argc
 	if(argc < 2) print_help(-1);
 
+	//reading a cow file does not need the driver
+	if(!strcmp(argv[1], "export-changes")){
+		ret = handle_export_changes(argc - 1, argv + 1);
+		if(ret) perror("error exporting changes");
+		return ret;
+	}
+
 	if(access("/dev/datto-ctl", F_OK) != 0){
 		errno = EINVAL;
 		perror("driver does not appear to be loaded");
@@ -427,6 +1069,10 @@ int main(int argc, char **argv){
 	else if(!strcmp(argv[1], "reconfigure")) ret = handle_reconfigure(argc - 1, argv + 1);
 	else if(!strcmp(argv[1], "expand-cow-file")) ret = handle_expand_cow_file(argc - 1, argv + 1);
 	else if(!strcmp(argv[1], "reconfigure-auto-expand")) ret = handle_reconfigure_auto_expand(argc - 1, argv + 1);
+	else if(!strcmp(argv[1], "reconfigure-cow-io")) ret = handle_reconfigure_cow_io(argc - 1, argv + 1);
+	else if(!strcmp(argv[1], "info")) ret = handle_info(argc - 1, argv + 1);
+	else if(!strcmp(argv[1], "events")) ret = handle_events(argc - 1);
+	else if(!strcmp(argv[1], "top")) ret = handle_top(argc - 1, argv + 1);
 	else if(!strcmp(argv[1], "help")) print_help(0);
 	else print_help(-1);
 
@@ -357,6 +357,10 @@ install -p -m 0644 app/bash_completion.d/dbdctl %{buildroot}%{_bashcompletionpat
 mkdir -p %{buildroot}%{_mandir}/man8
 install -p -m 0644 doc/dbdctl.8 %{buildroot}%{_mandir}/man8/dbdctl.8
 install -p -m 0755 utils/update-img %{buildroot}%{_bindir}/update-img
+install -p -m 0755 utils/write-delta %{buildroot}%{_bindir}/write-delta
+install -p -m 0755 utils/apply-delta %{buildroot}%{_bindir}/apply-delta
+install -p -m 0755 utils/verify-img %{buildroot}%{_bindir}/verify-img
+install -p -m 0755 utils/cow-inspect %{buildroot}%{_bindir}/cow-inspect
 install -p -m 0644 doc/update-img.8 %{buildroot}%{_mandir}/man8/update-img.8
 
 # Install kmod sources
@@ -518,6 +522,10 @@ rm -rf %{buildroot}
 %endif
 %{_bindir}/dbdctl
 %{_bindir}/update-img
+%{_bindir}/write-delta
+%{_bindir}/apply-delta
+%{_bindir}/verify-img
+%{_bindir}/cow-inspect
 %{_bashcompletionpath}/dbdctl
 %{_mandir}/man8/dbdctl.8*
 %{_mandir}/man8/update-img.8*
@@ -7,7 +7,12 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
 #include "libdattobd.h"
 
 int dattobd_setup_snapshot(unsigned int minor, char *bdev, char *cow, unsigned long fallocated_space, unsigned long cache_size){
@@ -141,6 +146,23 @@ int dattobd_info(unsigned int minor, struct dattobd_info *info){
 	return ret;
 }
 
+int dattobd_info_all(struct dattobd_info_all_params *params){
+	int fd, ret;
+
+	if(!params){
+		errno = EINVAL;
+		return -1;
+	}
+
+	fd = open("/dev/datto-ctl", O_RDONLY);
+	if(fd < 0) return -1;
+
+	ret = ioctl(fd, IOCTL_DATTOBD_INFO_ALL, params);
+
+	close(fd);
+	return ret;
+}
+
 int dattobd_get_free_minor(void){
 	int fd, ret, minor;
 
@@ -186,4 +208,636 @@ int dattobd_reconfigure_auto_expand(unsigned int minor, uint64_t step_size, uint
 
 	close(fd);
 	return ret;
-}
\ No newline at end of file
+}
+
+int dattobd_reconfigure_cow_io(unsigned int minor, unsigned int mode){
+	int fd, ret;
+	struct reconfigure_cow_io_params params = {
+		.mode = mode,
+		.minor = minor
+	};
+
+	fd = open("/dev/datto-ctl", O_RDONLY);
+	if(fd < 0) return -1;
+
+	ret = ioctl(fd, IOCTL_RECONFIGURE_COW_IO, &params);
+
+	close(fd);
+	return ret;
+}
+
+int dattobd_stats(unsigned int minor, struct dattobd_stats *stats){
+	int fd, ret;
+	struct dattobd_stats_params sp;
+
+	if(!stats){
+		errno = EINVAL;
+		return -1;
+	}
+
+	fd = open("/dev/datto-ctl", O_RDONLY);
+	if(fd < 0) return -1;
+
+	memset(stats, 0, sizeof(struct dattobd_stats));
+	sp.minor = minor;
+	sp.size = sizeof(struct dattobd_stats);
+	sp.stats = stats;
+
+	ret = ioctl(fd, IOCTL_DATTOBD_STATS, &sp);
+
+	close(fd);
+	return ret;
+}
+
+int dattobd_stats_reset(unsigned int minor){
+	int fd, ret;
+
+	fd = open("/dev/datto-ctl", O_RDONLY);
+	if(fd < 0) return -1;
+
+	ret = ioctl(fd, IOCTL_DATTOBD_STATS_RESET, &minor);
+
+	close(fd);
+	return ret;
+}
+
+int dattobd_events_open(int nonblock){
+	int fd, ret;
+
+	fd = open("/dev/datto-ctl", (nonblock) ? O_RDONLY | O_NONBLOCK : O_RDONLY);
+	if(fd < 0) return -1;
+
+	ret = ioctl(fd, IOCTL_DATTOBD_EVENTS);
+	if(ret){
+		ret = errno;
+		close(fd);
+		errno = ret;
+		return -1;
+	}
+
+	return fd;
+}
+
+int dattobd_events_read(int fd, struct dattobd_event *events, unsigned int count){
+	ssize_t ret;
+
+	ret = read(fd, events, count * sizeof(struct dattobd_event));
+	if(ret < 0) return -1;
+
+	return ret / sizeof(struct dattobd_event);
+}
+
+//index entries read from the cow file at a time
+#define CHANGES_INDEX_CHUNK 8192
+
+int dattobd_cow_changes(int fd, uint64_t nr_blocks, struct dattobd_changes_header *hdr, dattobd_extent_fn fn, void *arg){
+	int ret = -1;
+	ssize_t bytes;
+	uint64_t *mappings = NULL;
+	uint64_t block, i, nr;
+	struct cow_header ch;
+	struct dattobd_extent ext = { 0, 0 };
+
+	bytes = pread(fd, &ch, sizeof(struct cow_header), 0);
+	if(bytes < 0) return -1;
+	if(bytes != sizeof(struct cow_header) || ch.magic != COW_MAGIC){
+		errno = EINVAL;
+		return -1;
+	}
+
+	//an index only cow file ends with the index, so its size bounds the device
+	if(ch.flags & (1 << COW_INDEX_ONLY)){
+		if(ch.fsize < COW_HEADER_SIZE || nr_blocks > (ch.fsize - COW_HEADER_SIZE) / sizeof(uint64_t)){
+			errno = EINVAL;
+			return -1;
+		}
+		if(!nr_blocks) nr_blocks = (ch.fsize - COW_HEADER_SIZE) / sizeof(uint64_t);
+	}else if(!nr_blocks){
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(hdr, 0, sizeof(struct dattobd_changes_header));
+	memcpy(hdr->uuid, ch.uuid, COW_UUID_SIZE);
+	hdr->seqid = ch.seqid;
+	hdr->nr_blocks = nr_blocks;
+	hdr->block_size = COW_BLOCK_SIZE;
+
+	mappings = malloc(CHANGES_INDEX_CHUNK * sizeof(uint64_t));
+	if(!mappings) return -1;
+
+	for(block = 0; block < nr_blocks; block += nr){
+		nr = nr_blocks - block;
+		if(nr > CHANGES_INDEX_CHUNK) nr = CHANGES_INDEX_CHUNK;
+
+		bytes = pread(fd, mappings, nr * sizeof(uint64_t), COW_HEADER_SIZE + block * sizeof(uint64_t));
+		if(bytes < 0) goto out;
+		if(bytes != (ssize_t)(nr * sizeof(uint64_t))){
+			//the index ends before the device does
+			errno = EINVAL;
+			goto out;
+		}
+
+		for(i = 0; i < nr; i++){
+			if(!mappings[i]) continue;
+
+			if(ext.len && ext.start + ext.len == block + i){
+				ext.len++;
+				continue;
+			}
+
+			if(ext.len){
+				ret = fn(&ext, arg);
+				if(ret) goto out;
+				ret = -1;
+			}
+			ext.start = block + i;
+			ext.len = 1;
+		}
+	}
+
+	ret = (ext.len) ? fn(&ext, arg) : 0;
+
+out:
+	free(mappings);
+	return ret;
+}
+
+int dattobd_changes(struct dattobd_changes_params *params){
+	int fd, ret;
+
+	fd = open("/dev/datto-ctl", O_RDONLY);
+	if(fd < 0) return -1;
+
+	ret = ioctl(fd, IOCTL_DATTOBD_CHANGES, params);
+
+	close(fd);
+	return ret;
+}
+
+//extents fetched from the kernel module per query
+#define CHANGES_LIVE_BATCH 4096
+
+int dattobd_live_changes(unsigned int minor, struct dattobd_changes_header *hdr, dattobd_extent_fn fn, void *arg){
+	int fd, ret = -1;
+	uint32_t i;
+	uint64_t start = 0;
+	struct dattobd_changes_params params;
+	struct dattobd_extent *exts = NULL, ext = { 0, 0 };
+
+	fd = open("/dev/datto-ctl", O_RDONLY);
+	if(fd < 0) return -1;
+
+	exts = malloc(CHANGES_LIVE_BATCH * sizeof(struct dattobd_extent));
+	if(!exts) goto out;
+
+	do{
+		memset(&params, 0, sizeof(params));
+		params.minor = minor;
+		params.start = start;
+		params.count = UINT64_MAX;
+		params.nr = CHANGES_LIVE_BATCH;
+		params.buf = exts;
+
+		if(ioctl(fd, IOCTL_DATTOBD_CHANGES, &params)) goto out;
+
+		//the first query tells which device and snapshot this is
+		if(!start){
+			memset(hdr, 0, sizeof(struct dattobd_changes_header));
+			memcpy(hdr->uuid, params.uuid, COW_UUID_SIZE);
+			hdr->seqid = params.seqid;
+			hdr->nr_blocks = params.nr_blocks;
+			hdr->block_size = COW_BLOCK_SIZE;
+		}
+
+		for(i = 0; i < params.nr; i++){
+			//queries cut extents at the end of the range they cover
+			if(ext.len && ext.start + ext.len == exts[i].start){
+				ext.len += exts[i].len;
+				continue;
+			}
+
+			if(ext.len){
+				ret = fn(&ext, arg);
+				if(ret) goto out;
+				ret = -1;
+			}
+			ext = exts[i];
+		}
+
+		start += params.count;
+	}while(params.count && start < params.nr_blocks);
+
+	ret = (ext.len) ? fn(&ext, arg) : 0;
+
+out:
+	i = errno;
+	free(exts);
+	close(fd);
+	errno = i;
+	return ret;
+}
+
+static void put_le(uint8_t *buf, uint64_t val, int bytes){
+	int i;
+
+	for(i = 0; i < bytes; i++) buf[i] = (uint8_t)(val >> (8 * i));
+}
+
+static uint64_t get_le(const uint8_t *buf, int bytes){
+	int i;
+	uint64_t val = 0;
+
+	for(i = 0; i < bytes; i++) val |= (uint64_t)buf[i] << (8 * i);
+	return val;
+}
+
+void dattobd_changes_put_header(uint8_t *buf, const struct dattobd_changes_header *hdr){
+	memset(buf, 0, DATTOBD_CHANGES_HEADER_SIZE);
+	memcpy(buf, DATTOBD_CHANGES_MAGIC, 8);
+	put_le(buf + 8, DATTOBD_CHANGES_VERSION, 4);
+	put_le(buf + 12, hdr->block_size, 4);
+	put_le(buf + 16, hdr->seqid, 8);
+	put_le(buf + 24, hdr->nr_blocks, 8);
+	memcpy(buf + 32, hdr->uuid, COW_UUID_SIZE);
+}
+
+int dattobd_changes_get_header(const uint8_t *buf, struct dattobd_changes_header *hdr){
+	if(memcmp(buf, DATTOBD_CHANGES_MAGIC, 8) || get_le(buf + 8, 4) != DATTOBD_CHANGES_VERSION){
+		errno = EINVAL;
+		return -1;
+	}
+
+	hdr->block_size = get_le(buf + 12, 4);
+	hdr->seqid = get_le(buf + 16, 8);
+	hdr->nr_blocks = get_le(buf + 24, 8);
+	memcpy(hdr->uuid, buf + 32, COW_UUID_SIZE);
+	return 0;
+}
+
+static size_t put_varint(uint8_t *buf, uint64_t val){
+	size_t n = 0;
+
+	while(val >= 0x80){
+		buf[n++] = (uint8_t)(val | 0x80);
+		val >>= 7;
+	}
+	buf[n++] = (uint8_t)val;
+
+	return n;
+}
+
+//returns the number of bytes consumed, 0 if incomplete or -1 if malformed
+static int get_varint(const uint8_t *buf, size_t len, uint64_t *val){
+	size_t n;
+	uint64_t res = 0;
+
+	for(n = 0; n < len && n < 10; n++){
+		res |= (uint64_t)(buf[n] & 0x7f) << (7 * n);
+		if(!(buf[n] & 0x80)){
+			*val = res;
+			return n + 1;
+		}
+	}
+
+	if(n < 10) return 0;
+	errno = EINVAL;
+	return -1;
+}
+
+size_t dattobd_changes_put_extent(uint8_t *buf, uint64_t *pos, const struct dattobd_extent *ext){
+	size_t n;
+
+	if(!ext){
+		buf[0] = 0;
+		buf[1] = 0;
+		return 2;
+	}
+
+	n = put_varint(buf, ext->start - *pos);
+	n += put_varint(buf + n, ext->len);
+	*pos = ext->start + ext->len;
+
+	return n;
+}
+
+int dattobd_changes_get_extent(const uint8_t *buf, size_t len, uint64_t *pos, struct dattobd_extent *ext){
+	int n, m;
+	uint64_t gap;
+
+	n = get_varint(buf, len, &gap);
+	if(n <= 0) return n;
+
+	m = get_varint(buf + n, len - n, &ext->len);
+	if(m <= 0) return m;
+
+	ext->start = *pos + gap;
+	*pos = ext->start + ext->len;
+	return n + m;
+}
+
+void dattobd_op_setup_snapshot(struct dattobd_op *op, unsigned int minor, char *bdev, char *cow, unsigned long fallocated_space, unsigned long cache_size){
+	memset(&op->params, 0, sizeof(op->params));
+	op->cmd = IOCTL_SETUP_SNAP;
+	op->params.setup.minor = minor;
+	op->params.setup.bdev = bdev;
+	op->params.setup.cow = cow;
+	op->params.setup.fallocated_space = fallocated_space;
+	op->params.setup.cache_size = cache_size;
+}
+
+void dattobd_op_reload_snapshot(struct dattobd_op *op, unsigned int minor, char *bdev, char *cow, unsigned long cache_size){
+	memset(&op->params, 0, sizeof(op->params));
+	op->cmd = IOCTL_RELOAD_SNAP;
+	op->params.reload.minor = minor;
+	op->params.reload.bdev = bdev;
+	op->params.reload.cow = cow;
+	op->params.reload.cache_size = cache_size;
+}
+
+void dattobd_op_reload_incremental(struct dattobd_op *op, unsigned int minor, char *bdev, char *cow, unsigned long cache_size){
+	dattobd_op_reload_snapshot(op, minor, bdev, cow, cache_size);
+	op->cmd = IOCTL_RELOAD_INC;
+}
+
+void dattobd_op_destroy(struct dattobd_op *op, unsigned int minor){
+	memset(&op->params, 0, sizeof(op->params));
+	op->cmd = IOCTL_DESTROY;
+	op->params.minor = minor;
+}
+
+void dattobd_op_transition_incremental(struct dattobd_op *op, unsigned int minor){
+	memset(&op->params, 0, sizeof(op->params));
+	op->cmd = IOCTL_TRANSITION_INC;
+	op->params.minor = minor;
+}
+
+void dattobd_op_transition_snapshot(struct dattobd_op *op, unsigned int minor, char *cow, unsigned long fallocated_space){
+	memset(&op->params, 0, sizeof(op->params));
+	op->cmd = IOCTL_TRANSITION_SNAP;
+	op->params.transition_snap.minor = minor;
+	op->params.transition_snap.cow = cow;
+	op->params.transition_snap.fallocated_space = fallocated_space;
+}
+
+void dattobd_op_reconfigure(struct dattobd_op *op, unsigned int minor, unsigned long cache_size){
+	memset(&op->params, 0, sizeof(op->params));
+	op->cmd = IOCTL_RECONFIGURE;
+	op->params.reconfigure.minor = minor;
+	op->params.reconfigure.cache_size = cache_size;
+}
+
+void dattobd_op_info(struct dattobd_op *op, unsigned int minor, struct dattobd_info *info){
+	memset(&op->params, 0, sizeof(op->params));
+	op->cmd = IOCTL_DATTOBD_INFO;
+	op->params.info = info;
+	info->minor = minor;
+}
+
+//the argument of the ioctl, info is the only one that is not in the op itself
+static void *op_arg(struct dattobd_op *op){
+	if(op->cmd == IOCTL_DATTOBD_INFO) return op->params.info;
+	return &op->params;
+}
+
+//a batch passed to dattobd_submit()
+struct dattobd_request {
+	struct dattobd_op *ops;
+	unsigned int nr;
+	unsigned int flags;
+	struct dattobd_request *next;
+};
+
+struct dattobd_handle {
+	int fd;
+	int event_fd; //counts up as requests complete, drained once all are reaped
+
+	pthread_mutex_t lock;
+	pthread_cond_t submitted;
+	pthread_t thread;
+	int started;
+	int stopping;
+	struct dattobd_request *queue; //submitted, not run yet
+	struct dattobd_request *queue_tail;
+	struct dattobd_request *complete; //run, not fully reaped
+	struct dattobd_request *complete_tail;
+	unsigned int reaped; //operations of complete already reaped
+};
+
+struct dattobd_handle *dattobd_open(void){
+	int err;
+	struct dattobd_handle *h;
+
+	h = calloc(1, sizeof(struct dattobd_handle));
+	if(!h) return NULL;
+
+	h->fd = open("/dev/datto-ctl", O_RDONLY | O_CLOEXEC);
+	if(h->fd < 0) goto error;
+
+	h->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if(h->event_fd < 0) goto error;
+
+	pthread_mutex_init(&h->lock, NULL);
+	pthread_cond_init(&h->submitted, NULL);
+	return h;
+
+error:
+	err = errno;
+	if(h->fd >= 0) close(h->fd);
+	free(h);
+	errno = err;
+	return NULL;
+}
+
+//issues the operations one by one, each with its own ioctl on the handle
+static void run_request(struct dattobd_handle *h, struct dattobd_op *ops, unsigned int nr, unsigned int flags){
+	unsigned int i;
+	int failed = 0;
+
+	for(i = 0; i < nr; i++){
+		if(failed && (flags & DATTOBD_BATCH_STOP_ON_ERROR)){
+			ops[i].result = -ECANCELED;
+			continue;
+		}
+
+		ops[i].result = (ioctl(h->fd, ops[i].cmd, op_arg(&ops[i]))) ? -errno : 0;
+		if(ops[i].result) failed = 1;
+	}
+}
+
+int dattobd_batch(struct dattobd_handle *h, struct dattobd_op *ops, unsigned int nr, unsigned int flags){
+	if(!nr || (flags & ~DATTOBD_BATCH_STOP_ON_ERROR)){
+		errno = EINVAL;
+		return -1;
+	}
+
+	run_request(h, ops, nr, flags);
+	return 0;
+}
+
+//must be called with the lock held
+static void complete_request(struct dattobd_handle *h, struct dattobd_request *req){
+	uint64_t one = 1;
+
+	req->next = NULL;
+	if(h->complete_tail) h->complete_tail->next = req;
+	else h->complete = req;
+	h->complete_tail = req;
+
+	//cannot fail otherwise, the counter is drained long before it overflows
+	while(write(h->event_fd, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+
+static void *request_thread(void *arg){
+	struct dattobd_handle *h = arg;
+	struct dattobd_request *req;
+
+	pthread_mutex_lock(&h->lock);
+	while(1){
+		while(!h->queue && !h->stopping) pthread_cond_wait(&h->submitted, &h->lock);
+		if(!h->queue || h->stopping) break;
+
+		req = h->queue;
+		h->queue = req->next;
+		if(!h->queue) h->queue_tail = NULL;
+		pthread_mutex_unlock(&h->lock);
+
+		run_request(h, req->ops, req->nr, req->flags);
+
+		pthread_mutex_lock(&h->lock);
+		complete_request(h, req);
+	}
+	pthread_mutex_unlock(&h->lock);
+
+	return NULL;
+}
+
+int dattobd_submit(struct dattobd_handle *h, struct dattobd_op *ops, unsigned int nr, unsigned int flags){
+	int ret;
+	struct dattobd_request *req;
+
+	if(!nr || (flags & ~DATTOBD_BATCH_STOP_ON_ERROR)){
+		errno = EINVAL;
+		return -1;
+	}
+
+	req = malloc(sizeof(struct dattobd_request));
+	if(!req) return -1;
+
+	req->ops = ops;
+	req->nr = nr;
+	req->flags = flags;
+	req->next = NULL;
+
+	pthread_mutex_lock(&h->lock);
+	if(!h->started){
+		ret = pthread_create(&h->thread, NULL, request_thread, h);
+		if(ret){
+			pthread_mutex_unlock(&h->lock);
+			free(req);
+			errno = ret;
+			return -1;
+		}
+		h->started = 1;
+	}
+
+	if(h->queue_tail) h->queue_tail->next = req;
+	else h->queue = req;
+	h->queue_tail = req;
+	pthread_cond_signal(&h->submitted);
+	pthread_mutex_unlock(&h->lock);
+
+	return 0;
+}
+
+int dattobd_completion_fd(struct dattobd_handle *h){
+	return h->event_fd;
+}
+
+//must be called with the lock held
+static unsigned int take_completed(struct dattobd_handle *h, struct dattobd_op **done, unsigned int max){
+	unsigned int n = 0;
+	uint64_t count;
+	struct dattobd_request *req;
+
+	while(n < max && h->complete){
+		req = h->complete;
+		done[n++] = &req->ops[h->reaped++];
+		if(h->reaped < req->nr) continue;
+
+		h->complete = req->next;
+		if(!h->complete) h->complete_tail = NULL;
+		h->reaped = 0;
+		free(req);
+	}
+
+	//stop polling readable once everything is reaped, EAGAIN only means
+	//there was nothing to drain
+	if(!h->complete){
+		while(read(h->event_fd, &count, sizeof(count)) < 0 && errno == EINTR);
+	}
+
+	return n;
+}
+
+int dattobd_reap(struct dattobd_handle *h, struct dattobd_op **done, unsigned int max, int timeout_ms){
+	int ret;
+	unsigned int n;
+	struct pollfd pfd;
+
+	if(!max){
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&h->lock);
+	n = take_completed(h, done, max);
+	pthread_mutex_unlock(&h->lock);
+	if(n || !timeout_ms) return n;
+
+	pfd.fd = h->event_fd;
+	pfd.events = POLLIN;
+	do{
+		ret = poll(&pfd, 1, timeout_ms);
+	}while(ret < 0 && errno == EINTR);
+	if(ret < 0) return -1;
+
+	pthread_mutex_lock(&h->lock);
+	n = take_completed(h, done, max);
+	pthread_mutex_unlock(&h->lock);
+	return n;
+}
+
+void dattobd_close(struct dattobd_handle *h){
+	unsigned int i;
+	struct dattobd_request *req;
+
+	if(!h) return;
+
+	pthread_mutex_lock(&h->lock);
+	h->stopping = 1;
+	pthread_cond_signal(&h->submitted);
+	pthread_mutex_unlock(&h->lock);
+
+	if(h->started) pthread_join(h->thread, NULL);
+
+	//cancel what never started, and forget what was never reaped
+	while(h->queue){
+		req = h->queue;
+		h->queue = req->next;
+		for(i = 0; i < req->nr; i++) req->ops[i].result = -ECANCELED;
+		free(req);
+	}
+
+	while(h->complete){
+		req = h->complete;
+		h->complete = req->next;
+		free(req);
+	}
+
+	pthread_cond_destroy(&h->submitted);
+	pthread_mutex_destroy(&h->lock);
+	close(h->event_fd);
+	close(h->fd);
+	free(h);
+}
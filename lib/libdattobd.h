@@ -29,10 +29,163 @@ int dattobd_reconfigure(unsigned int minor, unsigned long cache_size);
 
 int dattobd_info(unsigned int minor, struct dattobd_info *info);
 
+/**
+ * Get the state of all configured devices in one call.
+ *
+ * params->recs and params->strings are filled with up to params->count
+ * records and params->strings_size bytes of paths. On success both fields
+ * are set to what all devices need; if either grew, the result is partial
+ * (paths that did not fit are DATTOBD_INFO_NO_PATH) and the call can be
+ * repeated with larger buffers.
+ *
+ * @returns 0 on success, otherwise -1 with errno set
+ */
+int dattobd_info_all(struct dattobd_info_all_params *params);
+
 int dattobd_expand_cow_file(unsigned int minor, uint64_t size);
 
 int dattobd_reconfigure_auto_expand(unsigned int minor, uint64_t step_size, uint64_t reserved_space);
 
+int dattobd_reconfigure_cow_io(unsigned int minor, unsigned int mode);
+
+/**
+ * Get the runtime statistics of a device.
+ *
+ * On success stats->version and stats->size describe how much of the
+ * structure the kernel module filled in, fields beyond stats->size are zero.
+ *
+ * @returns 0 on success, otherwise -1 with errno set
+ */
+int dattobd_stats(unsigned int minor, struct dattobd_stats *stats);
+
+/**
+ * Clear the latency histograms of a device. Counters are left untouched.
+ *
+ * @returns 0 on success, otherwise -1 with errno set
+ */
+int dattobd_stats_reset(unsigned int minor);
+
+/**
+ * Open the control device and subscribe it to the events of all devices.
+ * Events are queued from this call on until the descriptor is closed.
+ *
+ * @nonblock: nonzero to open the descriptor in non-blocking mode
+ * @returns a file descriptor to poll() and to pass to dattobd_events_read(),
+ *          otherwise -1 with errno set
+ */
+int dattobd_events_open(int nonblock);
+
+/**
+ * Read queued events. Blocks until at least one event is queued unless the
+ * descriptor is non-blocking, in which case it fails with EAGAIN.
+ *
+ * @fd: a descriptor returned by dattobd_events_open()
+ * @events: room for @count events
+ * @returns the number of events read, otherwise -1 with errno set
+ */
+int dattobd_events_read(int fd, struct dattobd_event *events, unsigned int count);
+
+#define DATTOBD_CHANGES_MAGIC "DBDCHGS"
+#define DATTOBD_CHANGES_VERSION 1
+#define DATTOBD_CHANGES_HEADER_SIZE 48
+#define DATTOBD_CHANGES_EXTENT_MAX 20
+
+/**
+ * Describes a change list: which snapshot series and sequence it belongs to
+ * and how many blocks the index covers.
+ */
+struct dattobd_changes_header {
+	uint8_t uuid[COW_UUID_SIZE];
+	uint64_t seqid;
+	uint64_t nr_blocks; // blocks covered by the index
+	uint32_t block_size; // bytes per block
+};
+
+/**
+ * Called with each extent of changed blocks, in ascending order. Returning
+ * nonzero stops the walk.
+ */
+typedef int (*dattobd_extent_fn)(const struct dattobd_extent *ext, void *arg);
+
+/**
+ * Walk the index of a COW file and report runs of changed blocks.
+ *
+ * The index covers the whole origin device, which the COW file header does
+ * not record. Pass the size of the device in blocks as @nr_blocks, or 0 for
+ * an index only COW file (as left behind in incremental mode), in which case
+ * it is derived from the size of the file.
+ *
+ * @fd: an open COW file
+ * @nr_blocks: number of blocks of the origin device, or 0
+ * @hdr: filled in from the COW file header before the first call to @fn
+ * @fn: called for every extent
+ * @returns 0 on success, the nonzero value returned by @fn, otherwise -1 with
+ *          errno set
+ */
+int dattobd_cow_changes(int fd, uint64_t nr_blocks, struct dattobd_changes_header *hdr, dattobd_extent_fn fn, void *arg);
+
+/**
+ * Query the changed blocks of a range of an active device, see
+ * struct dattobd_changes_params. The index is read where it is, in memory or
+ * in the COW file, without flushing it.
+ *
+ * @returns 0 on success, otherwise -1 with errno set
+ */
+int dattobd_changes(struct dattobd_changes_params *params);
+
+/**
+ * Walk the changed blocks of an active device, like dattobd_cow_changes()
+ * does for a COW file. The device is queried in pages with
+ * dattobd_changes(), extents split between pages are merged again. Changes
+ * made while the walk is in progress may or may not be reported.
+ *
+ * @minor: the minor of the device
+ * @hdr: filled in from the device before the first call to @fn
+ * @fn: called for every extent
+ * @returns 0 on success, the nonzero value returned by @fn, otherwise -1 with
+ *          errno set
+ */
+int dattobd_live_changes(unsigned int minor, struct dattobd_changes_header *hdr, dattobd_extent_fn fn, void *arg);
+
+/*
+ * The binary change list format is a DATTOBD_CHANGES_HEADER_SIZE byte header
+ * followed by one pair of LEB128 varints per extent: the gap since the end of
+ * the previous extent and the length, both in blocks. A pair with a length of
+ * zero ends the list. All integers in the header are little endian.
+ */
+
+/**
+ * Encode @hdr into the DATTOBD_CHANGES_HEADER_SIZE bytes at @buf.
+ */
+void dattobd_changes_put_header(uint8_t *buf, const struct dattobd_changes_header *hdr);
+
+/**
+ * Decode a header from the DATTOBD_CHANGES_HEADER_SIZE bytes at @buf.
+ *
+ * @returns 0 on success, otherwise -1 with errno set
+ */
+int dattobd_changes_get_header(const uint8_t *buf, struct dattobd_changes_header *hdr);
+
+/**
+ * Encode @ext into at most DATTOBD_CHANGES_EXTENT_MAX bytes at @buf, or the
+ * end of the list if @ext is NULL.
+ *
+ * @pos: end of the previous extent, 0 before the first one; advanced to the
+ *       end of @ext
+ * @returns the number of bytes written
+ */
+size_t dattobd_changes_put_extent(uint8_t *buf, uint64_t *pos, const struct dattobd_extent *ext);
+
+/**
+ * Decode an extent from @buf.
+ *
+ * @pos: same as for dattobd_changes_put_extent()
+ * @ext: the decoded extent, a length of 0 marks the end of the list
+ * @returns the number of bytes consumed, 0 if @len bytes do not hold a whole
+ *          extent, otherwise -1 with errno set
+ */
+int dattobd_changes_get_extent(const uint8_t *buf, size_t len, uint64_t *pos, struct dattobd_extent *ext);
+
 /**
  * Get the first available minor.
  *
@@ -40,6 +193,111 @@ int dattobd_reconfigure_auto_expand(unsigned int minor, uint64_t step_size, uint
  */
 int dattobd_get_free_minor(void);
 
+/*
+ * A handle keeps the control device open and runs batches of operations,
+ * either right away with dattobd_batch() or in the background with
+ * dattobd_submit(). Operations are described with the dattobd_op_*()
+ * functions and each is issued as its own ioctl, with its own result.
+ *
+ * Batches do not make operations faster or run them in parallel: the kernel
+ * module runs control operations one at a time, on all devices. A handle
+ * saves opening the control device for every operation, and dattobd_submit()
+ * lets a caller manage many devices from one thread without waiting on each
+ * operation, but a batch of operations on different devices still completes
+ * one operation after the other.
+ */
+struct dattobd_handle;
+
+// flags of dattobd_batch() and dattobd_submit()
+#define DATTOBD_BATCH_STOP_ON_ERROR 1 // skip the operations after a failed one
+
+/**
+ * An operation of a batch. The dattobd_op_*() functions set it up, the
+ * pointers given to them must stay valid until the operation completes.
+ */
+struct dattobd_op {
+	void *user_data; // for the caller, left untouched
+	int result; // 0 or a negative errno once complete
+	unsigned int cmd; // the IOCTL_* the operation is run as
+	union {
+		unsigned int minor;
+		struct setup_params setup;
+		struct reload_params reload;
+		struct transition_snap_params transition_snap;
+		struct reconfigure_params reconfigure;
+		struct dattobd_info *info;
+	} params;
+};
+
+void dattobd_op_setup_snapshot(struct dattobd_op *op, unsigned int minor, char *bdev, char *cow, unsigned long fallocated_space, unsigned long cache_size);
+
+void dattobd_op_reload_snapshot(struct dattobd_op *op, unsigned int minor, char *bdev, char *cow, unsigned long cache_size);
+
+void dattobd_op_reload_incremental(struct dattobd_op *op, unsigned int minor, char *bdev, char *cow, unsigned long cache_size);
+
+void dattobd_op_destroy(struct dattobd_op *op, unsigned int minor);
+
+void dattobd_op_transition_incremental(struct dattobd_op *op, unsigned int minor);
+
+void dattobd_op_transition_snapshot(struct dattobd_op *op, unsigned int minor, char *cow, unsigned long fallocated_space);
+
+void dattobd_op_reconfigure(struct dattobd_op *op, unsigned int minor, unsigned long cache_size);
+
+/**
+ * @info: filled in when the operation completes, info->minor is set here
+ */
+void dattobd_op_info(struct dattobd_op *op, unsigned int minor, struct dattobd_info *info);
+
+/**
+ * Open a handle on the control device.
+ *
+ * @returns the handle, otherwise NULL with errno set
+ */
+struct dattobd_handle *dattobd_open(void);
+
+/**
+ * Close a handle. Waits for the batch being run in the background, if any;
+ * submitted batches that have not started complete with -ECANCELED. No
+ * operation can be reaped afterwards.
+ */
+void dattobd_close(struct dattobd_handle *h);
+
+/**
+ * Run @nr operations in order and wait for them.
+ *
+ * @flags: DATTOBD_BATCH_STOP_ON_ERROR to complete the operations after a
+ *         failed one with -ECANCELED instead of running them
+ * @returns 0 if the batch was run, the result of each operation is in
+ *          op->result, otherwise -1 with errno set
+ */
+int dattobd_batch(struct dattobd_handle *h, struct dattobd_op *ops, unsigned int nr, unsigned int flags);
+
+/**
+ * Queue @nr operations to be run like dattobd_batch() does, by a thread of
+ * the handle. Batches are run in the order they are submitted. Each operation
+ * is reaped with dattobd_reap() once it completes, @ops must stay valid
+ * until then.
+ *
+ * @returns 0 on success, otherwise -1 with errno set
+ */
+int dattobd_submit(struct dattobd_handle *h, struct dattobd_op *ops, unsigned int nr, unsigned int flags);
+
+/**
+ * Get a descriptor that polls readable while completed operations wait to be
+ * reaped. It belongs to the handle, do not read from or close it.
+ */
+int dattobd_completion_fd(struct dattobd_handle *h);
+
+/**
+ * Reap completed operations, in the order they were submitted.
+ *
+ * @done: filled with pointers to up to @max completed operations
+ * @timeout_ms: how long to wait if none completed yet, as for poll()
+ * @returns the number of operations reaped, 0 on timeout, otherwise -1 with
+ *          errno set
+ */
+int dattobd_reap(struct dattobd_handle *h, struct dattobd_op **done, unsigned int max, int timeout_ms);
+
 #ifdef __cplusplus
 }
 #endif
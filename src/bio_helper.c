@@ -7,6 +7,8 @@
 #include "includes.h"
 
 #include "bio_helper.h"
+#include "cow_extents.h"
+#include "dattobd_trace.h"
 #include "logging.h"
 #include "snap_device.h"
 #include "tracer_helper.h"
@@ -396,6 +398,7 @@ static void __on_bio_read_complete(struct bio *bio, int err)
         struct tracing_params *tp = bio->bi_private;
         struct snap_device *dev = tp->dev;
         struct bio_sector_map *map = NULL;
+        u64 start_ns = snap_stats_now();
 #ifndef HAVE_BVEC_ITER
         unsigned short i = 0;
 #endif
@@ -419,6 +422,13 @@ static void __on_bio_read_complete(struct bio *bio, int err)
                         bio_sector(bio) = map->sect - dev->sd_sect_off;
                         bio_size(bio) = map->size;
                         bio_idx(bio) = 0;
+                        snap_stats_record(dev, SNAP_HIST_CLONE_READ,
+                                          map->submit_ns);
+                        snap_slow_op_check(dev, SNAP_SLOW_CLONE_READ,
+                                           map->submit_ns, map->sect,
+                                           map->size >> 9, 0);
+                        trace_dattobd_clone_complete(dev, map->sect,
+                                                     map->size, 0);
                         break;
                 }
         }
@@ -449,6 +459,9 @@ static void __on_bio_read_complete(struct bio *bio, int err)
         // queue cow bio for processing by kernel thread
         bio_queue_add(&dev->sd_cow_bios, bio);
         atomic64_inc(&dev->sd_received_cnt);
+        snap_stats_inc(dev, SNAP_STAT_CLONES_COMPLETED);
+        snap_stats_add(dev, SNAP_STAT_CPU_COMPLETION_NS,
+                       snap_stats_now() - start_ns);
         smp_wmb();
 
         tp_put(tp);
@@ -456,8 +469,11 @@ static void __on_bio_read_complete(struct bio *bio, int err)
         return;
 
 error:
+        trace_dattobd_clone_complete(dev, 0, 0, ret);
         LOG_ERROR(ret, "error during bio read complete callback");
         tracer_set_fail_state(dev, ret);
+        snap_stats_add(dev, SNAP_STAT_CPU_COMPLETION_NS,
+                       snap_stats_now() - start_ns);
         tp_put(tp);
         bio_free_clone(bio);
 }
@@ -576,14 +592,14 @@ struct inode *page_get_inode(struct page *pg)
  * bio_needs_cow() - Test to see if the &struct bio contains a write request
  * or if the bio inodes don't match our cow file.
  *
+ * @dev: The &struct snap_device tracking the cow file.
  * @bio: The &struct bio which describes the I/O.
- * @inode: The inode of the directory containing the cow file.
  *
  * Return:
  * * 0 - does not need to be copied.
  * * !0 - does need to be copied.
  */
-int bio_needs_cow(struct bio *bio, struct inode *inode)
+int bio_needs_cow(struct snap_device *dev, struct bio *bio)
 {
         bio_iter_t iter;
         bio_iter_bvec_t bvec;
@@ -594,10 +610,20 @@ int bio_needs_cow(struct bio *bio, struct inode *inode)
                 return 1;
 #endif
 
+        // a bio that lands outside of the cow file cannot carry its pages
+        if (!cow_phys_map_may_overlap(dev, bio_sector(bio) - dev->sd_sect_off,
+                                      bio_size(bio) >> 9))
+                return 1;
+
+        // nothing but the cow file lives there, e.g. direct I/O to it
+        if (cow_phys_map_contains(dev, bio_sector(bio) - dev->sd_sect_off,
+                                  bio_size(bio) >> 9))
+                return 0;
+
         // check the inode of each page return true if it does not match our cow
         // file
         bio_for_each_segment (bvec, bio, iter) {
-                if (page_get_inode(bio_iter_page(bio, iter)) != inode)
+                if (page_get_inode(bio_iter_page(bio, iter)) != dev->sd_cow_inode)
                         return 1;
         }
 
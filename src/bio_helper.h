@@ -73,6 +73,7 @@ struct bio_sector_map {
         struct bio *bio;
         sector_t sect;
         unsigned int size;
+        u64 submit_ns; // when the clone was added, for latency stats
         struct bio_sector_map *next;
 };
 
@@ -162,7 +163,7 @@ void dattobd_bio_op_clear_flag(struct bio *bio, unsigned int flag);
 
 struct inode *page_get_inode(struct page *pg);
 
-int bio_needs_cow(struct bio *bio, struct inode *inode);
+int bio_needs_cow(struct snap_device *dev, struct bio *bio);
 
 void bio_free_clone(struct bio *bio);
 
@@ -7,6 +7,7 @@
  */
 
 #include "bio_queue.h"
+#include "hints.h"
 #include "bio_helper.h"
 
 /**
@@ -18,6 +19,7 @@ void bio_queue_init(struct bio_queue *bq)
         bio_list_init(&bq->bios);
         spin_lock_init(&bq->lock);
         init_waitqueue_head(&bq->event);
+        bq->count = 0;
 }
 
 /**
@@ -33,6 +35,18 @@ int bio_queue_empty(const struct bio_queue *bq)
         return bio_list_empty(&bq->bios);
 }
 
+/**
+ * bio_queue_count() - Returns the number of bios in the supplied queue. The
+ * value is sampled without locking.
+ * @bq: The queue.
+ *
+ * Return: The number of queued bios.
+ */
+unsigned long bio_queue_count(const struct bio_queue *bq)
+{
+        return ACCESS_ONCE(bq->count);
+}
+
 /**
  * bio_queue_add() - Adds an element.
  * @bq: The queue.
@@ -46,6 +60,7 @@ void bio_queue_add(struct bio_queue *bq, struct bio *bio)
 
         spin_lock_irqsave(&bq->lock, flags);
         bio_list_add(&bq->bios, bio);
+        bq->count++;
         spin_unlock_irqrestore(&bq->lock, flags);
         wake_up(&bq->event);
 }
@@ -66,6 +81,8 @@ struct bio *bio_queue_dequeue(struct bio_queue *bq)
 
         spin_lock_irqsave(&bq->lock, flags);
         bio = bio_list_pop(&bq->bios);
+        if (bio)
+                bq->count--;
         spin_unlock_irqrestore(&bq->lock, flags);
 
         return bio;
@@ -111,6 +128,8 @@ struct bio *bio_queue_dequeue_delay_read(struct bio_queue *bq)
         spin_lock_irqsave(&bq->lock, flags);
 
         bio = bio_list_pop(&bq->bios);
+        if (bio)
+                bq->count--;
 
         if (!bio_data_dir(bio)) {
                 bio_list_for_each (tmp, &bq->bios) {
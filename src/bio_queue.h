@@ -13,12 +13,15 @@ struct bio_queue {
         struct bio_list bios;
         spinlock_t lock;
         wait_queue_head_t event;
+        unsigned long count; // number of queued bios
 };
 
 void bio_queue_init(struct bio_queue *bq);
 
 int bio_queue_empty(const struct bio_queue *bq);
 
+unsigned long bio_queue_count(const struct bio_queue *bq);
+
 void bio_queue_add(struct bio_queue *bq, struct bio *bio);
 
 struct bio *bio_queue_dequeue(struct bio_queue *bq);
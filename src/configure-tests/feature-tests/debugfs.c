@@ -0,0 +1,17 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Copyright (C) 2026 Datto Inc.
+ */
+
+#include "includes.h"
+#include <linux/debugfs.h>
+
+MODULE_LICENSE("GPL");
+
+static inline void dummy(void){
+	struct dentry *dir = debugfs_create_dir("dummy", NULL);
+	struct dentry *file = debugfs_create_file("dummy", 0444, dir, NULL, NULL);
+	(void)file;
+	debugfs_remove_recursive(dir);
+}
@@ -0,0 +1,17 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Copyright (C) 2026 Datto Inc.
+ */
+
+#include "includes.h"
+
+MODULE_LICENSE("GPL");
+
+static inline void dummy(void){
+	struct gendisk *gd = NULL;
+	struct device *dev = disk_to_dev(gd);
+	int ret = sysfs_create_group(&dev->kobj, NULL);
+	(void)dev_to_disk(dev);
+	(void)ret;
+}
@@ -0,0 +1,15 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Copyright (C) 2026 Datto Inc.
+ */
+
+#include "includes.h"
+#include <linux/sched/clock.h>
+
+MODULE_LICENSE("GPL");
+
+static inline void dummy(void){
+	u64 now = local_clock();
+	(void)now;
+}
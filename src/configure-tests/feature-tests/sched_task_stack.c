@@ -0,0 +1,14 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Copyright (C) 2026 Datto Inc.
+ */
+
+#include "includes.h"
+#include <linux/sched/task_stack.h>
+
+MODULE_LICENSE("GPL");
+
+static inline void dummy(void){
+	object_is_on_stack(NULL);
+}
@@ -0,0 +1,16 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Copyright (C) 2026 Datto Inc.
+ */
+
+#include "includes.h"
+#include <linux/percpu.h>
+
+MODULE_LICENSE("GPL");
+
+static DEFINE_PER_CPU(u64, dummy_cnt);
+
+static inline void dummy(void){
+	this_cpu_add(dummy_cnt, 1);
+}
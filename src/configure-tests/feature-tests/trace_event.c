@@ -0,0 +1,14 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Copyright (C) 2026 Datto Inc.
+ */
+
+#include "includes.h"
+#include <linux/tracepoint.h>
+
+MODULE_LICENSE("GPL");
+
+#if !defined(TRACE_EVENT) || !defined(DECLARE_EVENT_CLASS)
+#error "TRACE_EVENT is not available"
+#endif
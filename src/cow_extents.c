@@ -0,0 +1,362 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Copyright (C) 2026 Datto Inc.
+ */
+
+#include "cow_extents.h"
+
+#include "hints.h"
+#include "logging.h"
+#include "snap_device.h"
+
+#ifndef FIEMAP_EXTENT_SHARED
+#define FIEMAP_EXTENT_SHARED 0
+#endif
+
+// extents whose physical location is unknown or shared with other data
+#define COW_EXTENT_UNTRUSTED_FLAGS                                             \
+        (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC |                      \
+         FIEMAP_EXTENT_ENCODED | FIEMAP_EXTENT_DATA_INLINE |                   \
+         FIEMAP_EXTENT_DATA_TAIL | FIEMAP_EXTENT_NOT_ALIGNED |                 \
+         FIEMAP_EXTENT_SHARED)
+
+static int __cow_phys_range_cmp(const void *a, const void *b)
+{
+        const struct cow_phys_range *ra = a;
+        const struct cow_phys_range *rb = b;
+
+        if (ra->start < rb->start)
+                return -1;
+        if (ra->start > rb->start)
+                return 1;
+        return 0;
+}
+
+/**
+ * cow_extents_append() - Appends a FIEMAP extent to the compact extent array
+ * of @dev, growing the array as needed.
+ *
+ * @dev: The &struct snap_device object pointer.
+ * @fe: The &struct fiemap_extent reported for the cow file. Extents must be
+ *      appended in logical order, any part already covered is skipped.
+ *
+ * Return:
+ * * 0 - success
+ * * !0 - errno indicating the error
+ */
+int cow_extents_append(struct snap_device *dev, const struct fiemap_extent *fe)
+{
+        struct cow_extent *extents, *last;
+        uint64_t skip = 0;
+        unsigned int cap;
+
+        if (dev->sd_cow_ext_cnt) {
+                last = &dev->sd_cow_extents[dev->sd_cow_ext_cnt - 1];
+                if (fe->fe_logical + fe->fe_length <= last->logical + last->length)
+                        return 0;
+                if (fe->fe_logical < last->logical + last->length)
+                        skip = last->logical + last->length - fe->fe_logical;
+        }
+
+        if (dev->sd_cow_ext_cnt == dev->sd_cow_ext_cap) {
+                cap = (dev->sd_cow_ext_cap) ? dev->sd_cow_ext_cap * 2 :
+                                              PAGE_SIZE / sizeof(struct cow_extent);
+                extents = vmalloc(cap * sizeof(struct cow_extent));
+                if (!extents) {
+                        LOG_ERROR(-ENOMEM, "error allocating cow file extents");
+                        return -ENOMEM;
+                }
+
+                if (dev->sd_cow_extents) {
+                        memcpy(extents, dev->sd_cow_extents,
+                               dev->sd_cow_ext_cnt * sizeof(struct cow_extent));
+                        vfree(dev->sd_cow_extents);
+                }
+
+                dev->sd_cow_extents = extents;
+                dev->sd_cow_ext_cap = cap;
+        }
+
+        extents = &dev->sd_cow_extents[dev->sd_cow_ext_cnt++];
+        extents->logical = fe->fe_logical + skip;
+        extents->physical = fe->fe_physical + skip;
+        extents->length = fe->fe_length - skip;
+        dev->sd_cow_ext_flags |= fe->fe_flags;
+
+        return 0;
+}
+
+/**
+ * cow_extents_truncate() - Forgets the parts of the cow file at or beyond
+ * @logical_end.
+ *
+ * @dev: The &struct snap_device object pointer.
+ * @logical_end: The new end of the mapped part of the cow file in bytes.
+ */
+void cow_extents_truncate(struct snap_device *dev, uint64_t logical_end)
+{
+        struct cow_extent *last;
+
+        while (dev->sd_cow_ext_cnt) {
+                last = &dev->sd_cow_extents[dev->sd_cow_ext_cnt - 1];
+                if (last->logical < logical_end) {
+                        if (last->logical + last->length > logical_end)
+                                last->length = logical_end - last->logical;
+                        break;
+                }
+                dev->sd_cow_ext_cnt--;
+        }
+
+        dev->sd_cow_ext_hint = 0;
+}
+
+/**
+ * cow_extents_free() - Frees the extent array of @dev.
+ *
+ * @dev: The &struct snap_device object pointer.
+ */
+void cow_extents_free(struct snap_device *dev)
+{
+        if (dev->sd_cow_extents)
+                vfree(dev->sd_cow_extents);
+
+        dev->sd_cow_extents = NULL;
+        dev->sd_cow_ext_cnt = 0;
+        dev->sd_cow_ext_cap = 0;
+        dev->sd_cow_ext_flags = 0;
+        dev->sd_cow_ext_hint = 0;
+}
+
+/**
+ * __cow_phys_map_publish() - Replaces the physical range map of @dev with
+ * @map and frees the old one once no tracing function can still see it.
+ *
+ * @dev: The &struct snap_device object pointer.
+ * @map: The new &struct cow_phys_map or NULL.
+ */
+static void __cow_phys_map_publish(struct snap_device *dev,
+                                   struct cow_phys_map *map)
+{
+        struct cow_phys_map *old;
+
+        smp_wmb();
+        old = xchg(&dev->sd_cow_phys_map, map);
+        if (old) {
+                synchronize_rcu();
+                vfree(old);
+        }
+}
+
+/**
+ * cow_phys_map_build() - Builds a sorted, merged array of the physical
+ * sectors occupied by the cow file from the extents in @dev and publishes it
+ * for use by the tracing function.
+ *
+ * @dev: The &struct snap_device object pointer.
+ *
+ * If the extents cannot be trusted to describe where cow file writes will
+ * land, no map is published and callers fall back to inspecting pages.
+ *
+ * Return:
+ * * 0 - success
+ * * !0 - errno indicating the error
+ */
+int cow_phys_map_build(struct snap_device *dev)
+{
+        int ret;
+        unsigned int i, cnt;
+        struct cow_phys_map *map = NULL;
+        struct cow_extent *extent;
+
+        if (!dev->sd_cow_extents || !dev->sd_cow_ext_cnt) {
+                ret = -ENOENT;
+                goto error;
+        }
+
+        if (dev->sd_cow_ext_flags & COW_EXTENT_UNTRUSTED_FLAGS) {
+                ret = -EINVAL;
+                LOG_DEBUG("cow file extent flags 0x%x prevent physical range "
+                          "map", dev->sd_cow_ext_flags);
+                goto error;
+        }
+
+        map = vmalloc(sizeof(struct cow_phys_map) +
+                      dev->sd_cow_ext_cnt * sizeof(struct cow_phys_range));
+        if (!map) {
+                ret = -ENOMEM;
+                LOG_ERROR(ret, "error allocating cow physical range map");
+                goto error;
+        }
+
+        for (i = 0; i < dev->sd_cow_ext_cnt; i++) {
+                extent = &dev->sd_cow_extents[i];
+                map->ranges[i].start = extent->physical >> 9;
+                map->ranges[i].end = (extent->physical + extent->length +
+                                      SECTOR_SIZE - 1) >> 9;
+        }
+
+        sort(map->ranges, dev->sd_cow_ext_cnt, sizeof(struct cow_phys_range),
+             __cow_phys_range_cmp, NULL);
+
+        // merge adjacent and overlapping ranges
+        cnt = 0;
+        for (i = 1; i < dev->sd_cow_ext_cnt; i++) {
+                if (map->ranges[i].start <= map->ranges[cnt].end) {
+                        if (map->ranges[i].end > map->ranges[cnt].end)
+                                map->ranges[cnt].end = map->ranges[i].end;
+                } else {
+                        map->ranges[++cnt] = map->ranges[i];
+                }
+        }
+        map->cnt = cnt + 1;
+
+        LOG_DEBUG("cow file occupies %u physical ranges (%u extents)",
+                  map->cnt, dev->sd_cow_ext_cnt);
+
+        __cow_phys_map_publish(dev, map);
+        return 0;
+
+error:
+        if (map)
+                vfree(map);
+        cow_phys_map_clear(dev);
+        return ret;
+}
+
+/**
+ * cow_phys_map_clear() - Drops the physical range map of @dev. This must be
+ * done before the cow file can gain blocks that the map does not describe.
+ *
+ * @dev: The &struct snap_device object pointer.
+ *
+ * Waits for direct writes to the cow file that pinned the map to complete,
+ * as the tracing function could no longer tell them from other writes.
+ */
+void cow_phys_map_clear(struct snap_device *dev)
+{
+        down_write(&dev->sd_cow_dio_sem);
+        if (ACCESS_ONCE(dev->sd_cow_phys_map))
+                __cow_phys_map_publish(dev, NULL);
+        up_write(&dev->sd_cow_dio_sem);
+}
+
+/**
+ * cow_phys_map_pin() - Keeps the physical range map of @dev published until
+ * cow_phys_map_unpin() is called, so that a direct write to the cow file is
+ * recognized by the tracing function until it completes.
+ *
+ * @dev: The &struct snap_device object pointer.
+ *
+ * Does not wait for a concurrent cow_phys_map_clear(), callers that fail to
+ * pin the map are expected to use buffered I/O instead.
+ *
+ * Return:
+ * * 0 - no map is published or it is being cleared.
+ * * 1 - the map is pinned.
+ */
+int cow_phys_map_pin(struct snap_device *dev)
+{
+        if (!down_read_trylock(&dev->sd_cow_dio_sem))
+                return 0;
+
+        if (!ACCESS_ONCE(dev->sd_cow_phys_map)) {
+                up_read(&dev->sd_cow_dio_sem);
+                return 0;
+        }
+
+        return 1;
+}
+
+/**
+ * cow_phys_map_unpin() - Releases a map pinned by cow_phys_map_pin().
+ *
+ * @dev: The &struct snap_device object pointer.
+ */
+void cow_phys_map_unpin(struct snap_device *dev)
+{
+        up_read(&dev->sd_cow_dio_sem);
+}
+
+// returns the index of the first range ending after @sect
+static unsigned int __cow_phys_map_find(const struct cow_phys_map *map,
+                                        sector_t sect)
+{
+        unsigned int lo = 0, hi = map->cnt, mid;
+
+        while (lo < hi) {
+                mid = lo + (hi - lo) / 2;
+                if (map->ranges[mid].end <= sect)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+
+        return lo;
+}
+
+/**
+ * cow_phys_map_may_overlap() - Checks if an I/O to the given sectors could
+ * touch the cow file. Safe to call from the tracing function.
+ *
+ * @dev: The &struct snap_device object pointer.
+ * @sect: The first sector relative to the start of the base device.
+ * @nr_sects: The number of sectors.
+ *
+ * Return:
+ * * 0 - the range definitely does not touch the cow file.
+ * * 1 - the range intersects the cow file or no map is available.
+ */
+int cow_phys_map_may_overlap(struct snap_device *dev, sector_t sect,
+                             sector_t nr_sects)
+{
+        int ret = 1;
+        unsigned int i;
+        struct cow_phys_map *map;
+
+        rcu_read_lock();
+        map = rcu_dereference(dev->sd_cow_phys_map);
+        if (!map)
+                goto out;
+
+        i = __cow_phys_map_find(map, sect);
+        ret = (i < map->cnt && map->ranges[i].start < sect + nr_sects);
+
+out:
+        rcu_read_unlock();
+        return ret;
+}
+
+/**
+ * cow_phys_map_contains() - Checks if an I/O to the given sectors lies
+ * entirely within the cow file. Safe to call from the tracing function.
+ *
+ * @dev: The &struct snap_device object pointer.
+ * @sect: The first sector relative to the start of the base device.
+ * @nr_sects: The number of sectors.
+ *
+ * Return:
+ * * 0 - the range may touch other data or no map is available.
+ * * 1 - the range belongs to the cow file.
+ */
+int cow_phys_map_contains(struct snap_device *dev, sector_t sect,
+                          sector_t nr_sects)
+{
+        int ret = 0;
+        unsigned int i;
+        struct cow_phys_map *map;
+
+        rcu_read_lock();
+        map = rcu_dereference(dev->sd_cow_phys_map);
+        if (!map)
+                goto out;
+
+        // merged ranges are never adjacent, so one range has to hold it all
+        i = __cow_phys_map_find(map, sect);
+        ret = (i < map->cnt && map->ranges[i].start <= sect &&
+               sect + nr_sects <= map->ranges[i].end);
+
+out:
+        rcu_read_unlock();
+        return ret;
+}
@@ -0,0 +1,54 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Copyright (C) 2026 Datto Inc.
+ */
+
+#ifndef COW_EXTENTS_H_
+#define COW_EXTENTS_H_
+
+#include "includes.h"
+
+struct snap_device;
+
+// a contiguous piece of the cow file, offsets and length in bytes
+struct cow_extent {
+        uint64_t logical;
+        uint64_t physical;
+        uint64_t length;
+};
+
+// a run of sectors (relative to the start of the base device) occupied by
+// the cow file, [start, end)
+struct cow_phys_range {
+        sector_t start;
+        sector_t end;
+};
+
+// sorted, non-overlapping view of the physical space owned by the cow file
+struct cow_phys_map {
+        unsigned int cnt;
+        struct cow_phys_range ranges[];
+};
+
+int cow_extents_append(struct snap_device *dev, const struct fiemap_extent *fe);
+
+void cow_extents_truncate(struct snap_device *dev, uint64_t logical_end);
+
+void cow_extents_free(struct snap_device *dev);
+
+int cow_phys_map_build(struct snap_device *dev);
+
+void cow_phys_map_clear(struct snap_device *dev);
+
+int cow_phys_map_pin(struct snap_device *dev);
+
+void cow_phys_map_unpin(struct snap_device *dev);
+
+int cow_phys_map_may_overlap(struct snap_device *dev, sector_t sect,
+                             sector_t nr_sects);
+
+int cow_phys_map_contains(struct snap_device *dev, sector_t sect,
+                          sector_t nr_sects);
+
+#endif /* COW_EXTENTS_H_ */
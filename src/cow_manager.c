@@ -5,11 +5,14 @@
  */
 
 #include "cow_manager.h"
+#include "cow_extents.h"
+#include "dattobd_trace.h"
 #include "filesystem.h"
 #include "logging.h"
 #include "tracer.h"
 #include "blkdev.h"
 #include "memory.h"
+#include "snap_events.h"
 
 #ifdef HAVE_UUID_H
 #include <linux/uuid.h>
@@ -29,7 +32,11 @@
 #define get_zeroed_pages(flags, order)                                         \
         __get_free_pages(((flags) | __GFP_ZERO), order)
 
-const unsigned long dattobd_cow_ext_buf_size = sizeof(struct fiemap_extent) * 1024;
+// fill levels of the cow file (in percent) reported to event subscribers
+static const unsigned int cow_fill_marks[] = { 50, 75, 90, 95 };
+
+// size of the fiemap window, larger files are mapped in several passes
+const unsigned long dattobd_cow_ext_buf_size = sizeof(struct fiemap_extent) * 256;
 
 inline void __close_and_destroy_dattobd_mutable_file(struct dattobd_mutable_file *dfilp){
         file_close(dfilp);
@@ -121,28 +128,29 @@ static int __cow_alloc_section(struct cow_manager *cm, unsigned long sect_idx,
  */
 static int __cow_load_section(struct cow_manager *cm, unsigned long sect_idx)
 {
-        int ret, i;
-        int sect_size_bytes = COW_SECTION_SIZE * sizeof(uint64_t);
+        int ret;
+        u64 start_ns = snap_stats_now();
 
         ret = __cow_alloc_section(cm, sect_idx, 0);
         if (ret)
                 goto error;
 
-        for (i = 0; i < sect_size_bytes / COW_BLOCK_SIZE; i++) {
-		// int mapping_offset = (COW_BLOCK_SIZE / sizeof(cm->sects[sect_idx].mappings[0])) * i;
-		// int cow_file_offset = COW_BLOCK_SIZE * i;
-
-                ret = file_read(cm->dfilp, cm->dev, cm->sects[sect_idx].mappings,
-                                cm->sect_size * sect_idx * 8 + COW_HEADER_SIZE,
-                                cm->sect_size * 8);
-                if (ret)
-                        goto error;
-        }
+        ret = file_read(cm->dfilp, cm->dev, cm->sects[sect_idx].mappings,
+                        cm->sect_size * sect_idx * 8 + COW_HEADER_SIZE,
+                        cm->sect_size * 8);
+        if (ret)
+                goto error;
 
+        snap_stats_record(cm->dev, SNAP_HIST_SECTION_LOAD, start_ns);
+        snap_slow_op_check(cm->dev, SNAP_SLOW_SECTION_LOAD, start_ns,
+                           (u64)sect_idx * cm->sect_size, cm->sect_size, 0);
+        trace_dattobd_section_load(cm->dev, sect_idx, 0);
         return 0;
 
 error:
         LOG_ERROR(ret, "error loading section from file");
+        snap_slow_op_check(cm->dev, SNAP_SLOW_SECTION_LOAD, start_ns,
+                           (u64)sect_idx * cm->sect_size, cm->sect_size, ret);
         if (cm->sects[sect_idx].mappings)
                 __cow_free_section(cm, sect_idx);
         return ret;
@@ -159,12 +167,8 @@ error:
  */
 static int __cow_write_section(struct cow_manager *cm, unsigned long sect_idx)
 {
-        int i, ret;
-        int sect_size_bytes = COW_SECTION_SIZE * sizeof(uint64_t);
-
-        for (i = 0; i < sect_size_bytes / COW_BLOCK_SIZE; i++) {
-		// int mapping_offset = (COW_BLOCK_SIZE / sizeof(cm->sects[sect_idx].mappings[0])) * i;
-		// int cow_file_offset = COW_BLOCK_SIZE * i;
+        int ret;
+        u64 start_ns = snap_stats_now();
 
         ret = file_write(cm->dfilp, cm->dev, cm->sects[sect_idx].mappings,
                          cm->sect_size * sect_idx * 8 + COW_HEADER_SIZE,
@@ -173,8 +177,12 @@ static int __cow_write_section(struct cow_manager *cm, unsigned long sect_idx)
                 LOG_ERROR(ret, "error writing cow manager section to file");
                 return ret;
         }
-        }
 
+        cm->sects[sect_idx].dirty = 0;
+        snap_stats_inc(cm->dev, SNAP_STAT_SECTION_WRITES);
+        snap_stats_record(cm->dev, SNAP_HIST_SECTION_FLUSH, start_ns);
+        trace_dattobd_section_flush(cm->dev, sect_idx,
+                                    cm->sects[sect_idx].usage);
         return 0;
 }
 
@@ -211,7 +219,10 @@ static int __cow_sync_and_free_sections(struct cow_manager *cm,
                                 return ret;
                         }
 
+                        trace_dattobd_section_evict(cm->dev, i,
+                                                    cm->sects[i].usage);
                         __cow_free_section(cm, i);
+                        snap_stats_inc(cm->dev, SNAP_STAT_CACHE_EVICTIONS);
                 }
                 cm->sects[i].usage = 0;
         }
@@ -234,6 +245,11 @@ static int __cow_cleanup_mappings(struct cow_manager *cm)
         unsigned long i;
         int ret;
         unsigned long granularity, thresh = 0;
+        unsigned long allocated = cm->allocated_sects;
+        u64 start_ns = snap_stats_now();
+        struct snap_cpu_phase ph;
+
+        snap_cpu_phase_begin(cm->dev, &ph);
 
         // find the max usage of the sections of the cow manager
         for (i = 0; i < cm->total_sects; i++) {
@@ -266,11 +282,19 @@ static int __cow_cleanup_mappings(struct cow_manager *cm)
 
         // deallocate sections of the cm with less usage than the median
         ret = __cow_sync_and_free_sections(cm, thresh);
+        snap_cpu_phase_end(cm->dev, SNAP_STAT_CPU_EVICT_NS, &ph);
         if (ret) {
                 LOG_ERROR(ret, "error cleaning cow manager mappings");
                 return ret;
         }
 
+        // only read by snap_debugfs, see struct cow_cleanup_info
+        cm->last_cleanup.end_ns = snap_stats_now();
+        cm->last_cleanup.cost_ns = cm->last_cleanup.end_ns - start_ns;
+        cm->last_cleanup.thresh = thresh;
+        cm->last_cleanup.freed = allocated - cm->allocated_sects;
+        cm->cleanups++;
+
         return 0;
 }
 
@@ -395,6 +419,31 @@ error:
         return ret;
 }
 
+/**
+ * __cow_free_sects() - Frees the array of sections of @cm. The mappings of
+ * each section must have been freed already.
+ *
+ * @cm: each &struct snap_device has a &struct cow_manager
+ *
+ * The debugfs cache dump walks the array under rcu_read_lock(), so it is
+ * unpublished and a grace period is waited for before it is freed.
+ */
+static void __cow_free_sects(struct cow_manager *cm)
+{
+        struct cow_section *sects = cm->sects;
+
+        if (!sects)
+                return;
+
+        ACCESS_ONCE(cm->sects) = NULL;
+        synchronize_rcu();
+
+        if (cm->flags & (1 << COW_VMALLOC_UPPER))
+                vfree(sects);
+        else
+                kfree(sects);
+}
+
 /**
  * cow_free_members() - Frees COW state tracking memory and unlinks the COW
  * backing file.
@@ -411,12 +460,7 @@ void cow_free_members(struct cow_manager *cm)
                                            cm->log_sect_pages);
                 }
 
-                if (cm->flags & (1 << COW_VMALLOC_UPPER))
-                        vfree(cm->sects);
-                else
-                        kfree(cm->sects);
-
-                cm->sects = NULL;
+                __cow_free_sects(cm);
         }
 
         if (cm->dfilp) {
@@ -426,6 +470,24 @@ void cow_free_members(struct cow_manager *cm)
         }
 }
 
+static void __cow_free_rcu(struct rcu_head *head)
+{
+        kfree(container_of(head, struct cow_manager, rcu));
+}
+
+/**
+ * __cow_free_deferred() - Frees @cm once an RCU grace period has passed.
+ *
+ * @cm: each &struct snap_device has a &struct cow_manager
+ *
+ * The /proc and sysfs readers look at the scalar members of a device's cow
+ * manager under rcu_read_lock() without taking the ioctl mutex.
+ */
+static void __cow_free_deferred(struct cow_manager *cm)
+{
+        call_rcu(&cm->rcu, __cow_free_rcu);
+}
+
 /**
  * cow_free() - Frees the memory used for COW tracking and unlinks the COW
  * backing file from the block device.
@@ -435,7 +497,7 @@ void cow_free_members(struct cow_manager *cm)
 void cow_free(struct cow_manager *cm)
 {
         cow_free_members(cm);
-        kfree(cm);
+        __cow_free_deferred(cm);
 }
 
 /**
@@ -465,14 +527,8 @@ int cow_sync_and_free(struct cow_manager *cm)
                 cm->dfilp = NULL;
         }
 
-        if (cm->sects) {
-                if (cm->flags & (1 << COW_VMALLOC_UPPER))
-                        vfree(cm->sects);
-                else
-                        kfree(cm->sects);
-        }
-
-        kfree(cm);
+        __cow_free_sects(cm);
+        __cow_free_deferred(cm);
 
         return 0;
 
@@ -809,13 +865,31 @@ int cow_truncate_to_index(struct cow_manager *cm)
 {
         int ret;
 
+        // the blocks given back may be reused by other files before the map
+        // is rebuilt, writes to them must not pass for cow file writes
+        if (cm->dev) {
+                mutex_lock(&cm->dev->sd_cow_ext_lock);
+                cow_phys_map_clear(cm->dev);
+                mutex_unlock(&cm->dev->sd_cow_ext_lock);
+        }
+
         // truncate the cow file to just the index
         cm->flags |= (1 << COW_INDEX_ONLY);
         ret = file_truncate(cm->dfilp, cm->data_offset);
 
-        if(!ret)
+        if(!ret){
                 cm->file_size = cm->data_offset;
-        
+
+                if (cm->dev) {
+                        mutex_lock(&cm->dev->sd_cow_ext_lock);
+                        cow_extents_truncate(cm->dev, cm->data_offset);
+                        // not fatal, bios are inspected page by page without
+                        // the map
+                        cow_phys_map_build(cm->dev);
+                        mutex_unlock(&cm->dev->sd_cow_ext_lock);
+                }
+        }
+
         return ret;
 }
 
@@ -853,18 +927,24 @@ int cow_read_mapping(struct cow_manager *cm, uint64_t pos, uint64_t *out)
         int ret;
         uint64_t sect_idx = pos;
         unsigned long sect_pos = do_div(sect_idx, cm->sect_size);
+        struct snap_cpu_phase ph;
 
+        snap_cpu_phase_begin(cm->dev, &ph);
         cm->sects[sect_idx].usage++;
 
         if (!cm->sects[sect_idx].mappings) {
                 if (!cm->sects[sect_idx].has_data) {
+                        snap_stats_inc(cm->dev, SNAP_STAT_CACHE_HITS);
                         *out = 0;
-                        return 0;
+                        goto out;
                 } else {
+                        snap_stats_inc(cm->dev, SNAP_STAT_CACHE_MISSES);
                         ret = __cow_load_section(cm, sect_idx);
                         if (ret)
                                 goto error;
                 }
+        } else {
+                snap_stats_inc(cm->dev, SNAP_STAT_CACHE_HITS);
         }
 
         *out = cm->sects[sect_idx].mappings[sect_pos];
@@ -875,10 +955,60 @@ int cow_read_mapping(struct cow_manager *cm, uint64_t pos, uint64_t *out)
                         goto error;
         }
 
+out:
+        snap_cpu_phase_end(cm->dev, SNAP_STAT_CPU_MAPPING_NS, &ph);
         return 0;
 
 error:
         LOG_ERROR(ret, "error reading cow mapping");
+        snap_cpu_phase_end(cm->dev, SNAP_STAT_CPU_MAPPING_NS, &ph);
+        return ret;
+}
+
+/**
+ * cow_peek_section() - Copies the mappings of a section without going
+ * through the section cache. A cached section is copied from memory, one
+ * that was evicted is read from the COW file and one that never had data
+ * reads as zeroes.
+ *
+ * @cm: The &struct cow_manager associated with the &struct snap_device.
+ * @sect_idx: The index of the section.
+ * @out: Room for @cm->sect_size mappings, page aligned.
+ *
+ * The caller must hold &snap_device->sd_cow_lock so the cow thread does not
+ * change or free the section while it is copied.
+ *
+ * Return:
+ * * 0 - success
+ * * !0 - errno indicating the error
+ */
+int cow_peek_section(struct cow_manager *cm, unsigned long sect_idx,
+                     uint64_t *out)
+{
+        int ret;
+        struct cow_section *sect;
+
+        // the cow thread frees the sections when the device fails
+        if (!cm->sects || !cm->dfilp)
+                return -EIO;
+
+        sect = &cm->sects[sect_idx];
+        if (sect->mappings) {
+                memcpy(out, sect->mappings, cm->sect_size * 8);
+                return 0;
+        }
+
+        if (!sect->has_data) {
+                memset(out, 0, cm->sect_size * 8);
+                return 0;
+        }
+
+        ret = file_read(cm->dfilp, cm->dev, out,
+                        cm->sect_size * sect_idx * 8 + COW_HEADER_SIZE,
+                        cm->sect_size * 8);
+        if (ret)
+                LOG_ERROR(ret, "error reading section %lu from file", sect_idx);
+
         return ret;
 }
 
@@ -899,19 +1029,25 @@ int __cow_write_mapping(struct cow_manager *cm, uint64_t pos, uint64_t val)
         uint64_t sect_idx = pos;
         unsigned long sect_pos = do_div(sect_idx, cm->sect_size);
         //do_div modifies sect_idx to be the quotient of pos divided by cm->sect_size and returns the remainder
+        struct snap_cpu_phase ph;
 
+        snap_cpu_phase_begin(cm->dev, &ph);
         cm->sects[sect_idx].usage++;
 
         if (!cm->sects[sect_idx].mappings) {
                 if (!cm->sects[sect_idx].has_data) {
+                        snap_stats_inc(cm->dev, SNAP_STAT_CACHE_ALLOCS);
                         ret = __cow_alloc_section(cm, sect_idx, 1);
                         if (ret)
                                 goto error;
                 } else {
+                        snap_stats_inc(cm->dev, SNAP_STAT_CACHE_MISSES);
                         ret = __cow_load_section(cm, sect_idx);
                         if (ret)
                                 goto error;
                 }
+        } else {
+                snap_stats_inc(cm->dev, SNAP_STAT_CACHE_HITS);
         }
 
         if (cm->version >= COW_VERSION_CHANGED_BLOCKS &&
@@ -919,6 +1055,7 @@ int __cow_write_mapping(struct cow_manager *cm, uint64_t pos, uint64_t val)
                 cm->nr_changed_blocks++;
 
         cm->sects[sect_idx].mappings[sect_pos] = val;
+        cm->sects[sect_idx].dirty = 1;
 
         if (cm->allocated_sects > cm->allowed_sects) {
                 ret = __cow_cleanup_mappings(cm);
@@ -926,13 +1063,38 @@ int __cow_write_mapping(struct cow_manager *cm, uint64_t pos, uint64_t val)
                         goto error;
         }
 
+        snap_cpu_phase_end(cm->dev, SNAP_STAT_CPU_MAPPING_NS, &ph);
         return 0;
 
 error:
         LOG_ERROR(ret, "error writing cow mapping");
+        snap_cpu_phase_end(cm->dev, SNAP_STAT_CPU_MAPPING_NS, &ph);
         return ret;
 }
 
+/**
+ * __cow_check_fill() - Emits a %DATTOBD_EVENT_FILL event when the cow file
+ * has filled past another one of @cow_fill_marks. After the file grew, the
+ * marks it has dropped below are armed again.
+ *
+ * @cm: each &struct snap_device has a &struct cow_manager
+ */
+static void __cow_check_fill(struct cow_manager *cm)
+{
+        unsigned int marks = 0;
+        uint64_t used = cm->curr_pos * COW_BLOCK_SIZE * 100;
+
+        while (marks < ARRAY_SIZE(cow_fill_marks) &&
+               used >= cow_fill_marks[marks] * cm->file_size)
+                marks++;
+
+        if (marks > cm->fill_marks && cm->dev)
+                snap_events_emit(cm->dev->sd_minor, DATTOBD_EVENT_FILL,
+                                 cow_fill_marks[marks - 1], 0);
+
+        cm->fill_marks = marks;
+}
+
 /**
  * __cow_write_data() - Writes a block of COW data to the current position
  * in the COW file.
@@ -953,6 +1115,10 @@ static int __cow_write_data(struct cow_manager *cm, void *buf)
         uint64_t expand_allowance = 0;
         int kstatfs_ret;
         struct kstatfs kstatfs;
+        u64 start_ns;
+        u64 op_ns = snap_stats_now();
+        enum snap_slow_op op = SNAP_SLOW_COW_WRITE;
+        struct snap_cpu_phase ph;
 
 retry:
         if (curr_size >= cm->file_size) {
@@ -971,10 +1137,14 @@ retry:
                         }
 
                         if(expand_allowance){
+                                op = SNAP_SLOW_COW_WRITE_EXPAND;
                                 ret = tracer_expand_cow_file_no_check(cm->dev, expand_allowance);
                                 expand_allowance = 0;
                                 if(ret)
                                         goto error;
+                                snap_events_emit(cm->dev->sd_minor,
+                                                 DATTOBD_EVENT_EXPAND,
+                                                 cm->file_size, 0);
                                 goto retry;
                         }
                 }
@@ -996,16 +1166,23 @@ retry:
                 goto error;
         }
 
+        start_ns = snap_stats_now();
+        snap_cpu_phase_begin(cm->dev, &ph);
         ret = file_write(cm->dfilp, cm->dev, buf, curr_size, COW_BLOCK_SIZE);
+        snap_cpu_phase_end(cm->dev, SNAP_STAT_CPU_COPY_NS, &ph);
         if (ret)
                 goto error;
+        snap_stats_record(cm->dev, SNAP_HIST_COW_WRITE, start_ns);
+        snap_slow_op_check(cm->dev, op, op_ns, cm->curr_pos, 1, 0);
 
         cm->curr_pos++;
+        __cow_check_fill(cm);
 
         return 0;
 
 error:
         LOG_ERROR(ret, "error writing cow data");
+        snap_slow_op_check(cm->dev, op, op_ns, cm->curr_pos, 1, ret);
         return ret;
 }
 
@@ -1034,8 +1211,11 @@ int cow_write_current(struct cow_manager *cm, uint64_t block, void *buf)
                 goto error;
 
         // if the block mapping already exists return so we don't overwrite it
-        if (block_mapping)
+        trace_dattobd_cow_write(cm->dev, block, block_mapping != 0);
+        if (block_mapping) {
+                snap_stats_inc(cm->dev, SNAP_STAT_COW_BLOCKS_PRESENT);
                 return 0;
+        }
 
         // write the mapping
         ret = __cow_write_current_mapping(cm, block);
@@ -1047,6 +1227,7 @@ int cow_write_current(struct cow_manager *cm, uint64_t block, void *buf)
         if (ret)
                 goto error;
 
+        snap_stats_inc(cm->dev, SNAP_STAT_COW_BLOCKS_WRITTEN);
         return 0;
 
 error:
@@ -1071,12 +1252,15 @@ int cow_read_data(struct cow_manager *cm, void *buf, uint64_t block_pos,
                   unsigned long block_off, unsigned long len)
 {
         int ret;
+        struct snap_cpu_phase ph;
 
         if (block_off >= COW_BLOCK_SIZE)
                 return -EINVAL;
 
+        snap_cpu_phase_begin(cm->dev, &ph);
         ret = file_read(cm->dfilp, cm->dev, buf, (block_pos * COW_BLOCK_SIZE) + block_off,
                         len);
+        snap_cpu_phase_end(cm->dev, SNAP_STAT_CPU_COPY_NS, &ph);
         if (ret) {
                 LOG_ERROR(ret, "error reading cow data");
                 return ret;
@@ -1085,15 +1269,34 @@ int cow_read_data(struct cow_manager *cm, void *buf, uint64_t block_pos,
         return 0;
 }
 
+/**
+ * cow_get_file_extents() - Maps the extents of the cow file into the compact
+ * extent array of @dev and rebuilds the physical range map from it.
+ *
+ * @dev: The &struct snap_device that owns the cow file.
+ * @filp: The open cow file.
+ *
+ * Only the part of the file that is not mapped yet is queried, starting from
+ * the last known extent since the filesystem may have grown it. FIEMAP is
+ * issued in windows of a fixed size bounce buffer, so there is no limit on
+ * the number of extents. Needs a process context, the bounce buffer is
+ * mapped into the address space of the current task.
+ *
+ * Return:
+ * * 0 - success
+ * * !0 - errno indicating the error
+ */
 int cow_get_file_extents(struct snap_device* dev, struct file* filp)
 {
 	int ret;
 	struct fiemap_extent_info fiemap_info;
-	unsigned int fiemap_mapped_extents_size, i_ext;
-	struct fiemap_extent *extent;
+	struct fiemap_extent extent;
 	char parent_process_name[TASK_COMM_LEN];
 	unsigned long vm_flags = VM_READ | VM_WRITE;
 	unsigned long start_addr;
+	unsigned int i_ext, max_num_extents;
+	uint64_t fiemap_start;
+	int last_window;
 	struct task_struct *task;
 	struct vm_area_struct *vma;
 	struct page *pg;
@@ -1114,14 +1317,23 @@ int cow_get_file_extents(struct snap_device* dev, struct file* filp)
         fiemap = NULL;
 	task = get_current();
 
+        if (!task->mm) {
+                LOG_DEBUG("no address space to map cow file extents from");
+                return -EPERM;
+        }
+
         LOG_DEBUG("getting cow file extents from filp=%p", filp);
 	LOG_DEBUG("attempting page stealing from %s", get_task_comm(parent_process_name, task));
 
+        mutex_lock(&dev->sd_cow_ext_lock);
         dattobd_mm_lock(task->mm);
         start_addr = dattobd_get_unmapped_area(NULL, 0, cow_ext_buf_size, 0, VM_READ | VM_WRITE);
 
-        if (IS_ERR_VALUE(start_addr))
+        if (IS_ERR_VALUE(start_addr)) {
+                dattobd_mm_unlock(task->mm);
+                mutex_unlock(&dev->sd_cow_ext_lock);
 		return start_addr; // returns -EPERM if failed
+        }
 
 
         vma = dattobd_vm_area_allocate(task->mm);
@@ -1130,6 +1342,7 @@ int cow_get_file_extents(struct snap_device* dev, struct file* filp)
 		ret = -ENOMEM;
 		LOG_ERROR(ret, "vm_area_alloc() failed");
 		dattobd_mm_unlock(task->mm);
+                mutex_unlock(&dev->sd_cow_ext_lock);
 		return ret;
 	}
 
@@ -1144,14 +1357,17 @@ int cow_get_file_extents(struct snap_device* dev, struct file* filp)
 		LOG_ERROR(ret, "insert_vm_struct() failed");
 		dattobd_vm_area_free(vma);
 		dattobd_mm_unlock(task->mm);
+                mutex_unlock(&dev->sd_cow_ext_lock);
 		return ret;
 	}
 
         pg = alloc_pages(GFP_USER, get_order(cow_ext_buf_size));
 	if (!pg) {
+		ret = -ENOMEM;
 		LOG_ERROR(ret, "alloc_page() failed");
 		dattobd_vm_area_free(vma);
 		dattobd_mm_unlock(task->mm);
+                mutex_unlock(&dev->sd_cow_ext_lock);
 		return ret;
 	}
 
@@ -1163,6 +1379,7 @@ int cow_get_file_extents(struct snap_device* dev, struct file* filp)
 		__free_pages(pg, get_order(cow_ext_buf_size));
 		dattobd_vm_area_free(vma);
 		dattobd_mm_unlock(task->mm);
+                mutex_unlock(&dev->sd_cow_ext_lock);
 		return ret;
 	}
 
@@ -1171,49 +1388,74 @@ int cow_get_file_extents(struct snap_device* dev, struct file* filp)
 	if (filp->f_inode->i_op)
 		fiemap = filp->f_inode->i_op->fiemap;
 
-        if (fiemap) {
+        if (!fiemap) {
+		ret = -ENOTSUPP;
+		LOG_ERROR(ret, "fiemap not supported");
+		goto out;
+	}
+
+        // the last known extent may have grown, so map it again
+        fiemap_start = 0;
+        if (dev->sd_cow_ext_cnt)
+                fiemap_start = dev->sd_cow_extents[dev->sd_cow_ext_cnt - 1].logical;
+        cow_extents_truncate(dev, fiemap_start);
+
+        max_num_extents = cow_ext_buf_size / sizeof(struct fiemap_extent);
+        fiemap_info.fi_flags = FIEMAP_FLAG_SYNC;
+
+        do {
 		int64_t fiemap_max = ~0ULL & ~(1ULL << 63);
-		int max_num_extents = cow_ext_buf_size; // used for do_div() as it overwrites the first argument
 
-		fiemap_info.fi_flags = FIEMAP_FLAG_SYNC;
 		fiemap_info.fi_extents_mapped = 0;
-		do_div(max_num_extents, sizeof(struct fiemap_extent));
 		fiemap_info.fi_extents_max = max_num_extents;
 		fiemap_info.fi_extents_start = (struct fiemap_extent __user *)cow_ext_buf;
 
-		ret = fiemap(filp->f_inode, &fiemap_info, 0, fiemap_max);
-
-		LOG_DEBUG("fiemap for cow file (ret %d), extents %u (max %u)", ret,
-				fiemap_info.fi_extents_mapped, fiemap_info.fi_extents_max);
-
-		if (!ret && fiemap_info.fi_extents_mapped > 0) {
-			if (dev->sd_cow_extents) kfree(dev->sd_cow_extents);
-			fiemap_mapped_extents_size = fiemap_info.fi_extents_mapped * sizeof(struct fiemap_extent);
-			dev->sd_cow_extents = kmalloc(fiemap_mapped_extents_size, GFP_KERNEL);
-			if (dev->sd_cow_extents) {
-                                //TODO: closely watch
-				ret = copy_from_user(dev->sd_cow_extents, cow_ext_buf, fiemap_mapped_extents_size);
-				if (!ret) {
-					dev->sd_cow_ext_cnt = fiemap_info.fi_extents_mapped;
-					WARN(dev->sd_cow_ext_cnt == max_num_extents, "max num of extents read, increase cow_ext_buf_size");
-					extent = dev->sd_cow_extents;
-					for (i_ext = 0; i_ext < fiemap_info.fi_extents_mapped; ++i_ext, ++extent) {
-						LOG_DEBUG("   cow file extent: log 0x%llx, phy 0x%llx, len %llu", extent->fe_logical, extent->fe_physical, extent->fe_length);
-					}
-				}
-			}
-		}
-	} else {
-		ret = -ENOTSUPP;
-		LOG_ERROR(ret, "fiemap not supported");
-		goto out;
-	}
+		ret = fiemap(filp->f_inode, &fiemap_info, fiemap_start,
+                             fiemap_max - fiemap_start);
+
+		LOG_DEBUG("fiemap for cow file from %llu (ret %d), extents %u (max %u)",
+                          fiemap_start, ret, fiemap_info.fi_extents_mapped,
+                          fiemap_info.fi_extents_max);
+                if (ret)
+                        goto out;
+
+                // the file was synced by the first window
+                fiemap_info.fi_flags = 0;
+                last_window = (fiemap_info.fi_extents_mapped < max_num_extents);
+
+                for (i_ext = 0; i_ext < fiemap_info.fi_extents_mapped; i_ext++) {
+                        if (copy_from_user(&extent, cow_ext_buf + i_ext * sizeof(struct fiemap_extent),
+                                           sizeof(struct fiemap_extent))) {
+                                ret = -EFAULT;
+                                LOG_ERROR(ret, "error copying cow file extent");
+                                goto out;
+                        }
+
+                        LOG_DEBUG("   cow file extent: log 0x%llx, phy 0x%llx, len %llu", extent.fe_logical, extent.fe_physical, extent.fe_length);
+
+                        ret = cow_extents_append(dev, &extent);
+                        if (ret)
+                                goto out;
+
+                        fiemap_start = extent.fe_logical + extent.fe_length;
+                        if (extent.fe_flags & FIEMAP_EXTENT_LAST)
+                                last_window = 1;
+                }
+        } while (!last_window);
+
+        LOG_DEBUG("cow file mapped by %u extents", dev->sd_cow_ext_cnt);
+
+        // not fatal, bios are inspected page by page without the map
+        cow_phys_map_build(dev);
 
 out:
+        if (ret)
+                cow_phys_map_clear(dev);
 	ClearPageReserved(pg);
 	dattobd_mm_unlock(task->mm);
 	vm_munmap(vma->vm_start, cow_ext_buf_size);
 	__free_pages(pg, get_order(cow_ext_buf_size));
+        mutex_unlock(&dev->sd_cow_ext_lock);
 	return ret;
 }
 
@@ -1224,19 +1466,44 @@ int __cow_expand_datastore(struct cow_manager* cm, uint64_t append_size_bytes){
 
         LOG_DEBUG("trying to expand cow file with %llu bytes", append_size_bytes);
 
+        // the new blocks are not described by the physical range map
+        if (cm->dev) {
+                mutex_lock(&cm->dev->sd_cow_ext_lock);
+                cow_phys_map_clear(cm->dev);
+        }
+
         ret = file_allocate(cm->dfilp, cm->dev, cm->file_size, append_size_bytes, &actual);
 
+        if (cm->dev)
+                mutex_unlock(&cm->dev->sd_cow_ext_lock);
+
         if(actual != append_size_bytes){
                 LOG_WARN("cow file was not expanded to requested size (req: %llu, act: %llu)", append_size_bytes, actual);
         }
 
         cm->file_size = cm->file_size + actual;
+        trace_dattobd_cow_expand(cm->dev, append_size_bytes, actual,
+                                 cm->file_size, ret);
 
         if (ret){
                 LOG_ERROR(ret, "unable to expand cow file");
                 return ret;
         }
 
+        if (!cm->dev)
+                return 0;
+
+        // the cow thread has no address space for fiemap, the map is rebuilt
+        // by the next info or stats call on the device instead
+        if (!current->mm || cow_get_file_extents(cm->dev, cm->dfilp->filp)) {
+                cm->dev->sd_cow_ext_stale = 1;
+                snap_stats_inc(cm->dev, SNAP_STAT_COW_MAP_DEFERRED);
+                LOG_DEBUG("cow file physical range map left for a later "
+                          "refresh");
+        } else {
+                cm->dev->sd_cow_ext_stale = 0;
+        }
+
         return 0;
 }
 
@@ -1319,7 +1586,13 @@ uint64_t cow_auto_expand_manager_get_allowance_free_unknown(struct cow_auto_expa
 }
 
 
+static void __cow_auto_expand_manager_free_rcu(struct rcu_head *head)
+{
+        kfree(container_of(head, struct cow_auto_expand_manager, rcu));
+}
+
 void cow_auto_expand_manager_free(struct cow_auto_expand_manager* aem){
         mutex_destroy(&aem->lock);
-        kfree(aem);
+        // lock-free readers may still be printing the settings
+        call_rcu(&aem->rcu, __cow_auto_expand_manager_free_rcu);
 }
@@ -31,6 +31,12 @@ struct cow_section {
          */
         char has_data;
 
+        /**
+         * @dirty: nonzero if the cached mappings were changed since they were
+         * last written to the cow file
+         */
+        char dirty;
+
         /**
          * @usage: counter that keeps track of how often this section is used
          */
@@ -46,6 +52,15 @@ struct cow_auto_expand_manager {
 
         uint64_t step_size_mib;
         uint64_t reserved_space_mib;
+        struct rcu_head rcu; // deferred free, see cow_auto_expand_manager_free()
+};
+
+// what the last pass of __cow_cleanup_mappings() did
+struct cow_cleanup_info {
+        uint64_t end_ns; // when it finished, see snap_stats_now()
+        uint64_t cost_ns; // how long it took, including section writes
+        unsigned long thresh; // the usage at or below which sections went
+        unsigned long freed; // number of sections it freed
 };
 
 struct cow_manager {
@@ -70,9 +85,14 @@ struct cow_manager {
                                      // be allocated at once
         struct cow_section *sects; // pointer to the array of sections of
                                    // mappings
+        unsigned int fill_marks; // fill watermarks reached, see
+                                 // __cow_check_fill()
+        uint64_t cleanups; // number of cache cleanup passes
+        struct cow_cleanup_info last_cleanup; // the most recent cleanup pass
         struct snap_device* dev;  //pointer to snapshot device
 
         struct cow_auto_expand_manager* auto_expand; // auto expand settings
+        struct rcu_head rcu; // deferred free for lock-free readers
 };
 
 /***************************COW MANAGER FUNCTIONS**************************/
@@ -108,6 +128,9 @@ int cow_read_data(struct cow_manager *cm, void *buf, uint64_t block_pos,
 
 int __cow_write_mapping(struct cow_manager *cm, uint64_t pos, uint64_t val);
 
+int cow_peek_section(struct cow_manager *cm, unsigned long sect_idx,
+                     uint64_t *out);
+
 int cow_get_file_extents(struct snap_device* dev, struct file* filp);
 
 int __cow_expand_datastore(struct cow_manager *cm, uint64_t append_size_bytes);
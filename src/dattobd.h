@@ -59,6 +59,20 @@ struct reconfigure_auto_expand_params {
         unsigned int minor; // minor to configure
 };
 
+// how cow file I/O through the filesystem interacts with the page cache
+#define COW_IO_BUFFERED 0 // plain buffered I/O, the default
+#define COW_IO_DROP_CACHE 1 // buffered I/O, written ranges are dropped from the
+                            // page cache once clean
+#define COW_IO_DIRECT 2 // aligned I/O uses O_DIRECT, the rest is dropped
+                        // from the page cache
+#define COW_IO_MODE_MAX COW_IO_DIRECT
+
+struct reconfigure_cow_io_params {
+        uint32_t mode; // one of COW_IO_*
+
+        unsigned int minor; // minor to configure
+};
+
 #define COW_UUID_SIZE 16
 #define COW_BLOCK_LOG_SIZE 12
 #define COW_BLOCK_SIZE (1 << COW_BLOCK_LOG_SIZE)
@@ -87,6 +101,15 @@ struct cow_header {
                                     // snapshot
 };
 
+/**
+ * struct dattobd_extent - A run of changed blocks, both fields in
+ * COW_BLOCK_SIZE blocks.
+ */
+struct dattobd_extent {
+        uint64_t start;
+        uint64_t len;
+};
+
 struct dattobd_info {
         unsigned int minor;
         unsigned long state;
@@ -101,6 +124,191 @@ struct dattobd_info {
         unsigned long long nr_changed_blocks;
 };
 
+// offset of a path that did not fit into the string table
+#define DATTOBD_INFO_NO_PATH 0xffffffffU
+
+/**
+ * struct dattobd_info_rec - The state of one device as returned by
+ * IOCTL_DATTOBD_INFO_ALL. Same meaning as &struct dattobd_info, but fixed
+ * size with the paths stored in a separate string table.
+ */
+struct dattobd_info_rec {
+        uint32_t minor;
+        int32_t error;
+        uint64_t state;
+        uint64_t cache_size;
+        uint64_t falloc_size;
+        uint64_t seqid;
+        uint64_t version;
+        uint64_t nr_changed_blocks;
+        uint8_t uuid[COW_UUID_SIZE];
+        uint32_t cow; // offset of the cow file path in the string table
+        uint32_t bdev; // offset of the block device path in the string table
+};
+
+struct dattobd_info_all_params {
+        uint32_t count; // in: number of records that fit at recs
+                        // out: number of configured devices
+        uint32_t strings_size; // in: size of the buffer at strings (in bytes)
+                               // out: size needed for all paths
+        struct dattobd_info_rec *recs; // out: one record per device, in order
+                                       // of minors
+        char *strings; // out: nul terminated paths referenced by recs
+};
+
+#define DATTOBD_STATS_VERSION 5
+
+#define DATTOBD_HIST_BUCKETS 40
+
+/**
+ * struct dattobd_hist - A log2 latency histogram.
+ *
+ * Bucket 0 counts latencies below 1ns, bucket i counts latencies in
+ * [2^(i-1), 2^i) nanoseconds and the last bucket everything above.
+ */
+struct dattobd_hist {
+        uint64_t count; // number of samples
+        uint64_t sum_ns; // sum of all samples (in nanoseconds)
+        uint64_t buckets[DATTOBD_HIST_BUCKETS];
+};
+
+/**
+ * struct dattobd_stats - Runtime counters of a snapshot device.
+ *
+ * Counters accumulate from the time the device was set up and are carried
+ * over across transitions. Fields are only ever appended, a caller passing
+ * an older, shorter structure receives the prefix it knows about.
+ */
+struct dattobd_stats {
+        uint32_t version; // DATTOBD_STATS_VERSION of the kernel module
+        uint32_t size; // number of bytes filled in by the kernel module
+
+        uint64_t writes_traced; // write bios seen by the tracer
+        uint64_t write_bytes_traced;
+        uint64_t writes_passed; // write bios that needed no copy
+        uint64_t write_bytes_passed;
+        uint64_t clones_submitted; // read clones issued to preserve data
+        uint64_t clone_bytes;
+        uint64_t clones_completed;
+        uint64_t ssets_queued; // changed ranges queued in incremental mode
+        uint64_t cow_blocks_written; // blocks preserved in the cow file
+        uint64_t cow_blocks_present; // blocks that were already preserved
+        uint64_t cow_bytes_written; // bytes written to the cow file
+        uint64_t cow_bytes_read; // bytes read from the cow file
+        uint64_t snap_reads; // reads of the snapshot device
+        uint64_t snap_read_bytes;
+        uint64_t cache_hits; // index section lookups served from memory
+        uint64_t cache_misses; // index sections loaded from the cow file
+        uint64_t cache_allocs; // index sections created empty
+        uint64_t cache_evictions; // index sections dropped from memory
+        uint64_t section_writes; // index sections written to the cow file
+
+        uint64_t cow_bios_queued; // bios waiting for the cow thread
+        uint64_t orig_bios_queued; // original bios waiting for submission
+        uint64_t ssets_pending; // changed ranges waiting for the cow thread
+        uint64_t cache_sects; // index sections currently in memory
+        uint64_t cache_sects_allowed; // index sections allowed in memory
+
+        // since version 2, cleared by IOCTL_DATTOBD_STATS_RESET
+        struct dattobd_hist write_delay; // intercepted write until released
+                                         // to the device
+        struct dattobd_hist clone_read; // read clone round trip
+        struct dattobd_hist cow_write; // data block write to the cow file
+        struct dattobd_hist section_load; // index section read from the cow
+                                          // file
+        struct dattobd_hist section_flush; // index section written to the cow
+                                           // file
+        struct dattobd_hist snap_read; // snapshot read serviced by the cow
+                                       // thread
+
+        // since version 3, time spent working for the device (in
+        // nanoseconds); the submit path and completions are elapsed time,
+        // the threads exclude io_wait_ns
+        uint64_t cpu_submit_ns; // tracing writes in the submit path
+        uint64_t cpu_completion_ns; // completing read clones
+        uint64_t cpu_cow_thread_ns; // cow thread, snapshot mode
+        uint64_t cpu_sset_thread_ns; // sset thread, incremental mode
+        uint64_t cpu_mrf_thread_ns; // releasing original bios
+        uint64_t cpu_mapping_ns; // cow/sset thread: index lookups and updates
+        uint64_t cpu_copy_ns; // cow/sset thread: moving data to and from the
+                              // cow file
+        uint64_t cpu_evict_ns; // cow/sset thread: dropping index sections
+        uint64_t io_wait_ns; // cow/sset thread: in cow file or base device
+                             // io calls
+
+        // since version 4
+        uint64_t cow_file_size; // current size of the cow file (in bytes)
+        uint64_t cow_file_used; // bytes of the cow file in use
+
+        // since version 5
+        uint64_t cow_map_deferred; // automatic expansions that dropped the
+                                   // physical range map of the cow file
+        uint64_t cow_map_stale; // 1 while the map waits to be rebuilt by an
+                                // info or stats call
+};
+
+struct dattobd_stats_params {
+        unsigned int minor; // minor of the device to query
+        uint32_t size; // size of the buffer at stats (in bytes)
+        struct dattobd_stats *stats; // out: the device statistics
+};
+
+// types of struct dattobd_event
+#define DATTOBD_EVENT_LOST 0 // value: number of events dropped because the
+                             // reader fell behind, minor is not set
+#define DATTOBD_EVENT_FILL 1 // value: fill watermark of the cow file that was
+                             // crossed (in percent)
+#define DATTOBD_EVENT_EXPAND 2 // value: size of the cow file after it was
+                               // expanded automatically (in bytes)
+#define DATTOBD_EVENT_FAIL 3 // error: the error that failed the device
+#define DATTOBD_EVENT_STATE 4 // value: the new state of the device
+
+/**
+ * struct dattobd_event - A notification read from the control device.
+ *
+ * After IOCTL_DATTOBD_EVENTS a file descriptor of the control device queues
+ * the events of all devices until it is closed. read() returns whole events,
+ * blocking unless the descriptor is non-blocking, and poll() reports POLLIN
+ * while events are queued.
+ */
+struct dattobd_event {
+        uint64_t time_ns; // CLOCK_MONOTONIC time of the event
+        uint64_t value; // depends on type
+        uint32_t type; // DATTOBD_EVENT_*
+        uint32_t minor; // the device the event is about
+        int32_t error;
+        uint32_t reserved;
+};
+
+// flags of struct dattobd_changes_params
+#define DATTOBD_CHANGES_BITMAP 1 // fill buf with a bitmap instead of extents
+
+/**
+ * struct dattobd_changes_params - Parameters of IOCTL_DATTOBD_CHANGES.
+ *
+ * Reports which blocks of [start, start + count) changed, read from the index
+ * of an active device without flushing it to the cow file. By default buf
+ * receives &struct dattobd_extent records, with extents cut at the end of the
+ * range covered. With DATTOBD_CHANGES_BITMAP bit i of buf (least significant
+ * bit first) is set if block start + i changed. A call covers less than
+ * requested if buf fills up or to bound the time it takes, callers walk a
+ * device by repeating it with start advanced by the count returned.
+ */
+struct dattobd_changes_params {
+        uint64_t start; // in: first block to report
+        uint64_t count; // in: number of blocks to report
+                        // out: number of blocks reported
+        uint64_t nr_blocks; // out: number of blocks of the device
+        uint64_t seqid; // out: sequence id of the snapshot
+        uint8_t uuid[COW_UUID_SIZE]; // out: uuid of the snapshot series
+        uint32_t minor; // in: minor of the device to query
+        uint32_t flags; // in: DATTOBD_CHANGES_*
+        uint32_t nr; // in: extents (or bitmap bytes) that fit at buf
+                     // out: extents (or bitmap bytes) filled in
+        uint32_t reserved;
+        void *buf; // out: the extents or bitmap
+};
+
 #define IOCTL_SETUP_SNAP                                                       \
         _IOW(DATTO_IOCTL_MAGIC, 1, struct setup_params) // in: see above
 #define IOCTL_RELOAD_SNAP                                                      \
@@ -123,5 +331,20 @@ struct dattobd_info {
 #define IOCTL_RECONFIGURE_AUTO_EXPAND                                          \
         _IOW(DATTO_IOCTL_MAGIC, 11, struct reconfigure_auto_expand_params) 
                                                               // in: see above
+#define IOCTL_DATTOBD_STATS                                                    \
+        _IOW(DATTO_IOCTL_MAGIC, 12, struct dattobd_stats_params) // in: see
+                                                                 // above
+#define IOCTL_DATTOBD_STATS_RESET                                              \
+        _IOW(DATTO_IOCTL_MAGIC, 13, unsigned int) // in: minor
+#define IOCTL_DATTOBD_EVENTS _IO(DATTO_IOCTL_MAGIC, 14)
+#define IOCTL_DATTOBD_INFO_ALL                                                 \
+        _IOWR(DATTO_IOCTL_MAGIC, 15, struct dattobd_info_all_params) // in/out:
+                                                                     // see above
+#define IOCTL_DATTOBD_CHANGES                                                  \
+        _IOWR(DATTO_IOCTL_MAGIC, 16, struct dattobd_changes_params) // in/out:
+                                                                    // see above
+#define IOCTL_RECONFIGURE_COW_IO                                               \
+        _IOW(DATTO_IOCTL_MAGIC, 17, struct reconfigure_cow_io_params) // in: see
+                                                                      // above
 
 #endif /* DATTOBD_H_ */
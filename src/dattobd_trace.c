@@ -0,0 +1,8 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Copyright (C) 2026 Datto Inc.
+ */
+
+#define CREATE_TRACE_POINTS
+#include "dattobd_trace.h"
@@ -0,0 +1,291 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+/*
+ * Copyright (C) 2026 Datto Inc.
+ */
+
+/*
+ * Tracepoints for the tracing, cow and section cache paths. They are
+ * visible under /sys/kernel/tracing/events/dattobd and cost a static branch
+ * each while disabled. On kernels without TRACE_EVENT every trace_*() call
+ * compiles away.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM dattobd
+
+#if !defined(DATTOBD_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define DATTOBD_TRACE_H_
+
+#include "includes.h"
+#include "bio_helper.h"
+#include "snap_device.h"
+
+// what tracing_fn() did with a bio
+#define DATTOBD_TRACE_BIO_PASSTHROUGH 0 // our own cow file I/O
+#define DATTOBD_TRACE_BIO_SKIPPED 1 // not worth tracing (read, empty...)
+#define DATTOBD_TRACE_BIO_TRACED 2 // handed to snap/inc tracing
+
+// the minor of a device that may not be attached yet
+#define __trace_minor(dev) ((dev) ? (dev)->sd_minor : ~0U)
+
+#ifdef HAVE_TRACE_EVENT
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(dattobd_bio_intercept,
+        TP_PROTO(struct snap_device *dev, struct bio *bio, int action),
+        TP_ARGS(dev, bio, action),
+        TP_STRUCT__entry(
+                __field(unsigned int, minor)
+                __field(u64, sector)
+                __field(unsigned int, size)
+                __field(int, write)
+                __field(int, action)
+        ),
+        TP_fast_assign(
+                __entry->minor = dev->sd_minor;
+                __entry->sector = bio_sector(bio);
+                __entry->size = bio_size(bio);
+                __entry->write = bio_data_dir(bio);
+                __entry->action = action;
+        ),
+        TP_printk("minor=%u sector=%llu size=%u %s %s", __entry->minor,
+                  (unsigned long long)__entry->sector, __entry->size,
+                  __entry->write ? "write" : "read",
+                  __print_symbolic(__entry->action,
+                                   { DATTOBD_TRACE_BIO_PASSTHROUGH, "passthrough" },
+                                   { DATTOBD_TRACE_BIO_SKIPPED, "skipped" },
+                                   { DATTOBD_TRACE_BIO_TRACED, "traced" }))
+);
+
+TRACE_EVENT(dattobd_clone_submit,
+        TP_PROTO(struct snap_device *dev, sector_t sect, unsigned int bytes),
+        TP_ARGS(dev, sect, bytes),
+        TP_STRUCT__entry(
+                __field(unsigned int, minor)
+                __field(u64, sector)
+                __field(unsigned int, bytes)
+        ),
+        TP_fast_assign(
+                __entry->minor = dev->sd_minor;
+                __entry->sector = sect;
+                __entry->bytes = bytes;
+        ),
+        TP_printk("minor=%u sector=%llu bytes=%u", __entry->minor,
+                  (unsigned long long)__entry->sector, __entry->bytes)
+);
+
+TRACE_EVENT(dattobd_clone_complete,
+        TP_PROTO(struct snap_device *dev, sector_t sect, unsigned int bytes,
+                 int err),
+        TP_ARGS(dev, sect, bytes, err),
+        TP_STRUCT__entry(
+                __field(unsigned int, minor)
+                __field(u64, sector)
+                __field(unsigned int, bytes)
+                __field(int, err)
+        ),
+        TP_fast_assign(
+                __entry->minor = dev->sd_minor;
+                __entry->sector = sect;
+                __entry->bytes = bytes;
+                __entry->err = err;
+        ),
+        TP_printk("minor=%u sector=%llu bytes=%u err=%d", __entry->minor,
+                  (unsigned long long)__entry->sector, __entry->bytes,
+                  __entry->err)
+);
+
+TRACE_EVENT(dattobd_cow_write,
+        TP_PROTO(struct snap_device *dev, u64 block, int present),
+        TP_ARGS(dev, block, present),
+        TP_STRUCT__entry(
+                __field(unsigned int, minor)
+                __field(u64, block)
+                __field(int, present)
+        ),
+        TP_fast_assign(
+                __entry->minor = __trace_minor(dev);
+                __entry->block = block;
+                __entry->present = present;
+        ),
+        TP_printk("minor=%u block=%llu %s", __entry->minor,
+                  (unsigned long long)__entry->block,
+                  __entry->present ? "present" : "new")
+);
+
+DECLARE_EVENT_CLASS(dattobd_section,
+        TP_PROTO(struct snap_device *dev, unsigned long sect_idx,
+                 unsigned long usage),
+        TP_ARGS(dev, sect_idx, usage),
+        TP_STRUCT__entry(
+                __field(unsigned int, minor)
+                __field(unsigned long, sect_idx)
+                __field(unsigned long, usage)
+        ),
+        TP_fast_assign(
+                __entry->minor = __trace_minor(dev);
+                __entry->sect_idx = sect_idx;
+                __entry->usage = usage;
+        ),
+        TP_printk("minor=%u section=%lu usage=%lu", __entry->minor,
+                  __entry->sect_idx, __entry->usage)
+);
+
+DEFINE_EVENT(dattobd_section, dattobd_section_load,
+        TP_PROTO(struct snap_device *dev, unsigned long sect_idx,
+                 unsigned long usage),
+        TP_ARGS(dev, sect_idx, usage)
+);
+
+DEFINE_EVENT(dattobd_section, dattobd_section_flush,
+        TP_PROTO(struct snap_device *dev, unsigned long sect_idx,
+                 unsigned long usage),
+        TP_ARGS(dev, sect_idx, usage)
+);
+
+DEFINE_EVENT(dattobd_section, dattobd_section_evict,
+        TP_PROTO(struct snap_device *dev, unsigned long sect_idx,
+                 unsigned long usage),
+        TP_ARGS(dev, sect_idx, usage)
+);
+
+TRACE_EVENT(dattobd_cow_expand,
+        TP_PROTO(struct snap_device *dev, u64 requested, u64 actual,
+                 u64 file_size, int ret),
+        TP_ARGS(dev, requested, actual, file_size, ret),
+        TP_STRUCT__entry(
+                __field(unsigned int, minor)
+                __field(u64, requested)
+                __field(u64, actual)
+                __field(u64, file_size)
+                __field(int, ret)
+        ),
+        TP_fast_assign(
+                __entry->minor = __trace_minor(dev);
+                __entry->requested = requested;
+                __entry->actual = actual;
+                __entry->file_size = file_size;
+                __entry->ret = ret;
+        ),
+        TP_printk("minor=%u requested=%llu actual=%llu file_size=%llu ret=%d",
+                  __entry->minor, (unsigned long long)__entry->requested,
+                  (unsigned long long)__entry->actual,
+                  (unsigned long long)__entry->file_size, __entry->ret)
+);
+
+DECLARE_EVENT_CLASS(dattobd_freeze_class,
+        TP_PROTO(struct snap_device *dev, int start_tracing, int ret),
+        TP_ARGS(dev, start_tracing, ret),
+        TP_STRUCT__entry(
+                __field(unsigned int, minor)
+                __field(int, start_tracing)
+                __field(int, ret)
+        ),
+        TP_fast_assign(
+                __entry->minor = dev->sd_minor;
+                __entry->start_tracing = start_tracing;
+                __entry->ret = ret;
+        ),
+        TP_printk("minor=%u %s ret=%d", __entry->minor,
+                  __entry->start_tracing ? "start" : "end", __entry->ret)
+);
+
+DEFINE_EVENT(dattobd_freeze_class, dattobd_freeze,
+        TP_PROTO(struct snap_device *dev, int start_tracing, int ret),
+        TP_ARGS(dev, start_tracing, ret)
+);
+
+DEFINE_EVENT(dattobd_freeze_class, dattobd_thaw,
+        TP_PROTO(struct snap_device *dev, int start_tracing, int ret),
+        TP_ARGS(dev, start_tracing, ret)
+);
+
+TRACE_EVENT(dattobd_state,
+        TP_PROTO(struct snap_device *dev),
+        TP_ARGS(dev),
+        TP_STRUCT__entry(
+                __field(unsigned int, minor)
+                __field(unsigned long, state)
+        ),
+        TP_fast_assign(
+                __entry->minor = dev->sd_minor;
+                __entry->state = dev->sd_state;
+        ),
+        TP_printk("minor=%u state=%s", __entry->minor,
+                  __print_flags(__entry->state, "|",
+                                { 1UL << SNAPSHOT, "snapshot" },
+                                { 1UL << ACTIVE, "active" },
+                                { 1UL << UNVERIFIED, "unverified" }))
+);
+
+TRACE_EVENT(dattobd_fail,
+        TP_PROTO(struct snap_device *dev, int error),
+        TP_ARGS(dev, error),
+        TP_STRUCT__entry(
+                __field(unsigned int, minor)
+                __field(int, error)
+        ),
+        TP_fast_assign(
+                __entry->minor = dev->sd_minor;
+                __entry->error = error;
+        ),
+        TP_printk("minor=%u error=%d", __entry->minor, __entry->error)
+);
+
+#else
+
+#define __dattobd_trace_stub(name, proto)                                      \
+        static inline void trace_##name(proto)                                \
+        {                                                                      \
+        }
+
+#define __proto(...) __VA_ARGS__
+
+__dattobd_trace_stub(dattobd_bio_intercept,
+                     __proto(struct snap_device *dev, struct bio *bio,
+                             int action))
+__dattobd_trace_stub(dattobd_clone_submit,
+                     __proto(struct snap_device *dev, sector_t sect,
+                             unsigned int bytes))
+__dattobd_trace_stub(dattobd_clone_complete,
+                     __proto(struct snap_device *dev, sector_t sect,
+                             unsigned int bytes, int err))
+__dattobd_trace_stub(dattobd_cow_write,
+                     __proto(struct snap_device *dev, u64 block, int present))
+__dattobd_trace_stub(dattobd_section_load,
+                     __proto(struct snap_device *dev, unsigned long sect_idx,
+                             unsigned long usage))
+__dattobd_trace_stub(dattobd_section_flush,
+                     __proto(struct snap_device *dev, unsigned long sect_idx,
+                             unsigned long usage))
+__dattobd_trace_stub(dattobd_section_evict,
+                     __proto(struct snap_device *dev, unsigned long sect_idx,
+                             unsigned long usage))
+__dattobd_trace_stub(dattobd_cow_expand,
+                     __proto(struct snap_device *dev, u64 requested,
+                             u64 actual, u64 file_size, int ret))
+__dattobd_trace_stub(dattobd_freeze,
+                     __proto(struct snap_device *dev, int start_tracing,
+                             int ret))
+__dattobd_trace_stub(dattobd_thaw,
+                     __proto(struct snap_device *dev, int start_tracing,
+                             int ret))
+__dattobd_trace_stub(dattobd_state, __proto(struct snap_device *dev))
+__dattobd_trace_stub(dattobd_fail, __proto(struct snap_device *dev, int error))
+
+#undef __proto
+#undef __dattobd_trace_stub
+
+#endif /* HAVE_TRACE_EVENT */
+
+#endif /* DATTOBD_TRACE_H_ */
+
+#ifdef HAVE_TRACE_EVENT
+// the module is built out of tree, see CFLAGS_dattobd_trace.o in the Makefile
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE dattobd_trace
+#include <trace/define_trace.h>
+#endif
@@ -10,6 +10,11 @@
 #include "userspace_copy_helpers.h"
 #include "snap_device.h"
 #include "blkdev.h"
+#include "cow_extents.h"
+#include "hints.h"
+#ifdef HAVE_SCHED_TASK_STACK
+#include <linux/sched/task_stack.h>
+#endif
 
 // if this isn't defined, we don't need it anyway
 #ifndef FMODE_NONOTIFY
@@ -35,6 +40,140 @@ static int kern_path(const char *name, unsigned int flags, struct path *path)
 }
 #endif
 
+// bytes of page cache traffic after which a COW_IO_DROP_CACHE file is flushed
+// and its pages dropped
+#define FILE_DROP_CACHE_BATCH (1024 * 1024)
+
+static ssize_t __file_vfs_read(struct file *filp, void *buf, size_t count,
+                               loff_t *pos)
+{
+#ifndef HAVE_KERNEL_READ_PPOS
+        //#if LINUX_VERSION_CODE < KERNEL_VERSION(4,14,0)
+        ssize_t ret;
+        mm_segment_t old_fs;
+
+        old_fs = get_fs();
+        set_fs(get_ds());
+        ret = vfs_read(filp, (char __user *)buf, count, pos);
+        set_fs(old_fs);
+        return ret;
+#else
+        return kernel_read(filp, buf, count, pos);
+#endif
+}
+
+static ssize_t __file_vfs_write(struct file *filp, const void *buf,
+                                size_t count, loff_t *pos)
+{
+#ifndef HAVE_KERNEL_WRITE_PPOS
+        //#if LINUX_VERSION_CODE < KERNEL_VERSION(4,14,0)
+        ssize_t ret;
+        mm_segment_t old_fs;
+
+        old_fs = get_fs();
+        set_fs(get_ds());
+        ret = vfs_write(filp, (__force const char __user *)buf, count, pos);
+        set_fs(old_fs);
+        return ret;
+#else
+        return kernel_write(filp, buf, count, pos);
+#endif
+}
+
+/**
+ * __file_drop_cache() - Writes back the page cache range accumulated by
+ * __file_note_cached_io() and drops it from the page cache.
+ *
+ * @dfilp: A dattobd mutable file object.
+ */
+static void __file_drop_cache(struct dattobd_mutable_file *dfilp)
+{
+        struct address_space *mapping = dfilp->filp->f_mapping;
+        int ret;
+
+        if (!dfilp->drop_pending)
+                return;
+
+        ret = filemap_write_and_wait_range(mapping, dfilp->drop_start,
+                                           dfilp->drop_end - 1);
+        if (ret)
+                LOG_WARN("error writing back cow file range before dropping "
+                         "it from the page cache: %d", ret);
+
+        // pages that are still dirty or under writeback are skipped
+        invalidate_mapping_pages(mapping, dfilp->drop_start >> PAGE_SHIFT,
+                                 (dfilp->drop_end - 1) >> PAGE_SHIFT);
+
+        dfilp->drop_pending = 0;
+}
+
+/**
+ * __file_note_cached_io() - Records a range that went through the page cache
+ * so it can be dropped once enough traffic has accumulated.
+ *
+ * @dfilp: A dattobd mutable file object.
+ * @start: The file offset of the first byte transferred.
+ * @end: The file offset after the last byte transferred.
+ */
+static void __file_note_cached_io(struct dattobd_mutable_file *dfilp,
+                                  loff_t start, loff_t end)
+{
+        if (dfilp->io_mode == COW_IO_BUFFERED || end <= start)
+                return;
+
+        if (!dfilp->drop_pending) {
+                dfilp->drop_start = start;
+                dfilp->drop_end = end;
+        } else {
+                dfilp->drop_start = min(dfilp->drop_start, start);
+                dfilp->drop_end = max(dfilp->drop_end, end);
+        }
+
+        dfilp->drop_pending += end - start;
+        if (dfilp->drop_pending >= FILE_DROP_CACHE_BATCH)
+                __file_drop_cache(dfilp);
+}
+
+/**
+ * __file_dio_usable() - Checks whether an I/O may be sent through the
+ * O_DIRECT file.
+ *
+ * @dfilp: A dattobd mutable file object.
+ * @buf: The data buffer.
+ * @count: The number of bytes to transfer.
+ * @pos: The file offset.
+ *
+ * Return:
+ * * 0 - the I/O must go through the page cache
+ * * 1 - the I/O may use direct I/O
+ */
+static int __file_dio_usable(const struct dattobd_mutable_file *dfilp,
+                             const void *buf, size_t count, loff_t pos)
+{
+        if (!dfilp->dio_filp)
+                return 0;
+        if (((unsigned long)buf | count | pos) & (dfilp->dio_align - 1))
+                return 0;
+        // only linearly mapped memory can be pinned for direct I/O here
+        return virt_addr_valid(buf) && !object_is_on_stack(buf);
+}
+
+/**
+ * __file_dio_disable() - Closes the O_DIRECT file after it failed, leaving
+ * @dfilp with page cache dropping.
+ *
+ * @dfilp: A dattobd mutable file object.
+ * @err: The error returned by the direct I/O.
+ */
+static void __file_dio_disable(struct dattobd_mutable_file *dfilp, int err)
+{
+        LOG_WARN("direct I/O to the cow file failed (%d), falling back on "
+                 "dropping the page cache", err);
+        filp_close(dfilp->dio_filp, NULL);
+        dfilp->dio_filp = NULL;
+        dfilp->io_mode = COW_IO_DROP_CACHE;
+}
+
 /**
  * dattobd_kernel_read() - This is a wrapper around kernel_read enhanced for
  * systems that don't support it.
@@ -50,24 +189,19 @@ static ssize_t dattobd_kernel_read(struct dattobd_mutable_file *dfilp, struct sn
                                    loff_t *pos)
 {
         ssize_t ret;
-#ifndef HAVE_KERNEL_READ_PPOS
-        mm_segment_t old_fs;
-#endif
+        loff_t start = *pos;
 
         if(dfilp){
-                // no need for making file mutable at read?
-                dattobd_mutable_file_unlock(dfilp);
-#ifndef HAVE_KERNEL_READ_PPOS
-                //#if LINUX_VERSION_CODE < KERNEL_VERSION(4,14,0)
-                old_fs = get_fs();
-                set_fs(get_ds());
-                ret = vfs_read(dfilp->filp, (char __user *)buf, count, pos);
-                set_fs(old_fs);
-                return ret;
-#else
-                ret=kernel_read(dfilp->filp, buf, count, pos);
-#endif
-                dattobd_mutable_file_lock(dfilp);
+                if (__file_dio_usable(dfilp, buf, count, *pos)) {
+                        ret = __file_vfs_read(dfilp->dio_filp, buf, count, pos);
+                        if (ret != -EINVAL && ret != -EFAULT)
+                                return ret;
+                        __file_dio_disable(dfilp, (int)ret);
+                }
+
+                ret = __file_vfs_read(dfilp->filp, buf, count, pos);
+                if (ret > 0)
+                        __file_note_cached_io(dfilp, start, *pos);
                 return ret;
         }else{
 		LOG_DEBUG("DIO: reading %lu sectors...", count / SECTOR_SIZE);
@@ -94,22 +228,25 @@ static ssize_t dattobd_kernel_write(struct dattobd_mutable_file *dfilp, struct s
                                     size_t count, loff_t *pos)
 {
         ssize_t ret;
-#ifndef HAVE_KERNEL_READ_PPOS
-        mm_segment_t old_fs;
-#endif
+        loff_t start = *pos;
 
         if(dfilp){
                 dattobd_mutable_file_unlock(dfilp);
-#ifndef HAVE_KERNEL_WRITE_PPOS
-                //#if LINUX_VERSION_CODE < KERNEL_VERSION(4,14,0)
+                // the tracer only recognizes direct writes to the cow file
+                // by its physical range map, which must outlive the write
+                if (__file_dio_usable(dfilp, buf, count, *pos) && dev &&
+                    cow_phys_map_pin(dev)) {
+                        ret = __file_vfs_write(dfilp->dio_filp, buf, count, pos);
+                        cow_phys_map_unpin(dev);
+                        if (ret != -EINVAL && ret != -EFAULT)
+                                goto out;
+                        __file_dio_disable(dfilp, (int)ret);
+                }
 
-                old_fs = get_fs();
-                set_fs(get_ds());
-                ret = vfs_write(dfilp->filp, (__force const char __user *)buf, count, pos);
-                set_fs(old_fs);
-#else
-                ret = kernel_write(dfilp->filp, buf, count, pos);
-#endif
+                ret = __file_vfs_write(dfilp->filp, buf, count, pos);
+                if (ret > 0)
+                        __file_note_cached_io(dfilp, start, *pos);
+out:
                 dattobd_mutable_file_lock(dfilp);
                 return ret;
         }else{
@@ -142,14 +279,17 @@ int file_io(struct dattobd_mutable_file *dfilp, struct snap_device* dev, int is_
 {
         ssize_t ret;
         loff_t off = (loff_t)offset;
+        struct snap_cpu_io io;
 
         if(unlikely(done))
                 *done = 0;
 
+        snap_cpu_io_begin(dev, &io);
         if (is_write)
                 ret = dattobd_kernel_write(dfilp, dev, buf, len, &off);
         else
                 ret = dattobd_kernel_read(dfilp, dev, buf, len, &off);
+        snap_cpu_io_end(dev, &io);
 
         if (unlikely(ret < 0)) {
                 LOG_ERROR((int)ret, "error performing file '%s': %llu, %lu",
@@ -161,6 +301,9 @@ int file_io(struct dattobd_mutable_file *dfilp, struct snap_device* dev, int is_
         if(unlikely(done))
                 *done = ret;
 
+        snap_stats_add(dev, (is_write) ? SNAP_STAT_COW_BYTES_WRITTEN :
+                                         SNAP_STAT_COW_BYTES_READ, ret);
+
         if (unlikely(ret != len)) {
                 LOG_ERROR(-EIO, "invalid file '%s' size: %llu, %lu, %lu",
                           (is_write) ? "write" : "read",
@@ -180,6 +323,7 @@ inline void file_close(struct dattobd_mutable_file *dfilp){
         if(atomic_read(&dfilp->writers) > 0){
                 LOG_WARN("closing file that is still unlocked");
         }
+        file_set_io_mode(dfilp, COW_IO_BUFFERED);
         dattobd_mutable_file_unlock(dfilp);
         __file_close_raw(dfilp->filp);
 }
@@ -1104,235 +1248,420 @@ void dattobd_mm_unlock(struct mm_struct* mm)
 //         iput(inode);
 // }
 
-int file_write_block(struct snap_device* dev, const void* block, size_t offset, size_t len)
-{
-        int ret;
-	int bytes;
-	char *data;
-	struct page *pg;
-	struct bio_set *bs;
-	struct bio *new_bio;
-	struct block_device *bdev;
-	sector_t start_sect;
-	int sectors_processed;
-	int iterations_done;
-	int bytes_written;
-
-        ret = 0;
-	bs = dev_bioset(dev);
-	bdev = dev->sd_base_dev->bdev;
-	sectors_processed = 0;
-
-write_bio: 
-        start_sect = sector_by_offset(dev, offset);
-	if (start_sect == SECTOR_INVALID) {
-		LOG_WARN("Possible write IO to the end of file (offset=%lu)", offset);
-		ret = -EFAULT;
-		goto out;
-	}
-
-#ifdef HAVE_BIO_ALLOC
-	new_bio = bio_alloc(GFP_NOIO, 1);
+#ifdef BIO_MAX_PAGES
+#define FILE_DIO_MAX_VECS BIO_MAX_PAGES
 #else
-	new_bio = bio_alloc(bdev, 1, 0, GFP_NOIO);
+#define FILE_DIO_MAX_VECS BIO_MAX_VECS
 #endif
-        if(!new_bio){
-		ret = -ENOMEM;
-		LOG_ERROR(ret, "error allocating bio (write) - bs = %p", bs);
-		goto out;
-	}
-
-        dattobd_bio_set_dev(new_bio, bdev);
-        dattobd_set_bio_ops(new_bio, REQ_OP_READ, 0);
-        //from bio_helper.h
-        bio_sector(new_bio) = start_sect;
-	bio_idx(new_bio) = 0;
-
-        pg = alloc_page(GFP_NOIO);
-	if(!pg){
-		ret = -ENOMEM;
-		LOG_ERROR(ret, "error allocating read bio page");
-		goto out;
-	}
 
-	data = kmap(pg);
-	iterations_done = 0;
-	bytes_written = 0;
-
-        do {
-		bytes_written = iterations_done * SECTOR_SIZE;
-		memcpy(data + bytes_written, block + sectors_processed * SECTOR_SIZE, SECTOR_SIZE);
-		offset += SECTOR_SIZE;
-		sectors_processed++;
-		iterations_done++;
-	} while (sectors_processed < len &&
-			sector_by_offset(dev, offset) == start_sect + iterations_done);
-
-	kunmap(pg);
-
-        bytes_written = iterations_done * SECTOR_SIZE;
-	bytes = bio_add_page(new_bio, pg, bytes_written, 0);
-	if(bytes != bytes_written){
-		LOG_DEBUG("bio_add_page() error!");
-		__free_page(pg);
-		ret = -EFAULT;
-		goto out;
-	}
+// tracks the bios of one file_read_block()/file_write_block() request
+struct file_dio {
+        atomic_t pending;
+        atomic_t error;
+        struct completion done;
+};
 
-        if (dev->sd_cow_inode)
-		pg->mapping = dev->sd_cow_inode->i_mapping;
+/**
+ * __file_dio_put() - Drops a reference to @dio, waking up the submitter when
+ * the last bio has completed.
+ *
+ * @dio: The &struct file_dio object pointer.
+ */
+static void __file_dio_put(struct file_dio *dio)
+{
+        if (atomic_dec_and_test(&dio->pending))
+                complete(&dio->done);
+}
 
+/**
+ * __on_file_dio_complete() - Records the result of a direct I/O bio.
+ *
+ * @bio: The &struct bio which describes the I/O
+ * @err: an errno
+ */
+static void __on_file_dio_complete(struct bio *bio, int err)
+{
+        struct file_dio *dio = bio->bi_private;
 
-	ret = dattobd_submit_bio_wait(new_bio);
-	if (ret) {
-		LOG_ERROR(ret, "submit_bio_wait() error!");
-		goto out;
-	}
+        if (err)
+                atomic_cmpxchg(&dio->error, 0, err);
 
-        pg->mapping = NULL;
-	bio_free_clone(new_bio);
-	new_bio = NULL;
+        bio_put(bio);
+        __file_dio_put(dio);
+}
 
-	if (sectors_processed != len)
-		goto write_bio;
+#ifdef HAVE_BIO_ENDIO_INT
+static int on_file_dio_complete(struct bio *bio, unsigned int bytes, int err)
+{
+        if (bio->bi_size)
+                return 1;
+        __on_file_dio_complete(bio, err);
+        return 0;
+}
+#elif !defined HAVE_BIO_ENDIO_1
+static void on_file_dio_complete(struct bio *bio, int err)
+{
+        if (!test_bit(BIO_UPTODATE, &bio->bi_flags))
+                err = -EIO;
+        __on_file_dio_complete(bio, err);
+}
+#elif defined HAVE_BLK_STATUS_T
+static void on_file_dio_complete(struct bio *bio)
+{
+        __on_file_dio_complete(bio, blk_status_to_errno(bio->bi_status));
+}
+#else
+static void on_file_dio_complete(struct bio *bio)
+{
+        __on_file_dio_complete(bio, bio->bi_error);
+}
+#endif
 
-out:
-	if (new_bio) {
-		pg->mapping = NULL;
-		bio_free_clone(new_bio);
-	}
+/**
+ * __file_dio_needs_bounce() - Checks whether bios can be built directly over
+ * the pages of a buffer.
+ *
+ * @buf: The buffer.
+ * @len: The length of @buf in bytes.
+ *
+ * Stack buffers, highmem mappings and buffers that are not sector aligned
+ * are copied through a bounce buffer instead.
+ *
+ * Return:
+ * * 0 - @buf may be used for I/O as is
+ * * 1 - @buf needs a bounce buffer
+ */
+static int __file_dio_needs_bounce(const void *buf, size_t len)
+{
+        if (((unsigned long)buf | len) & (SECTOR_SIZE - 1))
+                return 1;
+        if (object_is_on_stack(buf))
+                return 1;
+        if (!is_vmalloc_addr(buf) && !virt_addr_valid(buf))
+                return 1;
+        return 0;
+}
 
-	return ret;
+static struct page *__file_dio_page(const void *addr)
+{
+        if (is_vmalloc_addr(addr))
+                return vmalloc_to_page(addr);
+        return virt_to_page(addr);
 }
 
-int file_read_block(struct snap_device* dev, void* block, size_t offset, size_t len)
+/**
+ * __file_dio_submit() - Submits bios covering @len bytes of the cow file at
+ * @offset, using the pages of @buf as the data buffer.
+ *
+ * @dev: The &struct snap_device holding the cow file extents.
+ * @dio: The &struct file_dio tracking the request, gains a reference for
+ *       each submitted bio.
+ * @is_write: An integer encoded bool indicating a write or read operation.
+ * @buf: A sector aligned buffer of @len bytes suitable for I/O.
+ * @offset: The byte offset into the cow file.
+ * @len: The number of bytes to transfer.
+ *
+ * Every physically contiguous run is covered by as few multi-page bios as
+ * the block layer allows. Nothing is waited on here.
+ *
+ * Return:
+ * * 0 - success
+ * * !0 - errno indicating the error, bios submitted before it still
+ *        complete through @dio
+ */
+static int __file_dio_submit(struct snap_device *dev, struct file_dio *dio,
+                             int is_write, char *buf, size_t offset, size_t len)
 {
         int ret;
-	int bytes;
-	struct page *pg;
-	struct bio_set *bs;
-	struct bio *new_bio;
-	struct block_device *bdev;
-	sector_t start_sect;
-	struct bio_vec *bvec;
-#ifdef HAVE_BVEC_ITER_ALL
-	struct bvec_iter_all iter;
-#else
-	int i = 0;
-#endif
-	int sectors_processed;
-	int iterations_done;
-	int bytes_to_read;
-	int buf_offset;
-
-	ret = 0;
-	bs = dev_bioset(dev);
-	bdev = dev->sd_base_dev->bdev;
-	sectors_processed = 0;
-WARN_ON(len > SECTORS_PER_BLOCK);
-
-read_bio:
-	start_sect = sector_by_offset(dev, offset);
-	if (start_sect == SECTOR_INVALID) {
-		LOG_WARN("Possible read IO to the end of file (offset=%lu)", offset);
-		ret = -EFAULT;
-		goto out;
-	}
+        struct bio *bio;
+        struct block_device *bdev = dev->sd_base_dev->bdev;
+        sector_t sect;
+        size_t run_len, bytes;
+        unsigned int nr_vecs, pg_off;
+
+        while (len) {
+                sect = sector_by_offset_run(dev, offset, &run_len);
+                run_len = min(run_len, len) & ~((size_t)SECTOR_SIZE - 1);
+                if (sect == SECTOR_INVALID || !run_len) {
+                        ret = -EFAULT;
+                        LOG_WARN("Possible %s IO to the end of file (offset=%lu)",
+                                 (is_write) ? "write" : "read", offset);
+                        return ret;
+                }
+
+                offset += run_len;
+                len -= run_len;
+
+                while (run_len) {
+                        nr_vecs = DIV_ROUND_UP(offset_in_page(buf) + run_len,
+                                               PAGE_SIZE);
+                        nr_vecs = min_t(unsigned int, nr_vecs, FILE_DIO_MAX_VECS);
+
 #ifdef HAVE_BIO_ALLOC
-	new_bio = bio_alloc(GFP_NOIO, 1);
+                        bio = bio_alloc(GFP_NOIO, nr_vecs);
 #else
-	new_bio = bio_alloc(bdev, 1, 0, GFP_NOIO);
+                        bio = bio_alloc(bdev, nr_vecs, 0, GFP_NOIO);
 #endif
-        if(!new_bio){
-		ret = -ENOMEM;
-		LOG_ERROR(ret, "error allocating bio (read) - bs = %p", bs);
-		goto out;
-	}
-        dattobd_bio_set_dev(new_bio, bdev);
-        dattobd_set_bio_ops(new_bio, REQ_OP_READ, 0);
-        bio_sector(new_bio) = start_sect;
-	bio_idx(new_bio) = 0;
-
-	//allocate a page and add it to our bio
-	pg = alloc_page(GFP_NOIO);
-	if(!pg){
-		ret = -ENOMEM;
-		LOG_ERROR(ret, "error allocating read bio page");
-		goto out;
-	}
+                        if (!bio) {
+                                ret = -ENOMEM;
+                                LOG_ERROR(ret, "error allocating cow file bio");
+                                return ret;
+                        }
+
+                        dattobd_bio_set_dev(bio, bdev);
+                        dattobd_set_bio_ops(bio, (is_write) ? REQ_OP_WRITE : REQ_OP_READ, 0);
+                        bio_sector(bio) = sect;
+                        bio_idx(bio) = 0;
+                        bio->bi_private = dio;
+                        bio->bi_end_io = on_file_dio_complete;
+
+                        // our own writes to the cow file must not be traced
+                        if (is_write)
+                                dattobd_bio_op_set_flag(bio, DATTOBD_PASSTHROUGH);
+
+                        while (run_len) {
+                                pg_off = offset_in_page(buf);
+                                bytes = min_t(size_t, PAGE_SIZE - pg_off, run_len);
+                                if (bio_add_page(bio, __file_dio_page(buf), bytes,
+                                                 pg_off) != bytes)
+                                        break;
+
+                                buf += bytes;
+                                run_len -= bytes;
+                                sect += bytes >> 9;
+                        }
+
+                        if (!bio_size(bio)) {
+                                ret = -EFAULT;
+                                LOG_ERROR(ret, "error adding page to cow file bio");
+                                bio_put(bio);
+                                return ret;
+                        }
+
+                        atomic_inc(&dio->pending);
+                        dattobd_submit_bio(bio);
+                }
+        }
 
-	iterations_done = 0;
-	bytes_to_read = 0;
-	buf_offset = sectors_processed * SECTOR_SIZE;
-
-        do {
-		offset += SECTOR_SIZE;
-		sectors_processed++;
-		iterations_done++;
-	} while (sectors_processed < len &&
-			sector_by_offset(dev, offset) == start_sect + iterations_done);
-
-	bytes_to_read = iterations_done * SECTOR_SIZE;
-	bytes = bio_add_page(new_bio, pg, bytes_to_read, 0);
-	if(bytes != bytes_to_read){
-		LOG_DEBUG("bio_add_page() error!");
-		__free_page(pg);
-		ret = -EFAULT;
-		goto out;
-	}
+        return 0;
+}
+
+/**
+ * __file_dio() - Transfers a part of the cow file directly to or from the
+ * base block device, bypassing the filesystem.
+ *
+ * @dev: The &struct snap_device holding the cow file extents.
+ * @is_write: An integer encoded bool indicating a write or read operation.
+ * @buf: The data buffer.
+ * @offset: The byte offset into the cow file.
+ * @len: The number of sectors to transfer.
+ *
+ * All bios of the request are in flight at once under a plug and are
+ * waited for together.
+ *
+ * Return:
+ * * 0 - success
+ * * !0 - errno indicating the error
+ */
+static int __file_dio(struct snap_device *dev, int is_write, void *buf,
+                      size_t offset, size_t len)
+{
+        int ret;
+        struct file_dio dio;
+        char *bounce = NULL;
+        size_t bytes = len * SECTOR_SIZE;
+#ifdef HAVE_BLK_START_PLUG
+        struct blk_plug plug;
+#endif
 
-	if (dev->sd_cow_inode)
-		pg->mapping = dev->sd_cow_inode->i_mapping;
+        if (!bytes)
+                return 0;
 
-        ret = dattobd_submit_bio_wait(new_bio);
-	if (ret) {
-		LOG_ERROR(ret, "submit_bio_wait() error!");
-		goto out;
-	}
+        if (__file_dio_needs_bounce(buf, bytes)) {
+                bounce = (char *)__get_free_pages(GFP_NOIO, get_order(bytes));
+                if (!bounce) {
+                        ret = -ENOMEM;
+                        LOG_ERROR(ret, "error allocating cow file bounce buffer");
+                        return ret;
+                }
 
-#ifdef HAVE_BVEC_ITER_ALL
-		bio_for_each_segment_all(bvec, new_bio, iter) {
-#else
-		bio_for_each_segment_all(bvec, new_bio, i) {
+                if (is_write)
+                        memcpy(bounce, buf, bytes);
+        }
+
+        // the submitter holds a reference until everything is queued
+        atomic_set(&dio.pending, 1);
+        atomic_set(&dio.error, 0);
+        init_completion(&dio.done);
+
+#ifdef HAVE_BLK_START_PLUG
+        blk_start_plug(&plug);
+#endif
+        ret = __file_dio_submit(dev, &dio, is_write, (bounce) ? bounce : buf,
+                                offset, bytes);
+#ifdef HAVE_BLK_START_PLUG
+        blk_finish_plug(&plug);
 #endif
-                        struct page *pg = bvec->bv_page;
-			char *data = kmap(pg);
-			WARN_ON(bytes_to_read != bvec->bv_len);
-			memcpy(block + buf_offset, data, bytes_to_read);
-			kunmap(pg);
-			// in an impossible case if we have more
-			// than one page (should never happen)
-			break;
-		}
 
+        __file_dio_put(&dio);
+        wait_for_completion(&dio.done);
 
+        if (!ret)
+                ret = atomic_read(&dio.error);
+        if (ret)
+                LOG_ERROR(ret, "error performing cow file direct %s",
+                          (is_write) ? "write" : "read");
 
-        pg->mapping = NULL;
-	bio_free_clone(new_bio);
-	new_bio = NULL;
+        if (bounce) {
+                if (!ret && !is_write)
+                        memcpy(buf, bounce, bytes);
+                free_pages((unsigned long)bounce, get_order(bytes));
+        }
 
-	if (sectors_processed != len)
-		goto read_bio;
-        
-out:
-	if (new_bio) {
-		pg->mapping = NULL;
-                bio_free_clone(new_bio);
-	}
+        return ret;
+}
 
-	return ret;
+/**
+ * file_write_block() - Writes to the cow file without going through the
+ * filesystem, using the mapped cow file extents.
+ *
+ * @dev: The &struct snap_device holding the cow file extents.
+ * @block: The data to write.
+ * @offset: The byte offset into the cow file.
+ * @len: The number of sectors to write.
+ *
+ * Return:
+ * * 0 - success
+ * * !0 - errno indicating the error
+ */
+int file_write_block(struct snap_device* dev, const void* block, size_t offset, size_t len)
+{
+        return __file_dio(dev, 1, (void *)block, offset, len);
 }
 
-sector_t sector_by_offset(struct snap_device*dev, size_t offset)
+/**
+ * file_read_block() - Reads from the cow file without going through the
+ * filesystem, using the mapped cow file extents.
+ *
+ * @dev: The &struct snap_device holding the cow file extents.
+ * @block: The buffer to read into.
+ * @offset: The byte offset into the cow file.
+ * @len: The number of sectors to read.
+ *
+ * Return:
+ * * 0 - success
+ * * !0 - errno indicating the error
+ */
+int file_read_block(struct snap_device* dev, void* block, size_t offset, size_t len)
 {
-        unsigned int i;
-	struct fiemap_extent *extent = dev->sd_cow_extents;
-	for (i = 0; i < dev->sd_cow_ext_cnt; i++) {
-		if (offset >= extent[i].fe_logical && offset < extent[i].fe_logical + extent[i].fe_length)
-			return (extent[i].fe_physical + (offset - extent[i].fe_logical)) >> 9;
-	}
+        return __file_dio(dev, 0, block, offset, len);
+}
+
+#define __offset_in_extent(ext, offset)                                        \
+        ((offset) >= (ext)->logical &&                                      \
+         (offset) < (ext)->logical + (ext)->length)
 
-	return SECTOR_INVALID;
+/**
+ * __extent_by_offset() - Finds the cow file extent containing a file offset.
+ *
+ * @dev: The &struct snap_device holding the cow file extents, which are
+ *       sorted by logical offset.
+ * @offset: The byte offset into the cow file.
+ *
+ * The extent found by the previous lookup is checked first, along with the
+ * one after it, since cow file i/o is mostly sequential. Otherwise the
+ * extents are binary searched.
+ *
+ * Return:
+ * * the index of the extent containing @offset
+ * * -1 if @offset is not mapped
+ */
+static int __extent_by_offset(struct snap_device *dev, size_t offset)
+{
+        unsigned int lo, hi, mid, hint;
+        unsigned int cnt = dev->sd_cow_ext_cnt;
+        struct cow_extent *extent = dev->sd_cow_extents;
+
+        if (!extent || !cnt)
+                return -1;
+
+        // the hint is only a guess, racing updates are harmless
+        hint = ACCESS_ONCE(dev->sd_cow_ext_hint);
+        if (hint < cnt && __offset_in_extent(&extent[hint], offset))
+                return hint;
+        if (hint + 1 < cnt && __offset_in_extent(&extent[hint + 1], offset)) {
+                dev->sd_cow_ext_hint = hint + 1;
+                return hint + 1;
+        }
+
+        lo = 0;
+        hi = cnt;
+        while (lo < hi) {
+                mid = lo + (hi - lo) / 2;
+                if (offset < extent[mid].logical) {
+                        hi = mid;
+                } else if (offset >= extent[mid].logical + extent[mid].length) {
+                        lo = mid + 1;
+                } else {
+                        dev->sd_cow_ext_hint = mid;
+                        return mid;
+                }
+        }
+
+        return -1;
+}
+
+/**
+ * sector_by_offset_run() - Translates a cow file offset to a sector on the
+ * base block device and reports how far the mapping stays contiguous.
+ *
+ * @dev: The &struct snap_device holding the cow file extents.
+ * @offset: The byte offset into the cow file.
+ * @run_len: Set to the number of bytes starting at @offset that are both
+ *           logically and physically contiguous, may be NULL.
+ *
+ * Return:
+ * * the sector relative to the start of the base block device
+ * * SECTOR_INVALID if @offset is not mapped
+ */
+sector_t sector_by_offset_run(struct snap_device *dev, size_t offset,
+                              size_t *run_len)
+{
+        int i;
+        struct cow_extent *extent;
+        u64 logical_end, physical_end;
+
+        i = __extent_by_offset(dev, offset);
+        if (i < 0) {
+                if (run_len)
+                        *run_len = 0;
+                return SECTOR_INVALID;
+        }
+
+        extent = &dev->sd_cow_extents[i];
+        if (run_len) {
+                logical_end = extent->logical + extent->length;
+                physical_end = extent->physical + extent->length;
+
+                // filesystems split large allocations into several extents
+                // that are still adjacent on disk
+                for (i++; i < dev->sd_cow_ext_cnt; i++) {
+                        if (dev->sd_cow_extents[i].logical != logical_end ||
+                            dev->sd_cow_extents[i].physical != physical_end)
+                                break;
+                        logical_end += dev->sd_cow_extents[i].length;
+                        physical_end += dev->sd_cow_extents[i].length;
+                }
+
+                *run_len = logical_end - offset;
+        }
+
+        return (extent->physical + (offset - extent->logical)) >> 9;
+}
+
+sector_t sector_by_offset(struct snap_device *dev, size_t offset)
+{
+        return sector_by_offset_run(dev, offset, NULL);
 }
 
 struct dattobd_mutable_file* dattobd_mutable_file_wrap(struct file* filp){
@@ -1420,6 +1749,68 @@ void dattobd_mutable_file_lock(struct dattobd_mutable_file* dfilp){
         }
 }
 
+/**
+ * file_set_io_mode() - Selects how I/O to @dfilp interacts with the page
+ * cache.
+ *
+ * @dfilp: A dattobd mutable file object.
+ * @mode: One of the COW_IO_* modes.
+ *
+ * If the filesystem cannot do direct I/O to the file, COW_IO_DIRECT falls
+ * back on COW_IO_DROP_CACHE. Anything still pending from the previous mode is
+ * dropped from the page cache first.
+ *
+ * Return:
+ * * 0 - success
+ * * !0 - errno indicating the error
+ */
+int file_set_io_mode(struct dattobd_mutable_file *dfilp, int mode)
+{
+        int ret;
+        char *abs_path = NULL;
+        int abs_path_len;
+        struct file *filp;
+
+        if (mode < COW_IO_BUFFERED || mode > COW_IO_MODE_MAX) {
+                ret = -EINVAL;
+                LOG_ERROR(ret, "invalid cow file I/O mode %d", mode);
+                return ret;
+        }
+
+        __file_drop_cache(dfilp);
+        if (dfilp->dio_filp) {
+                filp_close(dfilp->dio_filp, NULL);
+                dfilp->dio_filp = NULL;
+        }
+
+        dfilp->io_mode = mode;
+        if (mode != COW_IO_DIRECT)
+                return 0;
+
+        ret = file_get_absolute_pathname(dfilp, &abs_path, &abs_path_len);
+        if (ret)
+                goto fallback;
+
+        // opening for writing is refused while the inode is immutable
+        dattobd_mutable_file_unlock(dfilp);
+        ret = file_open(abs_path, O_DIRECT, &filp);
+        dattobd_mutable_file_lock(dfilp);
+        kfree(abs_path);
+        if (ret)
+                goto fallback;
+
+        dfilp->dio_filp = filp;
+        dfilp->dio_align = max_t(unsigned int, SECTOR_SIZE,
+                                 dfilp->inode->i_sb->s_blocksize);
+        return 0;
+
+fallback:
+        LOG_WARN("direct I/O is not available for the cow file (%d), falling "
+                 "back on dropping the page cache", ret);
+        dfilp->io_mode = COW_IO_DROP_CACHE;
+        return 0;
+}
+
 void dattobd_mutable_file_unwrap(struct dattobd_mutable_file* dfilp){
         if(dfilp){
                 kfree(dfilp);
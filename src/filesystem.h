@@ -7,6 +7,7 @@
 #ifndef FILESYSTEM_H_
 #define FILESYSTEM_H_
 
+#include "dattobd.h"
 #include "includes.h"
 #include "userspace_copy_helpers.h"
 #include "snap_device.h"
@@ -65,6 +66,13 @@ struct dattobd_mutable_file {
         struct vfsmount *mnt;
         
         atomic_t writers;
+
+        int io_mode; // one of COW_IO_*
+        struct file *dio_filp; // O_DIRECT file for COW_IO_DIRECT
+        unsigned int dio_align; // alignment required by dio_filp
+        loff_t drop_start; // start of the range pending page cache drop
+        loff_t drop_end; // end of the range pending page cache drop
+        size_t drop_pending; // bytes transferred since the last drop
 };
 
 struct dattobd_mutable_file* dattobd_mutable_file_wrap(struct file*);
@@ -75,6 +83,8 @@ void dattobd_mutable_file_lock(struct dattobd_mutable_file*);
 
 void dattobd_mutable_file_unwrap(struct dattobd_mutable_file*);
 
+int file_set_io_mode(struct dattobd_mutable_file *dfilp, int mode);
+
 #ifndef HAVE_STRUCT_PATH
 //#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
 struct path {
@@ -155,4 +165,7 @@ int file_read_block(struct snap_device* dev, void* block, size_t offset, size_t
 
 sector_t sector_by_offset(struct snap_device*dev, size_t offset);
 
+sector_t sector_by_offset_run(struct snap_device *dev, size_t offset,
+                              size_t *run_len);
+
 #endif /* FILESYSTEM_H_ */
@@ -20,7 +20,9 @@
 #include <linux/namei.h>
 #include <linux/proc_fs.h>
 #include <linux/random.h>
+#include <linux/rcupdate.h>
 #include <linux/seq_file.h>
+#include <linux/sort.h>
 #include <linux/unistd.h>
 #include <linux/vmalloc.h>
 #include <linux/fiemap.h>
@@ -12,7 +12,11 @@
 #include "includes.h"
 #include "logging.h"
 #include "module_control.h"
+#include "snap_changes.h"
+#include "snap_debugfs.h"
 #include "snap_device.h"
+#include "snap_events.h"
+#include "stats.h"
 #include "tracer.h"
 #include "tracer_helper.h"
 #include "userspace_copy_helpers.h"
@@ -204,13 +208,15 @@ static int __ioctl_setup(unsigned int minor, const char *bdev_path,
         if (ret)
                 goto error;
 
+        snap_debugfs_add(minor);
+
         put_snap_device_array_mut(snap_devices);
         return 0;
 
 error:
         LOG_ERROR(ret, "error during setup ioctl handler");
         if (dev)
-                kfree(dev);
+                tracer_free(dev);
         put_snap_device_array_mut(snap_devices);
         return ret;
 }
@@ -242,8 +248,9 @@ static int ioctl_destroy(unsigned int minor)
         }
 
         dev = snap_devices[minor];
+        snap_debugfs_remove(minor);
         tracer_destroy(dev, snap_devices);
-        kfree(dev);
+        tracer_free(dev);
 
         put_snap_device_array_mut(snap_devices);
         return 0;
@@ -526,6 +533,57 @@ error:
         return ret;
 }
 
+/**
+ * ioctl_reconfigure_cow_io() - Changes how the cow file of a device is
+ *                              accessed through the filesystem.
+ * @minor: An allocated device minor number.
+ * @mode: One of COW_IO_*.
+ *
+ * Return:
+ * * 0 - successful.
+ * * !0 - errno indicating the error.
+ */
+static int ioctl_reconfigure_cow_io(unsigned int minor, unsigned int mode)
+{
+        int ret;
+        struct snap_device *dev;
+        snap_device_array snap_devices = get_snap_device_array();
+
+        LOG_DEBUG("received reconfigure cow io ioctl - %u : %u", minor, mode);
+
+        if (mode > COW_IO_MODE_MAX) {
+                ret = -EINVAL;
+                LOG_ERROR(ret, "invalid cow file I/O mode %u", mode);
+                goto error;
+        }
+
+        // verify that the minor number is valid
+        ret = verify_minor_in_use(minor, snap_devices);
+        if (ret)
+                goto error;
+
+        dev = snap_devices[minor];
+
+        // check that the device is not in the fail state
+        if (tracer_read_fail_state(dev)) {
+                ret = -EINVAL;
+                LOG_ERROR(ret, "device specified is in the fail state");
+                goto error;
+        }
+
+        ret = tracer_reconfigure_cow_io(dev, mode);
+        if (ret)
+                goto error;
+
+        put_snap_device_array(snap_devices);
+        return 0;
+
+error:
+        LOG_ERROR(ret, "error during reconfigure cow io ioctl handler");
+        put_snap_device_array(snap_devices);
+        return ret;
+}
+
 /**
  * ioctl_dattobd_info() - Stores relevant, current &struct snap_device state
  *                        in @info.
@@ -551,6 +609,7 @@ static int ioctl_dattobd_info(struct dattobd_info *info)
 
         dev = snap_devices[info->minor];
 
+        tracer_refresh_cow_extents(dev);
         tracer_dattobd_info(dev, info);
 
         put_snap_device_array(snap_devices);
@@ -562,6 +621,274 @@ error:
         return ret;
 }
 
+/**
+ * __ioctl_info_all_path() - Appends @path to the user space string table of
+ * IOCTL_DATTOBD_INFO_ALL if it fits.
+ *
+ * @path: The path, may be NULL.
+ * @strings: The user space string table or NULL to only account for @path.
+ * @size: The size of @strings in bytes.
+ * @used: The bytes of @strings needed so far, advanced past @path.
+ * @off: Set to the offset of @path in @strings or %DATTOBD_INFO_NO_PATH.
+ *
+ * Return:
+ * * 0 - successful.
+ * * !0 - errno indicating the error.
+ */
+static int __ioctl_info_all_path(const char *path, char __user *strings,
+                                 uint32_t size, uint32_t *used, uint32_t *off)
+{
+        size_t len;
+
+        if (!path)
+                path = "";
+        len = strlen(path) + 1;
+
+        *off = DATTOBD_INFO_NO_PATH;
+        if (strings && len <= size && *used <= size - len) {
+                if (copy_to_user(strings + *used, path, len))
+                        return -EFAULT;
+                *off = *used;
+        }
+
+        *used += len;
+        return 0;
+}
+
+/**
+ * ioctl_dattobd_info_all() - Copies the state of all configured devices to
+ *                            user space, holding the device array once.
+ *
+ * @params: The &struct dattobd_info_all_params from user space. On return
+ *          its count and strings_size are set to what all devices need.
+ *
+ * Records are written for the first @params->count devices. Paths that do
+ * not fit into the string table are given %DATTOBD_INFO_NO_PATH, callers
+ * can retry with the sizes returned in @params.
+ *
+ * Return:
+ * * 0 - successful.
+ * * !0 - errno indicating the error.
+ */
+static int ioctl_dattobd_info_all(struct dattobd_info_all_params *params)
+{
+        int ret;
+        unsigned int i;
+        uint32_t nr = 0, used = 0;
+        struct snap_device *dev;
+        struct dattobd_info_rec rec;
+        struct dattobd_info_rec __user *urecs =
+                (struct dattobd_info_rec __user *)params->recs;
+        char __user *strings = (char __user *)params->strings;
+        snap_device_array snap_devices = get_snap_device_array();
+
+        LOG_DEBUG("received dattobd info all ioctl");
+
+        for (i = 0; i < dattobd_max_snap_devices; i++) {
+                dev = snap_devices[i];
+                if (!dev)
+                        continue;
+
+                tracer_dattobd_info_rec(dev, &rec);
+
+                ret = __ioctl_info_all_path(dev->sd_cow_path,
+                                            (nr < params->count) ? strings :
+                                                                   NULL,
+                                            params->strings_size, &used,
+                                            &rec.cow);
+                if (ret)
+                        goto error;
+
+                ret = __ioctl_info_all_path(dev->sd_bdev_path,
+                                            (nr < params->count) ? strings :
+                                                                   NULL,
+                                            params->strings_size, &used,
+                                            &rec.bdev);
+                if (ret)
+                        goto error;
+
+                if (nr < params->count &&
+                    copy_to_user(&urecs[nr], &rec, sizeof(rec))) {
+                        ret = -EFAULT;
+                        goto error;
+                }
+
+                nr++;
+        }
+
+        params->count = nr;
+        params->strings_size = used;
+
+        put_snap_device_array(snap_devices);
+        return 0;
+
+error:
+        LOG_ERROR(ret, "error during dattobd info all ioctl handler");
+        put_snap_device_array(snap_devices);
+        return ret;
+}
+
+/**
+ * ioctl_dattobd_stats() - Copies the runtime statistics of a device to user
+ *                         space.
+ *
+ * @minor: An allocated device minor number.
+ * @size: The size of the user space buffer in bytes.
+ * @ustats: The user space buffer receiving the statistics.
+ *
+ * Only the first @size bytes of &struct dattobd_stats are copied, which lets
+ * callers built against an older version of the structure use the ioctl.
+ *
+ * Return:
+ * * 0 - successful.
+ * * !0 - errno indicating the error.
+ */
+static int ioctl_dattobd_stats(unsigned int minor, uint32_t size,
+                               struct dattobd_stats __user *ustats)
+{
+        int ret;
+        struct snap_device *dev;
+        struct dattobd_stats *stats = NULL;
+        snap_device_array snap_devices = get_snap_device_array();
+
+        LOG_DEBUG("received dattobd stats ioctl - %u", minor);
+
+        // verify that the minor number is valid
+        ret = verify_minor_in_use(minor, snap_devices);
+        if (ret)
+                goto error;
+
+        // the version and size fields must at least fit
+        if (size < offsetof(struct dattobd_stats, writes_traced)) {
+                ret = -EINVAL;
+                LOG_ERROR(ret, "dattobd stats buffer too small (%u bytes)",
+                          size);
+                goto error;
+        }
+
+        stats = kmalloc(sizeof(struct dattobd_stats), GFP_KERNEL);
+        if (!stats) {
+                ret = -ENOMEM;
+                LOG_ERROR(ret, "error allocating memory for dattobd stats");
+                goto error;
+        }
+
+        dev = snap_devices[minor];
+        tracer_refresh_cow_extents(dev);
+        snap_stats_fill(dev, stats);
+        put_snap_device_array(snap_devices);
+
+        stats->size = min_t(uint32_t, size, sizeof(struct dattobd_stats));
+        ret = copy_to_user(ustats, stats, stats->size);
+        kfree(stats);
+        if (ret) {
+                ret = -EFAULT;
+                LOG_ERROR(ret, "error copying dattobd stats to user space");
+                return ret;
+        }
+
+        return 0;
+
+error:
+        LOG_ERROR(ret, "error during dattobd stats ioctl handler");
+        put_snap_device_array(snap_devices);
+        return ret;
+}
+
+/**
+ * ioctl_dattobd_stats_reset() - Clears the latency histograms of a device.
+ *
+ * @minor: An allocated device minor number.
+ *
+ * Return:
+ * * 0 - successful.
+ * * !0 - errno indicating the error.
+ */
+static int ioctl_dattobd_stats_reset(unsigned int minor)
+{
+        int ret;
+        snap_device_array snap_devices = get_snap_device_array();
+
+        LOG_DEBUG("received dattobd stats reset ioctl - %u", minor);
+
+        // verify that the minor number is valid
+        ret = verify_minor_in_use(minor, snap_devices);
+        if (ret) {
+                LOG_ERROR(ret, "error during dattobd stats reset ioctl "
+                               "handler");
+                put_snap_device_array(snap_devices);
+                return ret;
+        }
+
+        snap_stats_reset_hist(snap_devices[minor]);
+
+        put_snap_device_array(snap_devices);
+        return 0;
+}
+
+/**
+ * ioctl_dattobd_changes() - Reports the changed blocks of a range of an
+ *                           active device, see &struct
+ *                           dattobd_changes_params.
+ *
+ * @params: The parameters of the query, updated with the results.
+ *
+ * Return:
+ * * 0 - successful.
+ * * !0 - errno indicating the error.
+ */
+static int ioctl_dattobd_changes(struct dattobd_changes_params *params)
+{
+        int ret;
+        struct snap_device *dev;
+        snap_device_array snap_devices = get_snap_device_array();
+
+        LOG_DEBUG("received dattobd changes ioctl - %u : %llu+%llu",
+                  params->minor, (unsigned long long)params->start,
+                  (unsigned long long)params->count);
+
+        // verify that the minor number is valid
+        ret = verify_minor_in_use(params->minor, snap_devices);
+        if (ret)
+                goto error;
+
+        dev = snap_devices[params->minor];
+
+        // an empty buffer would never let a caller make progress
+        if (!params->nr || (params->flags & ~DATTOBD_CHANGES_BITMAP)) {
+                ret = -EINVAL;
+                LOG_ERROR(ret, "invalid changes query parameters");
+                goto error;
+        }
+
+        // check that the device is not in the fail state
+        if (tracer_read_fail_state(dev)) {
+                ret = -EINVAL;
+                LOG_ERROR(ret, "device specified is in the fail state");
+                goto error;
+        }
+
+        // a dormant device has no open cow file to read evicted sections from
+        if (!test_bit(ACTIVE, &dev->sd_state) ||
+            test_bit(UNVERIFIED, &dev->sd_state)) {
+                ret = -EINVAL;
+                LOG_ERROR(ret, "device specified is not active");
+                goto error;
+        }
+
+        ret = snap_changes_query(dev, params);
+        if (ret)
+                goto error;
+
+        put_snap_device_array(snap_devices);
+        return 0;
+
+error:
+        LOG_ERROR(ret, "error during dattobd changes ioctl handler");
+        put_snap_device_array(snap_devices);
+        return ret;
+}
+
 /**
  * get_free_minor() - Determine the next available device minor number.
  *
@@ -611,8 +938,13 @@ long ctrl_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
         unsigned long fallocated_space = 0, cache_size = 0;
         struct expand_cow_file_params *expand_params = NULL;
         struct reconfigure_auto_expand_params *reconfigure_auto_expand_params = NULL;
+        struct reconfigure_cow_io_params cow_io_params;
+        struct dattobd_stats_params stats_params;
+        struct dattobd_info_all_params info_all_params;
+        struct dattobd_changes_params changes_params;
 
         LOG_DEBUG("ioctl command received: %i", cmd);
+
         mutex_lock(&ioctl_mutex);
 
         switch (cmd) {
@@ -791,6 +1123,103 @@ long ctrl_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
                         break;
                 }
 
+                break;
+        case IOCTL_RECONFIGURE_COW_IO:
+                // get params from user space
+                ret = copy_from_user(&cow_io_params,
+                                     (struct reconfigure_cow_io_params __user *)arg,
+                                     sizeof(struct reconfigure_cow_io_params));
+                if (ret) {
+                        ret = -EFAULT;
+                        LOG_ERROR(ret, "error copying reconfigure_cow_io_params "
+                                       "from user space");
+                        break;
+                }
+
+                ret = ioctl_reconfigure_cow_io(cow_io_params.minor,
+                                               cow_io_params.mode);
+                break;
+        case IOCTL_DATTOBD_STATS:
+                // get params from user space
+                ret = copy_from_user(&stats_params,
+                                     (struct dattobd_stats_params __user *)arg,
+                                     sizeof(struct dattobd_stats_params));
+                if (ret) {
+                        ret = -EFAULT;
+                        LOG_ERROR(ret, "error copying dattobd stats params "
+                                       "from user space");
+                        break;
+                }
+
+                ret = ioctl_dattobd_stats(
+                        stats_params.minor, stats_params.size,
+                        (struct dattobd_stats __user *)stats_params.stats);
+                break;
+        case IOCTL_DATTOBD_STATS_RESET:
+                // get minor from user space
+                ret = get_user(minor, (unsigned int __user *)arg);
+                if (ret) {
+                        LOG_ERROR(ret,
+                                  "error copying minor number from user space");
+                        break;
+                }
+
+                ret = ioctl_dattobd_stats_reset(minor);
+                break;
+        case IOCTL_DATTOBD_EVENTS:
+                ret = snap_events_subscribe(filp);
+                break;
+        case IOCTL_DATTOBD_INFO_ALL:
+                // get params from user space
+                ret = copy_from_user(&info_all_params,
+                                     (struct dattobd_info_all_params __user *)arg,
+                                     sizeof(struct dattobd_info_all_params));
+                if (ret) {
+                        ret = -EFAULT;
+                        LOG_ERROR(ret, "error copying dattobd info all params "
+                                       "from user space");
+                        break;
+                }
+
+                ret = ioctl_dattobd_info_all(&info_all_params);
+                if (ret)
+                        break;
+
+                ret = copy_to_user((struct dattobd_info_all_params __user *)arg,
+                                   &info_all_params,
+                                   sizeof(struct dattobd_info_all_params));
+                if (ret) {
+                        ret = -EFAULT;
+                        LOG_ERROR(ret, "error copying dattobd info all params "
+                                       "to user space");
+                        break;
+                }
+                break;
+        case IOCTL_DATTOBD_CHANGES:
+                // get params from user space
+                ret = copy_from_user(&changes_params,
+                                     (struct dattobd_changes_params __user *)arg,
+                                     sizeof(struct dattobd_changes_params));
+                if (ret) {
+                        ret = -EFAULT;
+                        LOG_ERROR(ret, "error copying dattobd changes params "
+                                       "from user space");
+                        break;
+                }
+
+                ret = ioctl_dattobd_changes(&changes_params);
+                if (ret)
+                        break;
+
+                ret = copy_to_user((struct dattobd_changes_params __user *)arg,
+                                   &changes_params,
+                                   sizeof(struct dattobd_changes_params));
+                if (ret) {
+                        ret = -EFAULT;
+                        LOG_ERROR(ret, "error copying dattobd changes params "
+                                       "to user space");
+                        break;
+                }
                 break;
         default:
                 ret = -EINVAL;
@@ -9,9 +9,12 @@
 #include "dattobd.h"
 #include "includes.h"
 #include "callback_refs.h"
+#include "filesystem.h"
 #include "ioctl_handlers.h"
 #include "logging.h"
 #include "proc_seq_file.h"
+#include "snap_debugfs.h"
+#include "snap_events.h"
 #include "snap_device.h"
 #include "tracer.h"
 #include "tracer_helper.h"
@@ -40,6 +43,7 @@ int dattobd_may_hook_syscalls = 1;
 unsigned long dattobd_cow_max_memory_default = (300 * 1024 * 1024);
 unsigned int dattobd_cow_fallocate_percentage_default = 10;
 unsigned int dattobd_max_snap_devices = DATTOBD_DEFAULT_SNAP_DEVICES;
+unsigned int dattobd_slow_op_threshold_us = 50000;
 int dattobd_debug = 0;
 
 module_param_named(may_hook_syscalls, dattobd_may_hook_syscalls, int, S_IRUGO);
@@ -58,6 +62,13 @@ MODULE_PARM_DESC(
         cow_fallocate_percentage_default,
         "default space allocated to the cow file (as integer percentage)");
 
+module_param_named(slow_op_threshold_us, dattobd_slow_op_threshold_us, uint,
+                   S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(slow_op_threshold_us,
+                 "operations taking longer than this (in microseconds) are "
+                 "kept in the slow operation log of their device, 0 disables "
+                 "the log");
+
 module_param_named(max_snap_devices, dattobd_max_snap_devices, uint, S_IRUGO);
 MODULE_PARM_DESC(max_snap_devices, "maximum number of tracers available");
 
@@ -66,11 +77,21 @@ MODULE_PARM_DESC(debug, "enables debug logging");
 
 static struct proc_dir_entry *info_proc;
 
+// private_data holds the event queue, if the file subscribed to events
+static int ctrl_open(struct inode *inode, struct file *filp)
+{
+        filp->private_data = NULL;
+        return nonseekable_open(inode, filp);
+}
+
 static const struct file_operations snap_control_fops = {
         .owner = THIS_MODULE,
         .unlocked_ioctl = ctrl_ioctl,
         .compat_ioctl = ctrl_ioctl,
-        .open = nonseekable_open,
+        .open = ctrl_open,
+        .release = snap_events_release,
+        .read = snap_events_read,
+        .poll = snap_events_poll,
         .llseek = noop_llseek,
 };
 
@@ -157,8 +178,13 @@ static void agent_exit(void)
 
         unregister_sequential_file_in_proc();
 
+        snap_debugfs_exit();
+
         cleanup_snap_device_array();
 
+        // wait for cow managers freed after a grace period
+        rcu_barrier();
+
         unregister_blkdev_from_kernel();
 }
 
@@ -286,6 +312,8 @@ static int __init agent_init(void)
                 goto error;
         }
 
+        snap_debugfs_init();
+
         ret = register_ioctl_control_interface();
         if (ret) {
                 LOG_ERROR(ret, "error registering control device");
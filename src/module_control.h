@@ -21,6 +21,7 @@ extern int dattobd_may_hook_syscalls;
 extern unsigned long dattobd_cow_max_memory_default;
 extern unsigned int dattobd_cow_fallocate_percentage_default;
 extern unsigned int dattobd_max_snap_devices;
+extern unsigned int dattobd_slow_op_threshold_us;
 
 extern unsigned int highest_minor;
 extern unsigned int lowest_minor;
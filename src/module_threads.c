@@ -37,6 +37,7 @@ int inc_sset_thread(void *data)
         struct snap_device *dev = data;
         struct sset_queue *sq = &dev->sd_pending_ssets;
         struct sector_set *sset;
+        struct snap_cpu_phase ph;
 
         // give this thread the highest priority we are allowed
         set_user_nice(current, MIN_NICE);
@@ -52,8 +53,11 @@ int inc_sset_thread(void *data)
                                 "error detected in sset thread, cleaning up cow");
                         is_failed = 1;
 
-                        if (dev->sd_cow)
+                        if (dev->sd_cow) {
+                                mutex_lock(&dev->sd_cow_lock);
                                 cow_free_members(dev->sd_cow);
+                                mutex_unlock(&dev->sd_cow_lock);
+                        }
                 }
 
                 if (sset_queue_empty(sq))
@@ -70,7 +74,11 @@ int inc_sset_thread(void *data)
                 }
 
                 // pass the sset to the handler
+                mutex_lock(&dev->sd_cow_lock);
+                snap_cpu_phase_begin(dev, &ph);
                 ret = inc_handle_sset(dev, sset);
+                snap_cpu_thread_end(dev, SNAP_STAT_CPU_SSET_THREAD_NS, &ph);
+                mutex_unlock(&dev->sd_cow_lock);
                 if (ret) {
                         LOG_ERROR(ret,
                                   "error handling sector set in kernel thread");
@@ -98,6 +106,8 @@ int snap_cow_thread(void *data)
         struct snap_device *dev = data;
         struct bio_queue *bq = &dev->sd_cow_bios;
         struct bio *bio;
+        u64 start_ns;
+        struct snap_cpu_phase ph;
 
         // give this thread the highest priority we are allowed
         set_user_nice(current, MIN_NICE);
@@ -113,8 +123,11 @@ int snap_cow_thread(void *data)
                                 "error detected in cow thread, cleaning up cow");
                         is_failed = 1;
 
-                        if (dev->sd_cow)
+                        if (dev->sd_cow) {
+                                mutex_lock(&dev->sd_cow_lock);
                                 cow_free_members(dev->sd_cow);
+                                mutex_unlock(&dev->sd_cow_lock);
+                        }
                 }
 
                 if (bio_queue_empty(bq))
@@ -134,7 +147,18 @@ int snap_cow_thread(void *data)
                                 continue;
                         }
 
+                        snap_stats_inc(dev, SNAP_STAT_SNAP_READS);
+                        snap_stats_add(dev, SNAP_STAT_SNAP_READ_BYTES,
+                                       bio_size(bio));
+
+                        start_ns = snap_stats_now();
+                        mutex_lock(&dev->sd_cow_lock);
+                        snap_cpu_phase_begin(dev, &ph);
                         ret = snap_handle_read_bio(dev, bio);
+                        snap_cpu_thread_end(dev, SNAP_STAT_CPU_COW_THREAD_NS,
+                                            &ph);
+                        mutex_unlock(&dev->sd_cow_lock);
+                        snap_stats_record(dev, SNAP_HIST_SNAP_READ, start_ns);
                         if (ret) {
                                 LOG_ERROR(
                                         ret,
@@ -149,7 +173,12 @@ int snap_cow_thread(void *data)
                                 continue;
                         }
 
+                        mutex_lock(&dev->sd_cow_lock);
+                        snap_cpu_phase_begin(dev, &ph);
                         ret = snap_handle_write_bio(dev, bio);
+                        snap_cpu_thread_end(dev, SNAP_STAT_CPU_COW_THREAD_NS,
+                                            &ph);
+                        mutex_unlock(&dev->sd_cow_lock);
                         if (ret) {
                                 LOG_ERROR(ret, "error handling write bio in "
                                                "kernel thread");
@@ -177,6 +206,7 @@ int snap_mrf_thread(void *data)
         struct snap_device *dev = data;
         struct bio_queue *bq = &dev->sd_orig_bios;
         struct bio *bio = NULL;
+        u64 cpu_ns;
 
         MAYBE_UNUSED(ret);
 
@@ -199,7 +229,10 @@ int snap_mrf_thread(void *data)
 
                 // blk_qc_t (*)(struct request_queue *, struct bio *)’                 // {aka ‘unsigned int (*)(struct request_queue *, struct bio *)’} but argument is of type ‘struct snap_device *’
 
+                cpu_ns = snap_cpu_clock();
                 SUBMIT_BIO_REAL(dev,bio);
+                snap_stats_add(dev, SNAP_STAT_CPU_MRF_THREAD_NS,
+                               snap_cpu_delta(cpu_ns, snap_cpu_clock()));
 #ifdef HAVE_MAKE_REQUEST_FN_INT
                 if (ret)
                         generic_make_request(bio);
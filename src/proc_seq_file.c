@@ -1,9 +1,9 @@
 #include "cow_manager.h"
 #include "dattobd.h"
 #include "includes.h"
-#include "ioctl_handlers.h"
 #include "module_control.h"
 #include "snap_device.h"
+#include "stats.h"
 #include "tracer_helper.h"
 #include "proc_seq_file.h"
 
@@ -67,7 +67,24 @@ const struct proc_ops* get_proc_fops(void)
 
 #endif // HAVE_PROC_OPS
 
-static snap_device_array current_snap_devices = NULL;
+/*
+ * The file is read without the ioctl mutex so monitoring never blocks the
+ * control plane. Devices are looked up under rcu_read_lock() in *_show(), see
+ * tracer_free(), and every slot of the device array is visited since the
+ * minor range may change while the file is being read.
+ */
+
+// per open file state
+struct dattobd_proc_iter {
+        unsigned int first_minor; // first device printed, for separators
+        struct dattobd_stats stats; // scratch space for snap_stats_seq_show()
+};
+
+#define DATTOBD_PROC_NO_MINOR (~0U)
+
+// marks the position after the last slot of the device array
+static char dattobd_proc_footer_token;
+#define DATTOBD_PROC_FOOTER ((void *)&dattobd_proc_footer_token)
 
 /**
  * dattobd_proc_get_idx() - Turns offset into pointer into @snap_devices array.
@@ -75,13 +92,18 @@ static snap_device_array current_snap_devices = NULL;
  *
  * Return:
  * * NULL - invalid @pos supplied, indicates "past end of file."
+ * * DATTOBD_PROC_FOOTER - @pos is just past the array, print the footer.
  * * !NULL - a void* pointer into the @snap_devices array.
  */
 static void *dattobd_proc_get_idx(loff_t pos)
 {
-        if (pos > highest_minor)
-                return NULL;
-        return (void*)&current_snap_devices[pos];
+        snap_device_array snap_devices = get_snap_device_array_nolock();
+
+        if (pos < dattobd_max_snap_devices)
+                return (void *)&snap_devices[pos];
+        if (pos == dattobd_max_snap_devices)
+                return DATTOBD_PROC_FOOTER;
+        return NULL;
 }
 
 /**
@@ -103,7 +125,6 @@ static void *dattobd_proc_start(struct seq_file *m, loff_t *pos)
          * zero @pos with the expectation that we continue from where we
          * left off.
          */ 
-        current_snap_devices = get_snap_device_array();
         if (*pos == 0)
                 return SEQ_START_TOKEN;
         return dattobd_proc_get_idx(*pos - 1);
@@ -139,8 +160,88 @@ static void *dattobd_proc_next(struct seq_file *m, void *v, loff_t *pos)
  */
 static void dattobd_proc_stop(struct seq_file *m, void *v)
 {
-        put_snap_device_array(current_snap_devices);
-        current_snap_devices = NULL;
+}
+
+/** dattobd_proc_show_dev() - Outputs information about a @snap_device.
+ * @m: The seq_file structure.
+ * @dev: The &struct snap_device object pointer.
+ *
+ * Must be called under rcu_read_lock(), so nothing here may sleep.
+ */
+static void dattobd_proc_show_dev(struct seq_file *m, struct snap_device *dev)
+{
+        struct dattobd_proc_iter *iter = m->private;
+        struct cow_manager *cm = ACCESS_ONCE(dev->sd_cow);
+        struct cow_auto_expand_manager *aem;
+        int error;
+
+        // a retried show of the first device must not add a separator
+        if (iter->first_minor == DATTOBD_PROC_NO_MINOR)
+                iter->first_minor = dev->sd_minor;
+        else if (dev->sd_minor != iter->first_minor)
+                seq_printf(m, ",\n");
+
+        seq_printf(m, "\t\t{\n");
+        seq_printf(m, "\t\t\t\"minor\": %u,\n", dev->sd_minor);
+        seq_printf(m, "\t\t\t\"cow_file\": \"%s\",\n",
+                   ACCESS_ONCE(dev->sd_cow_path));
+        seq_printf(m, "\t\t\t\"block_device\": \"%s\",\n",
+                   ACCESS_ONCE(dev->sd_bdev_path));
+        seq_printf(m, "\t\t\t\"max_cache\": %lu,\n",
+                   (dev->sd_cache_size) ?
+                           dev->sd_cache_size :
+                           dattobd_cow_max_memory_default);
+
+        if (!test_bit(UNVERIFIED, &dev->sd_state)) {
+                seq_printf(m, "\t\t\t\"fallocate\": %llu,\n",
+                           ((unsigned long long)dev->sd_falloc_size) *
+                                   1024 * 1024);
+
+                if (cm) {
+                        int i;
+                        seq_printf(m, "\t\t\t\"cow_size_current\": %llu,\n",
+                                   (unsigned long long)cm->file_size);
+
+                        seq_printf(m, "\t\t\t\"seq_id\": %llu,\n",
+                                   (unsigned long long)cm->seqid);
+
+                        seq_printf(m, "\t\t\t\"uuid\": \"");
+                        for (i = 0; i < COW_UUID_SIZE; i++) {
+                                seq_printf(m, "%02x", cm->uuid[i]);
+                        }
+                        seq_printf(m, "\",\n");
+
+                        if (cm->version > COW_VERSION_0) {
+                                seq_printf(m, "\t\t\t\"version\": %llu,\n",
+                                           cm->version);
+                                seq_printf(m,
+                                           "\t\t\t\"nr_changed_blocks\": "
+                                           "%llu,\n",
+                                           cm->nr_changed_blocks);
+                        }
+
+                        aem = ACCESS_ONCE(cm->auto_expand);
+                        if (aem && !IS_ERR(aem)) {
+                                seq_printf(m, "\t\t\t\"auto_expand\": {\n");
+                                seq_printf(m, "\t\t\t\t\"step_size_mib\": %llu,\n",
+                                           (unsigned long long)aem->step_size_mib);
+                                seq_printf(m, "\t\t\t\t\"reserved_space_mib\": %llu\n",
+                                           aem->reserved_space_mib);
+                                seq_printf(m, "\t\t\t},\n");
+                        }
+                }
+        }
+
+        error = tracer_read_fail_state(dev);
+        if (error)
+                seq_printf(m, "\t\t\t\"error\": %d,\n", error);
+
+        seq_printf(m, "\t\t\t\"stats\": {\n");
+        snap_stats_seq_show(m, dev, &iter->stats, "\t\t\t\t");
+        seq_printf(m, "\t\t\t},\n");
+
+        seq_printf(m, "\t\t\t\"state\": %lu\n", dev->sd_state);
+        seq_printf(m, "\t\t}");
 }
 
 /** dattobd_proc_show() - Outputs information about a @snap_device.  Optionally
@@ -153,105 +254,58 @@ static void dattobd_proc_stop(struct seq_file *m, void *v)
  */
 static int dattobd_proc_show(struct seq_file *m, void *v)
 {
+        struct dattobd_proc_iter *iter = m->private;
         struct snap_device **dev_ptr = v;
-        struct snap_device *dev = NULL;
+        struct snap_device *dev;
 
         // print the header if the "pointer" really an indication to do so
         if (dev_ptr == SEQ_START_TOKEN) {
+                iter->first_minor = DATTOBD_PROC_NO_MINOR;
                 seq_printf(m, "{\n");
                 seq_printf(m, "\t\"version\": \"%s\",\n", DATTOBD_VERSION);
                 seq_printf(m, "\t\"devices\": [\n");
+                return 0;
         }
 
-        // if the pointer is actually a device print it
-        if (dev_ptr != SEQ_START_TOKEN && *dev_ptr != NULL) {
-                int error;
-                dev = *dev_ptr;
-
-                if (dev->sd_minor != lowest_minor)
-                        seq_printf(m, ",\n");
-                seq_printf(m, "\t\t{\n");
-                seq_printf(m, "\t\t\t\"minor\": %u,\n", dev->sd_minor);
-                seq_printf(m, "\t\t\t\"cow_file\": \"%s\",\n",
-                           dev->sd_cow_path);
-                seq_printf(m, "\t\t\t\"block_device\": \"%s\",\n",
-                           dev->sd_bdev_path);
-                seq_printf(m, "\t\t\t\"max_cache\": %lu,\n",
-                           (dev->sd_cache_size) ?
-                                   dev->sd_cache_size :
-                                   dattobd_cow_max_memory_default);
-
-                if (!test_bit(UNVERIFIED, &dev->sd_state)) {
-                        seq_printf(m, "\t\t\t\"fallocate\": %llu,\n",
-                                   ((unsigned long long)dev->sd_falloc_size) *
-                                           1024 * 1024);
-
-                        if (dev->sd_cow) {
-                                int i;
-                                seq_printf(m, "\t\t\t\"cow_size_current\": %llu,\n",
-                                   (unsigned long long)dev->sd_cow->file_size);
-
-                                seq_printf(
-                                        m, "\t\t\t\"seq_id\": %llu,\n",
-                                        (unsigned long long)dev->sd_cow->seqid);
-
-                                seq_printf(m, "\t\t\t\"uuid\": \"");
-                                for (i = 0; i < COW_UUID_SIZE; i++) {
-                                        seq_printf(m, "%02x",
-                                                   dev->sd_cow->uuid[i]);
-                                }
-                                seq_printf(m, "\",\n");
-
-                                if (dev->sd_cow->version > COW_VERSION_0) {
-                                        seq_printf(m,
-                                                   "\t\t\t\"version\": %llu,\n",
-                                                   dev->sd_cow->version);
-                                        seq_printf(
-                                                m,
-                                                "\t\t\t\"nr_changed_blocks\": "
-                                                "%llu,\n",
-                                                dev->sd_cow->nr_changed_blocks);
-                                }
-
-                                if(dev->sd_cow->auto_expand){
-                                        seq_printf(m, "\t\t\t\"auto_expand\": {\n");
-                                        seq_printf(m, "\t\t\t\t\"step_size_mib\": %llu,\n",
-                                                   (unsigned long long)dev->sd_cow->auto_expand->step_size_mib);
-                                        seq_printf(m, "\t\t\t\t\"reserved_space_mib\": %llu\n",
-                                                   dev->sd_cow->auto_expand->reserved_space_mib);
-                                        seq_printf(m, "\t\t\t},\n");
-                                }
-                        }
-                }
-
-                error = tracer_read_fail_state(dev);
-                if (error)
-                        seq_printf(m, "\t\t\t\"error\": %d,\n", error);
-
-                seq_printf(m, "\t\t\t\"state\": %lu\n", dev->sd_state);
-                seq_printf(m, "\t\t}");
-        }
-
-        // print the footer if there are no devices to print or if this device
-        // has the highest minor
-        if ((dev_ptr == SEQ_START_TOKEN && lowest_minor > highest_minor) ||
-            (dev && dev->sd_minor == highest_minor)) {
+        // print the footer after the last slot of the device array
+        if (v == DATTOBD_PROC_FOOTER) {
                 seq_printf(m, "\n\t]\n");
                 seq_printf(m, "}\n");
+                return 0;
         }
 
+        // if the pointer is actually a device print it
+        rcu_read_lock();
+        dev = ACCESS_ONCE(*dev_ptr);
+        if (dev)
+                dattobd_proc_show_dev(m, dev);
+        rcu_read_unlock();
+
         return 0;
 }
 
 static int dattobd_proc_open(struct inode *inode, struct file *filp)
 {
-        mutex_lock(&ioctl_mutex);
-        return seq_open(filp, &dattobd_seq_proc_ops);
+        int ret;
+        struct dattobd_proc_iter *iter;
+
+        iter = kmalloc(sizeof(struct dattobd_proc_iter), GFP_KERNEL);
+        if (!iter)
+                return -ENOMEM;
+        iter->first_minor = DATTOBD_PROC_NO_MINOR;
+
+        ret = seq_open(filp, &dattobd_seq_proc_ops);
+        if (ret) {
+                kfree(iter);
+                return ret;
+        }
+
+        ((struct seq_file *)filp->private_data)->private = iter;
+        return 0;
 }
 
 static int dattobd_proc_release(struct inode *inode, struct file *file)
 {
-        seq_release(inode, file);
-        mutex_unlock(&ioctl_mutex);
-        return 0;
+        kfree(((struct seq_file *)file->private_data)->private);
+        return seq_release(inode, file);
 }
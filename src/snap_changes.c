@@ -0,0 +1,243 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Copyright (C) 2026 Datto Inc.
+ */
+
+#include "snap_changes.h"
+
+#include "bio_helper.h"
+#include "cow_manager.h"
+#include "dattobd.h"
+#include "logging.h"
+#include "snap_device.h"
+#include "tracer_helper.h"
+
+#include <linux/uaccess.h>
+
+// index sections walked per call, bounds how long the ioctl mutex is held:
+// at worst every one of them was evicted and is read from the cow file
+// (256 KiB, which covers 128 MiB of the device)
+#define SNAP_CHANGES_MAX_SECTS 8
+
+// extents buffered before they are copied to user space
+#define SNAP_CHANGES_BATCH 64
+
+/*
+ * IOCTL_DATTOBD_CHANGES reads the index one section at a time with
+ * cow_peek_section(), holding sd_cow_lock only while a section is copied so
+ * the cow thread is held up for at most one section read. Sections are not
+ * loaded into the cache, a query does not change which sections stay in
+ * memory. The cow thread takes the lock uncontended for every bio, which costs
+ * far less than queueing the query behind the bios it has yet to handle.
+ */
+
+struct snap_changes_out {
+        void __user *buf;
+        uint32_t nr; // extents or bitmap bytes that fit at buf
+        uint32_t used; // extents or bitmap bytes copied to buf
+        unsigned int fill; // entries buffered in batch
+        size_t entry_size;
+        union {
+                struct dattobd_extent exts[SNAP_CHANGES_BATCH];
+                uint8_t bytes[SNAP_CHANGES_BATCH *
+                              sizeof(struct dattobd_extent)];
+        } batch;
+};
+
+static int __snap_changes_flush(struct snap_changes_out *out)
+{
+        if (!out->fill)
+                return 0;
+
+        if (copy_to_user((char __user *)out->buf +
+                                 (size_t)out->used * out->entry_size,
+                         &out->batch, out->fill * out->entry_size))
+                return -EFAULT;
+
+        out->used += out->fill;
+        out->fill = 0;
+        return 0;
+}
+
+/**
+ * __snap_changes_put_extent() - Buffers an extent for user space.
+ *
+ * @out: The &struct snap_changes_out being filled.
+ * @start: The first block of the extent.
+ * @len: The length of the extent in blocks.
+ *
+ * Return:
+ * * 0 - success
+ * * -ENOSPC - the user space buffer is full
+ * * !0 - errno indicating the error
+ */
+static int __snap_changes_put_extent(struct snap_changes_out *out,
+                                     uint64_t start, uint64_t len)
+{
+        if (out->used + out->fill == out->nr)
+                return -ENOSPC;
+
+        out->batch.exts[out->fill].start = start;
+        out->batch.exts[out->fill].len = len;
+        if (++out->fill == SNAP_CHANGES_BATCH)
+                return __snap_changes_flush(out);
+
+        return 0;
+}
+
+static int __snap_changes_put_byte(struct snap_changes_out *out, uint8_t byte)
+{
+        out->batch.bytes[out->fill] = byte;
+        if (++out->fill == sizeof(out->batch.bytes))
+                return __snap_changes_flush(out);
+
+        return 0;
+}
+
+/**
+ * snap_changes_query() - Reports the changed blocks of a range of @dev to
+ * user space, see &struct dattobd_changes_params.
+ *
+ * @dev: An active &struct snap_device.
+ * @params: The parameters of the query, updated with the results.
+ *
+ * Must be called with the ioctl mutex held, which keeps @dev from being
+ * transitioned or destroyed during the query.
+ *
+ * Return:
+ * * 0 - success
+ * * !0 - errno indicating the error
+ */
+int snap_changes_query(struct snap_device *dev,
+                       struct dattobd_changes_params *params)
+{
+        int ret;
+        struct cow_manager *cm = dev->sd_cow;
+        struct snap_changes_out *out = NULL;
+        uint64_t *mappings = NULL;
+        uint64_t nr_blocks = SECTOR_TO_BLOCK(dev->sd_size);
+        uint64_t start = params->start, end, block, sect_idx, sect_start,
+                 sect_end;
+        uint64_t ext_start = 0, ext_len = 0;
+        int bitmap = params->flags & DATTOBD_CHANGES_BITMAP;
+        unsigned int bit = 0;
+        uint8_t byte = 0;
+
+        if (start > nr_blocks) {
+                ret = -EINVAL;
+                LOG_ERROR(ret, "changes query starts past the end of the "
+                               "device");
+                goto error;
+        }
+
+        // stop at the end of the device, the section limit or the bitmap
+        end = start + min_t(uint64_t, params->count, nr_blocks - start);
+        sect_idx = start;
+        do_div(sect_idx, cm->sect_size);
+        end = min_t(uint64_t, end,
+                    (sect_idx + SNAP_CHANGES_MAX_SECTS) * cm->sect_size);
+        if (bitmap)
+                end = min_t(uint64_t, end, start + (uint64_t)params->nr * 8);
+
+        out = kzalloc(sizeof(struct snap_changes_out), GFP_KERNEL);
+        mappings = (void *)__get_free_pages(GFP_KERNEL, cm->log_sect_pages);
+        if (!out || !mappings) {
+                ret = -ENOMEM;
+                LOG_ERROR(ret, "error allocating memory for changes query");
+                goto error;
+        }
+
+        out->buf = (void __user *)params->buf;
+        out->nr = params->nr;
+        out->entry_size = (bitmap) ? 1 : sizeof(struct dattobd_extent);
+
+        for (block = start; block < end; block = sect_end) {
+                sect_idx = block;
+                sect_start = block - do_div(sect_idx, cm->sect_size);
+                sect_end = min_t(uint64_t, sect_start + cm->sect_size, end);
+
+                mutex_lock(&dev->sd_cow_lock);
+                ret = tracer_read_fail_state(dev);
+                if (!ret)
+                        ret = cow_peek_section(cm, sect_idx, mappings);
+                mutex_unlock(&dev->sd_cow_lock);
+                if (ret)
+                        goto error;
+
+                for (; block < sect_end; block++) {
+                        if (bitmap) {
+                                if (mappings[block - sect_start])
+                                        byte |= 1 << bit;
+                                if (++bit < 8)
+                                        continue;
+
+                                ret = __snap_changes_put_byte(out, byte);
+                                if (ret)
+                                        goto error;
+                                byte = 0;
+                                bit = 0;
+                                continue;
+                        }
+
+                        if (!mappings[block - sect_start])
+                                continue;
+
+                        if (ext_len && ext_start + ext_len == block) {
+                                ext_len++;
+                                continue;
+                        }
+
+                        if (ext_len) {
+                                ret = __snap_changes_put_extent(out, ext_start,
+                                                                ext_len);
+                                if (ret == -ENOSPC) {
+                                        // the next query picks up from here
+                                        end = ext_start;
+                                        ext_len = 0;
+                                        goto out;
+                                } else if (ret) {
+                                        goto error;
+                                }
+                        }
+                        ext_start = block;
+                        ext_len = 1;
+                }
+        }
+
+        if (bit) {
+                ret = __snap_changes_put_byte(out, byte);
+                if (ret)
+                        goto error;
+        }
+
+        if (ext_len) {
+                ret = __snap_changes_put_extent(out, ext_start, ext_len);
+                if (ret == -ENOSPC)
+                        end = ext_start;
+                else if (ret)
+                        goto error;
+        }
+
+out:
+        ret = __snap_changes_flush(out);
+        if (ret)
+                goto error;
+
+        params->count = end - start;
+        params->nr = out->used;
+        params->nr_blocks = nr_blocks;
+        params->seqid = cm->seqid;
+        memcpy(params->uuid, cm->uuid, COW_UUID_SIZE);
+
+        free_pages((unsigned long)mappings, cm->log_sect_pages);
+        kfree(out);
+        return 0;
+
+error:
+        LOG_ERROR(ret, "error querying changed blocks");
+        if (mappings)
+                free_pages((unsigned long)mappings, cm->log_sect_pages);
+        kfree(out);
+        return ret;
+}
@@ -0,0 +1,18 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Copyright (C) 2026 Datto Inc.
+ */
+
+#ifndef SNAP_CHANGES_H_
+#define SNAP_CHANGES_H_
+
+#include "includes.h"
+
+struct dattobd_changes_params;
+struct snap_device;
+
+int snap_changes_query(struct snap_device *dev,
+                       struct dattobd_changes_params *params);
+
+#endif /* SNAP_CHANGES_H_ */
@@ -0,0 +1,324 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Copyright (C) 2026 Datto Inc.
+ */
+
+#include "snap_debugfs.h"
+
+#include "cow_manager.h"
+#include "includes.h"
+#include "logging.h"
+#include "module_control.h"
+#include "snap_device.h"
+#include "stats.h"
+
+#ifdef HAVE_DEBUGFS
+#include <linux/debugfs.h>
+
+// number of log2 buckets in the section usage histogram, the last one is open
+#define SNAP_DEBUGFS_USAGE_BUCKETS 20
+
+/*
+ * Developer facing files under /sys/kernel/debug/dattobd/<minor>/. Their
+ * format is not an ABI. A directory exists for every minor that was set up
+ * through the control device and goes away with the destroy ioctl. The files
+ * only hold the minor and look the device up under rcu_read_lock() on each
+ * read, the same way /proc/datto-info does.
+ */
+
+static struct dentry *snap_debugfs_root;
+static struct dentry **snap_debugfs_dirs;
+
+// a snapshot of the section cache of a cow manager
+struct snap_debugfs_cache {
+        unsigned long resident;
+        unsigned long dirty;
+        unsigned long with_data;
+        unsigned long touched;
+        unsigned long usage[SNAP_DEBUGFS_USAGE_BUCKETS];
+};
+
+static unsigned int __snap_debugfs_usage_bucket(unsigned long usage)
+{
+        unsigned int bucket = fls_long(usage);
+
+        return min_t(unsigned int, bucket, SNAP_DEBUGFS_USAGE_BUCKETS - 1);
+}
+
+/**
+ * __snap_debugfs_walk_sects() - Counts the sections of @cm by their state.
+ *
+ * @cm: The &struct cow_manager object pointer.
+ * @sects: The section array of @cm, read once by the caller.
+ * @cache: The &struct snap_debugfs_cache to fill in.
+ *
+ * Must be called under rcu_read_lock(). The cow thread keeps changing the
+ * sections while they are counted, so the result is only approximate.
+ */
+static void __snap_debugfs_walk_sects(struct cow_manager *cm,
+                                      struct cow_section *sects,
+                                      struct snap_debugfs_cache *cache)
+{
+        unsigned long i, usage;
+
+        memset(cache, 0, sizeof(struct snap_debugfs_cache));
+
+        for (i = 0; i < cm->total_sects; i++) {
+                usage = ACCESS_ONCE(sects[i].usage);
+                if (usage)
+                        cache->touched++;
+                if (sects[i].has_data)
+                        cache->with_data++;
+                if (!ACCESS_ONCE(sects[i].mappings))
+                        continue;
+
+                cache->resident++;
+                if (sects[i].dirty)
+                        cache->dirty++;
+                cache->usage[__snap_debugfs_usage_bucket(usage)]++;
+        }
+}
+
+static void __snap_debugfs_show_cache(struct seq_file *m,
+                                      struct snap_device *dev,
+                                      struct snap_debugfs_cache *cache)
+{
+        int i;
+        unsigned long cache_size;
+        struct cow_manager *cm;
+        struct cow_section *sects;
+        struct cow_cleanup_info last;
+        uint64_t cleanups;
+
+        cache_size = (dev->sd_cache_size) ? dev->sd_cache_size :
+                                            dattobd_cow_max_memory_default;
+        seq_printf(m, "minor: %u\n", dev->sd_minor);
+        seq_printf(m, "state: %lu\n", dev->sd_state);
+        seq_printf(m, "cache_size: %lu\n", cache_size);
+
+        cm = ACCESS_ONCE(dev->sd_cow);
+        if (!cm)
+                return;
+
+        seq_printf(m, "sect_size: %lu\n", cm->sect_size);
+        seq_printf(m, "total_sects: %lu\n", cm->total_sects);
+        seq_printf(m, "allowed_sects: %lu\n", cm->allowed_sects);
+        seq_printf(m, "allocated_sects: %lu\n", cm->allocated_sects);
+
+        sects = ACCESS_ONCE(cm->sects);
+        if (sects) {
+                __snap_debugfs_walk_sects(cm, sects, cache);
+                seq_printf(m, "resident_sects: %lu\n", cache->resident);
+                seq_printf(m, "dirty_sects: %lu\n", cache->dirty);
+                seq_printf(m, "data_sects: %lu\n", cache->with_data);
+                seq_printf(m, "touched_sects: %lu\n", cache->touched);
+
+                // resident sections by usage since the last cleanup pass,
+                // bucket i > 0 holds usages in [2^(i-1), 2^i)
+                seq_printf(m, "usage_hist:");
+                for (i = 0; i < SNAP_DEBUGFS_USAGE_BUCKETS; i++)
+                        seq_printf(m, " %lu", cache->usage[i]);
+                seq_printf(m, "\n");
+        }
+
+        cleanups = cm->cleanups;
+        last = cm->last_cleanup;
+        seq_printf(m, "cleanups: %llu\n", (unsigned long long)cleanups);
+        if (!cleanups)
+                return;
+
+        seq_printf(m, "last_cleanup_age_ns: %llu\n",
+                   (unsigned long long)(snap_stats_now() - last.end_ns));
+        seq_printf(m, "last_cleanup_cost_ns: %llu\n",
+                   (unsigned long long)last.cost_ns);
+        seq_printf(m, "last_cleanup_thresh: %lu\n", last.thresh);
+        seq_printf(m, "last_cleanup_freed: %lu\n", last.freed);
+}
+
+static int snap_debugfs_cache_show(struct seq_file *m, void *v)
+{
+        unsigned int minor = (unsigned long)m->private;
+        struct snap_device *dev;
+        struct snap_debugfs_cache *cache;
+
+        cache = kmalloc(sizeof(struct snap_debugfs_cache), GFP_KERNEL);
+        if (!cache)
+                return -ENOMEM;
+
+        rcu_read_lock();
+        dev = ACCESS_ONCE(get_snap_device_array_nolock()[minor]);
+        if (dev)
+                __snap_debugfs_show_cache(m, dev, cache);
+        rcu_read_unlock();
+
+        kfree(cache);
+        return 0;
+}
+
+static int snap_debugfs_slow_ops_show(struct seq_file *m, void *v)
+{
+        unsigned int minor = (unsigned long)m->private;
+        unsigned long nr = 0, total = 0;
+        struct snap_device *dev;
+        struct snap_slow_rec *recs;
+
+        recs = kmalloc(sizeof(struct snap_slow_rec) * SNAP_SLOW_LOG_SIZE,
+                       GFP_KERNEL);
+        if (!recs)
+                return -ENOMEM;
+
+        rcu_read_lock();
+        dev = ACCESS_ONCE(get_snap_device_array_nolock()[minor]);
+        if (dev)
+                nr = snap_slow_log_copy(dev, recs, &total);
+        rcu_read_unlock();
+
+        seq_printf(m, "threshold_us: %u\n",
+                   ACCESS_ONCE(dattobd_slow_op_threshold_us));
+        seq_printf(m, "recorded: %lu\n", total);
+        snap_slow_log_seq_show(m, recs, nr);
+
+        kfree(recs);
+        return 0;
+}
+
+// defines the file operations of a debugfs file printed by name##_show()
+#define SNAP_DEBUGFS_FOPS(name)                                                \
+        static int name##_open(struct inode *inode, struct file *filp)         \
+        {                                                                      \
+                return single_open(filp, name##_show, inode->i_private);       \
+        }                                                                      \
+                                                                               \
+        static const struct file_operations name##_fops = {                    \
+                .owner = THIS_MODULE,                                          \
+                .open = name##_open,                                           \
+                .read = seq_read,                                              \
+                .llseek = seq_lseek,                                           \
+                .release = single_release,                                     \
+        }
+
+SNAP_DEBUGFS_FOPS(snap_debugfs_cache);
+SNAP_DEBUGFS_FOPS(snap_debugfs_slow_ops);
+
+// files in the directory of each minor
+static const struct {
+        const char *name;
+        const struct file_operations *fops;
+} snap_debugfs_files[] = {
+        { "cache", &snap_debugfs_cache_fops },
+        { "slow_ops", &snap_debugfs_slow_ops_fops },
+};
+
+// debugfs_create_*() return NULL or an ERR_PTR() depending on the kernel
+static int __snap_debugfs_failed(struct dentry *dentry)
+{
+        return !dentry || IS_ERR(dentry);
+}
+
+/**
+ * snap_debugfs_init() - Creates the dattobd debugfs directory. Failing to do
+ * so is not fatal, the module just works without the debug files.
+ */
+void snap_debugfs_init(void)
+{
+        struct dentry *root;
+
+        snap_debugfs_dirs = kcalloc(dattobd_max_snap_devices,
+                                    sizeof(struct dentry *), GFP_KERNEL);
+        if (!snap_debugfs_dirs) {
+                LOG_WARN("no memory for debugfs files");
+                return;
+        }
+
+        root = debugfs_create_dir("dattobd", NULL);
+        if (__snap_debugfs_failed(root)) {
+                LOG_DEBUG("debugfs not available");
+                kfree(snap_debugfs_dirs);
+                snap_debugfs_dirs = NULL;
+                return;
+        }
+
+        snap_debugfs_root = root;
+}
+
+/**
+ * snap_debugfs_exit() - Removes all dattobd debugfs files.
+ */
+void snap_debugfs_exit(void)
+{
+        if (snap_debugfs_root)
+                debugfs_remove_recursive(snap_debugfs_root);
+        snap_debugfs_root = NULL;
+
+        kfree(snap_debugfs_dirs);
+        snap_debugfs_dirs = NULL;
+}
+
+/**
+ * snap_debugfs_add() - Creates the debugfs directory of @minor.
+ *
+ * @minor: The minor number of a device that was just set up.
+ */
+void snap_debugfs_add(unsigned int minor)
+{
+        int i;
+        char name[16];
+        struct dentry *dir, *file;
+
+        if (!snap_debugfs_root || snap_debugfs_dirs[minor])
+                return;
+
+        snprintf(name, sizeof(name), "%u", minor);
+        dir = debugfs_create_dir(name, snap_debugfs_root);
+        if (__snap_debugfs_failed(dir)) {
+                LOG_WARN("error creating debugfs directory for minor %u",
+                         minor);
+                return;
+        }
+
+        for (i = 0; i < ARRAY_SIZE(snap_debugfs_files); i++) {
+                file = debugfs_create_file(snap_debugfs_files[i].name, S_IRUSR,
+                                           dir, (void *)(unsigned long)minor,
+                                           snap_debugfs_files[i].fops);
+                if (__snap_debugfs_failed(file))
+                        LOG_WARN("error creating debugfs file %s for minor %u",
+                                 snap_debugfs_files[i].name, minor);
+        }
+
+        snap_debugfs_dirs[minor] = dir;
+}
+
+/**
+ * snap_debugfs_remove() - Removes the debugfs directory of @minor.
+ *
+ * @minor: The minor number of a device that is being destroyed.
+ */
+void snap_debugfs_remove(unsigned int minor)
+{
+        if (!snap_debugfs_root || !snap_debugfs_dirs[minor])
+                return;
+
+        debugfs_remove_recursive(snap_debugfs_dirs[minor]);
+        snap_debugfs_dirs[minor] = NULL;
+}
+
+#else
+
+void snap_debugfs_init(void)
+{
+}
+
+void snap_debugfs_exit(void)
+{
+}
+
+void snap_debugfs_add(unsigned int minor)
+{
+}
+
+void snap_debugfs_remove(unsigned int minor)
+{
+}
+
+#endif /* HAVE_DEBUGFS */
@@ -0,0 +1,18 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Copyright (C) 2026 Datto Inc.
+ */
+
+#ifndef SNAP_DEBUGFS_H_
+#define SNAP_DEBUGFS_H_
+
+void snap_debugfs_init(void);
+
+void snap_debugfs_exit(void);
+
+void snap_debugfs_add(unsigned int minor);
+
+void snap_debugfs_remove(unsigned int minor);
+
+#endif /* SNAP_DEBUGFS_H_ */
@@ -39,6 +39,7 @@ void cleanup_snap_device_array(void){
                     if (dev) {
                             LOG_DEBUG("destroying minor - %d", i);
                             tracer_destroy(dev, snap_devices_wrp);
+                            tracer_free(dev);
                     }
             }
         
@@ -14,12 +14,16 @@
 #include "submit_bio.h"
 #include "sset_queue.h"
 #include "blkdev.h"
+#include "stats.h"
 
 // macros for defining the state of a tracing struct (bit offsets)
 #define SNAPSHOT 0
 #define ACTIVE 1
 #define UNVERIFIED 2
 
+struct cow_extent;
+struct cow_phys_map;
+
 #ifdef USE_BDOPS_SUBMIT_BIO
 struct tracing_ops {
 	struct block_device_operations *bd_ops;
@@ -49,6 +53,7 @@ struct snap_device {
         unsigned long sd_falloc_size; // space allocated to the cow file (in
                                       // megabytes)
         unsigned long sd_cache_size; // maximum cache size (in bytes)
+        int sd_cow_io_mode; // page cache handling of cow file I/O (COW_IO_*)
         atomic_t sd_refs; // number of users who have this device open
         atomic_t sd_fail_code; // failure return code
         atomic_t sd_active; // boolean for whether the snap device is set up and ready to trace i/o
@@ -56,6 +61,7 @@ struct snap_device {
         sector_t sd_size; // size of device in sectors
         struct request_queue *sd_queue; // snap device request queue
         struct gendisk *sd_gd; // snap device gendisk
+        int sd_sysfs; // attribute group registered under sd_gd
         struct bdev_wrapper *sd_base_dev; // device being snapshot
         char *sd_bdev_path; // base device file path
         struct cow_manager *sd_cow; // cow manager
@@ -68,8 +74,20 @@ struct snap_device {
                                            // read/writes
         struct bio_queue sd_orig_bios; // list of outstanding original bios
         struct sset_queue sd_pending_ssets; // list of outstanding sector sets
-	struct fiemap_extent *sd_cow_extents; //cow file extents
+	struct cow_extent *sd_cow_extents; //cow file extents
 	unsigned int sd_cow_ext_cnt; //cow file extents count
+        unsigned int sd_cow_ext_cap; // allocated length of sd_cow_extents
+        unsigned int sd_cow_ext_flags; // union of fiemap flags of the extents
+        unsigned int sd_cow_ext_hint; // extent of the last offset lookup
+        struct mutex sd_cow_ext_lock; // serializes extent refreshes against
+                                      // cow file expansion
+        struct cow_phys_map *sd_cow_phys_map; // rcu protected physical ranges
+                                              // of the cow file
+        struct rw_semaphore sd_cow_dio_sem; // read held by direct cow file
+                                            // writes, keeps the map published
+        int sd_cow_ext_stale; // the map was dropped by an expansion that
+                              // could not rebuild it, protected by
+                              // sd_cow_lock, see tracer_refresh_cow_extents()
 #ifndef HAVE_BIOSET_INIT
         //#if LINUX_VERSION_CODE < KERNEL_VERSION(4,18,0)
         struct bio_set *sd_bioset; // allocation pool for bios
@@ -80,6 +98,14 @@ struct snap_device {
                                      // underlying driver
         atomic64_t sd_received_cnt; // count of read clones submitted to
                                     // underlying driver
+        struct snap_stats __percpu *sd_stats; // runtime counters
+        struct snap_slow_log *sd_slow_log; // operations that took too long
+        u64 sd_cpu_nested_ns; // cpu time charged to phases of sd_cow_thread,
+                              // see snap_cpu_phase_end()
+        u64 sd_cpu_io_wait_ns; // time sd_cow_thread spent in io calls, see
+                               // snap_cpu_io_end()
+        struct mutex sd_cow_lock; // held by sd_cow_thread while it uses
+                                  // sd_cow, lets ioctls read the index
 #ifdef USE_BDOPS_SUBMIT_BIO
         struct block_device_operations *bd_ops;
         struct tracing_ops *sd_tracing_ops; //copy of original block_device_operations but with request_function for tracing
@@ -0,0 +1,261 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Copyright (C) 2026 Datto Inc.
+ */
+
+#include "snap_events.h"
+
+#include "dattobd.h"
+#include "logging.h"
+#include "stats.h"
+
+#include <linux/uaccess.h>
+
+// events queued for each subscriber before new ones are dropped
+#define SNAP_EVENTS_QUEUE_SIZE 64
+
+// events copied to user space per locked pass in snap_events_read()
+#define SNAP_EVENTS_READ_BATCH 8
+
+/*
+ * Each file descriptor of the control device that issued
+ * IOCTL_DATTOBD_EVENTS has its own queue. Events are emitted from any
+ * context, including bio completion, so the subscriber list and the queues
+ * are protected by one irq safe spinlock. Subscribers are few and queues
+ * short, so a single lock is plenty.
+ */
+
+struct snap_events_queue {
+        struct list_head list;
+        wait_queue_head_t wait;
+        unsigned long head; // next event to read
+        unsigned long tail; // next free slot
+        unsigned long lost; // events dropped since the last read
+        struct dattobd_event events[SNAP_EVENTS_QUEUE_SIZE];
+};
+
+static LIST_HEAD(snap_events_queues);
+static DEFINE_SPINLOCK(snap_events_lock);
+
+// must be called with snap_events_lock held
+static int __snap_events_pending(struct snap_events_queue *q)
+{
+        return q->head != q->tail || q->lost;
+}
+
+static int snap_events_pending(struct snap_events_queue *q)
+{
+        int ret;
+        unsigned long flags;
+
+        spin_lock_irqsave(&snap_events_lock, flags);
+        ret = __snap_events_pending(q);
+        spin_unlock_irqrestore(&snap_events_lock, flags);
+
+        return ret;
+}
+
+/**
+ * snap_events_subscribe() - Starts queueing events for @filp. Subscribing
+ * twice is harmless.
+ *
+ * @filp: An open file of the control device.
+ *
+ * Return:
+ * * 0 - success
+ * * !0 - errno indicating the error
+ */
+int snap_events_subscribe(struct file *filp)
+{
+        unsigned long flags;
+        struct snap_events_queue *q;
+
+        q = kzalloc(sizeof(struct snap_events_queue), GFP_KERNEL);
+        if (!q) {
+                LOG_ERROR(-ENOMEM, "error allocating event queue");
+                return -ENOMEM;
+        }
+        init_waitqueue_head(&q->wait);
+
+        spin_lock_irqsave(&snap_events_lock, flags);
+        if (filp->private_data) {
+                spin_unlock_irqrestore(&snap_events_lock, flags);
+                kfree(q);
+                return 0;
+        }
+
+        list_add_tail(&q->list, &snap_events_queues);
+        filp->private_data = q;
+        spin_unlock_irqrestore(&snap_events_lock, flags);
+
+        return 0;
+}
+
+/**
+ * snap_events_release() - Drops the event queue of @filp, if any. Used as
+ * the release callback of the control device.
+ *
+ * @inode: The inode of the control device.
+ * @filp: The file being closed.
+ *
+ * Return: 0
+ */
+int snap_events_release(struct inode *inode, struct file *filp)
+{
+        unsigned long flags;
+        struct snap_events_queue *q = filp->private_data;
+
+        if (!q)
+                return 0;
+
+        spin_lock_irqsave(&snap_events_lock, flags);
+        list_del(&q->list);
+        filp->private_data = NULL;
+        spin_unlock_irqrestore(&snap_events_lock, flags);
+
+        kfree(q);
+        return 0;
+}
+
+/**
+ * __snap_events_take() - Moves up to @nr queued events of @q to @out. A
+ * %DATTOBD_EVENT_LOST event comes first if events were dropped.
+ *
+ * @q: The &struct snap_events_queue.
+ * @out: The output array.
+ * @nr: The length of @out.
+ *
+ * Return: The number of events moved.
+ */
+static unsigned int __snap_events_take(struct snap_events_queue *q,
+                                       struct dattobd_event *out,
+                                       unsigned int nr)
+{
+        unsigned int i = 0;
+        unsigned long flags;
+
+        spin_lock_irqsave(&snap_events_lock, flags);
+        if (q->lost && nr) {
+                memset(&out[i], 0, sizeof(struct dattobd_event));
+                out[i].time_ns = snap_stats_now();
+                out[i].type = DATTOBD_EVENT_LOST;
+                out[i].value = q->lost;
+                q->lost = 0;
+                i++;
+        }
+
+        for (; i < nr && q->head != q->tail; i++, q->head++)
+                out[i] = q->events[q->head % SNAP_EVENTS_QUEUE_SIZE];
+        spin_unlock_irqrestore(&snap_events_lock, flags);
+
+        return i;
+}
+
+/**
+ * snap_events_read() - Reads whole &struct dattobd_event records from the
+ * event queue of @filp. Used as the read callback of the control device.
+ *
+ * @filp: An open file of the control device.
+ * @buf: The user space buffer.
+ * @count: The size of @buf in bytes.
+ * @ppos: Unused, the control device is not seekable.
+ *
+ * Return:
+ * * >0 - the number of bytes read
+ * * <0 - errno indicating the error
+ */
+ssize_t snap_events_read(struct file *filp, char __user *buf, size_t count,
+                         loff_t *ppos)
+{
+        int ret;
+        unsigned int nr;
+        size_t done = 0;
+        struct dattobd_event events[SNAP_EVENTS_READ_BATCH];
+        struct snap_events_queue *q = ACCESS_ONCE(filp->private_data);
+
+        if (!q || count < sizeof(struct dattobd_event))
+                return -EINVAL;
+
+        if (!snap_events_pending(q)) {
+                if (filp->f_flags & O_NONBLOCK)
+                        return -EAGAIN;
+
+                ret = wait_event_interruptible(q->wait,
+                                               snap_events_pending(q));
+                if (ret)
+                        return ret;
+        }
+
+        while (count - done >= sizeof(struct dattobd_event)) {
+                nr = min_t(size_t, SNAP_EVENTS_READ_BATCH,
+                           (count - done) / sizeof(struct dattobd_event));
+                nr = __snap_events_take(q, events, nr);
+                if (!nr)
+                        break;
+
+                if (copy_to_user(buf + done, events,
+                                 nr * sizeof(struct dattobd_event)))
+                        return (done) ? done : -EFAULT;
+                done += nr * sizeof(struct dattobd_event);
+        }
+
+        return done;
+}
+
+/**
+ * snap_events_poll() - Reports whether events are queued for @filp. Used as
+ * the poll callback of the control device.
+ *
+ * @filp: An open file of the control device.
+ * @wait: The poll table.
+ *
+ * Return: The poll mask.
+ */
+unsigned int snap_events_poll(struct file *filp, poll_table *wait)
+{
+        struct snap_events_queue *q = ACCESS_ONCE(filp->private_data);
+
+        if (!q)
+                return POLLERR;
+
+        poll_wait(filp, &q->wait, wait);
+
+        return (snap_events_pending(q)) ? POLLIN | POLLRDNORM : 0;
+}
+
+/**
+ * snap_events_emit() - Queues an event for every subscriber. Safe to call
+ * from any context.
+ *
+ * @minor: The minor of the device the event is about.
+ * @type: One of the DATTOBD_EVENT_* types.
+ * @value: Depends on @type, see &struct dattobd_event.
+ * @error: An error code or 0.
+ */
+void snap_events_emit(unsigned int minor, uint32_t type, uint64_t value,
+                      int error)
+{
+        unsigned long flags;
+        struct snap_events_queue *q;
+        struct dattobd_event *event;
+        uint64_t now = snap_stats_now();
+
+        spin_lock_irqsave(&snap_events_lock, flags);
+        list_for_each_entry (q, &snap_events_queues, list) {
+                if (q->tail - q->head == SNAP_EVENTS_QUEUE_SIZE) {
+                        q->lost++;
+                } else {
+                        event = &q->events[q->tail++ % SNAP_EVENTS_QUEUE_SIZE];
+                        event->time_ns = now;
+                        event->value = value;
+                        event->type = type;
+                        event->minor = minor;
+                        event->error = error;
+                        event->reserved = 0;
+                }
+
+                wake_up_interruptible(&q->wait);
+        }
+        spin_unlock_irqrestore(&snap_events_lock, flags);
+}
@@ -0,0 +1,28 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Copyright (C) 2026 Datto Inc.
+ */
+
+#ifndef SNAP_EVENTS_H_
+#define SNAP_EVENTS_H_
+
+#include "includes.h"
+#include <linux/poll.h>
+
+struct file;
+struct inode;
+
+int snap_events_subscribe(struct file *filp);
+
+int snap_events_release(struct inode *inode, struct file *filp);
+
+ssize_t snap_events_read(struct file *filp, char __user *buf, size_t count,
+                         loff_t *ppos);
+
+unsigned int snap_events_poll(struct file *filp, poll_table *wait);
+
+void snap_events_emit(unsigned int minor, uint32_t type, uint64_t value,
+                      int error);
+
+#endif /* SNAP_EVENTS_H_ */
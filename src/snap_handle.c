@@ -101,7 +101,7 @@ error:
  * * 0 - success.
  * * !0 - errno indicating the error.
  */
-int snap_handle_read_bio(const struct snap_device *dev, struct bio *bio)
+int snap_handle_read_bio(struct snap_device *dev, struct bio *bio)
 {
         int ret, mode;
         void *orig_private;
@@ -111,6 +111,7 @@ int snap_handle_read_bio(const struct snap_device *dev, struct bio *bio)
         unsigned int bio_orig_idx, bio_orig_size;
         uint64_t block_mapping, bytes_to_copy, block_off, bvec_off;
         struct bio_vec *bvec;
+        struct snap_cpu_io io;
 
 #ifdef HAVE_BVEC_ITER_ALL
 	struct bvec_iter_all iter;
@@ -136,7 +137,9 @@ int snap_handle_read_bio(const struct snap_device *dev, struct bio *bio)
 
         // submit the bio to the base device and wait for completion
         if (mode != READ_MODE_COW_FILE) {
+                snap_cpu_io_begin(dev, &io);
                 ret = dattobd_submit_bio_wait(bio);
+                snap_cpu_io_end(dev, &io);
                 if (ret) {
                         LOG_ERROR(ret,
                                   "error reading from base device for read");
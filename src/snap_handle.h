@@ -11,7 +11,7 @@ struct snap_device;
 struct bio;
 struct sector_set;
 
-int snap_handle_read_bio(const struct snap_device *dev, struct bio *bio);
+int snap_handle_read_bio(struct snap_device *dev, struct bio *bio);
 
 int snap_handle_write_bio(const struct snap_device *dev, struct bio *bio);
 
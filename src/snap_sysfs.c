@@ -0,0 +1,259 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Copyright (C) 2026 Datto Inc.
+ */
+
+#include "snap_sysfs.h"
+
+#include "cow_manager.h"
+#include "dattobd.h"
+#include "includes.h"
+#include "logging.h"
+#include "module_control.h"
+#include "snap_device.h"
+#include "stats.h"
+#include "tracer_helper.h"
+
+#ifdef HAVE_DISK_TO_DEV
+
+/*
+ * Read-only attributes under /sys/block/datto<minor>/dattobd. The group is
+ * removed before the gendisk and its &struct snap_device go away, which waits
+ * for running *_show() calls, so the device itself needs no locking here.
+ * The cow manager may be replaced by the control plane at any time and is
+ * only looked at under rcu_read_lock().
+ */
+
+static struct snap_device *__snap_sysfs_dev(struct device *kdev)
+{
+        return dev_to_disk(kdev)->private_data;
+}
+
+static ssize_t state_show(struct device *kdev, struct device_attribute *attr,
+                          char *buf)
+{
+        return scnprintf(buf, PAGE_SIZE, "%lu\n",
+                         __snap_sysfs_dev(kdev)->sd_state);
+}
+
+static ssize_t error_show(struct device *kdev, struct device_attribute *attr,
+                          char *buf)
+{
+        return scnprintf(buf, PAGE_SIZE, "%d\n",
+                         tracer_read_fail_state(__snap_sysfs_dev(kdev)));
+}
+
+static ssize_t block_device_show(struct device *kdev,
+                                 struct device_attribute *attr, char *buf)
+{
+        ssize_t ret;
+        const char *path;
+
+        rcu_read_lock();
+        path = ACCESS_ONCE(__snap_sysfs_dev(kdev)->sd_bdev_path);
+        ret = scnprintf(buf, PAGE_SIZE, "%s\n", (path) ? path : "");
+        rcu_read_unlock();
+
+        return ret;
+}
+
+static ssize_t cow_file_show(struct device *kdev, struct device_attribute *attr,
+                             char *buf)
+{
+        ssize_t ret;
+        const char *path;
+
+        rcu_read_lock();
+        path = ACCESS_ONCE(__snap_sysfs_dev(kdev)->sd_cow_path);
+        ret = scnprintf(buf, PAGE_SIZE, "%s\n", (path) ? path : "");
+        rcu_read_unlock();
+
+        return ret;
+}
+
+static ssize_t max_cache_show(struct device *kdev,
+                              struct device_attribute *attr, char *buf)
+{
+        unsigned long cache_size = __snap_sysfs_dev(kdev)->sd_cache_size;
+
+        return scnprintf(buf, PAGE_SIZE, "%lu\n",
+                         (cache_size) ? cache_size :
+                                        dattobd_cow_max_memory_default);
+}
+
+static ssize_t fallocate_show(struct device *kdev,
+                              struct device_attribute *attr, char *buf)
+{
+        return scnprintf(buf, PAGE_SIZE, "%llu\n",
+                         ((unsigned long long)__snap_sysfs_dev(kdev)
+                                  ->sd_falloc_size) *
+                                 1024 * 1024);
+}
+
+// prints a scalar member of the cow manager, or nothing if there is none
+#define SNAP_SYSFS_COW_ATTR(name, fmt, expr)                                   \
+        static ssize_t name##_show(struct device *kdev,                        \
+                                   struct device_attribute *attr, char *buf)   \
+        {                                                                      \
+                ssize_t ret = 0;                                               \
+                struct cow_manager *cm;                                        \
+                                                                               \
+                rcu_read_lock();                                               \
+                cm = ACCESS_ONCE(__snap_sysfs_dev(kdev)->sd_cow);              \
+                if (cm)                                                        \
+                        ret = scnprintf(buf, PAGE_SIZE, fmt "\n", expr);       \
+                rcu_read_unlock();                                             \
+                                                                               \
+                return ret;                                                    \
+        }
+
+SNAP_SYSFS_COW_ATTR(cow_size_current, "%llu",
+                    (unsigned long long)cm->file_size)
+SNAP_SYSFS_COW_ATTR(seq_id, "%llu", (unsigned long long)cm->seqid)
+SNAP_SYSFS_COW_ATTR(version, "%llu", (unsigned long long)cm->version)
+SNAP_SYSFS_COW_ATTR(nr_changed_blocks, "%llu",
+                    (unsigned long long)cm->nr_changed_blocks)
+
+static ssize_t uuid_show(struct device *kdev, struct device_attribute *attr,
+                         char *buf)
+{
+        int i;
+        ssize_t ret = 0;
+        struct cow_manager *cm;
+
+        rcu_read_lock();
+        cm = ACCESS_ONCE(__snap_sysfs_dev(kdev)->sd_cow);
+        if (cm) {
+                for (i = 0; i < COW_UUID_SIZE; i++)
+                        ret += scnprintf(buf + ret, PAGE_SIZE - ret, "%02x",
+                                         cm->uuid[i]);
+                ret += scnprintf(buf + ret, PAGE_SIZE - ret, "\n");
+        }
+        rcu_read_unlock();
+
+        return ret;
+}
+
+static ssize_t stats_show(struct device *kdev, struct device_attribute *attr,
+                          char *buf)
+{
+        ssize_t ret;
+        struct dattobd_stats *stats;
+
+        stats = kmalloc(sizeof(struct dattobd_stats), GFP_KERNEL);
+        if (!stats)
+                return -ENOMEM;
+
+        snap_stats_fill(__snap_sysfs_dev(kdev), stats);
+        ret = snap_stats_format(stats, buf, PAGE_SIZE);
+        kfree(stats);
+
+        return ret;
+}
+
+static ssize_t latency_show(struct device *kdev, struct device_attribute *attr,
+                            char *buf)
+{
+        ssize_t ret;
+        struct dattobd_stats *stats;
+
+        stats = kmalloc(sizeof(struct dattobd_stats), GFP_KERNEL);
+        if (!stats)
+                return -ENOMEM;
+
+        snap_stats_fill(__snap_sysfs_dev(kdev), stats);
+        ret = snap_stats_format_hist(stats, buf, PAGE_SIZE);
+        kfree(stats);
+
+        return ret;
+}
+
+static DEVICE_ATTR(state, S_IRUGO, state_show, NULL);
+static DEVICE_ATTR(error, S_IRUGO, error_show, NULL);
+static DEVICE_ATTR(block_device, S_IRUGO, block_device_show, NULL);
+static DEVICE_ATTR(cow_file, S_IRUGO, cow_file_show, NULL);
+static DEVICE_ATTR(max_cache, S_IRUGO, max_cache_show, NULL);
+static DEVICE_ATTR(fallocate, S_IRUGO, fallocate_show, NULL);
+static DEVICE_ATTR(cow_size_current, S_IRUGO, cow_size_current_show, NULL);
+static DEVICE_ATTR(seq_id, S_IRUGO, seq_id_show, NULL);
+static DEVICE_ATTR(version, S_IRUGO, version_show, NULL);
+static DEVICE_ATTR(nr_changed_blocks, S_IRUGO, nr_changed_blocks_show, NULL);
+static DEVICE_ATTR(uuid, S_IRUGO, uuid_show, NULL);
+static DEVICE_ATTR(stats, S_IRUGO, stats_show, NULL);
+static DEVICE_ATTR(latency, S_IRUGO, latency_show, NULL);
+
+static struct attribute *snap_sysfs_attrs[] = {
+        &dev_attr_state.attr,
+        &dev_attr_error.attr,
+        &dev_attr_block_device.attr,
+        &dev_attr_cow_file.attr,
+        &dev_attr_max_cache.attr,
+        &dev_attr_fallocate.attr,
+        &dev_attr_cow_size_current.attr,
+        &dev_attr_seq_id.attr,
+        &dev_attr_version.attr,
+        &dev_attr_nr_changed_blocks.attr,
+        &dev_attr_uuid.attr,
+        &dev_attr_stats.attr,
+        &dev_attr_latency.attr,
+        NULL,
+};
+
+static const struct attribute_group snap_sysfs_group = {
+        .name = "dattobd",
+        .attrs = snap_sysfs_attrs,
+};
+
+/**
+ * snap_sysfs_add() - Registers the dattobd attribute group under the
+ * snapshot disk of @dev. The disk must have been added already.
+ *
+ * @dev: The &struct snap_device object pointer.
+ *
+ * Return:
+ * * 0 - success
+ * * !0 - errno indicating the error
+ */
+int snap_sysfs_add(struct snap_device *dev)
+{
+        int ret;
+
+        ret = sysfs_create_group(&disk_to_dev(dev->sd_gd)->kobj,
+                                 &snap_sysfs_group);
+        if (ret) {
+                LOG_ERROR(ret, "error creating sysfs attributes");
+                return ret;
+        }
+
+        dev->sd_sysfs = 1;
+        return 0;
+}
+
+/**
+ * snap_sysfs_remove() - Removes the dattobd attribute group of @dev, waiting
+ * for readers that are still in a *_show() call.
+ *
+ * @dev: The &struct snap_device object pointer.
+ */
+void snap_sysfs_remove(struct snap_device *dev)
+{
+        if (!dev->sd_sysfs)
+                return;
+
+        sysfs_remove_group(&disk_to_dev(dev->sd_gd)->kobj, &snap_sysfs_group);
+        dev->sd_sysfs = 0;
+}
+
+#else
+
+int snap_sysfs_add(struct snap_device *dev)
+{
+        return 0;
+}
+
+void snap_sysfs_remove(struct snap_device *dev)
+{
+}
+
+#endif /* HAVE_DISK_TO_DEV */
@@ -0,0 +1,16 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Copyright (C) 2026 Datto Inc.
+ */
+
+#ifndef SNAP_SYSFS_H_
+#define SNAP_SYSFS_H_
+
+struct snap_device;
+
+int snap_sysfs_add(struct snap_device *dev);
+
+void snap_sysfs_remove(struct snap_device *dev);
+
+#endif /* SNAP_SYSFS_H_ */
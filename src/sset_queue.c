@@ -5,6 +5,7 @@
  */
 
 #include "sset_queue.h"
+#include "hints.h"
 #include "sset_list.h"
 
 /**
@@ -16,6 +17,7 @@ void sset_queue_init(struct sset_queue *sq)
         sset_list_init(&sq->ssets);
         spin_lock_init(&sq->lock);
         init_waitqueue_head(&sq->event);
+        sq->count = 0;
 }
 
 /**
@@ -33,6 +35,18 @@ int sset_queue_empty(const struct sset_queue *sq)
         return sset_list_empty(&sq->ssets);
 }
 
+/**
+ * sset_queue_count() - Returns the number of sector sets in the supplied
+ * queue. The value is sampled without locking.
+ * @sq: The &struct sset_queue object pointer.
+ *
+ * Return: The number of queued sector sets.
+ */
+unsigned long sset_queue_count(const struct sset_queue *sq)
+{
+        return ACCESS_ONCE(sq->count);
+}
+
 /**
  * sset_queue_add() - adds @sset to the queue @sq.
  *
@@ -45,6 +59,7 @@ void sset_queue_add(struct sset_queue *sq, struct sector_set *sset)
 
         spin_lock_irqsave(&sq->lock, flags);
         sset_list_add(&sq->ssets, sset);
+        sq->count++;
         spin_unlock_irqrestore(&sq->lock, flags);
         wake_up(&sq->event);
 }
@@ -63,6 +78,8 @@ struct sector_set *sset_queue_dequeue(struct sset_queue *sq)
 
         spin_lock_irqsave(&sq->lock, flags);
         sset = sset_list_pop(&sq->ssets);
+        if (sset)
+                sq->count--;
         spin_unlock_irqrestore(&sq->lock, flags);
 
         return sset;
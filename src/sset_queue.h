@@ -14,12 +14,15 @@ struct sset_queue {
         struct sset_list ssets;
         spinlock_t lock;
         wait_queue_head_t event;
+        unsigned long count; // number of queued sector sets
 };
 
 void sset_queue_init(struct sset_queue *sq);
 
 int sset_queue_empty(const struct sset_queue *sq);
 
+unsigned long sset_queue_count(const struct sset_queue *sq);
+
 void sset_queue_add(struct sset_queue *sq, struct sector_set *sset);
 
 struct sector_set *sset_queue_dequeue(struct sset_queue *sq);
@@ -0,0 +1,630 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Copyright (C) 2026 Datto Inc.
+ */
+
+#include "stats.h"
+
+#include "cow_manager.h"
+#include "dattobd.h"
+#include "logging.h"
+#include "snap_device.h"
+
+#define __stat_field(name) { #name, offsetof(struct dattobd_stats, name) }
+
+// fields of &struct dattobd_stats printed to /proc/datto-info, in order
+static const struct {
+        const char *name;
+        size_t offset;
+} snap_stat_fields[] = {
+        __stat_field(writes_traced),
+        __stat_field(write_bytes_traced),
+        __stat_field(writes_passed),
+        __stat_field(write_bytes_passed),
+        __stat_field(clones_submitted),
+        __stat_field(clone_bytes),
+        __stat_field(clones_completed),
+        __stat_field(ssets_queued),
+        __stat_field(cow_blocks_written),
+        __stat_field(cow_blocks_present),
+        __stat_field(cow_bytes_written),
+        __stat_field(cow_bytes_read),
+        __stat_field(snap_reads),
+        __stat_field(snap_read_bytes),
+        __stat_field(cache_hits),
+        __stat_field(cache_misses),
+        __stat_field(cache_allocs),
+        __stat_field(cache_evictions),
+        __stat_field(section_writes),
+        __stat_field(cow_bios_queued),
+        __stat_field(orig_bios_queued),
+        __stat_field(ssets_pending),
+        __stat_field(cache_sects),
+        __stat_field(cache_sects_allowed),
+        __stat_field(cpu_submit_ns),
+        __stat_field(cpu_completion_ns),
+        __stat_field(cpu_cow_thread_ns),
+        __stat_field(cpu_sset_thread_ns),
+        __stat_field(cpu_mrf_thread_ns),
+        __stat_field(cpu_mapping_ns),
+        __stat_field(cpu_copy_ns),
+        __stat_field(cpu_evict_ns),
+        __stat_field(io_wait_ns),
+        __stat_field(cow_file_size),
+        __stat_field(cow_file_used),
+        __stat_field(cow_map_deferred),
+        __stat_field(cow_map_stale),
+};
+
+// histograms of &struct dattobd_stats printed to /proc/datto-info, in order
+static const struct {
+        const char *name;
+        size_t offset;
+} snap_hist_fields[] = {
+        __stat_field(write_delay),
+        __stat_field(clone_read),
+        __stat_field(cow_write),
+        __stat_field(section_load),
+        __stat_field(section_flush),
+        __stat_field(snap_read),
+};
+
+// names of &enum snap_slow_op in the slow operation log
+static const char *const snap_slow_op_names[SNAP_SLOW_NR] = {
+        [SNAP_SLOW_CLONE_READ] = "clone_read",
+        [SNAP_SLOW_COW_WRITE] = "cow_write",
+        [SNAP_SLOW_COW_WRITE_EXPAND] = "cow_write_expand",
+        [SNAP_SLOW_SECTION_LOAD] = "section_load",
+        [SNAP_SLOW_FREEZE] = "freeze",
+        [SNAP_SLOW_THAW] = "thaw",
+        [SNAP_SLOW_COW_SYNC] = "cow_sync",
+};
+
+/**
+ * snap_stats_alloc() - Allocates the per cpu counters and the slow operation
+ * log of @dev.
+ *
+ * @dev: The &struct snap_device object pointer.
+ *
+ * Return:
+ * * 0 - success
+ * * !0 - errno indicating the error
+ */
+int snap_stats_alloc(struct snap_device *dev)
+{
+        dev->sd_stats = alloc_percpu(struct snap_stats);
+        if (!dev->sd_stats)
+                goto error;
+
+        dev->sd_slow_log = kzalloc(sizeof(struct snap_slow_log), GFP_KERNEL);
+        if (!dev->sd_slow_log)
+                goto error;
+        spin_lock_init(&dev->sd_slow_log->lock);
+
+        return 0;
+
+error:
+        LOG_ERROR(-ENOMEM, "error allocating device statistics");
+        snap_stats_free(dev);
+        return -ENOMEM;
+}
+
+/**
+ * snap_stats_free() - Frees the per cpu counters and the slow operation log
+ * of @dev.
+ *
+ * @dev: The &struct snap_device object pointer.
+ */
+void snap_stats_free(struct snap_device *dev)
+{
+        if (dev->sd_stats)
+                free_percpu(dev->sd_stats);
+        dev->sd_stats = NULL;
+
+        kfree(dev->sd_slow_log);
+        dev->sd_slow_log = NULL;
+}
+
+/**
+ * snap_stats_share() - Makes @dest count into the counters of @src. Used
+ * while @dest is being set up to replace @src in a transition, so both can
+ * be traced at once. Exactly one of them must later drop the counters with
+ * snap_stats_disown() before being freed.
+ *
+ * @src: The &struct snap_device being replaced.
+ * @dest: The newly allocated &struct snap_device, not yet tracing.
+ */
+void snap_stats_share(struct snap_device *src, struct snap_device *dest)
+{
+        if (!src->sd_stats || !src->sd_slow_log)
+                return;
+
+        snap_stats_free(dest);
+        dest->sd_stats = src->sd_stats;
+        dest->sd_slow_log = src->sd_slow_log;
+}
+
+/**
+ * snap_stats_disown() - Forgets the counters of @dev without freeing them,
+ * another device keeps using them.
+ *
+ * @dev: The &struct snap_device object pointer.
+ */
+void snap_stats_disown(struct snap_device *dev)
+{
+        dev->sd_stats = NULL;
+        dev->sd_slow_log = NULL;
+}
+
+static u64 __snap_stats_sum(struct snap_stats __percpu *sd_stats,
+                            enum snap_stat stat)
+{
+        int cpu;
+        u64 sum = 0;
+
+        for_each_possible_cpu (cpu)
+                sum += per_cpu_ptr(sd_stats, cpu)->cnt[stat];
+
+        return sum;
+}
+
+static void __snap_stats_sum_hist(struct snap_stats __percpu *sd_stats,
+                                  enum snap_hist hist,
+                                  struct dattobd_hist *out)
+{
+        int cpu, i;
+        struct snap_hist_data *data;
+
+        for_each_possible_cpu (cpu) {
+                data = per_cpu_ptr(sd_stats, cpu)->hist + hist;
+                out->count += data->count;
+                out->sum_ns += data->sum_ns;
+                for (i = 0; i < DATTOBD_HIST_BUCKETS; i++)
+                        out->buckets[i] += data->buckets[i];
+        }
+}
+
+/**
+ * snap_stats_fill() - Sums the counters of @dev and samples its queues into
+ * @stats.
+ *
+ * @dev: The &struct snap_device object pointer.
+ * @stats: The resulting &struct dattobd_stats.
+ *
+ * Counters are read without stopping writers, so they may lag each other by
+ * the operations in flight.
+ */
+void snap_stats_fill(struct snap_device *dev, struct dattobd_stats *stats)
+{
+        struct snap_stats __percpu *sd_stats = ACCESS_ONCE(dev->sd_stats);
+        struct cow_manager *cm;
+
+        memset(stats, 0, sizeof(struct dattobd_stats));
+        stats->version = DATTOBD_STATS_VERSION;
+        stats->size = sizeof(struct dattobd_stats);
+
+        if (sd_stats) {
+#define __sum(field, stat) stats->field = __snap_stats_sum(sd_stats, stat)
+                __sum(writes_traced, SNAP_STAT_WRITES_TRACED);
+                __sum(write_bytes_traced, SNAP_STAT_WRITE_BYTES_TRACED);
+                __sum(writes_passed, SNAP_STAT_WRITES_PASSED);
+                __sum(write_bytes_passed, SNAP_STAT_WRITE_BYTES_PASSED);
+                __sum(clones_submitted, SNAP_STAT_CLONES_SUBMITTED);
+                __sum(clone_bytes, SNAP_STAT_CLONE_BYTES);
+                __sum(clones_completed, SNAP_STAT_CLONES_COMPLETED);
+                __sum(ssets_queued, SNAP_STAT_SSETS_QUEUED);
+                __sum(cow_blocks_written, SNAP_STAT_COW_BLOCKS_WRITTEN);
+                __sum(cow_blocks_present, SNAP_STAT_COW_BLOCKS_PRESENT);
+                __sum(cow_bytes_written, SNAP_STAT_COW_BYTES_WRITTEN);
+                __sum(cow_bytes_read, SNAP_STAT_COW_BYTES_READ);
+                __sum(snap_reads, SNAP_STAT_SNAP_READS);
+                __sum(snap_read_bytes, SNAP_STAT_SNAP_READ_BYTES);
+                __sum(cache_hits, SNAP_STAT_CACHE_HITS);
+                __sum(cache_misses, SNAP_STAT_CACHE_MISSES);
+                __sum(cache_allocs, SNAP_STAT_CACHE_ALLOCS);
+                __sum(cache_evictions, SNAP_STAT_CACHE_EVICTIONS);
+                __sum(section_writes, SNAP_STAT_SECTION_WRITES);
+                __sum(cpu_submit_ns, SNAP_STAT_CPU_SUBMIT_NS);
+                __sum(cpu_completion_ns, SNAP_STAT_CPU_COMPLETION_NS);
+                __sum(cpu_cow_thread_ns, SNAP_STAT_CPU_COW_THREAD_NS);
+                __sum(cpu_sset_thread_ns, SNAP_STAT_CPU_SSET_THREAD_NS);
+                __sum(cpu_mrf_thread_ns, SNAP_STAT_CPU_MRF_THREAD_NS);
+                __sum(cpu_mapping_ns, SNAP_STAT_CPU_MAPPING_NS);
+                __sum(cpu_copy_ns, SNAP_STAT_CPU_COPY_NS);
+                __sum(cpu_evict_ns, SNAP_STAT_CPU_EVICT_NS);
+                __sum(io_wait_ns, SNAP_STAT_IO_WAIT_NS);
+                __sum(cow_map_deferred, SNAP_STAT_COW_MAP_DEFERRED);
+#undef __sum
+
+#define __sum_hist(field, hist)                                                \
+        __snap_stats_sum_hist(sd_stats, hist, &stats->field)
+                __sum_hist(write_delay, SNAP_HIST_WRITE_DELAY);
+                __sum_hist(clone_read, SNAP_HIST_CLONE_READ);
+                __sum_hist(cow_write, SNAP_HIST_COW_WRITE);
+                __sum_hist(section_load, SNAP_HIST_SECTION_LOAD);
+                __sum_hist(section_flush, SNAP_HIST_SECTION_FLUSH);
+                __sum_hist(snap_read, SNAP_HIST_SNAP_READ);
+#undef __sum_hist
+        }
+
+        stats->cow_bios_queued = bio_queue_count(&dev->sd_cow_bios);
+        stats->orig_bios_queued = bio_queue_count(&dev->sd_orig_bios);
+        stats->ssets_pending = sset_queue_count(&dev->sd_pending_ssets);
+
+        // cow managers are freed after a grace period
+        rcu_read_lock();
+        cm = ACCESS_ONCE(dev->sd_cow);
+        if (cm && !test_bit(UNVERIFIED, &dev->sd_state)) {
+                stats->cache_sects = ACCESS_ONCE(cm->allocated_sects);
+                stats->cache_sects_allowed = ACCESS_ONCE(cm->allowed_sects);
+                stats->cow_file_size = ACCESS_ONCE(cm->file_size);
+                stats->cow_file_used =
+                        ACCESS_ONCE(cm->curr_pos) * COW_BLOCK_SIZE;
+        }
+        stats->cow_map_stale = ACCESS_ONCE(dev->sd_cow_ext_stale);
+        rcu_read_unlock();
+}
+
+/**
+ * snap_stats_reset_hist() - Clears the latency histograms of @dev.
+ *
+ * @dev: The &struct snap_device object pointer.
+ *
+ * Samples recorded on other cpus while clearing may survive or be lost.
+ */
+void snap_stats_reset_hist(struct snap_device *dev)
+{
+        int cpu;
+        unsigned long flags;
+        struct snap_stats *pcpu;
+
+        if (!dev->sd_stats)
+                return;
+
+        for_each_possible_cpu (cpu) {
+                pcpu = per_cpu_ptr(dev->sd_stats, cpu);
+                local_irq_save(flags);
+                memset(pcpu->hist, 0, sizeof(pcpu->hist));
+                local_irq_restore(flags);
+        }
+}
+
+// returns the index of the last non-empty bucket of @hist
+static int __snap_stats_hist_last(const struct dattobd_hist *hist)
+{
+        int last;
+
+        for (last = DATTOBD_HIST_BUCKETS - 1; last > 0; last--) {
+                if (hist->buckets[last])
+                        break;
+        }
+
+        return last;
+}
+
+/**
+ * snap_stats_seq_show() - Prints the statistics of @dev as the members of a
+ * JSON object. Does not sleep.
+ *
+ * @m: The &struct seq_file to print to.
+ * @dev: The &struct snap_device object pointer.
+ * @stats: Scratch space for the statistics, owned by the caller.
+ * @indent: The indentation of each member.
+ */
+void snap_stats_seq_show(struct seq_file *m, struct snap_device *dev,
+                         struct dattobd_stats *stats, const char *indent)
+{
+        struct dattobd_hist *hist;
+        int i, j, last;
+
+        snap_stats_fill(dev, stats);
+
+        for (i = 0; i < ARRAY_SIZE(snap_stat_fields); i++) {
+                seq_printf(m, "%s\"%s\": %llu,\n", indent,
+                           snap_stat_fields[i].name,
+                           *(unsigned long long *)((char *)stats +
+                                                   snap_stat_fields[i].offset));
+        }
+
+        // buckets are printed up to the last non-empty one
+        seq_printf(m, "%s\"latency\": {\n", indent);
+        for (i = 0; i < ARRAY_SIZE(snap_hist_fields); i++) {
+                hist = (struct dattobd_hist *)((char *)stats +
+                                               snap_hist_fields[i].offset);
+                last = __snap_stats_hist_last(hist);
+
+                seq_printf(m, "%s\t\"%s\": { \"count\": %llu, \"sum_ns\": %llu, "
+                           "\"buckets\": [", indent, snap_hist_fields[i].name,
+                           (unsigned long long)hist->count,
+                           (unsigned long long)hist->sum_ns);
+                for (j = 0; j <= last; j++)
+                        seq_printf(m, "%s%llu", (j) ? ", " : "",
+                                   (unsigned long long)hist->buckets[j]);
+                seq_printf(m, "] }%s\n",
+                           (i + 1 < ARRAY_SIZE(snap_hist_fields)) ? "," : "");
+        }
+        seq_printf(m, "%s}\n", indent);
+}
+
+/**
+ * snap_stats_format() - Prints the counters of @stats as "name value" lines.
+ *
+ * @stats: Statistics filled in by snap_stats_fill().
+ * @buf: The output buffer.
+ * @len: The size of @buf in bytes.
+ *
+ * Return: The number of characters written to @buf.
+ */
+int snap_stats_format(const struct dattobd_stats *stats, char *buf, size_t len)
+{
+        int i, ret = 0;
+
+        for (i = 0; i < ARRAY_SIZE(snap_stat_fields); i++) {
+                ret += scnprintf(buf + ret, len - ret, "%s %llu\n",
+                                 snap_stat_fields[i].name,
+                                 *(unsigned long long *)((char *)stats +
+                                                         snap_stat_fields[i].offset));
+        }
+
+        return ret;
+}
+
+/**
+ * snap_stats_format_hist() - Prints the histograms of @stats one per line as
+ * "name count sum_ns bucket0 bucket1 ...", up to the last non-empty bucket.
+ *
+ * @stats: Statistics filled in by snap_stats_fill().
+ * @buf: The output buffer.
+ * @len: The size of @buf in bytes.
+ *
+ * Return: The number of characters written to @buf.
+ */
+int snap_stats_format_hist(const struct dattobd_stats *stats, char *buf,
+                           size_t len)
+{
+        const struct dattobd_hist *hist;
+        int i, j, last, ret = 0;
+
+        for (i = 0; i < ARRAY_SIZE(snap_hist_fields); i++) {
+                hist = (const struct dattobd_hist *)((char *)stats +
+                                                     snap_hist_fields[i].offset);
+                last = __snap_stats_hist_last(hist);
+
+                ret += scnprintf(buf + ret, len - ret, "%s %llu %llu",
+                                 snap_hist_fields[i].name,
+                                 (unsigned long long)hist->count,
+                                 (unsigned long long)hist->sum_ns);
+                for (j = 0; j <= last; j++)
+                        ret += scnprintf(buf + ret, len - ret, " %llu",
+                                         (unsigned long long)hist->buckets[j]);
+                ret += scnprintf(buf + ret, len - ret, "\n");
+        }
+
+        return ret;
+}
+
+// phases and io waits are only accounted for the cow (or sset) thread of dev
+static int __snap_cpu_owner(struct snap_device *dev)
+{
+        return dev && ACCESS_ONCE(dev->sd_cow_thread) == current;
+}
+
+/**
+ * snap_cpu_phase_begin() - Starts timing a phase of the work done by the cow
+ * thread of @dev. Phases may nest.
+ *
+ * @dev: The &struct snap_device the work is done for, may be NULL.
+ * @ph: The &struct snap_cpu_phase to pass to snap_cpu_phase_end().
+ *
+ * Nothing is accounted unless the caller is the cow thread of @dev, so the
+ * same code may run from the control plane.
+ */
+void snap_cpu_phase_begin(struct snap_device *dev, struct snap_cpu_phase *ph)
+{
+        ph->active = __snap_cpu_owner(dev);
+        if (!ph->active)
+                return;
+
+        ph->cpu_ns = snap_cpu_clock();
+        ph->nested_ns = dev->sd_cpu_nested_ns;
+        ph->io_wait_ns = dev->sd_cpu_io_wait_ns;
+}
+
+// time on cpu since snap_cpu_phase_begin(), less the io waits in between
+static u64 __snap_cpu_phase_time(struct snap_device *dev,
+                                 struct snap_cpu_phase *ph)
+{
+        u64 ns = snap_cpu_delta(ph->cpu_ns, snap_cpu_clock());
+        u64 io_wait = dev->sd_cpu_io_wait_ns - ph->io_wait_ns;
+
+        return (ns > io_wait) ? ns - io_wait : 0;
+}
+
+/**
+ * snap_cpu_phase_end() - Charges the cpu time since snap_cpu_phase_begin()
+ * to @stat, less the time charged to phases nested in it and the io waits.
+ *
+ * @dev: The &struct snap_device passed to snap_cpu_phase_begin().
+ * @stat: One of the SNAP_STAT_CPU_* phase counters.
+ * @ph: The &struct snap_cpu_phase filled in by snap_cpu_phase_begin().
+ */
+void snap_cpu_phase_end(struct snap_device *dev, enum snap_stat stat,
+                        struct snap_cpu_phase *ph)
+{
+        u64 ns, nested;
+
+        if (!ph->active)
+                return;
+
+        ns = __snap_cpu_phase_time(dev, ph);
+        nested = dev->sd_cpu_nested_ns - ph->nested_ns;
+        ns = (ns > nested) ? ns - nested : 0;
+
+        dev->sd_cpu_nested_ns += ns;
+        snap_stats_add(dev, stat, ns);
+}
+
+/**
+ * snap_cpu_thread_end() - Charges the cpu time since snap_cpu_phase_begin()
+ * to the thread counter @stat, phases nested in it included.
+ *
+ * @dev: The &struct snap_device passed to snap_cpu_phase_begin().
+ * @stat: One of the SNAP_STAT_CPU_*_THREAD_NS counters.
+ * @ph: The &struct snap_cpu_phase filled in by snap_cpu_phase_begin().
+ */
+void snap_cpu_thread_end(struct snap_device *dev, enum snap_stat stat,
+                         struct snap_cpu_phase *ph)
+{
+        if (!ph->active)
+                return;
+
+        snap_stats_add(dev, stat, __snap_cpu_phase_time(dev, ph));
+}
+
+/**
+ * snap_cpu_io_begin() - Starts timing a blocking io call of the cow thread
+ * of @dev.
+ *
+ * @dev: The &struct snap_device the io is done for, may be NULL.
+ * @io: The &struct snap_cpu_io to pass to snap_cpu_io_end().
+ */
+void snap_cpu_io_begin(struct snap_device *dev, struct snap_cpu_io *io)
+{
+        io->cpu_ns = 0;
+        if (!__snap_cpu_owner(dev))
+                return;
+
+        io->cpu_ns = snap_cpu_clock();
+}
+
+/**
+ * snap_cpu_io_end() - Charges the time since snap_cpu_io_begin() to
+ * %SNAP_STAT_IO_WAIT_NS and takes it out of the enclosing phases. The call
+ * is counted as a whole, including the little cpu time it uses to submit
+ * and complete the io.
+ *
+ * @dev: The &struct snap_device passed to snap_cpu_io_begin().
+ * @io: The &struct snap_cpu_io filled in by snap_cpu_io_begin().
+ */
+void snap_cpu_io_end(struct snap_device *dev, struct snap_cpu_io *io)
+{
+        u64 ns;
+
+        if (!io->cpu_ns)
+                return;
+
+        ns = snap_cpu_delta(io->cpu_ns, snap_cpu_clock());
+        dev->sd_cpu_io_wait_ns += ns;
+        snap_stats_add(dev, SNAP_STAT_IO_WAIT_NS, ns);
+}
+
+/**
+ * __snap_slow_op_record() - Adds an operation to the slow operation log of
+ * @dev, overwriting the oldest record once the log is full. Use
+ * snap_slow_op_check() instead of calling this directly.
+ *
+ * @dev: The &struct snap_device object pointer.
+ * @op: One of the &enum snap_slow_op operations.
+ * @duration_ns: How long @op took.
+ * @start: The first sector or block @op worked on.
+ * @len: The number of sectors or blocks.
+ * @ret: The result of @op.
+ */
+void __snap_slow_op_record(struct snap_device *dev, enum snap_slow_op op,
+                           u64 duration_ns, u64 start, u64 len, int ret)
+{
+        unsigned long flags;
+        struct snap_slow_rec *rec;
+        struct snap_slow_log *log = dev->sd_slow_log;
+
+        if (!log)
+                return;
+
+        spin_lock_irqsave(&log->lock, flags);
+        rec = &log->recs[log->total++ % SNAP_SLOW_LOG_SIZE];
+        rec->wall_ns = ktime_to_ns(ktime_get_real());
+        rec->duration_ns = duration_ns;
+        rec->start = start;
+        rec->len = len;
+        rec->cow_queue = bio_queue_count(&dev->sd_cow_bios);
+        rec->orig_queue = bio_queue_count(&dev->sd_orig_bios);
+        rec->clones_inflight = (long)(atomic64_read(&dev->sd_submitted_cnt) -
+                                      atomic64_read(&dev->sd_received_cnt));
+        rec->op = op;
+        rec->ret = ret;
+        spin_unlock_irqrestore(&log->lock, flags);
+}
+
+/**
+ * snap_slow_log_copy() - Copies the slow operation log of @dev, oldest
+ * record first. Does not sleep.
+ *
+ * @dev: The &struct snap_device object pointer.
+ * @recs: Room for %SNAP_SLOW_LOG_SIZE records.
+ * @total: Set to the number of records ever added to the log.
+ *
+ * Return: The number of records copied to @recs.
+ */
+unsigned long snap_slow_log_copy(struct snap_device *dev,
+                                 struct snap_slow_rec *recs,
+                                 unsigned long *total)
+{
+        unsigned long i, first, nr = 0;
+        unsigned long flags;
+        struct snap_slow_log *log = ACCESS_ONCE(dev->sd_slow_log);
+
+        *total = 0;
+        if (!log)
+                return 0;
+
+        spin_lock_irqsave(&log->lock, flags);
+        *total = log->total;
+        nr = min_t(unsigned long, log->total, SNAP_SLOW_LOG_SIZE);
+        first = log->total - nr;
+        for (i = 0; i < nr; i++)
+                recs[i] = log->recs[(first + i) % SNAP_SLOW_LOG_SIZE];
+        spin_unlock_irqrestore(&log->lock, flags);
+
+        return nr;
+}
+
+/**
+ * snap_slow_log_seq_show() - Prints records copied by snap_slow_log_copy(),
+ * one line each.
+ *
+ * @m: The &struct seq_file to print to.
+ * @recs: The records.
+ * @nr: The number of records.
+ */
+void snap_slow_log_seq_show(struct seq_file *m,
+                            const struct snap_slow_rec *recs,
+                            unsigned long nr)
+{
+        unsigned long i;
+        u64 secs, duration_us;
+        unsigned long nsecs;
+        const struct snap_slow_rec *rec;
+
+        for (i = 0; i < nr; i++) {
+                rec = &recs[i];
+                secs = rec->wall_ns;
+                nsecs = do_div(secs, 1000000000);
+                duration_us = rec->duration_ns;
+                do_div(duration_us, 1000);
+
+                seq_printf(m,
+                           "%llu.%06lu %s duration_us=%llu start=%llu "
+                           "len=%llu ret=%d cow_queue=%lu orig_queue=%lu "
+                           "clones_inflight=%ld\n",
+                           (unsigned long long)secs, nsecs / 1000,
+                           (rec->op < SNAP_SLOW_NR) ?
+                                   snap_slow_op_names[rec->op] :
+                                   "unknown",
+                           (unsigned long long)duration_us,
+                           (unsigned long long)rec->start,
+                           (unsigned long long)rec->len, rec->ret,
+                           rec->cow_queue, rec->orig_queue,
+                           rec->clones_inflight);
+        }
+}
@@ -0,0 +1,294 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Copyright (C) 2026 Datto Inc.
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include "dattobd.h"
+#include "includes.h"
+#include "module_control.h"
+#include <linux/percpu.h>
+#ifdef HAVE_SCHED_CLOCK
+#include <linux/sched/clock.h>
+#endif
+
+#ifndef __percpu
+#define __percpu
+#endif
+
+struct dattobd_stats;
+struct seq_file;
+struct snap_device;
+
+// event counters kept per cpu for each snapshot device
+enum snap_stat {
+        SNAP_STAT_WRITES_TRACED, // write bios seen by the tracing function
+        SNAP_STAT_WRITE_BYTES_TRACED,
+        SNAP_STAT_WRITES_PASSED, // write bios that did not need a copy
+        SNAP_STAT_WRITE_BYTES_PASSED,
+        SNAP_STAT_CLONES_SUBMITTED, // read clones issued
+        SNAP_STAT_CLONE_BYTES,
+        SNAP_STAT_CLONES_COMPLETED,
+        SNAP_STAT_SSETS_QUEUED, // sector sets queued in incremental mode
+        SNAP_STAT_COW_BLOCKS_WRITTEN, // blocks preserved in the cow file
+        SNAP_STAT_COW_BLOCKS_PRESENT, // blocks found already preserved
+        SNAP_STAT_COW_BYTES_WRITTEN, // all cow file writes, data and index
+        SNAP_STAT_COW_BYTES_READ, // all cow file reads, data and index
+        SNAP_STAT_SNAP_READS, // reads of the snapshot device
+        SNAP_STAT_SNAP_READ_BYTES,
+        SNAP_STAT_CACHE_HITS, // section lookups served from memory
+        SNAP_STAT_CACHE_MISSES, // sections loaded from the cow file
+        SNAP_STAT_CACHE_ALLOCS, // sections created empty
+        SNAP_STAT_CACHE_EVICTIONS, // sections dropped from memory
+        SNAP_STAT_SECTION_WRITES, // sections written to the cow file
+        SNAP_STAT_CPU_SUBMIT_NS, // tracing writes in the submit path
+        SNAP_STAT_CPU_COMPLETION_NS, // completing read clones
+        SNAP_STAT_CPU_COW_THREAD_NS, // cpu time of the kernel threads
+        SNAP_STAT_CPU_SSET_THREAD_NS,
+        SNAP_STAT_CPU_MRF_THREAD_NS,
+        SNAP_STAT_CPU_MAPPING_NS, // cpu time of the cow or sset thread by
+        SNAP_STAT_CPU_COPY_NS, // phase, see snap_cpu_phase_end()
+        SNAP_STAT_CPU_EVICT_NS,
+        SNAP_STAT_IO_WAIT_NS, // cow or sset thread blocked on io
+        SNAP_STAT_COW_MAP_DEFERRED, // expansions that left the cow file
+                                    // range map to be rebuilt later
+        SNAP_STAT_NR,
+};
+
+// latency histograms kept per cpu for each snapshot device
+enum snap_hist {
+        SNAP_HIST_WRITE_DELAY, // intercepted write until released
+        SNAP_HIST_CLONE_READ, // read clone round trip
+        SNAP_HIST_COW_WRITE, // data block write to the cow file
+        SNAP_HIST_SECTION_LOAD, // index section read
+        SNAP_HIST_SECTION_FLUSH, // index section write
+        SNAP_HIST_SNAP_READ, // snapshot read service
+        SNAP_HIST_NR,
+};
+
+struct snap_hist_data {
+        u64 count;
+        u64 sum_ns;
+        u64 buckets[DATTOBD_HIST_BUCKETS];
+};
+
+struct snap_stats {
+        u64 cnt[SNAP_STAT_NR];
+        struct snap_hist_data hist[SNAP_HIST_NR];
+};
+
+// operations kept in the slow operation log when they exceed the threshold
+enum snap_slow_op {
+        SNAP_SLOW_CLONE_READ, // read clone round trip, range in sectors
+        SNAP_SLOW_COW_WRITE, // cow data write, range in cow file blocks
+        SNAP_SLOW_COW_WRITE_EXPAND, // same, but the cow file had to grow
+        SNAP_SLOW_SECTION_LOAD, // index section read, range in blocks
+        SNAP_SLOW_FREEZE, // base device frozen until thawed again
+        SNAP_SLOW_THAW, // thawing the base device
+        SNAP_SLOW_COW_SYNC, // flushing the cow manager on teardown
+        SNAP_SLOW_NR,
+};
+
+// number of records kept by the slow operation log of each device
+#define SNAP_SLOW_LOG_SIZE 64
+
+struct snap_slow_rec {
+        u64 wall_ns; // wall clock time the operation finished
+        u64 duration_ns;
+        u64 start; // first sector or block, see &enum snap_slow_op
+        u64 len;
+        unsigned long cow_queue; // bios waiting for the cow thread
+        unsigned long orig_queue; // original bios waiting for release
+        long clones_inflight; // read clones not completed yet
+        int op; // &enum snap_slow_op
+        int ret;
+};
+
+struct snap_slow_log {
+        spinlock_t lock;
+        unsigned long total; // records ever added, the next one goes to
+                             // recs[total % SNAP_SLOW_LOG_SIZE]
+        struct snap_slow_rec recs[SNAP_SLOW_LOG_SIZE];
+};
+
+// a phase of the cow thread timed by snap_cpu_phase_begin()
+struct snap_cpu_phase {
+        u64 cpu_ns; // cpu clock when the phase began
+        u64 nested_ns; // cpu time of finished phases when the phase began
+        u64 io_wait_ns; // io wait of the thread when the phase began
+        int active; // the phase is being accounted
+};
+
+// an io wait of the cow thread timed by snap_cpu_io_begin()
+struct snap_cpu_io {
+        u64 cpu_ns; // cpu clock when the io began, zero if not accounted
+};
+
+int snap_stats_alloc(struct snap_device *dev);
+
+void snap_stats_free(struct snap_device *dev);
+
+void snap_stats_share(struct snap_device *src, struct snap_device *dest);
+
+void snap_stats_disown(struct snap_device *dev);
+
+void snap_stats_fill(struct snap_device *dev, struct dattobd_stats *stats);
+
+void snap_stats_reset_hist(struct snap_device *dev);
+
+void snap_stats_seq_show(struct seq_file *m, struct snap_device *dev,
+                         struct dattobd_stats *stats, const char *indent);
+
+int snap_stats_format(const struct dattobd_stats *stats, char *buf, size_t len);
+
+int snap_stats_format_hist(const struct dattobd_stats *stats, char *buf,
+                           size_t len);
+
+void snap_cpu_phase_begin(struct snap_device *dev, struct snap_cpu_phase *ph);
+
+void snap_cpu_phase_end(struct snap_device *dev, enum snap_stat stat,
+                        struct snap_cpu_phase *ph);
+
+void snap_cpu_thread_end(struct snap_device *dev, enum snap_stat stat,
+                         struct snap_cpu_phase *ph);
+
+void snap_cpu_io_begin(struct snap_device *dev, struct snap_cpu_io *io);
+
+void snap_cpu_io_end(struct snap_device *dev, struct snap_cpu_io *io);
+
+void __snap_slow_op_record(struct snap_device *dev, enum snap_slow_op op,
+                           u64 duration_ns, u64 start, u64 len, int ret);
+
+unsigned long snap_slow_log_copy(struct snap_device *dev,
+                                 struct snap_slow_rec *recs,
+                                 unsigned long *total);
+
+void snap_slow_log_seq_show(struct seq_file *m,
+                            const struct snap_slow_rec *recs,
+                            unsigned long nr);
+
+/**
+ * __snap_stats_add() - Adds @val to the counter @stat of the calling cpu.
+ * Safe to call from any context.
+ *
+ * @sd_stats: The per cpu counters of a &struct snap_device, may be NULL.
+ * @stat: One of the &enum snap_stat counters.
+ * @val: The amount to add.
+ */
+static inline void __snap_stats_add(struct snap_stats __percpu *sd_stats,
+                                    enum snap_stat stat, u64 val)
+{
+#ifndef HAVE_THIS_CPU_ADD
+        unsigned long flags;
+#endif
+
+        if (unlikely(!sd_stats))
+                return;
+
+#ifdef HAVE_THIS_CPU_ADD
+        this_cpu_add(sd_stats->cnt[stat], val);
+#else
+        local_irq_save(flags);
+        per_cpu_ptr(sd_stats, smp_processor_id())->cnt[stat] += val;
+        local_irq_restore(flags);
+#endif
+}
+
+#define snap_stats_add(dev, stat, val)                                         \
+        do {                                                                   \
+                if (dev)                                                       \
+                        __snap_stats_add((dev)->sd_stats, stat, val);          \
+        } while (0)
+
+#define snap_stats_inc(dev, stat) snap_stats_add(dev, stat, 1)
+
+// timestamp for snap_stats_record(), in nanoseconds
+static inline u64 snap_stats_now(void)
+{
+        return ktime_to_ns(ktime_get());
+}
+
+/**
+ * snap_cpu_clock() - Returns a cheap nanosecond clock for timing the work
+ * of the kernel threads.
+ *
+ * The clock keeps running while the caller sleeps, so it only measures cpu
+ * time for sections that do not block. The cow thread subtracts the io waits
+ * it measures in between, see snap_cpu_io_end(). Readings taken on two cpus
+ * may be slightly out of order; callers clamp negative intervals to zero.
+ */
+static inline u64 snap_cpu_clock(void)
+{
+        return local_clock();
+}
+
+// interval between two snap_cpu_clock() readings, zero if out of order
+static inline u64 snap_cpu_delta(u64 from, u64 to)
+{
+        return (to > from) ? to - from : 0;
+}
+
+/**
+ * __snap_stats_record() - Adds the time elapsed since @start_ns to the
+ * histogram @hist of the calling cpu. Safe to call from any context.
+ *
+ * @sd_stats: The per cpu counters of a &struct snap_device, may be NULL.
+ * @hist: One of the &enum snap_hist histograms.
+ * @start_ns: A timestamp taken with snap_stats_now().
+ */
+static inline void __snap_stats_record(struct snap_stats __percpu *sd_stats,
+                                       enum snap_hist hist, u64 start_ns)
+{
+        u64 now = snap_stats_now();
+        u64 ns = (now > start_ns) ? now - start_ns : 0;
+        unsigned int bucket = min_t(unsigned int, fls64(ns),
+                                    DATTOBD_HIST_BUCKETS - 1);
+        struct snap_hist_data *data;
+        unsigned long flags;
+
+        if (unlikely(!sd_stats))
+                return;
+
+        local_irq_save(flags);
+        data = per_cpu_ptr(sd_stats, smp_processor_id())->hist + hist;
+        data->count++;
+        data->sum_ns += ns;
+        data->buckets[bucket]++;
+        local_irq_restore(flags);
+}
+
+#define snap_stats_record(dev, hist, start_ns)                                 \
+        do {                                                                   \
+                if (dev)                                                       \
+                        __snap_stats_record((dev)->sd_stats, hist, start_ns);  \
+        } while (0)
+
+/**
+ * snap_slow_op_check() - Adds an operation to the slow operation log of
+ * @dev if it took longer than the slow_op_threshold_us module parameter.
+ * Safe to call from any context.
+ *
+ * @dev: The &struct snap_device object pointer, may be NULL.
+ * @op: One of the &enum snap_slow_op operations.
+ * @start_ns: A timestamp taken with snap_stats_now() when @op started.
+ * @start: The first sector or block @op worked on.
+ * @len: The number of sectors or blocks.
+ * @ret: The result of @op.
+ */
+static inline void snap_slow_op_check(struct snap_device *dev,
+                                      enum snap_slow_op op, u64 start_ns,
+                                      u64 start, u64 len, int ret)
+{
+        u64 thresh_ns = (u64)ACCESS_ONCE(dattobd_slow_op_threshold_us) * 1000;
+        u64 now = snap_stats_now();
+
+        if (!dev || !thresh_ns || now < start_ns + thresh_ns)
+                return;
+
+        __snap_slow_op_record(dev, op, now - start_ns, start, len, ret);
+}
+
+#endif /* STATS_H_ */
@@ -9,7 +9,9 @@
 #include "bio_request_callback.h"
 #include "blkdev.h"
 #include "callback_refs.h"
+#include "cow_extents.h"
 #include "cow_manager.h"
+#include "dattobd_trace.h"
 #include "filesystem.h"
 #include "hints.h"
 #include "logging.h"
@@ -17,7 +19,10 @@
 #include "module_threads.h"
 #include "mrf.h"
 #include "snap_device.h"
+#include "snap_events.h"
 #include "snap_ops.h"
+#include "snap_sysfs.h"
+#include "stats.h"
 #include "submit_bio.h"
 #include "task_helper.h"
 #include "tracer_helper.h"
@@ -90,6 +95,13 @@ static inline BIO_REQUEST_CALLBACK_FN *dattobd_get_bd_fn(
 #define SECTORS_PER_PAGE (PAGE_SIZE / SECTOR_SIZE)
 #define BLOCK_TO_SECTOR(block) ((block)*SECTORS_PER_BLOCK)
 
+// reports a change of dev->sd_state to tracing and event subscribers
+static void __tracer_state_changed(struct snap_device *dev)
+{
+        trace_dattobd_state(dev);
+        snap_events_emit(dev->sd_minor, DATTOBD_EVENT_STATE, dev->sd_state, 0);
+}
+
 void dattobd_free_request_tracking_ptr(struct snap_device *dev)
 {
 #ifdef USE_BDOPS_SUBMIT_BIO
@@ -124,9 +136,14 @@ static int snap_trace_bio(struct snap_device *dev, struct bio *bio)
         sector_t start_sect, end_sect;
         unsigned int bytes, pages;
 
+        snap_stats_inc(dev, SNAP_STAT_WRITES_TRACED);
+        snap_stats_add(dev, SNAP_STAT_WRITE_BYTES_TRACED, bio_size(bio));
+
         // if we don't need to cow this bio just call the real mrf normally
-        if (!bio_needs_cow(bio, dev->sd_cow_inode) || tracer_read_fail_state(dev))
+        if (!bio_needs_cow(dev, bio) || tracer_read_fail_state(dev))
         {
+                snap_stats_inc(dev, SNAP_STAT_WRITES_PASSED);
+                snap_stats_add(dev, SNAP_STAT_WRITE_BYTES_PASSED, bio_size(bio));
 #ifdef HAVE_NONVOID_SUBMIT_BIO_1
                 return SUBMIT_BIO_REAL(dev, bio);
 #else
@@ -174,6 +191,9 @@ static int snap_trace_bio(struct snap_device *dev, struct bio *bio)
                         goto error;
 
                 atomic64_inc(&dev->sd_submitted_cnt);
+                snap_stats_inc(dev, SNAP_STAT_CLONES_SUBMITTED);
+                snap_stats_add(dev, SNAP_STAT_CLONE_BYTES, bytes);
+                trace_dattobd_clone_submit(dev, bio_sector(new_bio), bytes);
                 smp_wmb();
 
 #ifdef USE_BDOPS_SUBMIT_BIO
@@ -246,6 +266,7 @@ static int inc_make_sset(struct snap_device *dev, sector_t sect,
 
         // queue sset for processing by kernel thread
         sset_queue_add(&dev->sd_pending_ssets, sset);
+        snap_stats_inc(dev, SNAP_STAT_SSETS_QUEUED);
 
         return 0;
 }
@@ -272,6 +293,9 @@ static int inc_trace_bio(struct snap_device *dev, struct bio *bio)
         bio_iter_t iter;
         bio_iter_bvec_t bvec;
 
+        snap_stats_inc(dev, SNAP_STAT_WRITES_TRACED);
+        snap_stats_add(dev, SNAP_STAT_WRITE_BYTES_TRACED, bio_size(bio));
+
 #ifdef HAVE_ENUM_REQ_OPF
         //#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
         if (bio_op(bio) == REQ_OP_WRITE_ZEROES) {
@@ -280,6 +304,20 @@ static int inc_trace_bio(struct snap_device *dev, struct bio *bio)
                 goto out;
         }
 #endif
+
+        // a bio outside of the cow file is recorded as a single range
+        if (!cow_phys_map_may_overlap(dev, bio_sector(bio) - dev->sd_sect_off,
+                                      bio_size(bio) / SECTOR_SIZE)) {
+                ret = inc_make_sset(dev, bio_sector(bio),
+                                    bio_size(bio) / SECTOR_SIZE);
+                goto out;
+        }
+
+        // direct I/O to the cow file carries no page cache pages to check
+        if (cow_phys_map_contains(dev, bio_sector(bio) - dev->sd_sect_off,
+                                  bio_size(bio) / SECTOR_SIZE))
+                goto out;
+
         bio_for_each_segment (bvec, bio, iter) {
                 if (page_get_inode(bio_iter_page(bio, iter)) !=
                     dev->sd_cow_inode) {
@@ -424,6 +462,10 @@ static void __tracer_init(struct snap_device *dev)
         bio_queue_init(&dev->sd_cow_bios);
         bio_queue_init(&dev->sd_orig_bios);
         sset_queue_init(&dev->sd_pending_ssets);
+        mutex_init(&dev->sd_cow_ext_lock);
+        init_rwsem(&dev->sd_cow_dio_sem);
+        mutex_init(&dev->sd_cow_lock);
+        dev->sd_cow_io_mode = COW_IO_BUFFERED;
 }
 
 /**
@@ -452,6 +494,10 @@ int tracer_alloc(struct snap_device **dev_ptr)
 
         __tracer_init(dev);
 
+        ret = snap_stats_alloc(dev);
+        if (ret)
+                goto error;
+
         *dev_ptr = dev;
         return 0;
 
@@ -464,6 +510,41 @@ error:
         return ret;
 }
 
+/**
+ * tracer_free() - Frees a &struct snap_device allocated by tracer_alloc()
+ * once it has been torn down.
+ *
+ * @dev: The &struct snap_device object pointer.
+ *
+ * The /proc and sysfs readers walk the device array under rcu_read_lock()
+ * instead of the ioctl mutex, so @dev must already be unpublished and is
+ * only freed after a grace period.
+ */
+void tracer_free(struct snap_device *dev)
+{
+        if (!dev)
+                return;
+
+        synchronize_rcu();
+        snap_stats_free(dev);
+        kfree(dev);
+}
+
+/**
+ * __tracer_free_path() - Frees a path string of a &struct snap_device that
+ * lock-free readers may still be printing.
+ *
+ * @path: The path, may be NULL.
+ */
+static void __tracer_free_path(char *path)
+{
+        if (!path)
+                return;
+
+        synchronize_rcu();
+        kfree(path);
+}
+
 /**
  * __tracer_destroy_cow() - Tears down COW tracking state, deallocating the
  * &struct cow_manager object in the process.
@@ -483,6 +564,7 @@ error:
 static int __tracer_destroy_cow(struct snap_device *dev, int close_method)
 {
         int ret = 0;
+        u64 start_ns = snap_stats_now();
 
         dev->sd_cow_inode = NULL;
         dev->sd_falloc_size = 0;
@@ -497,17 +579,22 @@ static int __tracer_destroy_cow(struct snap_device *dev, int close_method)
                 } else if (close_method == 1) {
                         ret = cow_sync_and_free(dev->sd_cow);
                         dev->sd_cow = NULL;
+                        snap_slow_op_check(dev, SNAP_SLOW_COW_SYNC, start_ns,
+                                           0, 0, ret);
                 } else if (close_method == 2) {
                         ret = cow_sync_and_close(dev->sd_cow);
                         task_work_flush();
+                        snap_slow_op_check(dev, SNAP_SLOW_COW_SYNC, start_ns,
+                                           0, 0, ret);
                 }
         }
 
+        if (close_method != 2)
+                cow_phys_map_clear(dev);
+
         if (close_method != 2 && dev->sd_cow_extents) {
 		LOG_DEBUG("destroying cow file extents");
-		kfree(dev->sd_cow_extents);
-		dev->sd_cow_extents = NULL;
-		dev->sd_cow_ext_cnt = 0;
+		cow_extents_free(dev);
 		dev->sd_cow_inode = NULL;
 	} else {
 		LOG_DEBUG("preserving cow file extents");
@@ -519,6 +606,26 @@ static int __tracer_destroy_cow(struct snap_device *dev, int close_method)
         return ret;
 }
 
+/**
+ * __tracer_setup_cow_extents() - Maps the extents of the open COW file and
+ * builds the physical range map used to filter traced bios.
+ *
+ * @dev: The &struct snap_device that keeps snapshot device state.
+ *
+ * Failure is not fatal, the tracing function falls back to inspecting the
+ * pages of every bio.
+ */
+static void __tracer_setup_cow_extents(struct snap_device *dev)
+{
+        int ret;
+
+        ret = cow_get_file_extents(dev, dev->sd_cow->dfilp->filp);
+        if (ret)
+                LOG_DEBUG("cow file physical range map unavailable (%d)", ret);
+        else
+                dev->sd_cow_ext_stale = 0;
+}
+
 /**
  * __tracer_setup_cow() - Sets up the COW tracking structures.
  *
@@ -603,6 +710,7 @@ static int __tracer_setup_cow(struct snap_device *dev,
                         if (ret)
                                 goto error;
 
+                        dev->sd_cow->dev = dev;
                         dev->sd_falloc_size = dev->sd_cow->file_size;
                         do_div(dev->sd_falloc_size, (1024 * 1024));
                 }
@@ -623,6 +731,12 @@ static int __tracer_setup_cow(struct snap_device *dev,
         LOG_DEBUG("finding cow file inode");
         dev->sd_cow_inode = dev->sd_cow->dfilp->inode;
 
+        ret = file_set_io_mode(dev->sd_cow->dfilp, dev->sd_cow_io_mode);
+        if (ret)
+                goto error;
+
+        __tracer_setup_cow_extents(dev);
+
         return 0;
 
 error:
@@ -643,9 +757,11 @@ static void __tracer_destroy_base_dev(struct snap_device *dev)
         dev->sd_sect_off = 0;
 
         if (dev->sd_bdev_path) {
+                char *path = dev->sd_bdev_path;
+
                 LOG_DEBUG("freeing base block device path");
-                kfree(dev->sd_bdev_path);
                 dev->sd_bdev_path = NULL;
+                __tracer_free_path(path);
         }
 
         if (dev->sd_base_dev) {
@@ -803,11 +919,15 @@ static void __tracer_copy_cow(const struct snap_device *src,
         // copy cow file extents and update the device
         dest->sd_cow_extents = src->sd_cow_extents;
         dest->sd_cow_ext_cnt = src->sd_cow_ext_cnt;
+        dest->sd_cow_ext_cap = src->sd_cow_ext_cap;
+        dest->sd_cow_ext_flags = src->sd_cow_ext_flags;
+        dest->sd_cow_phys_map = src->sd_cow_phys_map;
         dest->sd_cow_inode = src->sd_cow_inode;
         dest->sd_cow->dev = dest;
 
         dest->sd_cache_size = src->sd_cache_size;
         dest->sd_falloc_size = src->sd_falloc_size;
+        dest->sd_cow_io_mode = src->sd_cow_io_mode;
 }
 
 /**
@@ -818,9 +938,11 @@ static void __tracer_copy_cow(const struct snap_device *src,
 static void __tracer_destroy_cow_path(struct snap_device *dev)
 {
         if (dev->sd_cow_path) {
+                char *path = dev->sd_cow_path;
+
                 LOG_DEBUG("freeing cow path");
-                kfree(dev->sd_cow_path);
                 dev->sd_cow_path = NULL;
+                __tracer_free_path(path);
         }
 }
 
@@ -904,6 +1026,8 @@ static void __tracer_destroy_snap(struct snap_device *dev)
         }
 
         if (dev->sd_gd) {
+                snap_sysfs_remove(dev);
+
                 LOG_DEBUG("freeing gendisk");
 #ifdef GENHD_FL_UP
                 if (dev->sd_gd->flags & GENHD_FL_UP)
@@ -1101,6 +1225,9 @@ static int __tracer_setup_snap(struct snap_device *dev, unsigned int minor,
 #else 
         add_disk(dev->sd_gd);
 #endif
+
+        // the attributes only help monitoring, the snapshot works without
+        snap_sysfs_add(dev);
         return 0;
 
 error:
@@ -1310,11 +1437,16 @@ static int __tracer_transition_tracing(
         int ret;
         struct super_block* sb = NULL;
         bool freezed;
+        u64 freeze_ns = snap_stats_now();
+        u64 thaw_ns;
         MAYBE_UNUSED(ret);
 
         // we do not allow freeze to fail during starting tracing
         // we allow freeze to fail in case of finishing tracing and device is in fail condition
         ret = __try_freeze_bdev(bdev, &sb);
+        trace_dattobd_freeze(dev, start_tracing, ret);
+        if (ret)
+                snap_slow_op_check(dev, SNAP_SLOW_FREEZE, freeze_ns, 0, 0, ret);
         if(ret != 0 && start_tracing){
                 return ret;
         }
@@ -1369,7 +1501,11 @@ static int __tracer_transition_tracing(
                 smp_wmb();
         }
         if(freezed){
+                thaw_ns = snap_stats_now();
                 ret = __try_thaw_bdev(bdev, sb);
+                trace_dattobd_thaw(dev, start_tracing, ret);
+                snap_slow_op_check(dev, SNAP_SLOW_THAW, thaw_ns, 0, 0, ret);
+                snap_slow_op_check(dev, SNAP_SLOW_FREEZE, freeze_ns, 0, 0, 0);
                 // thaws failures are ignored as we can't undo what we have already done
         }
         return 0;
@@ -1398,6 +1534,7 @@ static MRF_RETURN_TYPE tracing_fn(struct request_queue *q, struct bio *bio)
         struct snap_device *dev = NULL;
         make_request_fn* orig_fn = NULL;
         snap_device_array snap_devices = get_snap_device_array_nolock();
+        u64 start_ns;
         MAYBE_UNUSED(ret);
 
         smp_rmb();
@@ -1409,18 +1546,27 @@ static MRF_RETURN_TYPE tracing_fn(struct request_queue *q, struct bio *bio)
                 orig_fn=dev->sd_orig_request_fn;
                 if (dattobd_bio_op_flagged(bio, DATTOBD_PASSTHROUGH))
                 {
+                        trace_dattobd_bio_intercept(
+                                dev, bio, DATTOBD_TRACE_BIO_PASSTHROUGH);
                         dattobd_bio_op_clear_flag(bio, DATTOBD_PASSTHROUGH);
                 }
                 else
                 {
                         if (tracer_should_trace_bio(dev, bio))
                         {
+                                trace_dattobd_bio_intercept(
+                                        dev, bio, DATTOBD_TRACE_BIO_TRACED);
+                                start_ns = snap_stats_now();
                                 if (test_bit(SNAPSHOT, &dev->sd_state))
                                         ret = snap_trace_bio(dev, bio);
                                 else
                                         ret = inc_trace_bio(dev, bio);
+                                snap_stats_add(dev, SNAP_STAT_CPU_SUBMIT_NS,
+                                               snap_stats_now() - start_ns);
                                 goto out;
                         }
+                        trace_dattobd_bio_intercept(dev, bio,
+                                                    DATTOBD_TRACE_BIO_SKIPPED);
                 } 
         } // tracer_for_each(dev, i)
 
@@ -1815,6 +1961,7 @@ int __tracer_setup_unverified(struct snap_device *dev, unsigned int minor,
                 clear_bit(SNAPSHOT, &dev->sd_state);
         clear_bit(ACTIVE, &dev->sd_state);
         set_bit(UNVERIFIED, &dev->sd_state);
+        __tracer_state_changed(dev);
 
         dev->sd_cache_size = cache_size;
 
@@ -1886,6 +2033,7 @@ int tracer_setup_active_snap(struct snap_device *dev, unsigned int minor,
         set_bit(SNAPSHOT, &dev->sd_state);
         set_bit(ACTIVE, &dev->sd_state);
         clear_bit(UNVERIFIED, &dev->sd_state);
+        __tracer_state_changed(dev);
 
         // setup base device
         ret = __tracer_setup_base_dev(dev, bdev_path, snap_devices);
@@ -1963,6 +2111,7 @@ int tracer_active_snap_to_inc(struct snap_device *old_dev, snap_device_array_mut
         clear_bit(SNAPSHOT, &dev->sd_state);
         set_bit(ACTIVE, &dev->sd_state);
         clear_bit(UNVERIFIED, &dev->sd_state);
+        __tracer_state_changed(dev);
 
         // copy / set fields we need
         __tracer_copy_base_dev(old_dev, dev);
@@ -1971,6 +2120,7 @@ int tracer_active_snap_to_inc(struct snap_device *old_dev, snap_device_array_mut
         // copy cow manager to new device. Care must be taken to make sure it
         // isn't used by multiple threads at once.
         __tracer_copy_cow(old_dev, dev);
+        snap_stats_share(old_dev, dev);
 
         // setup the cow thread
         ret = __tracer_setup_inc_cow_thread(dev, old_dev->sd_minor);
@@ -2010,7 +2160,8 @@ int tracer_active_snap_to_inc(struct snap_device *old_dev, snap_device_array_mut
 
                 // clean up the old device no matter what
                 __tracer_destroy_snap(old_dev);
-                kfree(old_dev);
+                snap_stats_disown(old_dev);
+                tracer_free(old_dev);
 
                 return ret;
         }
@@ -2040,14 +2191,16 @@ int tracer_active_snap_to_inc(struct snap_device *old_dev, snap_device_array_mut
 
         // destroy the unneeded fields of the old_dev and the old_dev itself
         __tracer_destroy_snap(old_dev);
-        kfree(old_dev);
+        snap_stats_disown(old_dev);
+        tracer_free(old_dev);
 
         return 0;
 
 error:
         LOG_ERROR(ret, "error transitioning to incremental mode");
         __tracer_destroy_cow_thread(dev);
-        kfree(dev);
+        snap_stats_disown(dev);
+        tracer_free(dev);
 
         return ret;
 }
@@ -2081,12 +2234,15 @@ int tracer_active_inc_to_snap(struct snap_device *old_dev, const char *cow_path,
         set_bit(SNAPSHOT, &dev->sd_state);
         set_bit(ACTIVE, &dev->sd_state);
         clear_bit(UNVERIFIED, &dev->sd_state);
+        __tracer_state_changed(dev);
 
         fallocated_space =
                 (fallocated_space) ? fallocated_space : old_dev->sd_falloc_size;
 
         // copy / set fields we need
         __tracer_copy_base_dev(old_dev, dev);
+        dev->sd_cow_io_mode = old_dev->sd_cow_io_mode;
+        snap_stats_share(old_dev, dev);
 
         // setup the cow manager
         ret = __tracer_setup_cow_new(dev, dev->sd_base_dev->bdev, cow_path,
@@ -2125,7 +2281,8 @@ int tracer_active_inc_to_snap(struct snap_device *old_dev, const char *cow_path,
         // destroy the unneeded fields of the old_dev and the old_dev itself
         __tracer_destroy_cow_path(old_dev);
         __tracer_destroy_cow_sync_and_free(old_dev);
-        kfree(old_dev);
+        snap_stats_disown(old_dev);
+        tracer_free(old_dev);
 
         return 0;
 
@@ -2135,7 +2292,8 @@ error:
         __tracer_destroy_snap(dev);
         __tracer_destroy_cow_path(dev);
         __tracer_destroy_cow_free(dev);
-        kfree(dev);
+        snap_stats_disown(dev);
+        tracer_free(dev);
 
         return ret;
 }
@@ -2155,6 +2313,65 @@ void tracer_reconfigure(struct snap_device *dev, unsigned long cache_size)
                 cow_modify_cache_size(dev->sd_cow, cache_size);
 }
 
+/**
+ * tracer_reconfigure_cow_io() - Changes how the cow file of @dev is accessed
+ * through the filesystem, see COW_IO_*.
+ *
+ * @dev: The &struct snap_device object pointer.
+ * @mode: One of COW_IO_*.
+ *
+ * An active device switches right away, between two operations of the cow
+ * thread. Otherwise the mode is used once the cow file is opened. It is kept
+ * across transitions.
+ *
+ * Return:
+ * * 0 - success
+ * * !0 - errno indicating the error
+ */
+int tracer_reconfigure_cow_io(struct snap_device *dev, int mode)
+{
+        int ret = 0;
+
+        dev->sd_cow_io_mode = mode;
+        if (!test_bit(ACTIVE, &dev->sd_state) ||
+            test_bit(UNVERIFIED, &dev->sd_state) || !dev->sd_cow)
+                return 0;
+
+        // the cow thread closes the file if the device fails meanwhile
+        mutex_lock(&dev->sd_cow_lock);
+        if (dev->sd_cow->dfilp)
+                ret = file_set_io_mode(dev->sd_cow->dfilp, mode);
+        mutex_unlock(&dev->sd_cow_lock);
+
+        return ret;
+}
+
+/**
+ * tracer_refresh_cow_extents() - Rebuilds the physical range map of the cow
+ * file of @dev if an automatic expansion had to drop it.
+ *
+ * @dev: The &struct snap_device object pointer.
+ *
+ * The cow thread expands the cow file without an address space to map its
+ * extents, so the map is rebuilt here, from the first info or stats call
+ * issued by a process. Until then the tracing function inspects the pages of
+ * every bio and direct cow file writes go through the page cache.
+ */
+void tracer_refresh_cow_extents(struct snap_device *dev)
+{
+        if (!ACCESS_ONCE(dev->sd_cow_ext_stale) || !current->mm)
+                return;
+
+        mutex_lock(&dev->sd_cow_lock);
+        if (dev->sd_cow_ext_stale && test_bit(ACTIVE, &dev->sd_state) &&
+            !test_bit(UNVERIFIED, &dev->sd_state) &&
+            !tracer_read_fail_state(dev) && dev->sd_cow &&
+            dev->sd_cow->dfilp &&
+            !cow_get_file_extents(dev, dev->sd_cow->dfilp->filp))
+                dev->sd_cow_ext_stale = 0;
+        mutex_unlock(&dev->sd_cow_lock);
+}
+
 /**
  * tracer_dattobd_info() - Copies relevant, current information in @dev to
  *                         @info.
@@ -2194,6 +2411,33 @@ void tracer_dattobd_info(const struct snap_device *dev,
         }
 }
 
+/**
+ * tracer_dattobd_info_rec() - Stores the scalar state of @dev in @rec. The
+ * path offsets are left to the caller.
+ *
+ * @dev: The &struct snap_device object pointer.
+ * @rec: The &struct dattobd_info_rec to fill in.
+ */
+void tracer_dattobd_info_rec(const struct snap_device *dev,
+                             struct dattobd_info_rec *rec)
+{
+        memset(rec, 0, sizeof(struct dattobd_info_rec));
+        rec->minor = dev->sd_minor;
+        rec->state = dev->sd_state;
+        rec->error = tracer_read_fail_state(dev);
+        rec->cache_size = (dev->sd_cache_size) ?
+                                  dev->sd_cache_size :
+                                  dattobd_cow_max_memory_default;
+
+        if (!test_bit(UNVERIFIED, &dev->sd_state) && dev->sd_cow) {
+                rec->falloc_size = dev->sd_cow->file_size;
+                rec->seqid = dev->sd_cow->seqid;
+                memcpy(rec->uuid, dev->sd_cow->uuid, COW_UUID_SIZE);
+                rec->version = dev->sd_cow->version;
+                rec->nr_changed_blocks = dev->sd_cow->nr_changed_blocks;
+        }
+}
+
 /************************AUTOMATIC TRANSITION FUNCTIONS************************/
 
 /**
@@ -2219,6 +2463,7 @@ void __tracer_active_to_dormant(struct snap_device *dev)
         // mark as dormant
         smp_wmb();
         clear_bit(ACTIVE, &dev->sd_state);
+        __tracer_state_changed(dev);
 
         return;
 
@@ -2252,6 +2497,7 @@ void __tracer_unverified_snap_to_active(struct snap_device *dev,
         // mark as active
         set_bit(ACTIVE, &dev->sd_state);
         clear_bit(UNVERIFIED, &dev->sd_state);
+        __tracer_state_changed(dev);
 
         dev->sd_bdev_path = NULL;
         dev->sd_cow_path = NULL;
@@ -2305,6 +2551,8 @@ void __tracer_unverified_snap_to_active(struct snap_device *dev,
         if (ret)
                 goto error;
 
+        // the old paths may still be visible to lock-free readers
+        synchronize_rcu();
         kfree(bdev_path);
         kfree(rel_path);
         kfree(cow_path);
@@ -2317,6 +2565,8 @@ error:
         tracer_setup_unverified_snap(dev, minor, bdev_path, rel_path,
                                      cache_size, snap_devices);
         tracer_set_fail_state(dev, ret);
+        // the old paths may still be visible to lock-free readers
+        synchronize_rcu();
         kfree(bdev_path);
         kfree(rel_path);
         if (cow_path)
@@ -2349,6 +2599,7 @@ void __tracer_unverified_inc_to_active(struct snap_device *dev,
         // mark as active
         set_bit(ACTIVE, &dev->sd_state);
         clear_bit(UNVERIFIED, &dev->sd_state);
+        __tracer_state_changed(dev);
 
         dev->sd_bdev_path = NULL;
         dev->sd_cow_path = NULL;
@@ -2397,6 +2648,8 @@ void __tracer_unverified_inc_to_active(struct snap_device *dev,
         if (ret)
                 goto error;
 
+        // the old paths may still be visible to lock-free readers
+        synchronize_rcu();
         kfree(bdev_path);
         kfree(rel_path);
         kfree(cow_path);
@@ -2409,6 +2662,8 @@ error:
         tracer_setup_unverified_inc(dev, minor, bdev_path, rel_path,
                                     cache_size, snap_devices);
         tracer_set_fail_state(dev, ret);
+        // the old paths may still be visible to lock-free readers
+        synchronize_rcu();
         kfree(bdev_path);
         kfree(rel_path);
         if (cow_path)
@@ -2461,6 +2716,7 @@ void __tracer_dormant_to_active(struct snap_device *dev,
         smp_wmb();
         set_bit(ACTIVE, &dev->sd_state);
         clear_bit(UNVERIFIED, &dev->sd_state);
+        __tracer_state_changed(dev);
 
         kfree(cow_path);
 
@@ -29,6 +29,7 @@ struct bio;
 
 /************************SETUP / DESTROY FUNCTIONS************************/
 int tracer_alloc(struct snap_device **dev_ptr);
+void tracer_free(struct snap_device *dev);
 void tracer_destroy(struct snap_device *dev, snap_device_array_mut snap_devices);
 
 int tracer_setup_active_snap(struct snap_device *dev, unsigned int minor,
@@ -50,9 +51,16 @@ int tracer_active_inc_to_snap(struct snap_device *old_dev, const char *cow_path,
 
 void tracer_reconfigure(struct snap_device *dev, unsigned long cache_size);
 
+int tracer_reconfigure_cow_io(struct snap_device *dev, int mode);
+
+void tracer_refresh_cow_extents(struct snap_device *dev);
+
 void tracer_dattobd_info(const struct snap_device *dev,
                          struct dattobd_info *info);
 
+void tracer_dattobd_info_rec(const struct snap_device *dev,
+                             struct dattobd_info_rec *rec);
+
 int tracer_expand_cow_file_no_check(struct snap_device *dev, uint64_t size);
 
 /************************AUTOMATIC TRANSITION FUNCTIONS************************/
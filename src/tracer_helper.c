@@ -7,8 +7,10 @@
 #include "tracer_helper.h"
 
 #include "bio_helper.h"
+#include "dattobd_trace.h"
 #include "includes.h"
 #include "snap_device.h"
+#include "snap_events.h"
 #include "logging.h"
 #include "blkdev.h"
 
@@ -23,7 +25,10 @@ int tracer_read_fail_state(const struct snap_device *dev)
 void tracer_set_fail_state(struct snap_device *dev, int error)
 {
         smp_mb();
-        (void)atomic_cmpxchg(&dev->sd_fail_code, 0, error);
+        if (atomic_cmpxchg(&dev->sd_fail_code, 0, error) == 0) {
+                trace_dattobd_fail(dev, error);
+                snap_events_emit(dev->sd_minor, DATTOBD_EVENT_FAIL, 0, error);
+        }
         smp_mb();
 }
 
@@ -10,6 +10,7 @@
 #include "includes.h"
 #include "logging.h"
 #include "snap_device.h"
+#include "stats.h"
 
 /**
  * tp_alloc() - Allocates and initializes tracing params and increments the
@@ -41,6 +42,7 @@ int tp_alloc(struct snap_device *dev, struct bio *bio,
         tp->bio_sects.head = NULL;
         tp->bio_sects.tail = NULL;
         atomic_set(&tp->refs, 1);
+        tp->start_ns = snap_stats_now();
 
         *tp_out = tp;
         return 0;
@@ -70,6 +72,7 @@ void tp_put(struct tracing_params *tp)
 
                 // if there are no references left, its safe to release the
                 // orig_bio
+                snap_stats_record(tp->dev, SNAP_HIST_WRITE_DELAY, tp->start_ns);
                 bio_queue_add(&tp->dev->sd_orig_bios, tp->orig_bio);
 
                 // free nodes in the sector map list
@@ -104,6 +107,7 @@ int tp_add(struct tracing_params *tp, struct bio *bio)
         map->bio = bio;
         map->sect = bio_sector(bio);
         map->size = bio_size(bio);
+        map->submit_ns = snap_stats_now();
         map->next = NULL;
         if (tp->bio_sects.head == NULL) {
                 tp->bio_sects.head = map;
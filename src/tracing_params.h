@@ -22,6 +22,8 @@ struct tracing_params {
         struct snap_device *dev;
         atomic_t refs;
         struct bsector_list bio_sects;
+        u64 start_ns; // when the orig_bio was intercepted
+
 };
 
 int tp_alloc(struct snap_device *dev, struct bio *bio,
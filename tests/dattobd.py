@@ -35,8 +35,95 @@ int dattobd_destroy(unsigned int minor);
 int dattobd_transition_incremental(unsigned int minor);
 int dattobd_transition_snapshot(unsigned int minor, char *cow, unsigned long fallocated_space);
 int dattobd_reconfigure(unsigned int minor, unsigned long cache_size);
+int dattobd_reconfigure_cow_io(unsigned int minor, unsigned int mode);
 int dattobd_info(unsigned int minor, struct dattobd_info *info);
 int dattobd_get_free_minor(void);
+
+#define DATTOBD_CHANGES_BITMAP 1
+
+struct dattobd_extent {
+    uint64_t start;
+    uint64_t len;
+};
+
+struct dattobd_changes_params {
+    uint64_t start;
+    uint64_t count;
+    uint64_t nr_blocks;
+    uint64_t seqid;
+    uint8_t uuid[COW_UUID_SIZE];
+    uint32_t minor;
+    uint32_t flags;
+    uint32_t nr;
+    uint32_t reserved;
+    void *buf;
+};
+
+struct dattobd_changes_header {
+    uint8_t uuid[COW_UUID_SIZE];
+    uint64_t seqid;
+    uint64_t nr_blocks;
+    uint32_t block_size;
+};
+
+typedef int (*dattobd_extent_fn)(const struct dattobd_extent *ext, void *arg);
+
+int dattobd_changes(struct dattobd_changes_params *params);
+int dattobd_live_changes(unsigned int minor, struct dattobd_changes_header *hdr, dattobd_extent_fn fn, void *arg);
+
+#define DATTOBD_BATCH_STOP_ON_ERROR 1
+
+struct setup_params {
+    char *bdev;
+    char *cow;
+    unsigned long fallocated_space;
+    unsigned long cache_size;
+    unsigned int minor;
+};
+
+struct reload_params {
+    char *bdev;
+    char *cow;
+    unsigned long cache_size;
+    unsigned int minor;
+};
+
+struct transition_snap_params {
+    char *cow;
+    unsigned long fallocated_space;
+    unsigned int minor;
+};
+
+struct reconfigure_params {
+    unsigned long cache_size;
+    unsigned int minor;
+};
+
+struct dattobd_op {
+    void *user_data;
+    int result;
+    unsigned int cmd;
+    union {
+        unsigned int minor;
+        struct setup_params setup;
+        struct reload_params reload;
+        struct transition_snap_params transition_snap;
+        struct reconfigure_params reconfigure;
+        struct dattobd_info *info;
+    } params;
+};
+
+struct dattobd_handle;
+
+void dattobd_op_setup_snapshot(struct dattobd_op *op, unsigned int minor, char *bdev, char *cow, unsigned long fallocated_space, unsigned long cache_size);
+void dattobd_op_destroy(struct dattobd_op *op, unsigned int minor);
+void dattobd_op_transition_incremental(struct dattobd_op *op, unsigned int minor);
+void dattobd_op_transition_snapshot(struct dattobd_op *op, unsigned int minor, char *cow, unsigned long fallocated_space);
+void dattobd_op_reconfigure(struct dattobd_op *op, unsigned int minor, unsigned long cache_size);
+void dattobd_op_info(struct dattobd_op *op, unsigned int minor, struct dattobd_info *info);
+struct dattobd_handle *dattobd_open(void);
+void dattobd_close(struct dattobd_handle *h);
+int dattobd_batch(struct dattobd_handle *h, struct dattobd_op *ops, unsigned int nr, unsigned int flags);
 """)
 
 lib = ffi.dlopen("../lib/libdattobd.so")
@@ -129,6 +216,20 @@ def reconfigure(minor, cache_size):
     return 0
 
 
+# COW_IO_* from dattobd.h
+COW_IO_BUFFERED = 0
+COW_IO_DROP_CACHE = 1
+COW_IO_DIRECT = 2
+
+
+def reconfigure_cow_io(minor, mode):
+    ret = lib.dattobd_reconfigure_cow_io(minor, mode)
+    if ret != 0:
+        return ffi.errno
+
+    return 0
+
+
 def info(minor):
     di = ffi.new("struct dattobd_info *")
     ret = lib.dattobd_info(minor, di)
@@ -151,6 +252,121 @@ def info(minor):
         "nr_changed_blocks": di.nr_changed_blocks,
     }
 
+def changes(minor, start, count, nr=4096, bitmap=False):
+    """
+    Run one changes query. Returns the blocks reported, the set of changed
+    blocks among them and, unless bitmap is set, the extents as the kernel
+    module cut them, or None if the query failed.
+    """
+    params = ffi.new("struct dattobd_changes_params *")
+    if bitmap:
+        buf = ffi.new("uint8_t[]", nr)
+        params.flags = lib.DATTOBD_CHANGES_BITMAP
+    else:
+        buf = ffi.new("struct dattobd_extent[]", nr)
+    params.minor = minor
+    params.start = start
+    params.count = count
+    params.nr = nr
+    params.buf = buf
+
+    ret = lib.dattobd_changes(params)
+    if ret != 0:
+        return None
+
+    blocks = set()
+    extents = []
+    if bitmap:
+        for block in range(params.count):
+            if buf[block // 8] & (1 << (block % 8)):
+                blocks.add(params.start + block)
+    else:
+        for i in range(params.nr):
+            extents.append((buf[i].start, buf[i].len))
+            blocks.update(range(buf[i].start, buf[i].start + buf[i].len))
+
+    return {
+        "count": params.count,
+        "nr_blocks": params.nr_blocks,
+        "seqid": params.seqid,
+        "blocks": blocks,
+        "extents": extents,
+    }
+
+
+def live_changes(minor):
+    """Returns the extents of changed blocks of a device, or None."""
+    extents = []
+
+    @ffi.callback("int(const struct dattobd_extent *, void *)")
+    def collect(ext, arg):
+        extents.append((ext.start, ext.len))
+        return 0
+
+    hdr = ffi.new("struct dattobd_changes_header *")
+    ret = lib.dattobd_live_changes(minor, hdr, collect, ffi.NULL)
+    if ret != 0:
+        return None
+
+    return extents
+
+
+# _IO(DATTO_IOCTL_MAGIC, 0), a command the module does not know
+IOCTL_DATTOBD_UNKNOWN = (0x91 << 8) | 0
+
+
+def batch(ops, stop_on_error=False):
+    """
+    Run ops as a batch through a libdattobd handle. Each op is a tuple naming the
+    operation followed by its arguments, e.g. ("setup", minor, device, cow),
+    ("destroy", minor) or ("cmd", ioctl_cmd) for an arbitrary command.
+    Returns the errno of each operation, 0 on success, or None if the batch
+    could not be run at all.
+    """
+    h = lib.dattobd_open()
+    if h == ffi.NULL:
+        return None
+
+    dops = ffi.new("struct dattobd_op[]", len(ops))
+    # the ops point to these until the batch is run
+    keep = []
+
+    def cstr(s):
+        buf = ffi.new("char[]", s.encode("utf-8"))
+        keep.append(buf)
+        return buf
+
+    for i, (name, *args) in enumerate(ops):
+        op = dops + i
+        if name == "setup":
+            lib.dattobd_op_setup_snapshot(op, args[0], cstr(args[1]), cstr(args[2]), 0, 0)
+        elif name == "destroy":
+            lib.dattobd_op_destroy(op, args[0])
+        elif name == "transition_incremental":
+            lib.dattobd_op_transition_incremental(op, args[0])
+        elif name == "transition_snapshot":
+            lib.dattobd_op_transition_snapshot(op, args[0], cstr(args[1]), 0)
+        elif name == "reconfigure":
+            lib.dattobd_op_reconfigure(op, args[0], args[1])
+        elif name == "info":
+            di = ffi.new("struct dattobd_info *")
+            keep.append(di)
+            lib.dattobd_op_info(op, args[0], di)
+        elif name == "cmd":
+            op.cmd = args[0]
+        else:
+            raise ValueError("unknown batch operation {}".format(name))
+
+    flags = lib.DATTOBD_BATCH_STOP_ON_ERROR if stop_on_error else 0
+    ret = lib.dattobd_batch(h, dops, len(ops), flags)
+    lib.dattobd_close(h)
+    if ret != 0:
+        return None
+
+    util.settle()
+    return [-dops[i].result for i in range(len(ops))]
+
+
 def get_free_minor():
     ret = lib.dattobd_get_free_minor()
     if (ret < 0):
@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-only
+
+#
+# Copyright (C) 2019 Datto, Inc.
+#
+
+import errno
+import unittest
+
+import dattobd
+from devicetestcase import DeviceTestCase
+
+
+class TestBatch(DeviceTestCase):
+    def setUp(self):
+        self.device = "/dev/loop0"
+        self.mount = "/tmp/dattobd"
+        self.cow_file = "cow.snap"
+        self.cow_full_path = "{}/{}".format(self.mount, self.cow_file)
+        self.minor = 1
+        self.unused_minor = 2
+
+    def test_batch_mixed_results(self):
+        results = dattobd.batch([
+            ("setup", self.minor, self.device, self.cow_full_path),
+            ("setup", self.minor, self.device, self.cow_full_path),
+            ("destroy", self.unused_minor),
+            ("transition_incremental", self.minor),
+            ("info", self.minor),
+        ])
+        self.addCleanup(dattobd.destroy, self.minor)
+
+        self.assertEqual(results, [0, errno.EBUSY, errno.ENOENT, 0, 0])
+
+        # the transition ran despite the failures before it
+        self.assertEqual(dattobd.transition_to_incremental(self.minor), errno.EINVAL)
+
+    def test_batch_stop_on_error(self):
+        results = dattobd.batch([
+            ("setup", self.minor, self.device, self.cow_full_path),
+            ("destroy", self.unused_minor),
+            ("transition_incremental", self.minor),
+        ], stop_on_error=True)
+        self.addCleanup(dattobd.destroy, self.minor)
+
+        self.assertEqual(results, [0, errno.ENOENT, errno.ECANCELED])
+
+        # the skipped transition must not have run
+        self.assertEqual(dattobd.transition_to_incremental(self.minor), 0)
+
+    def test_batch_unknown_cmd(self):
+        results = dattobd.batch([
+            ("cmd", dattobd.IOCTL_DATTOBD_UNKNOWN),
+            ("setup", self.minor, self.device, self.cow_full_path),
+        ])
+        self.addCleanup(dattobd.destroy, self.minor)
+
+        self.assertEqual(results, [errno.EINVAL, 0])
+        self.assertIsNotNone(dattobd.info(self.minor))
+
+    def test_batch_unknown_cmd_stop_on_error(self):
+        results = dattobd.batch([
+            ("cmd", dattobd.IOCTL_DATTOBD_UNKNOWN),
+            ("setup", self.minor, self.device, self.cow_full_path),
+        ], stop_on_error=True)
+
+        self.assertEqual(results, [errno.EINVAL, errno.ECANCELED])
+        self.assertIsNone(dattobd.info(self.minor))
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,113 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-only
+
+#
+# Copyright (C) 2019 Datto, Inc.
+#
+
+import os
+import unittest
+
+import dattobd
+import util
+from devicetestcase import DeviceTestCase
+
+# blocks per index section, and sections a query reads at most
+SECT_SIZE = 4096
+MAX_SECTS = 8
+PAGE_BLOCKS = SECT_SIZE * MAX_SECTS
+
+
+class TestChanges(DeviceTestCase):
+    def setUp(self):
+        self.device = "/dev/loop0"
+        self.mount = "/tmp/dattobd"
+        self.cow_file = "cow.snap"
+        self.cow_full_path = "{}/{}".format(self.mount, self.cow_file)
+        self.minor = 1
+        self.nr_blocks = os.path.getsize(self.backing_store) // 4096
+
+    def write_blocks(self, path, blocks):
+        """Overwrites the parts of path stored on the given device blocks."""
+        extents = util.fiemap(path)
+        for block in blocks:
+            phys = block * 4096
+            for logical, physical, length in extents:
+                if physical <= phys and phys + 4096 <= physical + length:
+                    util.dd("/dev/urandom", path, 4, bs=1024, seek=(logical + phys - physical) // 1024, conv="notrunc,fsync")
+                    break
+            else:
+                self.skipTest("block {} is not part of {}".format(block, path))
+
+    def test_changes_nonexistent_device(self):
+        self.assertIsNone(dattobd.changes(self.minor, 0, 1))
+
+    def test_changes_past_end(self):
+        self.assertEqual(dattobd.setup(self.minor, self.device, self.cow_full_path), 0)
+        self.addCleanup(dattobd.destroy, self.minor)
+
+        self.assertIsNone(dattobd.changes(self.minor, self.nr_blocks + 1, 1))
+
+    def test_changes_known_pattern(self):
+        data = "{}/data".format(self.mount)
+        next_cow = "{}/cow.next".format(self.mount)
+
+        # allocate most of the file system up front, so the blocks written
+        # below are the only data blocks that change
+        with open(data, "wb") as f:
+            os.posix_fallocate(f.fileno(), 0, 160 * 1024 * 1024)
+        self.addCleanup(os.remove, data)
+        os.sync()
+
+        self.assertEqual(dattobd.setup(self.minor, self.device, self.cow_full_path), 0)
+        self.addCleanup(dattobd.destroy, self.minor)
+        self.assertEqual(dattobd.transition_to_incremental(self.minor), 0)
+
+        # straddle the end of the first page and a section boundary after it
+        pattern = {PAGE_BLOCKS - 1, PAGE_BLOCKS, PAGE_BLOCKS + SECT_SIZE}
+        self.write_blocks(data, sorted(pattern))
+        os.sync()
+
+        paged = set()
+        pages = []
+        start = 0
+        while start < self.nr_blocks:
+            res = dattobd.changes(self.minor, start, self.nr_blocks - start)
+            self.assertIsNotNone(res)
+            self.assertEqual(res["nr_blocks"], self.nr_blocks)
+            self.assertGreater(res["count"], 0)
+            paged |= res["blocks"]
+            pages.append(res)
+            start += res["count"]
+
+        # each query stops after MAX_SECTS sections
+        self.assertEqual(pages[0]["count"], PAGE_BLOCKS)
+        self.assertTrue(pattern <= paged)
+
+        # the run over the page boundary is cut in two by the queries...
+        self.assertEqual(pages[0]["extents"][-1][0] + pages[0]["extents"][-1][1], PAGE_BLOCKS)
+        self.assertEqual(pages[1]["extents"][0][0], PAGE_BLOCKS)
+
+        # ...and merged again by the library
+        live = dattobd.live_changes(self.minor)
+        self.assertIsNotNone(live)
+        self.assertTrue(any(s < PAGE_BLOCKS and s + n > PAGE_BLOCKS for s, n in live))
+
+        live_blocks = set()
+        for s, n in live:
+            live_blocks.update(range(s, s + n))
+        self.assertTrue(paged <= live_blocks)
+
+        # a bitmap reports the same blocks as the extents
+        res = dattobd.changes(self.minor, PAGE_BLOCKS - 8, 16, bitmap=True)
+        self.assertIsNotNone(res)
+        self.assertEqual(res["count"], 16)
+        self.assertTrue(paged & set(range(PAGE_BLOCKS - 8, PAGE_BLOCKS + 8)) <= res["blocks"])
+
+        # the index written to the cow file agrees with the live queries
+        self.assertEqual(dattobd.transition_to_snapshot(self.minor, next_cow), 0)
+        self.assertTrue(live_blocks <= util.cow_changed_blocks(self.cow_full_path, self.nr_blocks))
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,125 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-only
+
+#
+# Copyright (C) 2019 Datto, Inc.
+#
+
+import errno
+import os
+import subprocess
+import unittest
+
+import dattobd
+import util
+from devicetestcase import DeviceTestCase
+
+
+class TestDelta(DeviceTestCase):
+    def setUp(self):
+        self.device = "/dev/loop0"
+        self.mount = "/tmp/dattobd"
+        self.cow_file = "cow.snap"
+        self.cow_full_path = "{}/{}".format(self.mount, self.cow_file)
+        self.minor = 1
+
+        self.snap_device = "/dev/datto{}".format(self.minor)
+        self.next_cow = "{}/cow.next".format(self.mount)
+        self.image = "/tmp/image.img"
+        self.delta = "/tmp/image.delta"
+        self.scratch = "{}/scratch".format(self.mount)
+
+        # copy a snapshot to the image, then move the device to the next one
+        # with some writes in between
+        self.addCleanup(self.remove_files, [self.cow_full_path, self.next_cow, self.image, self.delta, self.scratch])
+
+        self.assertEqual(dattobd.setup(self.minor, self.device, self.cow_full_path), 0)
+        self.addCleanup(dattobd.destroy, self.minor)
+
+        util.dd(self.snap_device, self.image, 256, bs="1M")
+
+        self.assertEqual(dattobd.transition_to_incremental(self.minor), 0)
+        util.dd("/dev/urandom", self.scratch, 16, bs="1M")
+        os.sync()
+        self.assertEqual(dattobd.transition_to_snapshot(self.minor, self.next_cow), 0)
+
+        self.md5_image = util.md5sum(self.image)
+        self.md5_snap = util.md5sum(self.snap_device)
+        self.assertNotEqual(self.md5_image, self.md5_snap)
+
+    def remove_files(self, paths):
+        for path in paths:
+            if os.path.exists(path):
+                os.remove(path)
+
+    def write_delta(self):
+        cmd = ["../utils/write-delta", "-c", self.snap_device, self.cow_full_path, self.delta]
+        self.assertEqual(subprocess.call(cmd, stderr=subprocess.DEVNULL, timeout=60), 0)
+
+    def apply_delta(self, *args):
+        cmd = ["../utils/apply-delta"] + list(args) + [self.delta, self.image]
+        return subprocess.call(cmd, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL, timeout=60)
+
+    def test_delta_round_trip_file(self):
+        self.write_delta()
+
+        self.assertEqual(self.apply_delta("-n"), 0)
+        self.assertEqual(util.md5sum(self.image), self.md5_image)
+
+        self.assertEqual(self.apply_delta(), 0)
+        self.assertEqual(util.md5sum(self.image), self.md5_snap)
+
+    def test_delta_round_trip_pipe(self):
+        write = subprocess.Popen(["../utils/write-delta", "-c", self.snap_device, self.cow_full_path, "-"],
+                                 stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+        apply = subprocess.Popen(["../utils/apply-delta", "-", self.image], stdin=write.stdout,
+                                 stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        write.stdout.close()
+
+        self.assertEqual(apply.wait(timeout=60), 0)
+        self.assertEqual(write.wait(timeout=60), 0)
+        self.assertEqual(util.md5sum(self.image), self.md5_snap)
+
+    def test_delta_truncated(self):
+        self.write_delta()
+        os.truncate(self.delta, os.path.getsize(self.delta) - 4096)
+
+        # a check first leaves the image alone...
+        self.assertEqual(self.apply_delta("-n"), errno.EINVAL)
+        self.assertEqual(util.md5sum(self.image), self.md5_image)
+
+        # ...while a streamed apply stops at the end of the delta
+        self.assertEqual(self.apply_delta(), errno.EINVAL)
+        self.assertNotEqual(util.md5sum(self.image), self.md5_snap)
+
+    def test_delta_truncated_pipe(self):
+        self.write_delta()
+        os.truncate(self.delta, os.path.getsize(self.delta) - 4096)
+
+        with open(self.delta, "rb") as f:
+            ret = subprocess.call(["../utils/apply-delta", "-", self.image], stdin=f,
+                                  stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL, timeout=60)
+
+        self.assertEqual(ret, errno.EINVAL)
+        self.assertNotEqual(util.md5sum(self.image), self.md5_snap)
+
+    def test_delta_corrupt(self):
+        self.write_delta()
+
+        # flip a bit of the data of the last extent, right before its crc
+        with open(self.delta, "r+b") as f:
+            f.seek(-5, os.SEEK_END)
+            b = f.read(1)
+            f.seek(-5, os.SEEK_END)
+            f.write(bytes([b[0] ^ 0x01]))
+
+        self.assertEqual(self.apply_delta("-n"), errno.EIO)
+        self.assertEqual(util.md5sum(self.image), self.md5_image)
+
+        # the bad extent is not written
+        self.assertEqual(self.apply_delta(), errno.EIO)
+        self.assertNotEqual(util.md5sum(self.image), self.md5_snap)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -88,6 +88,35 @@ class TestTransitionToIncremental(DeviceTestCase):
         self.assertEqual(snapdev["error"], -errno.EFBIG)
         self.assertEqual(snapdev["state"], 2)
 
+    def test_transition_direct_io_cow_not_tracked(self):
+        # with direct I/O, writes to the cow file carry no page cache pages
+        # and must be recognized by where they land
+        scratch = "{}/scratch".format(self.mount)
+        next_cow = "{}/cow.next".format(self.mount)
+        nr_blocks = os.path.getsize(self.backing_store) // 4096
+
+        # a tiny cache makes the index sections get written out while
+        # incremental tracing is active
+        self.assertEqual(dattobd.setup(self.minor, self.device, self.cow_full_path, cache_size=4096), 0)
+        self.addCleanup(dattobd.destroy, self.minor)
+        self.assertEqual(dattobd.reconfigure_cow_io(self.minor, dattobd.COW_IO_DIRECT), 0)
+
+        self.assertEqual(dattobd.transition_to_incremental(self.minor), 0)
+
+        util.dd("/dev/urandom", scratch, 32, bs="1M")
+        self.addCleanup(os.remove, scratch)
+        os.sync()
+
+        start_nr = dattobd.info(self.minor)["nr_changed_blocks"]
+        os.sync()
+        self.assertEqual(dattobd.info(self.minor)["nr_changed_blocks"], start_nr)
+
+        # the incremental cow file is complete once it is handed over
+        self.assertEqual(dattobd.transition_to_snapshot(self.minor, next_cow), 0)
+
+        changed = util.cow_changed_blocks(self.cow_full_path, nr_blocks)
+        self.assertFalse(changed & util.physical_blocks(self.cow_full_path))
+
 
 if __name__ == "__main__":
     unittest.main()
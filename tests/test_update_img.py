@@ -0,0 +1,172 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-only
+
+#
+# Copyright (C) 2019 Datto, Inc.
+#
+
+import errno
+import os
+import subprocess
+import unittest
+
+import dattobd
+import util
+from devicetestcase import DeviceTestCase
+
+
+class TestUpdateImg(DeviceTestCase):
+    def setUp(self):
+        self.device = "/dev/loop0"
+        self.mount = "/tmp/dattobd"
+        self.cow_file = "cow.snap"
+        self.cow_full_path = "{}/{}".format(self.mount, self.cow_file)
+        self.minor = 1
+
+        self.snap_device = "/dev/datto{}".format(self.minor)
+        self.image = "/tmp/image.img"
+        self.scratch = "{}/scratch".format(self.mount)
+
+    def remove_files(self, paths):
+        for path in paths:
+            if os.path.exists(path):
+                os.remove(path)
+
+    def make_chain(self, nr_cows):
+        """
+        Copies a snapshot to the image, then runs nr_cows incremental cycles
+        with writes in each. Returns the cow files the cycles left behind,
+        oldest first; the snapshot device is left at the one after them.
+        """
+        cows = [self.cow_full_path] + ["{}/cow.{}".format(self.mount, i) for i in range(1, nr_cows + 1)]
+        self.addCleanup(self.remove_files, cows + [self.image, self.scratch])
+
+        self.assertEqual(dattobd.setup(self.minor, self.device, cows[0]), 0)
+        self.addCleanup(dattobd.destroy, self.minor)
+
+        util.dd(self.snap_device, self.image, 256, bs="1M")
+
+        for i in range(nr_cows):
+            self.assertEqual(dattobd.transition_to_incremental(self.minor), 0)
+            util.dd("/dev/urandom", self.scratch, 8, bs="1M", seek=8 * i, conv="notrunc")
+            os.sync()
+            self.assertEqual(dattobd.transition_to_snapshot(self.minor, cows[i + 1]), 0)
+
+        return cows[:-1]
+
+    def update_img(self, cows, opts=(), snap_device=None, image=None):
+        cmd = ["../utils/update-img"] + list(opts) + [snap_device or self.snap_device] + cows + [image or self.image]
+        return subprocess.call(cmd, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL, timeout=60)
+
+    def test_update_img_several_cows(self):
+        cows = self.make_chain(3)
+        self.assertNotEqual(util.md5sum(self.image), util.md5sum(self.snap_device))
+
+        # any order will do
+        self.assertEqual(self.update_img([cows[2], cows[0], cows[1]]), 0)
+        self.assertEqual(util.md5sum(self.image), util.md5sum(self.snap_device))
+
+    def test_update_img_threads(self):
+        cows = self.make_chain(3)
+
+        # small extents spread the changes over all of the threads
+        self.assertEqual(self.update_img(cows, ["-t", "4", "-m", "1"]), 0)
+        self.assertEqual(util.md5sum(self.image), util.md5sum(self.snap_device))
+
+    def test_update_img_single_block(self):
+        data = "{}/data".format(self.mount)
+        next_cow = "{}/cow.next".format(self.mount)
+        self.addCleanup(self.remove_files, [self.cow_full_path, next_cow, self.image, data])
+
+        # write the file out before the snapshot, so overwriting one block of
+        # it in place changes that data block alone
+        util.dd("/dev/urandom", data, 4, bs="1M", conv="fsync")
+
+        self.assertEqual(dattobd.setup(self.minor, self.device, self.cow_full_path), 0)
+        self.addCleanup(dattobd.destroy, self.minor)
+        util.dd(self.snap_device, self.image, 256, bs="1M")
+
+        self.assertEqual(dattobd.transition_to_incremental(self.minor), 0)
+        util.dd("/dev/urandom", data, 1, bs=4096, seek=129, conv="notrunc,fsync")
+        self.assertEqual(dattobd.transition_to_snapshot(self.minor, next_cow), 0)
+
+        self.assertNotEqual(util.md5sum(self.image), util.md5sum(self.snap_device))
+        self.assertEqual(self.update_img([self.cow_full_path]), 0)
+        self.assertEqual(util.md5sum(self.image), util.md5sum(self.snap_device))
+
+    def test_update_img_other_filesystem(self):
+        cows = self.make_chain(2)
+
+        # the kernel cannot copy between different file systems, so the data
+        # goes through a pipe or update-img's own buffers instead
+        image_mount = "/tmp/dattobd-image"
+        os.makedirs(image_mount, exist_ok=True)
+        subprocess.check_call(["mount", "-t", "tmpfs", "-o", "size=300m", "tmpfs", image_mount], timeout=10)
+        self.addCleanup(util.unmount, image_mount)
+
+        image = "{}/image.img".format(image_mount)
+        util.dd(self.image, image, 256, bs="1M")
+
+        self.assertEqual(self.update_img(cows, image=image), 0)
+        self.assertEqual(util.md5sum(image), util.md5sum(self.snap_device))
+
+    def test_update_img_partial_last_block(self):
+        backing_store = "/tmp/disk-odd.img"
+        device = "/dev/loop1"
+        mount = "/tmp/dattobd-odd"
+        cow = "{}/cow.snap".format(mount)
+        next_cow = "{}/cow.next".format(mount)
+        snap_device = "/dev/datto{}".format(self.minor)
+
+        # a device of 64 MiB and one sector, so its last block is partial
+        util.dd("/dev/zero", backing_store, 64, bs="1M")
+        with open(backing_store, "r+b") as f:
+            f.truncate(64 * 1024 * 1024 + 512)
+        self.addCleanup(os.remove, backing_store)
+
+        util.loop_create(device, backing_store)
+        self.addCleanup(util.loop_destroy, device)
+        util.mkfs(device)
+        os.makedirs(mount, exist_ok=True)
+        util.mount(device, mount)
+        self.addCleanup(util.unmount, mount)
+        self.addCleanup(self.remove_files, [cow, next_cow, self.image])
+
+        self.assertEqual(dattobd.setup(self.minor, device, cow), 0)
+        self.addCleanup(dattobd.destroy, self.minor)
+        util.dd(snap_device, self.image, 64 * 2048 + 1, bs=512)
+
+        # the file system never uses the last sector, write it directly
+        self.assertEqual(dattobd.transition_to_incremental(self.minor), 0)
+        try:
+            util.dd("/dev/urandom", device, 1, bs=512, seek=64 * 2048, oflag="direct")
+        except subprocess.CalledProcessError:
+            self.skipTest("cannot write to a mounted block device")
+        self.assertEqual(dattobd.transition_to_snapshot(self.minor, next_cow), 0)
+
+        self.assertNotEqual(util.md5sum(self.image), util.md5sum(snap_device))
+        self.assertEqual(self.update_img([cow], snap_device=snap_device), 0)
+        self.assertEqual(util.md5sum(self.image), util.md5sum(snap_device))
+
+    def test_update_img_missing_cow(self):
+        cows = self.make_chain(3)
+        md5_image = util.md5sum(self.image)
+
+        # a gap in the sequence ids
+        self.assertEqual(self.update_img([cows[0], cows[2]]), errno.EINVAL)
+        self.assertEqual(util.md5sum(self.image), md5_image)
+
+        # not the cows right before the snapshot
+        self.assertEqual(self.update_img([cows[0], cows[1]]), errno.EINVAL)
+        self.assertEqual(util.md5sum(self.image), md5_image)
+
+    def test_update_img_duplicate_cow(self):
+        cows = self.make_chain(2)
+        md5_image = util.md5sum(self.image)
+
+        self.assertEqual(self.update_img([cows[0], cows[1], cows[1]]), errno.EINVAL)
+        self.assertEqual(util.md5sum(self.image), md5_image)
+
+
+if __name__ == "__main__":
+    unittest.main()
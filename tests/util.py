@@ -5,7 +5,9 @@
 # Copyright (C) 2019 Datto, Inc.
 #
 
+import fcntl
 import hashlib
+import struct
 import subprocess
 
 
@@ -57,3 +59,61 @@ def loop_destroy(loop):
 def mkfs(device):
     cmd = ["mkfs.ext4", "-F", device]
     subprocess.check_call(cmd, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL, timeout=10)
+
+
+# FS_IOC_FIEMAP, struct fiemap and struct fiemap_extent from linux/fiemap.h
+FS_IOC_FIEMAP = 0xc020660b
+FIEMAP_HEADER = "=QQIIII"
+FIEMAP_EXTENT = "=QQQQQIIII"
+FIEMAP_EXTENT_LAST = 0x1
+
+
+def fiemap(path, batch=256):
+    """Returns the (logical, physical, length) byte ranges of a file."""
+    extents = []
+    start = 0
+    hdr_size = struct.calcsize(FIEMAP_HEADER)
+    ext_size = struct.calcsize(FIEMAP_EXTENT)
+
+    with open(path, "rb") as f:
+        while True:
+            buf = bytearray(struct.pack(FIEMAP_HEADER, start, 2**64 - 1 - start, 0, 0, batch, 0))
+            buf += bytes(batch * ext_size)
+            fcntl.ioctl(f.fileno(), FS_IOC_FIEMAP, buf)
+
+            mapped = struct.unpack_from(FIEMAP_HEADER, buf)[3]
+            if mapped == 0:
+                return extents
+
+            for i in range(mapped):
+                fe = struct.unpack_from(FIEMAP_EXTENT, buf, hdr_size + i * ext_size)
+                extents.append((fe[0], fe[1], fe[2]))
+                start = fe[0] + fe[2]
+                if fe[5] & FIEMAP_EXTENT_LAST:
+                    return extents
+
+
+def physical_blocks(path, block_size=4096):
+    """Returns the set of device blocks that hold nothing but the file."""
+    blocks = set()
+    for _, physical, length in fiemap(path):
+        blocks.update(range((physical + block_size - 1) // block_size, (physical + length) // block_size))
+
+    return blocks
+
+
+COW_HEADER_SIZE = 4096
+
+
+def cow_changed_blocks(path, nr_blocks):
+    """Returns the set of blocks the index of a cow file marks as changed."""
+    changed = set()
+    with open(path, "rb") as f:
+        f.seek(COW_HEADER_SIZE)
+        index = f.read(nr_blocks * 8)
+
+    for block, mapping in enumerate(struct.unpack("={}Q".format(len(index) // 8), index)):
+        if mapping:
+            changed.add(block)
+
+    return changed
@@ -0,0 +1,311 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Copyright (C) 2026 Datto Inc.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "delta.h"
+
+//largest extent accepted from a delta, bounds the data buffer
+#define MAX_EXTENT_SIZE (1024 * 1024 * 1024)
+
+static void print_help(char* progname, int status){
+	fprintf(stderr, "Usage: %s [-n] <delta file>|- <image file>\n", progname);
+	exit(status);
+}
+
+//like read and pwrite, but retry until everything is transferred
+static int full_read(int fd, void *buf, size_t count){
+	ssize_t bytes;
+	char *p = buf;
+
+	while(count){
+		bytes = read(fd, p, count);
+		if(bytes < 0 && errno == EINTR) continue;
+		if(bytes <= 0){
+			//a delta cut short
+			if(!bytes) errno = EINVAL;
+			return -1;
+		}
+
+		p += bytes;
+		count -= bytes;
+	}
+
+	return 0;
+}
+
+static int full_pwrite(int fd, const char *buf, size_t count, off_t offset){
+	ssize_t bytes;
+
+	while(count){
+		bytes = pwrite(fd, buf, count, offset);
+		if(bytes < 0 && errno == EINTR) continue;
+		if(bytes <= 0) return -1;
+
+		buf += bytes;
+		count -= bytes;
+		offset += bytes;
+	}
+
+	return 0;
+}
+
+/*
+ * Reads the extent table and checks that it matches its checksum and that the
+ * extents are in order, do not overlap and lie within the snapshot. Returns
+ * the length of the largest extent in blocks through max_len.
+ */
+static int read_table(int delta_fd, const struct delta_header *dh, uint8_t **table_out, uint64_t *max_len){
+	int ret;
+	uint8_t *table = NULL;
+	uint64_t i, start, len, end = 0;
+	uint64_t nr_blocks = (dh->size + dh->block_size - 1) / dh->block_size;
+
+	//there cannot be more extents than blocks
+	if(dh->nr_extents > nr_blocks || dh->nr_extents > SIZE_MAX / DELTA_EXTENT_SIZE){
+		ret = EINVAL;
+		fprintf(stderr, "delta header is corrupt\n");
+		goto error;
+	}
+
+	table = malloc(dh->nr_extents * DELTA_EXTENT_SIZE + 1);
+	if(!table){
+		ret = ENOMEM;
+		fprintf(stderr, "error allocating extent table\n");
+		goto error;
+	}
+
+	if(full_read(delta_fd, table, dh->nr_extents * DELTA_EXTENT_SIZE)){
+		ret = errno;
+		errno = 0;
+		fprintf(stderr, "error reading extent table\n");
+		goto error;
+	}
+
+	if(crc32c(0, table, dh->nr_extents * DELTA_EXTENT_SIZE) != dh->table_crc){
+		ret = EINVAL;
+		fprintf(stderr, "extent table does not match its checksum\n");
+		goto error;
+	}
+
+	*max_len = 0;
+	for(i = 0; i < dh->nr_extents; i++){
+		delta_get_extent(table + i * DELTA_EXTENT_SIZE, &start, &len);
+		if(!len || start < end || start >= nr_blocks || len > nr_blocks - start){
+			ret = EINVAL;
+			fprintf(stderr, "extent %llu of the table is invalid\n", (unsigned long long)i);
+			goto error;
+		}
+
+		if(len > *max_len) *max_len = len;
+		end = start + len;
+	}
+
+	*table_out = table;
+	return 0;
+
+error:
+	free(table);
+	return ret;
+}
+
+/*
+ * Reads the data of every extent in the order of the table and checks it
+ * against its checksum, then writes it to img_fd as soon as it passes. The
+ * delta is streamed, nothing is held back beyond the extent being written. An
+ * extent that does not match stops the apply, unless img_fd is -1 for a dry
+ * run, which counts every bad extent in bad. The number of extents written is
+ * returned through written.
+ */
+static int read_extents(int fd, const struct delta_header *dh, const uint8_t *table, char *buf, int img_fd, uint64_t *bad, uint64_t *written){
+	uint64_t i, start, len;
+	size_t bytes, crc_size = (dh->flags & DELTA_CHECKSUMS) ? sizeof(uint32_t) : 0;
+	off_t off;
+	int ret;
+
+	*bad = 0;
+	*written = 0;
+	for(i = 0; i < dh->nr_extents; i++){
+		delta_get_extent(table + i * DELTA_EXTENT_SIZE, &start, &len);
+		off = (off_t)start * dh->block_size;
+		bytes = len * dh->block_size;
+
+		//the last block of the snapshot may be partial
+		if(off + (off_t)bytes > (off_t)dh->size) bytes = dh->size - off;
+
+		if(full_read(fd, buf, bytes + crc_size)){
+			ret = errno;
+			errno = 0;
+			fprintf(stderr, "error reading delta data\n");
+			return ret;
+		}
+
+		if(crc_size && crc32c(0, buf, bytes) != delta_get_crc((uint8_t *)buf + bytes)){
+			fprintf(stderr, "extent of %llu blocks at block %llu does not match its checksum\n", (unsigned long long)len, (unsigned long long)start);
+			(*bad)++;
+			if(img_fd < 0) continue;
+			return EIO;
+		}
+
+		if(img_fd < 0) continue;
+
+		if(full_pwrite(img_fd, buf, bytes, off)){
+			ret = errno;
+			errno = 0;
+			fprintf(stderr, "error writing data to image\n");
+			return ret;
+		}
+
+		(*written)++;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv){
+	int ret, c, dry_run = 0, delta_fd = -1, img_fd = -1;
+	uint64_t i, start, len, max_len = 0, nr_blocks = 0, bad = 0, written = 0;
+	uint8_t hdr_buf[DELTA_HEADER_SIZE], *table = NULL;
+	char *buf = NULL;
+	off_t img_size;
+	struct delta_header dh;
+	struct stat st;
+
+	while((c = getopt(argc, argv, "n")) != -1){
+		switch(c){
+		case 'n':
+			dry_run = 1;
+			break;
+		default:
+			print_help(argv[0], EINVAL);
+		}
+	}
+
+	if(argc - optind != 2) print_help(argv[0], EINVAL);
+
+	select_crc32c();
+
+	//open delta
+	if(!strcmp(argv[optind], "-")) delta_fd = dup(STDIN_FILENO);
+	else delta_fd = open(argv[optind], O_RDONLY);
+	if(delta_fd < 0){
+		ret = errno;
+		errno = 0;
+		fprintf(stderr, "error opening delta\n");
+		goto error;
+	}
+
+	posix_fadvise(delta_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	//open image
+	img_fd = open(argv[optind + 1], (dry_run) ? O_RDONLY : O_RDWR);
+	if(img_fd < 0){
+		ret = errno;
+		errno = 0;
+		fprintf(stderr, "error opening image\n");
+		goto error;
+	}
+
+	//read and check the header
+	if(full_read(delta_fd, hdr_buf, DELTA_HEADER_SIZE)){
+		ret = errno;
+		errno = 0;
+		fprintf(stderr, "error reading delta header\n");
+		goto error;
+	}
+
+	ret = delta_get_header(hdr_buf, &dh);
+	if(ret){
+		fprintf(stderr, "input is not a delta this version understands\n");
+		goto error;
+	}
+
+	if(!dh.block_size || dh.block_size > MAX_EXTENT_SIZE || (dh.flags & ~DELTA_CHECKSUMS)){
+		ret = EINVAL;
+		fprintf(stderr, "delta header is corrupt\n");
+		goto error;
+	}
+
+	printf("delta brings snapshot %llu to %llu, %llu extents%s\n", (unsigned long long)dh.from_seqid, (unsigned long long)dh.seqid, (unsigned long long)dh.nr_extents, (dh.flags & DELTA_CHECKSUMS) ? ", checksummed" : "");
+
+	//the image must be a copy of the whole snapshot
+	if(fstat(img_fd, &st)){
+		ret = errno;
+		errno = 0;
+		fprintf(stderr, "error determining size of image\n");
+		goto error;
+	}
+
+	img_size = (S_ISBLK(st.st_mode)) ? lseek(img_fd, 0, SEEK_END) : st.st_size;
+	if(img_size < 0 || (uint64_t)img_size < dh.size){
+		ret = EINVAL;
+		fprintf(stderr, "image is smaller than the snapshot the delta was made from\n");
+		goto error;
+	}
+
+	ret = read_table(delta_fd, &dh, &table, &max_len);
+	if(ret) goto error;
+
+	if(max_len * dh.block_size > MAX_EXTENT_SIZE){
+		ret = EINVAL;
+		fprintf(stderr, "delta extents are too large\n");
+		goto error;
+	}
+
+	buf = malloc(max_len * dh.block_size + sizeof(uint32_t));
+	if(!buf){
+		ret = ENOMEM;
+		fprintf(stderr, "error allocating data buffer\n");
+		goto error;
+	}
+
+	for(i = 0; i < dh.nr_extents; i++){
+		delta_get_extent(table + i * DELTA_EXTENT_SIZE, &start, &len);
+		nr_blocks += len;
+	}
+
+	ret = read_extents(delta_fd, &dh, table, buf, (dry_run) ? -1 : img_fd, &bad, &written);
+	if(dry_run && !ret && bad){
+		ret = EIO;
+		fprintf(stderr, "%llu of %llu extents are corrupt, the delta cannot be applied\n", (unsigned long long)bad, (unsigned long long)dh.nr_extents);
+	}
+	if(ret){
+		if(!dry_run) fprintf(stderr, "%llu of %llu extents were written, the image is %s\n", (unsigned long long)written, (unsigned long long)dh.nr_extents, (written) ? "partly written" : "untouched");
+		goto error;
+	}
+
+	if(dry_run){
+		printf("check complete: %llu blocks in %llu extents\n", (unsigned long long)nr_blocks, (unsigned long long)dh.nr_extents);
+		goto error;
+	}
+
+	if(fsync(img_fd)){
+		ret = errno;
+		errno = 0;
+		fprintf(stderr, "error syncing image\n");
+		goto error;
+	}
+
+	printf("apply complete: %llu blocks in %llu extents\n", (unsigned long long)nr_blocks, (unsigned long long)dh.nr_extents);
+	ret = 0;
+
+error:
+	free(buf);
+	free(table);
+	if(delta_fd >= 0) close(delta_fd);
+	if(img_fd >= 0) close(img_fd);
+
+	return ret;
+}
@@ -0,0 +1,341 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Copyright (C) 2026 Datto Inc.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cow-index.h"
+
+//index entries ORed together at a time when merging several cow files
+#define MERGE_CHUNK_SIZE (64 * 1024)
+
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+
+/*
+ * Zero-skip scanners. Almost all of the index is usually zero, so the scan is
+ * dominated by skipping zero mappings. skip_zeros() returns the index of the
+ * first non-zero entry of m[i..n), or n. The vector versions test 8 or 16
+ * entries at a time and leave the tail to the scalar loop. or_index(), used
+ * to merge the indexes of several cow files, is vectorized the same way.
+ */
+static size_t skip_zeros_scalar(const uint64_t *m, size_t i, size_t n){
+	while(i + 4 <= n && !(m[i] | m[i + 1] | m[i + 2] | m[i + 3])) i += 4;
+	while(i < n && !m[i]) i++;
+	return i;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define HAVE_X86_SCAN
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static size_t skip_zeros_sse2(const uint64_t *m, size_t i, size_t n){
+	__m128i v;
+
+	for(; i + 8 <= n; i += 8){
+		v = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i *)(m + i)), _mm_loadu_si128((const __m128i *)(m + i + 2))),
+		                 _mm_or_si128(_mm_loadu_si128((const __m128i *)(m + i + 4)), _mm_loadu_si128((const __m128i *)(m + i + 6))));
+		if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff) break;
+	}
+
+	return skip_zeros_scalar(m, i, n);
+}
+
+__attribute__((target("avx2")))
+static size_t skip_zeros_avx2(const uint64_t *m, size_t i, size_t n){
+	__m256i v;
+
+	for(; i + 16 <= n; i += 16){
+		v = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256((const __m256i *)(m + i)), _mm256_loadu_si256((const __m256i *)(m + i + 4))),
+		                    _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(m + i + 8)), _mm256_loadu_si256((const __m256i *)(m + i + 12))));
+		if(!_mm256_testz_si256(v, v)) break;
+	}
+
+	return skip_zeros_scalar(m, i, n);
+}
+
+__attribute__((target("sse2")))
+static void or_index_sse2(uint64_t *dst, const uint64_t *src, size_t n){
+	size_t i;
+
+	for(i = 0; i + 4 <= n; i += 4){
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(_mm_loadu_si128((const __m128i *)(dst + i)), _mm_loadu_si128((const __m128i *)(src + i))));
+		_mm_storeu_si128((__m128i *)(dst + i + 2), _mm_or_si128(_mm_loadu_si128((const __m128i *)(dst + i + 2)), _mm_loadu_si128((const __m128i *)(src + i + 2))));
+	}
+
+	for(; i < n; i++) dst[i] |= src[i];
+}
+
+__attribute__((target("avx2")))
+static void or_index_avx2(uint64_t *dst, const uint64_t *src, size_t n){
+	size_t i;
+
+	for(i = 0; i + 8 <= n; i += 8){
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(dst + i)), _mm256_loadu_si256((const __m256i *)(src + i))));
+		_mm256_storeu_si256((__m256i *)(dst + i + 4), _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(dst + i + 4)), _mm256_loadu_si256((const __m256i *)(src + i + 4))));
+	}
+
+	for(; i < n; i++) dst[i] |= src[i];
+}
+#endif
+
+//merges the changes of two indexes, dst[i] |= src[i]
+static void or_index_scalar(uint64_t *dst, const uint64_t *src, size_t n){
+	size_t i;
+
+	for(i = 0; i < n; i++) dst[i] |= src[i];
+}
+
+size_t (*skip_zeros)(const uint64_t *m, size_t i, size_t n) = skip_zeros_scalar;
+void (*or_index)(uint64_t *dst, const uint64_t *src, size_t n) = or_index_scalar;
+
+void select_scanner(void){
+#ifdef HAVE_X86_SCAN
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")){
+		skip_zeros = skip_zeros_avx2;
+		or_index = or_index_avx2;
+	}else if(__builtin_cpu_supports("sse2")){
+		skip_zeros = skip_zeros_sse2;
+		or_index = or_index_sse2;
+	}
+#endif
+}
+
+//gets the minor of a snapshot device from its path, resolving symlinks
+int snapshot_minor(const char *path, unsigned int *minor){
+	int ret;
+	char *snap_path;
+	char snap_path_buf[PATH_MAX];
+
+	//get the full path of the snapshot
+	snap_path = realpath(path, snap_path_buf);
+	if(!snap_path){
+		ret = errno;
+		errno = 0;
+		fprintf(stderr, "error determining full path of snapshot\n");
+		return ret;
+	}
+
+	//get the minor number of the snapshot
+	ret = sscanf(snap_path, "/dev/datto%u", minor);
+	if(ret != 1){
+		ret = (errno) ? errno : EINVAL;
+		errno = 0;
+		fprintf(stderr, "snapshot does not appear to be a dattobd snapshot device\n");
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Checks that the cow files belong to the snapshot series of the device and
+ * that their sequence ids, in any order, are the ones right before the
+ * snapshot, with none missing or repeated. The info of the snapshot is copied
+ * to info_out, if given.
+ */
+int verify_cow_files(const int *cow_fds, unsigned int nr_cows, unsigned int minor, struct dattobd_info *info_out){
+	int ret;
+	size_t bytes;
+	unsigned int c;
+	struct cow_header ch;
+	struct dattobd_info *info = NULL;
+	char *seen = NULL;
+
+	//allocate a buffer for the proc data
+	info = malloc(sizeof(struct dattobd_info));
+	seen = calloc(nr_cows, 1);
+	if(!info || !seen){
+		ret = ENOMEM;
+		errno = 0;
+		fprintf(stderr, "error allocating memory for dattobd info\n");
+		goto error;
+	}
+
+	//read info from the dattobd driver
+	ret = dattobd_info(minor, info);
+	if(ret){
+		ret = errno;
+		errno = 0;
+		fprintf(stderr, "error reading dattobd info from driver\n");
+		goto error;
+	}
+
+	for(c = 0; c < nr_cows; c++){
+		//read cow header from cow file
+		bytes = pread(cow_fds[c], &ch, sizeof(struct cow_header), 0);
+		if(bytes != sizeof(struct cow_header)){
+			ret = errno;
+			errno = 0;
+			fprintf(stderr, "error reading cow header\n");
+			goto error;
+		}
+
+		//check the cow file's magic number
+		if(ch.magic != COW_MAGIC){
+			ret = EINVAL;
+			fprintf(stderr, "invalid magic number from cow file\n");
+			goto error;
+		}
+
+		//check the uuid
+		if(memcmp(ch.uuid, info->uuid, COW_UUID_SIZE) != 0){
+			ret = EINVAL;
+			fprintf(stderr, "cow file uuid does not match snapshot\n");
+			goto error;
+		}
+
+		//check the sequence id
+		if(ch.seqid >= info->seqid || ch.seqid + nr_cows < info->seqid){
+			ret = EINVAL;
+			if(nr_cows == 1) fprintf(stderr, "snapshot provided does not immediately follow the snapshot that created the cow file\n");
+			else fprintf(stderr, "cow file with seqid %llu is not one of the %u before snapshot %llu\n", (unsigned long long)ch.seqid, nr_cows, info->seqid);
+			goto error;
+		}
+
+		if(seen[info->seqid - 1 - ch.seqid]++){
+			ret = EINVAL;
+			fprintf(stderr, "cow file with seqid %llu given more than once\n", (unsigned long long)ch.seqid);
+			goto error;
+		}
+	}
+
+	if(info_out) memcpy(info_out, info, sizeof(struct dattobd_info));
+	free(seen);
+	free(info);
+
+	return 0;
+
+error:
+	free(seen);
+	if(info) free(info);
+	return ret;
+}
+
+int map_index(int cow_fd, uint64_t first, uint64_t nr, struct index_map *im){
+	int ret;
+	long page_size = sysconf(_SC_PAGESIZE);
+	off_t index_off = COW_HEADER_SIZE + first * sizeof(uint64_t);
+	off_t map_off = index_off & ~((off_t)page_size - 1);
+
+	im->map_len = (index_off - map_off) + nr * sizeof(uint64_t);
+	im->map = mmap(NULL, im->map_len, PROT_READ, MAP_SHARED, cow_fd, map_off);
+	if(im->map == MAP_FAILED){
+		ret = errno;
+		errno = 0;
+		im->map = NULL;
+		fprintf(stderr, "error mapping cow file index\n");
+		return ret;
+	}
+
+	madvise(im->map, im->map_len, MADV_SEQUENTIAL);
+	im->m = (const uint64_t *)(im->map + (index_off - map_off));
+	return 0;
+}
+
+void unmap_index(struct index_map *im){
+	if(!im->map) return;
+
+	munmap(im->map, im->map_len);
+	im->map = NULL;
+}
+
+static void scan_runs(const uint64_t *m, size_t nr, uint64_t first, index_run_fn fn, void *arg){
+	size_t i, start;
+
+	for(i = 0; i < nr;){
+		i = skip_zeros(m, i, nr);
+		if(i == nr) break;
+
+		//runs of changed blocks are short, no need to vectorize these
+		for(start = i; i < nr && m[i]; i++);
+		fn(first + start, i - start, arg);
+	}
+}
+
+/*
+ * Maps the indexes of the cow files one window at a time and hands the runs
+ * of changed blocks found in them to fn. Windows keep the address space needed
+ * bounded on 32 bit systems and let the kernel drop pages already scanned.
+ * With several cow files the windows are ORed together a chunk at a time, so
+ * a block changed in any of them is copied once.
+ */
+int scan_index(const int *cow_fds, unsigned int nr_cows, uint64_t total_blocks, index_run_fn fn, void *arg){
+	int ret = 0;
+	unsigned int c;
+	struct stat st;
+	uint64_t first, nr, window, off, len;
+	struct index_map *maps = NULL;
+	uint64_t *merged = NULL;
+
+	for(c = 0; c < nr_cows; c++){
+		if(fstat(cow_fds[c], &st)){
+			ret = errno;
+			errno = 0;
+			fprintf(stderr, "error determining size of cow file\n");
+			return ret;
+		}
+
+		//reading past the end of the file through a mapping would raise SIGBUS
+		if(st.st_size < COW_HEADER_SIZE + (off_t)(total_blocks * sizeof(uint64_t))){
+			fprintf(stderr, "cow file is too small to hold the index of the snapshot\n");
+			return EINVAL;
+		}
+	}
+
+	maps = calloc(nr_cows, sizeof(struct index_map));
+	if(nr_cows > 1) merged = malloc(MERGE_CHUNK_SIZE * sizeof(uint64_t));
+	if(!maps || (nr_cows > 1 && !merged)){
+		ret = ENOMEM;
+		fprintf(stderr, "error allocating index buffers\n");
+		goto out;
+	}
+
+	//all windows are mapped at once, keep their sum the size of one
+	window = MAX(INDEX_WINDOW_SIZE / nr_cows, MERGE_CHUNK_SIZE);
+
+	for(first = 0; first < total_blocks; first += nr){
+		nr = MIN(window, total_blocks - first);
+
+		for(c = 0; c < nr_cows; c++){
+			ret = map_index(cow_fds[c], first, nr, &maps[c]);
+			if(ret) goto out;
+		}
+
+		if(nr_cows == 1){
+			scan_runs(maps[0].m, nr, first, fn, arg);
+		}else{
+			for(off = 0; off < nr; off += len){
+				len = MIN(MERGE_CHUNK_SIZE, nr - off);
+
+				memcpy(merged, maps[0].m + off, len * sizeof(uint64_t));
+				for(c = 1; c < nr_cows; c++) or_index(merged, maps[c].m + off, len);
+				scan_runs(merged, len, first + off, fn, arg);
+			}
+		}
+
+		for(c = 0; c < nr_cows; c++) unmap_index(&maps[c]);
+	}
+
+out:
+	if(maps){
+		for(c = 0; c < nr_cows; c++) unmap_index(&maps[c]);
+		free(maps);
+	}
+	free(merged);
+	return ret;
+}
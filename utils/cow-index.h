@@ -0,0 +1,53 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Copyright (C) 2026 Datto Inc.
+ */
+
+#ifndef COW_INDEX_H_
+#define COW_INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libdattobd.h"
+
+//index entries per section, as in src/cow_manager.h; the index is allocated
+//and written a whole section at a time
+#define COW_SECTION_SIZE 4096
+
+//index entries mapped at a time (64 MiB)
+#define INDEX_WINDOW_SIZE (8 * 1024 * 1024)
+
+//a window of the index of one cow file
+struct index_map {
+	char *map;
+	size_t map_len;
+	const uint64_t *m; //first mapping of the window
+};
+
+//called with each run of consecutive changed blocks, in ascending order
+typedef void (*index_run_fn)(uint64_t start, uint64_t len, void *arg);
+
+//index of the first non-zero entry of m[i..n), or n
+extern size_t (*skip_zeros)(const uint64_t *m, size_t i, size_t n);
+
+//dst[i] |= src[i] for the first n entries
+extern void (*or_index)(uint64_t *dst, const uint64_t *src, size_t n);
+
+//picks the fastest skip_zeros() and or_index() the cpu supports
+void select_scanner(void);
+
+int snapshot_minor(const char *path, unsigned int *minor);
+
+//checks the cow files are the nr_cows ones right before snapshot minor
+int verify_cow_files(const int *cow_fds, unsigned int nr_cows, unsigned int minor, struct dattobd_info *info_out);
+
+//maps nr entries of the index of a cow file, starting at block first
+int map_index(int cow_fd, uint64_t first, uint64_t nr, struct index_map *im);
+
+void unmap_index(struct index_map *im);
+
+int scan_index(const int *cow_fds, unsigned int nr_cows, uint64_t total_blocks, index_run_fn fn, void *arg);
+
+#endif /* COW_INDEX_H_ */
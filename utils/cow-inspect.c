@@ -0,0 +1,459 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Copyright (C) 2026 Datto Inc.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#include "cow-index.h"
+
+//extents asked of FS_IOC_FIEMAP at a time
+#define FIEMAP_BATCH 512
+
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+
+//flags the driver sets in the cow header
+#define COW_KNOWN_FLAGS ((1 << COW_CLEAN) | (1 << COW_INDEX_ONLY) | (1 << COW_VMALLOC_UPPER))
+
+//what the index of a cow file says about its changed blocks
+struct index_stats {
+	uint64_t entries; //index entries, one per block of the origin device
+	uint64_t changed;
+	uint64_t runs; //of consecutive changed blocks
+	uint64_t longest_run;
+	uint64_t past_end; //changed blocks beyond the end of the origin device
+
+	//snapshot mode only, where a mapping is the cow file block holding the data
+	uint64_t adjacent; //changed blocks following another changed block
+	uint64_t sequential; //of which the data follows that of the other block
+	uint64_t cow_reads; //reads needed to get every changed block in order
+	uint64_t min_map;
+	uint64_t max_map;
+	uint64_t bad_maps; //mappings past the data written
+};
+
+//how the file system laid out the cow file
+struct extent_stats {
+	uint64_t extents;
+	uint64_t fragments; //physically contiguous runs of extents
+	uint64_t index_extents;
+	uint64_t data_extents;
+	uint64_t unwritten;
+	uint64_t mapped_bytes;
+	uint64_t largest;
+};
+
+static void print_help(char* progname, int status){
+	fprintf(stderr, "Usage: %s [-d <origin device>] <cow file>\n", progname);
+	fprintf(stderr, "without the origin device, the size of the index is derived from the cow file.\n");
+	exit(status);
+}
+
+static double percent(uint64_t part, uint64_t whole){
+	return (whole) ? 100.0 * part / whole : 0.0;
+}
+
+//gets the size of the origin device (or an image of it) in blocks
+static int origin_blocks(const char *path, uint64_t *nr_blocks){
+	int ret, fd;
+	struct stat st;
+	uint64_t size;
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0){
+		ret = errno;
+		errno = 0;
+		fprintf(stderr, "error opening origin device\n");
+		return ret;
+	}
+
+	if(fstat(fd, &st)){
+		ret = errno;
+		errno = 0;
+		fprintf(stderr, "error determining size of origin device\n");
+		goto out;
+	}
+
+	ret = 0;
+	if(!S_ISBLK(st.st_mode)) size = st.st_size;
+	else if(ioctl(fd, BLKGETSIZE64, &size)){
+		ret = errno;
+		errno = 0;
+		fprintf(stderr, "error determining size of origin device\n");
+		goto out;
+	}
+
+	*nr_blocks = (size + COW_BLOCK_SIZE - 1) / COW_BLOCK_SIZE;
+
+out:
+	close(fd);
+	return ret;
+}
+
+/*
+ * Checks the header against itself and the size of the file. Problems that do
+ * not keep the index from being read are only reported.
+ */
+static int check_header(const struct cow_header *ch, off_t file_size, int *problems){
+	if(ch->magic != COW_MAGIC){
+		fprintf(stderr, "invalid magic number from cow file\n");
+		return EINVAL;
+	}
+
+	if(ch->version > COW_VERSION_CHANGED_BLOCKS){
+		fprintf(stderr, "cow file version %llu is not supported\n", (unsigned long long)ch->version);
+		return EINVAL;
+	}
+
+	if(file_size < COW_HEADER_SIZE || ch->fsize < COW_HEADER_SIZE){
+		fprintf(stderr, "cow file is too small to hold an index\n");
+		return EINVAL;
+	}
+
+	if(ch->flags & ~COW_KNOWN_FLAGS){
+		printf("problem: unknown flags 0x%x\n", ch->flags & ~COW_KNOWN_FLAGS);
+		(*problems)++;
+	}
+
+	if(ch->flags & (1 << COW_INDEX_ONLY)){
+		if((ch->fsize - COW_HEADER_SIZE) % COW_BLOCK_SIZE){
+			printf("problem: index size is not a multiple of the block size\n");
+			(*problems)++;
+		}
+
+		if((uint64_t)file_size < ch->fsize){
+			printf("problem: file is %llu bytes, smaller than its index of %llu\n", (unsigned long long)file_size, (unsigned long long)ch->fsize);
+			(*problems)++;
+		}
+	}else{
+		//even the smallest index is a whole section
+		if(ch->fpos < (COW_HEADER_SIZE + COW_SECTION_SIZE * sizeof(uint64_t)) / COW_BLOCK_SIZE){
+			fprintf(stderr, "cow header is corrupt\n");
+			return EINVAL;
+		}
+
+		if(ch->fpos > ch->fsize / COW_BLOCK_SIZE){
+			printf("problem: data written up to byte %llu, past the end of the file at %llu\n", (unsigned long long)ch->fpos * COW_BLOCK_SIZE, (unsigned long long)ch->fsize);
+			(*problems)++;
+		}
+
+		if((uint64_t)file_size / COW_BLOCK_SIZE < ch->fpos){
+			printf("problem: file is %llu bytes, the data written ends at %llu\n", (unsigned long long)file_size, (unsigned long long)ch->fpos * COW_BLOCK_SIZE);
+			(*problems)++;
+		}
+	}
+
+	return 0;
+}
+
+static void print_header(const struct cow_header *ch, off_t file_size){
+	int i;
+
+	printf("header:\n");
+	printf("  version:          %llu\n", (unsigned long long)ch->version);
+	printf("  mode:             %s\n", (ch->flags & (1 << COW_INDEX_ONLY)) ? "incremental (index only)" : "snapshot");
+	printf("  state:            %s\n", (ch->flags & (1 << COW_CLEAN)) ? "clean" : "dirty (in use or not closed cleanly, the index may be stale)");
+	printf("  seqid:            %llu\n", (unsigned long long)ch->seqid);
+	printf("  uuid:             ");
+	for(i = 0; i < COW_UUID_SIZE; i++) printf("%02x", ch->uuid[i]);
+	printf("\n");
+	printf("  file size:        %llu bytes (%llu in the header)\n", (unsigned long long)file_size, (unsigned long long)ch->fsize);
+	if(!(ch->flags & (1 << COW_INDEX_ONLY))) printf("  data written to:  block %llu\n", (unsigned long long)ch->fpos);
+	if(ch->version >= COW_VERSION_CHANGED_BLOCKS) printf("  changed blocks:   %llu\n", (unsigned long long)ch->nr_changed_blocks);
+}
+
+/*
+ * Scans the index a window at a time, skipping zero mappings with the
+ * vectorized skip_zeros(). Only changed blocks are looked at one by one.
+ *
+ * In snapshot mode and without the size of the origin device, is->entries is
+ * an upper bound to begin with and is lowered as mappings are found: data is
+ * written right after the index, so the lowest mapping, which is that of the
+ * first block copied, is where the index ends.
+ */
+static int scan_cow_index(int cow_fd, int snapshot, uint64_t fpos, uint64_t nr_blocks, int derive, struct index_stats *is){
+	int ret;
+	uint64_t first, nr, i, v, prev = 0, prev_v = 0;
+	uint64_t run = 0;
+	struct index_map im;
+
+	is->min_map = UINT64_MAX;
+
+	for(first = 0; first < is->entries; first += nr){
+		nr = MIN(INDEX_WINDOW_SIZE, is->entries - first);
+
+		ret = map_index(cow_fd, first, nr, &im);
+		if(ret) return ret;
+
+		for(i = 0; i < nr && first + i < is->entries; i++){
+			i = skip_zeros(im.m, i, MIN(nr, is->entries - first));
+			if(i == nr || first + i >= is->entries) break;
+
+			v = im.m[i];
+
+			if(snapshot && derive && v < fpos && v * COW_BLOCK_SIZE >= COW_HEADER_SIZE && (v * COW_BLOCK_SIZE - COW_HEADER_SIZE) / sizeof(uint64_t) < is->entries){
+				//this mapping lies in what was taken for the index
+				is->entries = (v * COW_BLOCK_SIZE - COW_HEADER_SIZE) / sizeof(uint64_t);
+				if(first + i >= is->entries) break;
+			}
+
+			if(is->changed && first + i == prev + 1){
+				run++;
+				is->adjacent++;
+				if(v == prev_v + 1) is->sequential++;
+				else is->cow_reads++;
+			}else{
+				run = 1;
+				is->runs++;
+				is->cow_reads++;
+			}
+
+			if(run > is->longest_run) is->longest_run = run;
+			if(first + i >= nr_blocks) is->past_end++;
+
+			if(snapshot){
+				if(v < is->min_map) is->min_map = v;
+				if(v > is->max_map) is->max_map = v;
+				if(v >= fpos) is->bad_maps++;
+			}
+
+			is->changed++;
+			prev = first + i;
+			prev_v = v;
+		}
+
+		unmap_index(&im);
+	}
+
+	return 0;
+}
+
+/*
+ * Walks the extents of the cow file with FS_IOC_FIEMAP. Extents that are
+ * logically and physically contiguous (file systems cap the size of an extent)
+ * count as one fragment, since they are read without a seek.
+ */
+static int scan_extents(int cow_fd, uint64_t data_offset, uint64_t data_end, struct extent_stats *es){
+	int ret, last = 0;
+	unsigned int i;
+	uint64_t start = 0, next_logical = 0, next_physical = 0;
+	struct fiemap *fm;
+	struct fiemap_extent *fe;
+
+	fm = calloc(1, sizeof(struct fiemap) + FIEMAP_BATCH * sizeof(struct fiemap_extent));
+	if(!fm){
+		fprintf(stderr, "error allocating extent buffer\n");
+		return ENOMEM;
+	}
+
+	while(!last){
+		memset(fm, 0, sizeof(struct fiemap));
+		fm->fm_start = start;
+		fm->fm_length = FIEMAP_MAX_OFFSET - start;
+		fm->fm_extent_count = FIEMAP_BATCH;
+
+		if(ioctl(cow_fd, FS_IOC_FIEMAP, fm)){
+			ret = errno;
+			errno = 0;
+			goto out;
+		}
+
+		if(!fm->fm_mapped_extents) break;
+
+		for(i = 0; i < fm->fm_mapped_extents; i++){
+			fe = &fm->fm_extents[i];
+
+			es->extents++;
+			es->mapped_bytes += fe->fe_length;
+			if(fe->fe_length > es->largest) es->largest = fe->fe_length;
+			if(fe->fe_flags & FIEMAP_EXTENT_UNWRITTEN) es->unwritten++;
+			if(fe->fe_logical < data_offset) es->index_extents++;
+			if(fe->fe_logical + fe->fe_length > data_offset && fe->fe_logical < data_end) es->data_extents++;
+			if(es->extents == 1 || fe->fe_logical != next_logical || fe->fe_physical != next_physical) es->fragments++;
+
+			next_logical = fe->fe_logical + fe->fe_length;
+			next_physical = fe->fe_physical + fe->fe_length;
+			if(fe->fe_flags & FIEMAP_EXTENT_LAST) last = 1;
+		}
+
+		start = next_logical;
+	}
+
+	ret = 0;
+
+out:
+	free(fm);
+	return ret;
+}
+
+static void print_index(const struct index_stats *is, const struct cow_header *ch, int snapshot, uint64_t nr_blocks, int derive){
+	uint64_t data_start = COW_HEADER_SIZE + is->entries * sizeof(uint64_t);
+
+	printf("index:\n");
+	printf("  entries:          %llu%s\n", (unsigned long long)is->entries, (derive) ? " (derived from the cow file)" : "");
+	printf("  changed blocks:   %llu (%.2f%%)\n", (unsigned long long)is->changed, percent(is->changed, (derive) ? is->entries : nr_blocks));
+	printf("  runs:             %llu, %.1f blocks on average, longest %llu\n", (unsigned long long)is->runs, (is->runs) ? (double)is->changed / is->runs : 0.0, (unsigned long long)is->longest_run);
+
+	if(!snapshot) return;
+
+	//in snapshot mode every changed block was copied to the datastore once
+	printf("datastore:\n");
+	printf("  starts at:        byte %llu\n", (unsigned long long)data_start);
+	if(ch->fpos * COW_BLOCK_SIZE >= data_start && ch->fsize >= data_start){
+		printf("  used:             %llu of %llu bytes (%.2f%%)\n", (unsigned long long)(ch->fpos * COW_BLOCK_SIZE - data_start), (unsigned long long)(ch->fsize - data_start), percent(ch->fpos * COW_BLOCK_SIZE - data_start, ch->fsize - data_start));
+	}
+	printf("  file fill:        %.2f%%\n", percent(ch->fpos * COW_BLOCK_SIZE, ch->fsize));
+	printf("locality:\n");
+	printf("  sequential:       %llu of %llu adjacent changed blocks (%.2f%%) are stored next to each other\n", (unsigned long long)is->sequential, (unsigned long long)is->adjacent, percent(is->sequential, is->adjacent));
+	printf("  cow reads:        %llu to read every changed block in order, %.1f blocks per read\n", (unsigned long long)is->cow_reads, (is->cow_reads) ? (double)is->changed / is->cow_reads : 0.0);
+	if(is->changed) printf("  mappings:         blocks %llu to %llu\n", (unsigned long long)is->min_map, (unsigned long long)is->max_map);
+}
+
+static void print_extents(const struct extent_stats *es){
+	printf("fragmentation:\n");
+	printf("  extents:          %llu (%llu in the index, %llu in the data written)\n", (unsigned long long)es->extents, (unsigned long long)es->index_extents, (unsigned long long)es->data_extents);
+	printf("  fragments:        %llu, %.1f MiB on average\n", (unsigned long long)es->fragments, (es->fragments) ? (double)es->mapped_bytes / es->fragments / (1024 * 1024) : 0.0);
+	printf("  largest extent:   %.1f MiB\n", (double)es->largest / (1024 * 1024));
+	printf("  unwritten:        %llu extents\n", (unsigned long long)es->unwritten);
+}
+
+int main(int argc, char **argv){
+	int ret, c, snapshot, derive, problems = 0, cow_fd = -1;
+	uint64_t nr_blocks = 0, data_offset, data_end;
+	ssize_t bytes;
+	struct stat st;
+	struct cow_header ch;
+	struct index_stats is;
+	struct extent_stats es;
+
+	while((c = getopt(argc, argv, "d:")) != -1){
+		switch(c){
+		case 'd':
+			ret = origin_blocks(optarg, &nr_blocks);
+			if(ret) return ret;
+			break;
+		default:
+			print_help(argv[0], EINVAL);
+		}
+	}
+
+	if(argc - optind != 1) print_help(argv[0], EINVAL);
+
+	select_scanner();
+	derive = !nr_blocks;
+
+	//open cow file
+	cow_fd = open(argv[optind], O_RDONLY);
+	if(cow_fd < 0){
+		ret = errno;
+		errno = 0;
+		fprintf(stderr, "error opening cow file\n");
+		goto error;
+	}
+
+	if(fstat(cow_fd, &st)){
+		ret = errno;
+		errno = 0;
+		fprintf(stderr, "error determining size of cow file\n");
+		goto error;
+	}
+
+	//read cow header from cow file
+	bytes = pread(cow_fd, &ch, sizeof(struct cow_header), 0);
+	if(bytes != sizeof(struct cow_header)){
+		ret = (bytes < 0) ? errno : EINVAL;
+		errno = 0;
+		fprintf(stderr, "error reading cow header\n");
+		goto error;
+	}
+
+	ret = check_header(&ch, st.st_size, &problems);
+	if(ret) goto error;
+
+	print_header(&ch, st.st_size);
+
+	snapshot = !(ch.flags & (1 << COW_INDEX_ONLY));
+
+	//work out how many entries the index has
+	memset(&is, 0, sizeof(struct index_stats));
+	if(!derive){
+		is.entries = (nr_blocks + COW_SECTION_SIZE - 1) / COW_SECTION_SIZE * COW_SECTION_SIZE;
+	}else{
+		nr_blocks = UINT64_MAX;
+		if(snapshot) is.entries = (ch.fpos * COW_BLOCK_SIZE - COW_HEADER_SIZE) / sizeof(uint64_t);
+		else is.entries = (ch.fsize - COW_HEADER_SIZE) / sizeof(uint64_t);
+	}
+
+	//reading past the end of the file through a mapping would raise SIGBUS
+	if(st.st_size < COW_HEADER_SIZE + (off_t)(is.entries * sizeof(uint64_t))){
+		if(!derive){
+			ret = EINVAL;
+			fprintf(stderr, "cow file is too small to hold the index of the origin device\n");
+			goto error;
+		}
+
+		is.entries = (st.st_size - COW_HEADER_SIZE) / sizeof(uint64_t);
+	}
+
+	ret = scan_cow_index(cow_fd, snapshot, ch.fpos, nr_blocks, derive, &is);
+	if(ret) goto error;
+
+	print_index(&is, &ch, snapshot, nr_blocks, derive);
+
+	data_offset = COW_HEADER_SIZE + is.entries * sizeof(uint64_t);
+	data_end = (snapshot) ? ch.fpos * COW_BLOCK_SIZE : data_offset;
+
+	memset(&es, 0, sizeof(struct extent_stats));
+	ret = scan_extents(cow_fd, data_offset, data_end, &es);
+	if(!ret) print_extents(&es);
+	else if(ret == EOPNOTSUPP) printf("fragmentation: not reported by the file system\n");
+	else{
+		fprintf(stderr, "error mapping extents of cow file\n");
+		goto error;
+	}
+
+	if(ch.version >= COW_VERSION_CHANGED_BLOCKS && ch.nr_changed_blocks != is.changed && (ch.flags & (1 << COW_CLEAN))){
+		printf("problem: header counts %llu changed blocks, the index %llu\n", (unsigned long long)ch.nr_changed_blocks, (unsigned long long)is.changed);
+		problems++;
+	}
+
+	if(is.past_end){
+		printf("problem: %llu changed blocks past the end of the origin device\n", (unsigned long long)is.past_end);
+		problems++;
+	}
+
+	if(snapshot && is.bad_maps){
+		printf("problem: %llu mappings past the data written\n", (unsigned long long)is.bad_maps);
+		problems++;
+	}
+
+	if(snapshot && is.changed && is.min_map * COW_BLOCK_SIZE < data_offset){
+		printf("problem: mappings point into the index\n");
+		problems++;
+	}
+
+	if(snapshot && (ch.flags & (1 << COW_CLEAN)) && data_offset <= ch.fpos * COW_BLOCK_SIZE && is.changed != ch.fpos - data_offset / COW_BLOCK_SIZE){
+		printf("problem: %llu changed blocks, but %llu blocks of data written\n", (unsigned long long)is.changed, (unsigned long long)(ch.fpos - data_offset / COW_BLOCK_SIZE));
+		problems++;
+	}
+
+	ret = (problems) ? EINVAL : 0;
+
+error:
+	if(cow_fd >= 0) close(cow_fd);
+
+	return ret;
+}
@@ -0,0 +1,143 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Copyright (C) 2026 Datto Inc.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+
+#include "delta.h"
+
+//header bytes covered by the header crc, which follows them
+#define DELTA_HEADER_CRC_OFFSET 72
+
+static void put_le(uint8_t *buf, uint64_t val, int bytes){
+	int i;
+
+	for(i = 0; i < bytes; i++) buf[i] = (uint8_t)(val >> (8 * i));
+}
+
+static uint64_t get_le(const uint8_t *buf, int bytes){
+	int i;
+	uint64_t val = 0;
+
+	for(i = 0; i < bytes; i++) val |= (uint64_t)buf[i] << (8 * i);
+	return val;
+}
+
+void delta_put_header(uint8_t *buf, const struct delta_header *dh){
+	memset(buf, 0, DELTA_HEADER_SIZE);
+	memcpy(buf, DELTA_MAGIC, 8);
+	put_le(buf + 8, DELTA_VERSION, 4);
+	put_le(buf + 12, dh->flags, 4);
+	put_le(buf + 16, dh->block_size, 4);
+	put_le(buf + 20, dh->table_crc, 4);
+	put_le(buf + 24, dh->from_seqid, 8);
+	put_le(buf + 32, dh->seqid, 8);
+	put_le(buf + 40, dh->size, 8);
+	put_le(buf + 48, dh->nr_extents, 8);
+	memcpy(buf + 56, dh->uuid, COW_UUID_SIZE);
+	put_le(buf + DELTA_HEADER_CRC_OFFSET, crc32c(0, buf, DELTA_HEADER_CRC_OFFSET), 4);
+}
+
+int delta_get_header(const uint8_t *buf, struct delta_header *dh){
+	if(memcmp(buf, DELTA_MAGIC, 8) || get_le(buf + 8, 4) != DELTA_VERSION) return EINVAL;
+	if(get_le(buf + DELTA_HEADER_CRC_OFFSET, 4) != crc32c(0, buf, DELTA_HEADER_CRC_OFFSET)) return EINVAL;
+
+	dh->flags = get_le(buf + 12, 4);
+	dh->block_size = get_le(buf + 16, 4);
+	dh->table_crc = get_le(buf + 20, 4);
+	dh->from_seqid = get_le(buf + 24, 8);
+	dh->seqid = get_le(buf + 32, 8);
+	dh->size = get_le(buf + 40, 8);
+	dh->nr_extents = get_le(buf + 48, 8);
+	memcpy(dh->uuid, buf + 56, COW_UUID_SIZE);
+	return 0;
+}
+
+void delta_put_extent(uint8_t *buf, uint64_t start, uint64_t len){
+	put_le(buf, start, 8);
+	put_le(buf + 8, len, 8);
+}
+
+void delta_get_extent(const uint8_t *buf, uint64_t *start, uint64_t *len){
+	*start = get_le(buf, 8);
+	*len = get_le(buf + 8, 8);
+}
+
+void delta_put_crc(uint8_t *buf, uint32_t crc){
+	put_le(buf, crc, 4);
+}
+
+uint32_t delta_get_crc(const uint8_t *buf){
+	return get_le(buf, 4);
+}
+
+//reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len){
+	const uint8_t *p = buf;
+
+	crc = ~crc;
+	while(len--) crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define HAVE_X86_CRC32C
+#include <immintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *buf, size_t len){
+	const uint8_t *p = buf;
+#ifdef __x86_64__
+	uint64_t c = ~crc, v;
+
+	for(; len >= 8; p += 8, len -= 8){
+		memcpy(&v, p, 8);
+		c = _mm_crc32_u64(c, v);
+	}
+	crc = (uint32_t)c;
+#else
+	uint32_t v;
+
+	crc = ~crc;
+	for(; len >= 4; p += 4, len -= 4){
+		memcpy(&v, p, 4);
+		crc = _mm_crc32_u32(crc, v);
+	}
+#endif
+
+	while(len--) crc = _mm_crc32_u8(crc, *p++);
+
+	return ~crc;
+}
+#endif
+
+uint32_t (*crc32c)(uint32_t crc, const void *buf, size_t len) = crc32c_sw;
+
+static void init_crc32c_table(void){
+	uint32_t i, j, c;
+
+	for(i = 0; i < 256; i++){
+		c = i;
+		for(j = 0; j < 8; j++) c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		crc32c_table[i] = c;
+	}
+}
+
+void select_crc32c(void){
+	init_crc32c_table();
+
+#ifdef HAVE_X86_CRC32C
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse4.2")) crc32c = crc32c_sse42;
+#endif
+}
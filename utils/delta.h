@@ -0,0 +1,67 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Copyright (C) 2026 Datto Inc.
+ */
+
+#ifndef DELTA_H_
+#define DELTA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libdattobd.h"
+
+/*
+ * A delta stream carries the blocks that changed between two snapshots of a
+ * series, as written by write-delta and read by apply-delta:
+ *
+ *   header     DELTA_HEADER_SIZE bytes, checked by a crc32c of its own
+ *   table      nr_extents entries of DELTA_EXTENT_SIZE bytes: the first block
+ *              and the length in blocks of each extent, in ascending order
+ *   data       the contents of each extent in table order, the last one cut
+ *              short at the end of the snapshot, each followed by the crc32c
+ *              of its contents if DELTA_CHECKSUMS is set
+ *
+ * All integers are little endian. The table comes first so that the whole
+ * stream can be checked for sanity before any data is written to an image.
+ */
+#define DELTA_MAGIC "DBDDELTA"
+#define DELTA_VERSION 1
+#define DELTA_HEADER_SIZE 80
+#define DELTA_EXTENT_SIZE 16
+
+//flags
+#define DELTA_CHECKSUMS 1
+
+struct delta_header {
+	uint32_t flags;
+	uint32_t block_size; //bytes per block
+	uint32_t table_crc; //crc32c of the encoded table
+	uint64_t from_seqid; //snapshot the image must have been copied from
+	uint64_t seqid; //snapshot the image is brought to
+	uint64_t size; //of the snapshot in bytes
+	uint64_t nr_extents;
+	uint8_t uuid[COW_UUID_SIZE];
+};
+
+void delta_put_header(uint8_t *buf, const struct delta_header *dh);
+
+//returns 0 or EINVAL if buf does not hold a header this version understands
+int delta_get_header(const uint8_t *buf, struct delta_header *dh);
+
+void delta_put_extent(uint8_t *buf, uint64_t start, uint64_t len);
+
+void delta_get_extent(const uint8_t *buf, uint64_t *start, uint64_t *len);
+
+void delta_put_crc(uint8_t *buf, uint32_t crc);
+
+uint32_t delta_get_crc(const uint8_t *buf);
+
+//crc32c (Castagnoli) of len bytes at buf, continuing from crc (0 to start)
+extern uint32_t (*crc32c)(uint32_t crc, const void *buf, size_t len);
+
+//uses the crc32 instruction of SSE4.2 for crc32c() when the cpu has it
+void select_crc32c(void);
+
+#endif /* DELTA_H_ */
@@ -4,6 +4,7 @@
  * Copyright (C) 2015 Datto Inc.
  */
 
+#define _GNU_SOURCE
 #define _FILE_OFFSET_BITS 64
 #define __USE_LARGEFILE64
 
@@ -12,231 +13,544 @@
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sys/syscall.h>
 
-#include "libdattobd.h"
+#include "cow-index.h"
 
-#define INDEX_BUFFER_SIZE 8192
+//defaults for the -t and -m options
+#define DEFAULT_THREADS 4
+#define DEFAULT_EXTENT_MB 1
+
+//alignment of the copy buffers, enough for O_DIRECT on any device
+#define BUFFER_ALIGN 4096
 
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 
+//ways of moving data from the snapshot to the image, best first
+enum copy_method {
+	COPY_FILE_RANGE, //in-kernel copy, no data passes through user space
+	COPY_SPLICE, //through a pipe, for when the files cannot be copied
+	             //between directly (a block device source, for instance)
+	COPY_BUFFERED, //pread and pwrite through a user space buffer
+};
+
 typedef unsigned long long sector_t;
 
+//a run of consecutive changed blocks
+struct extent {
+	sector_t start;
+	sector_t len;
+};
+
+//extents handed from the index scan to the copy threads
+struct copy_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	struct extent *extents;
+	unsigned int size; //capacity of extents, bounds the copies in flight
+	unsigned int head;
+	unsigned int count;
+	int done; //no more extents will be queued
+
+	int snap_fd;
+	int img_fd;
+	off_t snap_size;
+	sector_t err_count; //blocks that could not be copied
+};
+
+struct copy_worker {
+	pthread_t thread;
+	struct copy_queue *q;
+	char *buf; //room for the largest extent
+	int method; //best &enum copy_method the kernel accepted so far
+	int pipe_fds[2]; //for COPY_SPLICE
+	size_t pipe_size;
+};
+
 static void print_help(char* progname, int status){
-	fprintf(stderr, "Usage: %s <snapshot device> <cow file> <image file>\n", progname);
+	fprintf(stderr, "Usage: %s [-t <threads>] [-m <max extent size>] <snapshot device> <cow file>... <image file>\n", progname);
+	fprintf(stderr, "max extent size should be provided in megabytes.\n");
 	exit(status);
 }
 
-static int copy_block(FILE *snap, FILE *img, sector_t block){
-	char buf[COW_BLOCK_SIZE];
-	int ret;
-	size_t bytes;
+static int parse_ui(const char *str, unsigned int *out){
+	long tmp;
+	const char *c = str;
 
-	bytes = pread(fileno(snap), buf, COW_BLOCK_SIZE, block * COW_BLOCK_SIZE);
-	if(bytes != COW_BLOCK_SIZE){
-		ret = errno;
-		errno = 0;
-		fprintf(stderr, "error reading data block from snapshot\n");
-		goto error;
-	}
+	//check that string is an integer number and has a length
+	do{
+		if(!isdigit(*c)) goto error;
+		c++;
+	}while(*c);
 
-	bytes = pwrite(fileno(img), buf, COW_BLOCK_SIZE, block * COW_BLOCK_SIZE);
-	if(bytes != COW_BLOCK_SIZE){
-		ret = errno;
-		errno = 0;
-		fprintf(stderr, "error writing data block to output image\n");
+	//convert to long
+	tmp = strtol(str, NULL, 0);
+	if(errno) goto error;
+
+	//check boundaries
+	if(tmp < 0 || tmp == LONG_MAX){
+		errno = ERANGE;
 		goto error;
 	}
 
+	*out = (unsigned int)tmp;
 	return 0;
 
 error:
-	fprintf(stderr, "error copying sector to output image\n");
-	return ret;
+	*out = 0;
+	return -1;
 }
 
-static int verify_files(FILE *cow, unsigned minor){
-	int ret;
-	size_t bytes;
-	struct cow_header ch;
-	struct dattobd_info *info = NULL;
+//like pread and pwrite, but retry until everything is transferred
+static int full_pread(int fd, char *buf, size_t count, off_t offset){
+	ssize_t bytes;
 
-	//allocate a buffer for the proc data
-	info = malloc(sizeof(struct dattobd_info));
-	if(!info){
-		ret = ENOMEM;
-		errno = 0;
-		fprintf(stderr, "error allocating mmeory for dattobd info\n");
-		goto error;
+	while(count){
+		bytes = pread(fd, buf, count, offset);
+		if(bytes < 0 && errno == EINTR) continue;
+		if(bytes <= 0) return -1;
+
+		buf += bytes;
+		count -= bytes;
+		offset += bytes;
 	}
 
-	//read info from the dattobd driver
-	ret = dattobd_info(minor, info);
-	if(ret){
-		ret = errno;
-		errno = 0;
-		fprintf(stderr, "error reading dattobd info from driver\n");
-		goto error;
+	return 0;
+}
+
+static int full_pwrite(int fd, const char *buf, size_t count, off_t offset){
+	ssize_t bytes;
+
+	while(count){
+		bytes = pwrite(fd, buf, count, offset);
+		if(bytes < 0 && errno == EINTR) continue;
+		if(bytes <= 0) return -1;
+
+		buf += bytes;
+		count -= bytes;
+		offset += bytes;
 	}
 
-	//read cow header from cow file
-	bytes = pread(fileno(cow), &ch, sizeof(struct cow_header), 0);
-	if(bytes != sizeof(struct cow_header)){
-		ret = errno;
-		errno = 0;
-		fprintf(stderr, "error reading cow header\n");
-		goto error;
+	return 0;
+}
+
+//errors meaning the kernel cannot copy this way at all, rather than failed i/o
+static int copy_unsupported(int err){
+	return err == EINVAL || err == EXDEV || err == ENOSYS || err == EOPNOTSUPP || err == EBADF;
+}
+
+//the glibc wrapper is recent and older versions emulate it in user space
+static ssize_t sys_copy_file_range(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len){
+#ifdef __NR_copy_file_range
+	return syscall(__NR_copy_file_range, fd_in, off_in, fd_out, off_out, len, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+//the copy_*() functions advance offset and bytes by what they copied
+static int copy_file_range_loop(struct copy_worker *w, off_t *offset, size_t *bytes){
+	ssize_t done;
+	loff_t in_off, out_off;
+
+	while(*bytes){
+		in_off = out_off = *offset;
+		done = sys_copy_file_range(w->q->snap_fd, &in_off, w->q->img_fd, &out_off, *bytes);
+		if(done < 0 && errno == EINTR) continue;
+		if(done <= 0){
+			//the source ended early or the copy cannot be done in-kernel
+			if(!done) errno = EINVAL;
+			return -1;
+		}
+
+		*offset += done;
+		*bytes -= done;
 	}
 
-	//check the cow file's magic number
-	if(ch.magic != COW_MAGIC){
-		ret = EINVAL;
-		fprintf(stderr, "invalid magic number from cow file\n");
-		goto error;
+	return 0;
+}
+
+//opens the pipe of w, sized to hold a whole extent if the system allows it
+static void open_pipe(struct copy_worker *w, size_t size){
+#ifdef F_SETPIPE_SZ
+	int ret;
+#endif
+
+	if(pipe(w->pipe_fds)){
+		w->pipe_fds[0] = w->pipe_fds[1] = -1;
+		if(w->method == COPY_SPLICE) w->method = COPY_BUFFERED;
+		return;
 	}
 
-	//check the uuid
-	if(memcmp(ch.uuid, info->uuid, COW_UUID_SIZE) != 0){
-		ret = EINVAL;
-		fprintf(stderr, "cow file uuid does not match snapshot\n");
-		goto error;
+	//pipes hold 64k by default, which would split up every extent
+	w->pipe_size = size;
+#ifdef F_SETPIPE_SZ
+	ret = fcntl(w->pipe_fds[1], F_SETPIPE_SZ, size);
+	if(ret > 0) w->pipe_size = ret;
+#endif
+}
+
+static void close_pipe(struct copy_worker *w){
+	if(w->pipe_fds[0] >= 0) close(w->pipe_fds[0]);
+	if(w->pipe_fds[1] >= 0) close(w->pipe_fds[1]);
+	w->pipe_fds[0] = w->pipe_fds[1] = -1;
+}
+
+//replaces the pipe of w, which may hold data that could not be written out
+static void reset_pipe(struct copy_worker *w){
+	size_t size = w->pipe_size;
+
+	close_pipe(w);
+	open_pipe(w, size);
+}
+
+static int copy_splice(struct copy_worker *w, off_t *offset, size_t *bytes){
+	ssize_t in, out;
+	loff_t in_off = *offset, out_off;
+
+	while(*bytes){
+		in = splice(w->q->snap_fd, &in_off, w->pipe_fds[1], NULL, MIN(*bytes, w->pipe_size), SPLICE_F_MOVE | SPLICE_F_MORE);
+		if(in < 0 && errno == EINTR) continue;
+		if(in <= 0){
+			if(!in) errno = EINVAL;
+			return -1;
+		}
+
+		while(in){
+			out_off = *offset;
+			out = splice(w->pipe_fds[0], NULL, w->q->img_fd, &out_off, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if(out < 0 && errno == EINTR) continue;
+			if(out <= 0){
+				if(!out) errno = EIO;
+				reset_pipe(w);
+				return -1;
+			}
+
+			in -= out;
+			*offset += out;
+			*bytes -= out;
+		}
 	}
 
-	//check the sequence id
-	if(ch.seqid != info->seqid - 1){
-		ret = EINVAL;
-		fprintf(stderr, "snapshot provided does not immediately follow the snapshot that created the cow file\n");
-		goto error;
+	return 0;
+}
+
+static int copy_buffered(struct copy_worker *w, off_t *offset, size_t *bytes){
+	if(full_pread(w->q->snap_fd, w->buf, *bytes, *offset)){
+		fprintf(stderr, "error reading data block from snapshot\n");
+		return -1;
 	}
 
-	free(info);
+	if(full_pwrite(w->q->img_fd, w->buf, *bytes, *offset)){
+		fprintf(stderr, "error writing data block to output image\n");
+		return -1;
+	}
 
+	*offset += *bytes;
+	*bytes = 0;
 	return 0;
+}
 
-error:
-	if(info) free(info);
-	return ret;
+static int copy_range(struct copy_worker *w, sector_t block, sector_t len){
+	int ret;
+	off_t offset = (off_t)block * COW_BLOCK_SIZE;
+	size_t bytes = len * COW_BLOCK_SIZE;
+
+	//the last block of the snapshot may be partial
+	if(offset + (off_t)bytes > w->q->snap_size) bytes = w->q->snap_size - offset;
+
+	//any failure moves on to the next method for the rest of the range, so
+	//that real i/o errors are reported by the buffered copy, but only methods
+	//the kernel refuses are given up on for good
+	if(w->method == COPY_FILE_RANGE){
+		ret = copy_file_range_loop(w, &offset, &bytes);
+		if(!ret) return 0;
+		if(copy_unsupported(errno)) w->method = COPY_SPLICE;
+	}
+
+	if(w->method == COPY_SPLICE){
+		ret = copy_splice(w, &offset, &bytes);
+		if(!ret) return 0;
+		if(copy_unsupported(errno)) w->method = COPY_BUFFERED;
+	}
+
+	return copy_buffered(w, &offset, &bytes);
+}
+
+//returns the number of blocks of the extent that could not be copied
+static sector_t copy_extent(struct copy_worker *w, const struct extent *ext){
+	sector_t i, errs = 0;
+
+	if(!copy_range(w, ext->start, ext->len)) return 0;
+
+	//retry one block at a time so only the bad blocks are lost
+	for(i = 0; i < ext->len; i++){
+		if(ext->len > 1 && !copy_range(w, ext->start + i, 1)) continue;
+
+		fprintf(stderr, "error copying sector to output image\n");
+		errs++;
+	}
+
+	return errs;
+}
+
+static void *copy_thread(void *arg){
+	struct copy_worker *w = arg;
+	struct copy_queue *q = w->q;
+	struct extent ext;
+	sector_t errs;
+
+	while(1){
+		pthread_mutex_lock(&q->lock);
+		while(!q->count && !q->done) pthread_cond_wait(&q->not_empty, &q->lock);
+		if(!q->count){
+			pthread_mutex_unlock(&q->lock);
+			break;
+		}
+
+		ext = q->extents[q->head];
+		q->head = (q->head + 1) % q->size;
+		q->count--;
+		pthread_cond_signal(&q->not_full);
+		pthread_mutex_unlock(&q->lock);
+
+		errs = copy_extent(w, &ext);
+		if(!errs) continue;
+
+		pthread_mutex_lock(&q->lock);
+		q->err_count += errs;
+		pthread_mutex_unlock(&q->lock);
+	}
+
+	return NULL;
+}
+
+static void queue_extent(struct copy_queue *q, const struct extent *ext){
+	pthread_mutex_lock(&q->lock);
+	while(q->count == q->size) pthread_cond_wait(&q->not_full, &q->lock);
+
+	q->extents[(q->head + q->count) % q->size] = *ext;
+	q->count++;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static void queue_finish(struct copy_queue *q){
+	pthread_mutex_lock(&q->lock);
+	q->done = 1;
+	pthread_cond_broadcast(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+//turns changed blocks into extents for the copy threads
+struct extent_builder {
+	struct copy_queue *q;
+	struct extent ext; //extent being grown, not queued yet
+	sector_t max_blocks;
+	sector_t count; //changed blocks
+	sector_t nr_extents;
+};
+
+static void add_run(uint64_t start, uint64_t len, void *arg){
+	struct extent_builder *eb = arg;
+	sector_t take;
+
+	eb->count += len;
+	while(len){
+		if(eb->ext.len && start == eb->ext.start + eb->ext.len && eb->ext.len < eb->max_blocks){
+			take = MIN(len, eb->max_blocks - eb->ext.len);
+			eb->ext.len += take;
+		}else{
+			if(eb->ext.len){
+				queue_extent(eb->q, &eb->ext);
+				eb->nr_extents++;
+			}
+			take = MIN(len, eb->max_blocks);
+			eb->ext.start = start;
+			eb->ext.len = take;
+		}
+
+		start += take;
+		len -= take;
+	}
+}
+
+static void finish_runs(struct extent_builder *eb){
+	if(!eb->ext.len) return;
+
+	queue_extent(eb->q, &eb->ext);
+	eb->nr_extents++;
+	eb->ext.len = 0;
 }
 
 int main(int argc, char **argv){
-	int ret;
-	unsigned minor;
-	size_t snap_size, bytes, blocks_to_read;
-	sector_t total_chunks, total_blocks, i, j, blocks_done = 0, count = 0, err_count = 0;
-	FILE *cow = NULL, *snap = NULL, *img = NULL;
-	uint64_t *mappings = NULL;
-	char *snap_path;
-	char snap_path_buf[PATH_MAX];
+	int ret, c, *cow_fds = NULL;
+	unsigned minor, nr_cows = 0, nr_threads = DEFAULT_THREADS, extent_mb = DEFAULT_EXTENT_MB, started = 0, t;
+	sector_t total_blocks, max_blocks;
+	struct copy_queue q;
+	struct copy_worker *workers = NULL;
+	struct extent_builder eb;
+
+	memset(&q, 0, sizeof(q));
+	memset(&eb, 0, sizeof(eb));
+	q.snap_fd = -1;
+	q.img_fd = -1;
+	pthread_mutex_init(&q.lock, NULL);
+	pthread_cond_init(&q.not_empty, NULL);
+	pthread_cond_init(&q.not_full, NULL);
+
+	while((c = getopt(argc, argv, "t:m:")) != -1){
+		switch(c){
+		case 't':
+			if(parse_ui(optarg, &nr_threads) || !nr_threads) print_help(argv[0], EINVAL);
+			break;
+		case 'm':
+			if(parse_ui(optarg, &extent_mb) || !extent_mb) print_help(argv[0], EINVAL);
+			break;
+		default:
+			print_help(argv[0], EINVAL);
+		}
+	}
 
-	if(argc != 4) print_help(argv[0], EINVAL);
+	if(argc - optind < 3) print_help(argv[0], EINVAL);
 
 	//open snapshot
-	snap = fopen(argv[1], "r");
-	if(!snap){
+	q.snap_fd = open(argv[optind], O_RDONLY);
+	if(q.snap_fd < 0){
 		ret = errno;
 		errno = 0;
 		fprintf(stderr, "error opening snapshot\n");
 		goto error;
 	}
 
-	//open cow file
-	cow = fopen(argv[2], "r");
-	if(!cow){
-		ret = errno;
-		errno = 0;
-		fprintf(stderr, "error opening cow file\n");
+	//open cow files, everything between the snapshot and the image
+	cow_fds = malloc((argc - optind - 2) * sizeof(int));
+	if(!cow_fds){
+		ret = ENOMEM;
+		fprintf(stderr, "error allocating cow files\n");
 		goto error;
 	}
 
-	//open original image
-	img = fopen(argv[3], "r+");
-	if(!img){
-		ret = errno;
-		errno = 0;
-		fprintf(stderr, "error opening image\n");
-		goto error;
+	for(; nr_cows < (unsigned)(argc - optind - 2); nr_cows++){
+		cow_fds[nr_cows] = open(argv[optind + 1 + nr_cows], O_RDONLY);
+		if(cow_fds[nr_cows] < 0){
+			ret = errno;
+			errno = 0;
+			fprintf(stderr, "error opening cow file %s\n", argv[optind + 1 + nr_cows]);
+			goto error;
+		}
 	}
 
-	//get the full path of the cow file
-	snap_path = realpath(argv[1], snap_path_buf);
-	if(!snap_path){
+	//open original image
+	q.img_fd = open(argv[argc - 1], O_RDWR);
+	if(q.img_fd < 0){
 		ret = errno;
 		errno = 0;
-		fprintf(stderr, "error determining full path of snapshot\n");
+		fprintf(stderr, "error opening image\n");
 		goto error;
 	}
 
 	//get the minor number of the snapshot
-	ret = sscanf(snap_path, "/dev/datto%u", &minor);
-	if(ret != 1){
-		ret = errno;
-		errno = 0;
-		fprintf(stderr, "snapshot does not appear to be a dattobd snapshot device\n");
-		goto error;
-	}
+	ret = snapshot_minor(argv[optind], &minor);
+	if(ret) goto error;
 
 	//verify all of the inputs before attempting to merge
-	ret = verify_files(cow, minor);
+	ret = verify_cow_files(cow_fds, nr_cows, minor, NULL);
 	if(ret) goto error;
 
 	//get size of snapshot, calculate other needed sizes
-	fseeko(snap, 0, SEEK_END);
-	snap_size = ftello(snap);
-	total_blocks = (snap_size + COW_BLOCK_SIZE - 1) / COW_BLOCK_SIZE;
-	total_chunks = (total_blocks + INDEX_BUFFER_SIZE - 1) / INDEX_BUFFER_SIZE;
-	rewind(snap);
+	q.snap_size = lseek(q.snap_fd, 0, SEEK_END);
+	if(q.snap_size < 0){
+		ret = errno;
+		errno = 0;
+		fprintf(stderr, "error determining size of snapshot\n");
+		goto error;
+	}
+	total_blocks = (q.snap_size + COW_BLOCK_SIZE - 1) / COW_BLOCK_SIZE;
+	max_blocks = (sector_t)extent_mb * 1024 * 1024 / COW_BLOCK_SIZE;
 
 	printf("snapshot is %llu blocks large\n", total_blocks);
 
-	//allocate mappings array
-	mappings = malloc(INDEX_BUFFER_SIZE * sizeof(uint64_t));
-	if(!mappings){
+	//two extents per thread keep every thread busy while the scan catches up
+	q.size = nr_threads * 2;
+	q.extents = malloc(q.size * sizeof(struct extent));
+	workers = calloc(nr_threads, sizeof(struct copy_worker));
+	if(!q.extents || !workers){
 		ret = ENOMEM;
-		fprintf(stderr, "error allocating mappings\n");
+		fprintf(stderr, "error allocating copy queue\n");
 		goto error;
 	}
 
-	//count number of blocks changed while performing merge
-	printf("copying blocks\n");
-	for(i = 0; i < total_chunks; i++){
-		//read a chunk of mappings from the cow file
-		blocks_to_read = MIN(INDEX_BUFFER_SIZE, total_blocks - blocks_done);
+	for(t = 0; t < nr_threads; t++){
+		workers[t].q = &q;
+		workers[t].method = COPY_FILE_RANGE;
+		open_pipe(&workers[t], max_blocks * COW_BLOCK_SIZE);
 
-		bytes = pread(fileno(cow), mappings, blocks_to_read * sizeof(uint64_t), COW_HEADER_SIZE + (INDEX_BUFFER_SIZE * sizeof(uint64_t) * i));
-		if(bytes != blocks_to_read * sizeof(uint64_t)){
-			ret = errno;
-			errno = 0;
-			fprintf(stderr, "error reading mappings into memory\n");
+		ret = posix_memalign((void **)&workers[t].buf, BUFFER_ALIGN, max_blocks * COW_BLOCK_SIZE);
+		if(ret){
+			workers[t].buf = NULL;
+			fprintf(stderr, "error allocating copy buffers\n");
 			goto error;
 		}
 
-		//copy blocks where the mapping is set
-		for(j = 0; j < blocks_to_read; j++){
-			if(!mappings[j]) continue;
-
-			ret = copy_block(snap, img, (INDEX_BUFFER_SIZE * i) + j);
-			if(ret) err_count++;
-
-			count++;
+		ret = pthread_create(&workers[t].thread, NULL, copy_thread, &workers[t]);
+		if(ret){
+			fprintf(stderr, "error starting copy threads\n");
+			goto error;
 		}
-
-		blocks_done += blocks_to_read;
+		started++;
 	}
 
-	//print number of blocks changed
-	printf("copying complete: %llu blocks changed, %llu errors\n", count, err_count);
+	//merge changed blocks into extents and queue them for the copy threads
+	printf("copying blocks\n");
+	eb.q = &q;
+	eb.max_blocks = max_blocks;
+	select_scanner();
+	ret = scan_index(cow_fds, nr_cows, total_blocks, add_run, &eb);
+	if(ret) goto error;
+	finish_runs(&eb);
 
-	free(mappings);
-	fclose(cow);
-	fclose(snap);
-	fclose(img);
+	queue_finish(&q);
+	for(t = 0; t < started; t++) pthread_join(workers[t].thread, NULL);
+	started = 0;
 
-	return 0;
+	//print number of blocks changed
+	printf("copying complete: %llu blocks changed in %llu extents, %llu errors\n", eb.count, eb.nr_extents, q.err_count);
+
+	ret = 0;
 
 error:
-	if(mappings) free(mappings);
-	if(cow) fclose(cow);
-	if(snap) fclose(snap);
-	if(img) fclose(img);
+	//stop the copy threads, dropping whatever is still queued
+	if(started){
+		pthread_mutex_lock(&q.lock);
+		q.count = 0;
+		pthread_mutex_unlock(&q.lock);
+		queue_finish(&q);
+		for(t = 0; t < started; t++) pthread_join(workers[t].thread, NULL);
+	}
+
+	if(workers){
+		for(t = 0; t < nr_threads; t++){
+			free(workers[t].buf);
+			if(workers[t].q) close_pipe(&workers[t]);
+		}
+		free(workers);
+	}
+	if(q.extents) free(q.extents);
+	if(cow_fds){
+		for(t = 0; t < nr_cows; t++){
+			if(cow_fds[t] >= 0) close(cow_fds[t]);
+		}
+		free(cow_fds);
+	}
+	if(q.snap_fd >= 0) close(q.snap_fd);
+	if(q.img_fd >= 0) close(q.img_fd);
 
 	return ret;
 }
@@ -0,0 +1,474 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Copyright (C) 2026 Datto Inc.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include "cow-index.h"
+
+//defaults for the -t and -m options
+#define DEFAULT_THREADS 4
+#define DEFAULT_CHUNK_MB 4
+
+//alignment of the read buffers, enough for O_DIRECT on any device
+#define BUFFER_ALIGN 4096
+
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+
+typedef unsigned long long sector_t;
+
+//a range of blocks, to verify or found to differ
+struct extent {
+	sector_t start;
+	sector_t len;
+};
+
+//chunks handed to the verify threads, and the ranges they found
+struct verify_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	struct extent *chunks;
+	unsigned int size;
+	unsigned int head;
+	unsigned int count;
+	int done; //no more chunks will be queued
+
+	int snap_fd;
+	int img_fd;
+	off_t snap_size;
+
+	struct extent *bad; //ranges that differ, in no particular order
+	size_t nr_bad;
+	size_t bad_size;
+	sector_t bad_blocks;
+	sector_t err_blocks; //blocks that could not be read
+	sector_t verified; //blocks compared
+};
+
+struct verify_worker {
+	pthread_t thread;
+	struct verify_queue *q;
+	char *snap_buf; //room for one chunk of the snapshot
+	char *img_buf; //and of the image
+};
+
+static void print_help(char* progname, int status){
+	fprintf(stderr, "Usage: %s [-t <threads>] [-m <chunk size>] <snapshot device> [<cow file>...] <image file>\n", progname);
+	fprintf(stderr, "chunk size should be provided in megabytes.\n");
+	exit(status);
+}
+
+static int parse_ui(const char *str, unsigned int *out){
+	long tmp;
+	const char *c = str;
+
+	//check that string is an integer number and has a length
+	do{
+		if(!isdigit(*c)) goto error;
+		c++;
+	}while(*c);
+
+	//convert to long
+	tmp = strtol(str, NULL, 0);
+	if(errno) goto error;
+
+	//check boundaries
+	if(tmp < 0 || tmp == LONG_MAX){
+		errno = ERANGE;
+		goto error;
+	}
+
+	*out = (unsigned int)tmp;
+	return 0;
+
+error:
+	*out = 0;
+	return -1;
+}
+
+//like pread, but retry until everything is transferred
+static int full_pread(int fd, char *buf, size_t count, off_t offset){
+	ssize_t bytes;
+
+	while(count){
+		bytes = pread(fd, buf, count, offset);
+		if(bytes < 0 && errno == EINTR) continue;
+		if(bytes <= 0) return -1;
+
+		buf += bytes;
+		count -= bytes;
+		offset += bytes;
+	}
+
+	return 0;
+}
+
+//records a range of blocks that differ, merging it with the last one if it can
+static void add_bad(struct verify_queue *q, sector_t start, sector_t len){
+	struct extent *tmp;
+
+	q->bad_blocks += len;
+
+	if(q->nr_bad && q->bad[q->nr_bad - 1].start + q->bad[q->nr_bad - 1].len == start){
+		q->bad[q->nr_bad - 1].len += len;
+		return;
+	}
+
+	if(q->nr_bad == q->bad_size){
+		tmp = realloc(q->bad, (q->bad_size * 2 + 64) * sizeof(struct extent));
+		if(!tmp){
+			//the counts stay right, only the list of ranges is cut short
+			fprintf(stderr, "error allocating memory for mismatched ranges\n");
+			return;
+		}
+		q->bad = tmp;
+		q->bad_size = q->bad_size * 2 + 64;
+	}
+
+	q->bad[q->nr_bad].start = start;
+	q->bad[q->nr_bad].len = len;
+	q->nr_bad++;
+}
+
+static void verify_chunk(struct verify_worker *w, const struct extent *chunk){
+	struct verify_queue *q = w->q;
+	off_t offset = (off_t)chunk->start * COW_BLOCK_SIZE;
+	size_t bytes = chunk->len * COW_BLOCK_SIZE, block_bytes;
+	sector_t i, nr = chunk->len, nr_same = 0, bad_start = 0, bad_len = 0;
+	int read_err = 0, differs;
+
+	//the last block of the snapshot may be partial
+	if(offset + (off_t)bytes > q->snap_size) bytes = q->snap_size - offset;
+
+	if(full_pread(q->snap_fd, w->snap_buf, bytes, offset)){
+		fprintf(stderr, "error reading blocks %llu-%llu from snapshot\n", chunk->start, chunk->start + nr - 1);
+		read_err = 1;
+	}
+
+	if(!read_err && full_pread(q->img_fd, w->img_buf, bytes, offset)){
+		fprintf(stderr, "error reading blocks %llu-%llu from image\n", chunk->start, chunk->start + nr - 1);
+		read_err = 1;
+	}
+
+	if(read_err){
+		pthread_mutex_lock(&q->lock);
+		q->err_blocks += nr;
+		pthread_mutex_unlock(&q->lock);
+		return;
+	}
+
+	//most chunks match, only look for the blocks that differ in those that do not
+	if(!memcmp(w->snap_buf, w->img_buf, bytes)) nr_same = nr;
+
+	//compare block by block, so that a difference is found down to the block
+	for(i = nr_same; i < nr; i++){
+		block_bytes = MIN(COW_BLOCK_SIZE, bytes - i * COW_BLOCK_SIZE);
+		differs = memcmp(w->snap_buf + i * COW_BLOCK_SIZE, w->img_buf + i * COW_BLOCK_SIZE, block_bytes);
+
+		if(!differs){
+			if(bad_len){
+				pthread_mutex_lock(&q->lock);
+				add_bad(q, bad_start, bad_len);
+				pthread_mutex_unlock(&q->lock);
+			}
+			bad_len = 0;
+			continue;
+		}
+
+		if(!bad_len) bad_start = chunk->start + i;
+		bad_len++;
+	}
+
+	pthread_mutex_lock(&q->lock);
+	if(bad_len) add_bad(q, bad_start, bad_len);
+	q->verified += nr;
+	pthread_mutex_unlock(&q->lock);
+}
+
+static void *verify_thread(void *arg){
+	struct verify_worker *w = arg;
+	struct verify_queue *q = w->q;
+	struct extent chunk;
+
+	while(1){
+		pthread_mutex_lock(&q->lock);
+		while(!q->count && !q->done) pthread_cond_wait(&q->not_empty, &q->lock);
+		if(!q->count){
+			pthread_mutex_unlock(&q->lock);
+			break;
+		}
+
+		chunk = q->chunks[q->head];
+		q->head = (q->head + 1) % q->size;
+		q->count--;
+		pthread_cond_signal(&q->not_full);
+		pthread_mutex_unlock(&q->lock);
+
+		verify_chunk(w, &chunk);
+	}
+
+	return NULL;
+}
+
+static void queue_chunk(struct verify_queue *q, sector_t start, sector_t len){
+	pthread_mutex_lock(&q->lock);
+	while(q->count == q->size) pthread_cond_wait(&q->not_full, &q->lock);
+
+	q->chunks[(q->head + q->count) % q->size].start = start;
+	q->chunks[(q->head + q->count) % q->size].len = len;
+	q->count++;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static void queue_finish(struct verify_queue *q){
+	pthread_mutex_lock(&q->lock);
+	q->done = 1;
+	pthread_cond_broadcast(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+//turns changed blocks into chunks for the verify threads
+struct chunk_builder {
+	struct verify_queue *q;
+	struct extent chunk; //chunk being grown, not queued yet
+	sector_t max_blocks;
+};
+
+static void add_run(uint64_t start, uint64_t len, void *arg){
+	struct chunk_builder *cb = arg;
+	sector_t take;
+
+	while(len){
+		if(cb->chunk.len && start == cb->chunk.start + cb->chunk.len && cb->chunk.len < cb->max_blocks){
+			take = MIN(len, cb->max_blocks - cb->chunk.len);
+			cb->chunk.len += take;
+		}else{
+			if(cb->chunk.len) queue_chunk(cb->q, cb->chunk.start, cb->chunk.len);
+			take = MIN(len, cb->max_blocks);
+			cb->chunk.start = start;
+			cb->chunk.len = take;
+		}
+
+		start += take;
+		len -= take;
+	}
+}
+
+static int compare_extents(const void *a, const void *b){
+	const struct extent *x = a, *y = b;
+
+	return (x->start > y->start) - (x->start < y->start);
+}
+
+//prints the ranges that differ in order, merging those split between chunks
+static void print_bad(struct verify_queue *q){
+	size_t i, j;
+	struct extent ext;
+
+	qsort(q->bad, q->nr_bad, sizeof(struct extent), compare_extents);
+
+	for(i = 0; i < q->nr_bad; i = j){
+		ext = q->bad[i];
+
+		for(j = i + 1; j < q->nr_bad && q->bad[j].start == ext.start + ext.len; j++) ext.len += q->bad[j].len;
+		printf("mismatch: blocks %llu-%llu (%llu blocks)\n", ext.start, ext.start + ext.len - 1, ext.len);
+	}
+}
+
+int main(int argc, char **argv){
+	int ret, c, *cow_fds = NULL;
+	unsigned minor, nr_cows = 0, nr_threads = DEFAULT_THREADS, chunk_mb = DEFAULT_CHUNK_MB, started = 0, t;
+	sector_t total_blocks, max_blocks, block;
+	off_t img_size;
+	struct verify_queue q;
+	struct verify_worker *workers = NULL;
+	struct chunk_builder cb;
+
+	memset(&q, 0, sizeof(q));
+	memset(&cb, 0, sizeof(cb));
+	q.snap_fd = -1;
+	q.img_fd = -1;
+	pthread_mutex_init(&q.lock, NULL);
+	pthread_cond_init(&q.not_empty, NULL);
+	pthread_cond_init(&q.not_full, NULL);
+
+	while((c = getopt(argc, argv, "t:m:")) != -1){
+		switch(c){
+		case 't':
+			if(parse_ui(optarg, &nr_threads) || !nr_threads) print_help(argv[0], EINVAL);
+			break;
+		case 'm':
+			if(parse_ui(optarg, &chunk_mb) || !chunk_mb) print_help(argv[0], EINVAL);
+			break;
+		default:
+			print_help(argv[0], EINVAL);
+		}
+	}
+
+	if(argc - optind < 2) print_help(argv[0], EINVAL);
+
+	//open snapshot
+	q.snap_fd = open(argv[optind], O_RDONLY);
+	if(q.snap_fd < 0){
+		ret = errno;
+		errno = 0;
+		fprintf(stderr, "error opening snapshot\n");
+		goto error;
+	}
+
+	//open cow files, if any, everything between the snapshot and the image
+	if(argc - optind > 2){
+		cow_fds = malloc((argc - optind - 2) * sizeof(int));
+		if(!cow_fds){
+			ret = ENOMEM;
+			fprintf(stderr, "error allocating cow files\n");
+			goto error;
+		}
+	}
+
+	for(; nr_cows < (unsigned)(argc - optind - 2); nr_cows++){
+		cow_fds[nr_cows] = open(argv[optind + 1 + nr_cows], O_RDONLY);
+		if(cow_fds[nr_cows] < 0){
+			ret = errno;
+			errno = 0;
+			fprintf(stderr, "error opening cow file %s\n", argv[optind + 1 + nr_cows]);
+			goto error;
+		}
+	}
+
+	//open image
+	q.img_fd = open(argv[argc - 1], O_RDONLY);
+	if(q.img_fd < 0){
+		ret = errno;
+		errno = 0;
+		fprintf(stderr, "error opening image\n");
+		goto error;
+	}
+
+	//only the cow files need to match the snapshot, any two files can be compared
+	if(nr_cows){
+		ret = snapshot_minor(argv[optind], &minor);
+		if(ret) goto error;
+
+		ret = verify_cow_files(cow_fds, nr_cows, minor, NULL);
+		if(ret) goto error;
+	}
+
+	//get sizes of snapshot and image, calculate other needed sizes
+	q.snap_size = lseek(q.snap_fd, 0, SEEK_END);
+	img_size = lseek(q.img_fd, 0, SEEK_END);
+	if(q.snap_size < 0 || img_size < 0){
+		ret = errno;
+		errno = 0;
+		fprintf(stderr, "error determining size of snapshot or image\n");
+		goto error;
+	}
+
+	if(img_size < q.snap_size){
+		ret = EINVAL;
+		fprintf(stderr, "image is smaller than the snapshot\n");
+		goto error;
+	}
+
+	total_blocks = (q.snap_size + COW_BLOCK_SIZE - 1) / COW_BLOCK_SIZE;
+	max_blocks = (sector_t)chunk_mb * 1024 * 1024 / COW_BLOCK_SIZE;
+
+	printf("snapshot is %llu blocks large\n", total_blocks);
+
+	//two chunks per thread keep every thread busy while the scan catches up
+	q.size = nr_threads * 2;
+	q.chunks = malloc(q.size * sizeof(struct extent));
+	workers = calloc(nr_threads, sizeof(struct verify_worker));
+	if(!q.chunks || !workers){
+		ret = ENOMEM;
+		fprintf(stderr, "error allocating verify queue\n");
+		goto error;
+	}
+
+	for(t = 0; t < nr_threads; t++){
+		workers[t].q = &q;
+		ret = posix_memalign((void **)&workers[t].snap_buf, BUFFER_ALIGN, max_blocks * COW_BLOCK_SIZE);
+		if(ret) workers[t].snap_buf = NULL;
+		else if((ret = posix_memalign((void **)&workers[t].img_buf, BUFFER_ALIGN, max_blocks * COW_BLOCK_SIZE))) workers[t].img_buf = NULL;
+		if(ret){
+			ret = ENOMEM;
+			fprintf(stderr, "error allocating verify buffers\n");
+			goto error;
+		}
+
+		ret = pthread_create(&workers[t].thread, NULL, verify_thread, &workers[t]);
+		if(ret){
+			fprintf(stderr, "error starting verify threads\n");
+			goto error;
+		}
+		started++;
+	}
+
+	if(nr_cows){
+		//verify only the blocks the cow files say have changed
+		printf("verifying changed blocks\n");
+		cb.q = &q;
+		cb.max_blocks = max_blocks;
+		select_scanner();
+		ret = scan_index(cow_fds, nr_cows, total_blocks, add_run, &cb);
+		if(ret) goto error;
+		if(cb.chunk.len) queue_chunk(&q, cb.chunk.start, cb.chunk.len);
+	}else{
+		printf("verifying all blocks\n");
+		for(block = 0; block < total_blocks; block += max_blocks) queue_chunk(&q, block, MIN(max_blocks, total_blocks - block));
+	}
+
+	queue_finish(&q);
+	for(t = 0; t < started; t++) pthread_join(workers[t].thread, NULL);
+	started = 0;
+
+	print_bad(&q);
+	printf("verify complete: %llu blocks compared, %llu differ, %llu could not be read\n", q.verified, q.bad_blocks, q.err_blocks);
+
+	ret = (q.bad_blocks || q.err_blocks) ? EIO : 0;
+
+error:
+	//stop the verify threads, dropping whatever is still queued
+	if(started){
+		pthread_mutex_lock(&q.lock);
+		q.count = 0;
+		pthread_mutex_unlock(&q.lock);
+		queue_finish(&q);
+		for(t = 0; t < started; t++) pthread_join(workers[t].thread, NULL);
+	}
+
+	if(workers){
+		for(t = 0; t < nr_threads; t++){
+			free(workers[t].snap_buf);
+			free(workers[t].img_buf);
+		}
+		free(workers);
+	}
+	free(q.chunks);
+	free(q.bad);
+	if(cow_fds){
+		for(t = 0; t < nr_cows; t++){
+			if(cow_fds[t] >= 0) close(cow_fds[t]);
+		}
+		free(cow_fds);
+	}
+	if(q.snap_fd >= 0) close(q.snap_fd);
+	if(q.img_fd >= 0) close(q.img_fd);
+
+	return ret;
+}
@@ -0,0 +1,572 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Copyright (C) 2026 Datto Inc.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include "cow-index.h"
+#include "delta.h"
+
+//default for the -m option
+#define DEFAULT_EXTENT_MB 1
+
+//data is read in buffers of this size, while the previous ones are written
+#define DELTA_BUFFER_SIZE (4 * 1024 * 1024)
+#define DELTA_BUFFERS 4
+
+//table entries written at a time
+#define TABLE_BUFFER_ENTRIES (64 * 1024)
+
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+
+//buffers passed from the reader thread to the writer, in stream order
+struct delta_ring {
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+	pthread_cond_t emptied;
+	char *bufs[DELTA_BUFFERS];
+	size_t lens[DELTA_BUFFERS];
+	unsigned int head; //oldest filled buffer
+	unsigned int count; //filled buffers, the reader fills the one after them
+	int done; //no more buffers will be filled
+	int err; //set by either side to stop the other
+};
+
+/*
+ * The index is scanned three times: to count the extents and checksum the
+ * table for the header, to write the table and to read the data. Scanning is
+ * cheap next to copying data, and this keeps memory use independent of how
+ * many extents there are.
+ */
+struct delta_writer {
+	//splitting runs of changed blocks into extents
+	uint64_t max_blocks;
+	uint64_t ext_start;
+	uint64_t ext_len; //extent being grown, not emitted yet
+	void (*emit)(struct delta_writer *dw, uint64_t start, uint64_t len);
+	int err; //errno of the first failure, later extents are ignored
+
+	int snap_fd;
+	int out_fd;
+	off_t snap_size;
+	int checksums;
+
+	//counting pass
+	uint64_t nr_extents;
+	uint64_t nr_blocks;
+	uint32_t table_crc;
+
+	//table pass
+	uint8_t *table;
+	size_t table_len;
+
+	//data pass
+	struct delta_ring *ring;
+	char *buf; //buffer being filled, NULL if none
+	size_t len;
+	off_t read_off; //read queued up to be done in one go
+	size_t read_pos;
+	size_t read_len;
+	uint64_t bytes;
+};
+
+static void print_help(char* progname, int status){
+	fprintf(stderr, "Usage: %s [-c] [-m <max extent size>] <snapshot device> <cow file>... <delta file>|-\n", progname);
+	fprintf(stderr, "max extent size should be provided in megabytes.\n");
+	exit(status);
+}
+
+static int parse_ui(const char *str, unsigned int *out){
+	long tmp;
+	const char *c = str;
+
+	//check that string is an integer number and has a length
+	do{
+		if(!isdigit(*c)) goto error;
+		c++;
+	}while(*c);
+
+	//convert to long
+	tmp = strtol(str, NULL, 0);
+	if(errno) goto error;
+
+	//check boundaries
+	if(tmp < 0 || tmp == LONG_MAX){
+		errno = ERANGE;
+		goto error;
+	}
+
+	*out = (unsigned int)tmp;
+	return 0;
+
+error:
+	*out = 0;
+	return -1;
+}
+
+//like pread and write, but retry until everything is transferred
+static int full_pread(int fd, char *buf, size_t count, off_t offset){
+	ssize_t bytes;
+
+	while(count){
+		bytes = pread(fd, buf, count, offset);
+		if(bytes < 0 && errno == EINTR) continue;
+		if(bytes <= 0) return -1;
+
+		buf += bytes;
+		count -= bytes;
+		offset += bytes;
+	}
+
+	return 0;
+}
+
+static int full_write(int fd, const void *buf, size_t count){
+	ssize_t bytes;
+	const char *p = buf;
+
+	while(count){
+		bytes = write(fd, p, count);
+		if(bytes < 0 && errno == EINTR) continue;
+		if(bytes <= 0) return -1;
+
+		p += bytes;
+		count -= bytes;
+	}
+
+	return 0;
+}
+
+static void set_error(struct delta_writer *dw, int err, const char *msg){
+	if(dw->err) return;
+
+	dw->err = (err) ? err : EIO;
+	errno = 0;
+	fprintf(stderr, "%s\n", msg);
+}
+
+//merges runs of changed blocks into extents of at most max_blocks
+static void split_run(uint64_t start, uint64_t len, void *arg){
+	struct delta_writer *dw = arg;
+	uint64_t take;
+
+	dw->nr_blocks += len;
+	while(len){
+		if(dw->ext_len && start == dw->ext_start + dw->ext_len && dw->ext_len < dw->max_blocks){
+			take = MIN(len, dw->max_blocks - dw->ext_len);
+			dw->ext_len += take;
+		}else{
+			if(dw->ext_len && !dw->err) dw->emit(dw, dw->ext_start, dw->ext_len);
+			take = MIN(len, dw->max_blocks);
+			dw->ext_start = start;
+			dw->ext_len = take;
+		}
+
+		start += take;
+		len -= take;
+	}
+}
+
+static int scan_extents(struct delta_writer *dw, const int *cow_fds, unsigned int nr_cows, uint64_t total_blocks, void (*emit)(struct delta_writer *, uint64_t, uint64_t)){
+	int ret;
+
+	dw->emit = emit;
+	dw->ext_len = 0;
+	dw->nr_blocks = 0;
+
+	ret = scan_index(cow_fds, nr_cows, total_blocks, split_run, dw);
+	if(ret) return ret;
+
+	if(dw->ext_len && !dw->err) dw->emit(dw, dw->ext_start, dw->ext_len);
+	dw->ext_len = 0;
+
+	return dw->err;
+}
+
+static void count_extent(struct delta_writer *dw, uint64_t start, uint64_t len){
+	uint8_t entry[DELTA_EXTENT_SIZE];
+
+	delta_put_extent(entry, start, len);
+	dw->table_crc = crc32c(dw->table_crc, entry, DELTA_EXTENT_SIZE);
+	dw->nr_extents++;
+}
+
+static void flush_table(struct delta_writer *dw){
+	if(!dw->table_len || dw->err) return;
+
+	if(full_write(dw->out_fd, dw->table, dw->table_len)) set_error(dw, errno, "error writing extent table");
+	dw->table_len = 0;
+}
+
+static void table_extent(struct delta_writer *dw, uint64_t start, uint64_t len){
+	delta_put_extent(dw->table + dw->table_len, start, len);
+	dw->table_len += DELTA_EXTENT_SIZE;
+
+	if(dw->table_len == TABLE_BUFFER_ENTRIES * DELTA_EXTENT_SIZE) flush_table(dw);
+}
+
+//does the read queued up in the current buffer
+static void flush_read(struct delta_writer *dw){
+	if(!dw->read_len || dw->err) return;
+
+	if(full_pread(dw->snap_fd, dw->buf + dw->read_pos, dw->read_len, dw->read_off)) set_error(dw, errno, "error reading data from snapshot");
+	dw->read_len = 0;
+}
+
+//queues a read, merging it with the last one if both are contiguous
+static void queue_read(struct delta_writer *dw, off_t off, size_t len){
+	if(dw->read_len && dw->read_off + (off_t)dw->read_len == off && dw->read_pos + dw->read_len == dw->len){
+		dw->read_len += len;
+		return;
+	}
+
+	flush_read(dw);
+	dw->read_off = off;
+	dw->read_pos = dw->len;
+	dw->read_len = len;
+}
+
+static void get_buffer(struct delta_writer *dw){
+	struct delta_ring *r = dw->ring;
+
+	pthread_mutex_lock(&r->lock);
+	while(r->count == DELTA_BUFFERS && !r->err) pthread_cond_wait(&r->emptied, &r->lock);
+	//the writer has already reported its error
+	if(r->err) dw->err = r->err;
+	else dw->buf = r->bufs[(r->head + r->count) % DELTA_BUFFERS];
+	pthread_mutex_unlock(&r->lock);
+
+	dw->len = 0;
+}
+
+static void put_buffer(struct delta_writer *dw){
+	struct delta_ring *r = dw->ring;
+	unsigned int slot;
+
+	flush_read(dw);
+	if(dw->err) return;
+
+	pthread_mutex_lock(&r->lock);
+	slot = (r->head + r->count) % DELTA_BUFFERS;
+	r->lens[slot] = dw->len;
+	r->count++;
+	pthread_cond_signal(&r->filled);
+	pthread_mutex_unlock(&r->lock);
+
+	dw->buf = NULL;
+}
+
+static void data_extent(struct delta_writer *dw, uint64_t start, uint64_t len){
+	off_t off = (off_t)start * COW_BLOCK_SIZE;
+	size_t bytes = len * COW_BLOCK_SIZE, n;
+	uint32_t crc = 0;
+
+	//the last block of the snapshot may be partial
+	if(off + (off_t)bytes > dw->snap_size) bytes = dw->snap_size - off;
+	dw->bytes += bytes;
+
+	while(bytes){
+		if(!dw->buf){
+			get_buffer(dw);
+			if(dw->err) return;
+		}
+
+		n = MIN(bytes, DELTA_BUFFER_SIZE - dw->len);
+		queue_read(dw, off, n);
+		dw->len += n;
+		off += n;
+		bytes -= n;
+
+		//checksum the data while it is still in the cache
+		if(dw->checksums){
+			flush_read(dw);
+			if(dw->err) return;
+			crc = crc32c(crc, dw->buf + dw->len - n, n);
+
+			//buffers have room for the checksum past DELTA_BUFFER_SIZE
+			if(!bytes){
+				delta_put_crc((uint8_t *)dw->buf + dw->len, crc);
+				dw->len += sizeof(uint32_t);
+			}
+		}
+
+		if(dw->len >= DELTA_BUFFER_SIZE) put_buffer(dw);
+	}
+}
+
+struct reader_args {
+	struct delta_writer *dw;
+	const int *cow_fds;
+	unsigned int nr_cows;
+	uint64_t total_blocks;
+	int ret;
+};
+
+static void *reader_thread(void *arg){
+	struct reader_args *ra = arg;
+	struct delta_writer *dw = ra->dw;
+	struct delta_ring *r = dw->ring;
+
+	ra->ret = scan_extents(dw, ra->cow_fds, ra->nr_cows, ra->total_blocks, data_extent);
+	if(!ra->ret && dw->buf && dw->len) put_buffer(dw);
+	if(!ra->ret) ra->ret = dw->err;
+
+	pthread_mutex_lock(&r->lock);
+	r->done = 1;
+	if(ra->ret && !r->err) r->err = ra->ret;
+	pthread_cond_signal(&r->filled);
+	pthread_mutex_unlock(&r->lock);
+
+	return NULL;
+}
+
+//writes the buffers filled by the reader thread until it is done
+static int write_buffers(struct delta_ring *r, int out_fd){
+	int ret = 0;
+	char *buf;
+	size_t len;
+
+	while(1){
+		pthread_mutex_lock(&r->lock);
+		while(!r->count && !r->done && !r->err) pthread_cond_wait(&r->filled, &r->lock);
+		if(r->err || !r->count){
+			ret = r->err;
+			pthread_mutex_unlock(&r->lock);
+			return ret;
+		}
+		buf = r->bufs[r->head];
+		len = r->lens[r->head];
+		pthread_mutex_unlock(&r->lock);
+
+		if(full_write(out_fd, buf, len)){
+			ret = (errno) ? errno : EIO;
+			errno = 0;
+			fprintf(stderr, "error writing delta data\n");
+		}
+
+		pthread_mutex_lock(&r->lock);
+		if(ret) r->err = ret;
+		else{
+			r->head = (r->head + 1) % DELTA_BUFFERS;
+			r->count--;
+		}
+		pthread_cond_signal(&r->emptied);
+		pthread_mutex_unlock(&r->lock);
+
+		if(ret) return ret;
+	}
+}
+
+int main(int argc, char **argv){
+	int ret, c, *cow_fds = NULL;
+	unsigned minor, nr_cows = 0, extent_mb = DEFAULT_EXTENT_MB, i;
+	uint64_t total_blocks;
+	uint8_t hdr_buf[DELTA_HEADER_SIZE];
+	struct delta_header dh;
+	struct delta_writer dw;
+	struct delta_ring ring;
+	struct reader_args ra;
+	struct dattobd_info *info = NULL;
+	pthread_t reader;
+
+	memset(&dw, 0, sizeof(dw));
+	memset(&ring, 0, sizeof(ring));
+	dw.snap_fd = -1;
+	dw.out_fd = -1;
+	pthread_mutex_init(&ring.lock, NULL);
+	pthread_cond_init(&ring.filled, NULL);
+	pthread_cond_init(&ring.emptied, NULL);
+
+	while((c = getopt(argc, argv, "cm:")) != -1){
+		switch(c){
+		case 'c':
+			dw.checksums = 1;
+			break;
+		case 'm':
+			if(parse_ui(optarg, &extent_mb) || !extent_mb) print_help(argv[0], EINVAL);
+			break;
+		default:
+			print_help(argv[0], EINVAL);
+		}
+	}
+
+	if(argc - optind < 3) print_help(argv[0], EINVAL);
+
+	//open snapshot
+	dw.snap_fd = open(argv[optind], O_RDONLY);
+	if(dw.snap_fd < 0){
+		ret = errno;
+		errno = 0;
+		fprintf(stderr, "error opening snapshot\n");
+		goto error;
+	}
+
+	//open cow files, everything between the snapshot and the output
+	cow_fds = malloc((argc - optind - 2) * sizeof(int));
+	info = malloc(sizeof(struct dattobd_info));
+	if(!cow_fds || !info){
+		ret = ENOMEM;
+		fprintf(stderr, "error allocating cow files\n");
+		goto error;
+	}
+
+	for(; nr_cows < (unsigned)(argc - optind - 2); nr_cows++){
+		cow_fds[nr_cows] = open(argv[optind + 1 + nr_cows], O_RDONLY);
+		if(cow_fds[nr_cows] < 0){
+			ret = errno;
+			errno = 0;
+			fprintf(stderr, "error opening cow file %s\n", argv[optind + 1 + nr_cows]);
+			goto error;
+		}
+	}
+
+	//get the minor number of the snapshot and check the cow files against it
+	ret = snapshot_minor(argv[optind], &minor);
+	if(ret) goto error;
+
+	ret = verify_cow_files(cow_fds, nr_cows, minor, info);
+	if(ret) goto error;
+
+	//open output, only once the inputs are known to be good
+	if(!strcmp(argv[argc - 1], "-")){
+		if(isatty(STDOUT_FILENO)){
+			ret = EINVAL;
+			fprintf(stderr, "refusing to write a delta to a terminal\n");
+			goto error;
+		}
+		dw.out_fd = dup(STDOUT_FILENO);
+	}else{
+		dw.out_fd = open(argv[argc - 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	if(dw.out_fd < 0){
+		ret = errno;
+		errno = 0;
+		fprintf(stderr, "error opening output\n");
+		goto error;
+	}
+
+	//get size of snapshot, calculate other needed sizes
+	dw.snap_size = lseek(dw.snap_fd, 0, SEEK_END);
+	if(dw.snap_size < 0){
+		ret = errno;
+		errno = 0;
+		fprintf(stderr, "error determining size of snapshot\n");
+		goto error;
+	}
+	total_blocks = (dw.snap_size + COW_BLOCK_SIZE - 1) / COW_BLOCK_SIZE;
+	dw.max_blocks = (uint64_t)extent_mb * 1024 * 1024 / COW_BLOCK_SIZE;
+
+	//data is read in ascending order, let the kernel read ahead
+	posix_fadvise(dw.snap_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	select_scanner();
+	select_crc32c();
+
+	//count the extents, the header needs the size and checksum of the table
+	ret = scan_extents(&dw, cow_fds, nr_cows, total_blocks, count_extent);
+	if(ret) goto error;
+
+	memset(&dh, 0, sizeof(dh));
+	dh.flags = (dw.checksums) ? DELTA_CHECKSUMS : 0;
+	dh.block_size = COW_BLOCK_SIZE;
+	dh.table_crc = dw.table_crc;
+	dh.from_seqid = info->seqid - nr_cows;
+	dh.seqid = info->seqid;
+	dh.size = dw.snap_size;
+	dh.nr_extents = dw.nr_extents;
+	memcpy(dh.uuid, info->uuid, COW_UUID_SIZE);
+
+	fprintf(stderr, "snapshot is %llu blocks large, %llu blocks changed in %llu extents\n", (unsigned long long)total_blocks, (unsigned long long)dw.nr_blocks, (unsigned long long)dw.nr_extents);
+
+	delta_put_header(hdr_buf, &dh);
+	if(full_write(dw.out_fd, hdr_buf, DELTA_HEADER_SIZE)){
+		ret = errno;
+		errno = 0;
+		fprintf(stderr, "error writing delta header\n");
+		goto error;
+	}
+
+	//write the extent table
+	dw.table = malloc(TABLE_BUFFER_ENTRIES * DELTA_EXTENT_SIZE);
+	if(!dw.table){
+		ret = ENOMEM;
+		fprintf(stderr, "error allocating table buffer\n");
+		goto error;
+	}
+
+	ret = scan_extents(&dw, cow_fds, nr_cows, total_blocks, table_extent);
+	if(!ret){
+		flush_table(&dw);
+		ret = dw.err;
+	}
+	if(ret) goto error;
+
+	//stream the data, reading the next buffers while the last ones are written
+	for(i = 0; i < DELTA_BUFFERS; i++){
+		ring.bufs[i] = malloc(DELTA_BUFFER_SIZE + sizeof(uint32_t));
+		if(!ring.bufs[i]){
+			ret = ENOMEM;
+			fprintf(stderr, "error allocating data buffers\n");
+			goto error;
+		}
+	}
+
+	dw.ring = &ring;
+	ra.dw = &dw;
+	ra.cow_fds = cow_fds;
+	ra.nr_cows = nr_cows;
+	ra.total_blocks = total_blocks;
+	ra.ret = 0;
+
+	ret = pthread_create(&reader, NULL, reader_thread, &ra);
+	if(ret){
+		fprintf(stderr, "error starting reader thread\n");
+		goto error;
+	}
+
+	ret = write_buffers(&ring, dw.out_fd);
+	pthread_join(reader, NULL);
+	if(!ret) ret = ra.ret;
+	if(ret) goto error;
+
+	if(close(dw.out_fd)){
+		dw.out_fd = -1;
+		ret = errno;
+		errno = 0;
+		fprintf(stderr, "error closing output\n");
+		goto error;
+	}
+	dw.out_fd = -1;
+
+	fprintf(stderr, "delta complete: %llu bytes of data in %llu extents%s\n", (unsigned long long)dw.bytes, (unsigned long long)dw.nr_extents, (dw.checksums) ? ", checksummed" : "");
+
+	ret = 0;
+
+error:
+	for(i = 0; i < DELTA_BUFFERS; i++) free(ring.bufs[i]);
+	free(dw.table);
+	free(info);
+	if(cow_fds){
+		for(i = 0; i < nr_cows; i++){
+			if(cow_fds[i] >= 0) close(cow_fds[i]);
+		}
+		free(cow_fds);
+	}
+	if(dw.snap_fd >= 0) close(dw.snap_fd);
+	if(dw.out_fd >= 0) close(dw.out_fd);
+
+	return ret;
+}